@@ -0,0 +1,172 @@
+/**
+ * @file aesd-circular-buffer-bench.c
+ * @brief Microbenchmark for the circular buffer in aesd-circular-buffer.c
+ *
+ * Times a fixed number of adds to a full buffer, which wrap and overwrite
+ * the oldest entry, and of lookups by file position spread over every byte
+ * of a full, wrapped buffer. Lookups are first checked against the layout
+ * the adds produced so a wrong answer can't masquerade as a fast one.
+ */
+
+#include "aesd-circular-buffer.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define DEFAULT_ITERATIONS  20000000UL
+#define ENTRY_SIZE          64
+
+static char entryData[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED * 2][ENTRY_SIZE];
+
+static double nowSeconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Fill buffer past full, so it has wrapped and out_offs is not 0
+ */
+static void fillWrapped(struct aesd_circular_buffer *buffer)
+{
+    struct aesd_buffer_entry entry;
+    size_t i;
+
+    aesd_circular_buffer_init(buffer);
+    for (i = 0; i < sizeof(entryData) / sizeof(entryData[0]); i++)
+    {
+        entry.buffptr = entryData[i];
+        entry.size = ENTRY_SIZE;
+        aesd_circular_buffer_add_entry(buffer, &entry);
+    }
+}
+
+/**
+ * @brief Check every position of a wrapped buffer maps to the entry and
+ *  byte it was written as, and that the one past the end is not found
+ */
+static int checkFind(struct aesd_circular_buffer *buffer)
+{
+    const size_t total = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED * ENTRY_SIZE;
+    const size_t oldest = sizeof(entryData) / sizeof(entryData[0]) -
+                          AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    struct aesd_buffer_entry *entry;
+    size_t entryOffset;
+    size_t pos;
+
+    for (pos = 0; pos < total; pos++)
+    {
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, pos, &entryOffset);
+        if (entry == NULL || entry->buffptr != entryData[oldest + pos / ENTRY_SIZE] ||
+            entryOffset != pos % ENTRY_SIZE)
+        {
+            fprintf(stderr, "Wrong entry for position %zu\n", pos);
+            return -1;
+        }
+    }
+
+    if (aesd_circular_buffer_find_entry_offset_for_fpos(buffer, total, &entryOffset) != NULL)
+    {
+        fprintf(stderr, "Position %zu past the end was found\n", total);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @return double Nanoseconds per add
+ */
+static double benchAdd(struct aesd_circular_buffer *buffer, unsigned long iterations)
+{
+    struct aesd_buffer_entry entry;
+    unsigned long i;
+    double start;
+
+    fillWrapped(buffer);
+    entry.size = ENTRY_SIZE;
+
+    start = nowSeconds();
+    for (i = 0; i < iterations; i++)
+    {
+        entry.buffptr = entryData[i % (sizeof(entryData) / sizeof(entryData[0]))];
+        aesd_circular_buffer_add_entry(buffer, &entry);
+    }
+    return (nowSeconds() - start) * 1e9 / iterations;
+}
+
+/**
+ * @return double Nanoseconds per lookup
+ */
+static double benchFind(struct aesd_circular_buffer *buffer, unsigned long iterations)
+{
+    const size_t total = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED * ENTRY_SIZE;
+    struct aesd_buffer_entry *entry;
+    volatile size_t sink = 0;
+    size_t entryOffset;
+    unsigned long i;
+    double start;
+
+    fillWrapped(buffer);
+
+    // Stepping by a prime spreads lookups over early and late entries
+    start = nowSeconds();
+    for (i = 0; i < iterations; i++)
+    {
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, i * 7 % total,
+                                                                &entryOffset);
+        sink += entry->size + entryOffset;
+    }
+    return (nowSeconds() - start) * 1e9 / iterations;
+}
+
+static void usage(const char *progName)
+{
+    fprintf(stderr,
+            "USAGE: %s [-n iterations]\n"
+            "  -n times that many adds and that many lookups (default %lu)\n",
+            progName, DEFAULT_ITERATIONS);
+}
+
+int main(int argc, char *argv[])
+{
+    struct aesd_circular_buffer buffer;
+    unsigned long iterations = DEFAULT_ITERATIONS;
+    char *endPtr;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            iterations = strtoul(optarg, &endPtr, 10);
+            if (*endPtr != '\0' || iterations == 0)
+            {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    fillWrapped(&buffer);
+    if (checkFind(&buffer) != 0)
+    {
+        return EXIT_FAILURE;
+    }
+
+    printf("entries:            %d x %d bytes\n", AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED,
+           ENTRY_SIZE);
+    printf("iterations:         %lu\n", iterations);
+    printf("add (ns/op):        %.2f\n", benchAdd(&buffer, iterations));
+    printf("find (ns/op):       %.2f\n", benchFind(&buffer, iterations));
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,204 @@
+#!/bin/bash
+# Performance regression gate for the circular buffer and the server
+#
+# Runs fixed workloads, keeps the best of PERF_RUNS runs of each (default
+# 5) and compares every metric with perf-baseline.txt, failing when one is
+# worse than its baseline by more than its tolerance. Run it through the
+# perf-gate target of the CMake build, or on its own from anywhere.
+#
+# Usage: perf-test.sh [--update] [circular buffer bench]
+#
+# The circular buffer bench is built from aesd-char-driver when not given.
+# The server is built optimised in a scratch copy of server/ and listens on
+# PERF_PORT (default 9300) while measured.
+#
+# Results only compare on the machine the baseline was measured on. --update
+# rewrites the baseline values with this run's, keeping the tolerances.
+
+set -u
+
+cd "$(dirname "$0")"
+repo_dir=$(pwd)
+baseline_file=${repo_dir}/perf-baseline.txt
+runs=${PERF_RUNS:-5}
+port=${PERF_PORT:-9300}
+update=false
+cb_bench=
+
+for arg in "$@"; do
+    case "${arg}" in
+        --update)
+            update=true
+            ;;
+        *)
+            cb_bench=${arg}
+            ;;
+    esac
+done
+
+scratch_dir=$(mktemp -d)
+server_pid=
+
+cleanup() {
+    if [ -n "${server_pid}" ]; then
+        kill -TERM "${server_pid}" 2>/dev/null
+        wait "${server_pid}" 2>/dev/null
+    fi
+    rm -rf "${scratch_dir}"
+}
+trap cleanup EXIT
+
+declare -A baseline tolerance better result
+metrics=()
+
+while read -r metric value tol dir; do
+    case "${metric}" in
+        ''|'#'*)
+            continue
+            ;;
+    esac
+    metrics+=("${metric}")
+    baseline[${metric}]=${value}
+    tolerance[${metric}]=${tol}
+    better[${metric}]=${dir}
+done < "${baseline_file}"
+
+# Keep value for metric if it is the best seen so far
+record() {
+    local metric=$1
+    local value=$2
+    local previous=${result[${metric}]:-}
+
+    if [ -z "${value}" ]; then
+        echo "No ${metric} in the bench output" >&2
+        exit 1
+    fi
+    if [ -z "${previous}" ] || awk -v v="${value}" -v p="${previous}" -v b="${better[${metric}]}" \
+        'BEGIN { exit !(b == "higher" ? v > p : v < p) }'; then
+        result[${metric}]=${value}
+    fi
+}
+
+# Value of a "key: value" line of bench output
+field() {
+    awk -F': *' -v key="$1" '$1 == key { print $2 }' <<< "$2"
+}
+
+# p99 of the "p50 / p99 / p99.9 / max" round trip line
+p99() {
+    field "round trip p50/p99/p99.9/max (us)" "$1" | awk -F' / ' '{ print $2 }'
+}
+
+if [ -z "${cb_bench}" ]; then
+    cb_bench=${scratch_dir}/aesd-circular-buffer-bench
+    cc -O2 -Wall -Werror aesd-char-driver/aesd-circular-buffer-bench.c \
+        aesd-char-driver/aesd-circular-buffer.c -o "${cb_bench}" || exit 1
+fi
+
+# Clean first, objects built with other flags may have come along
+cp -r server "${scratch_dir}/server"
+make -s -C "${scratch_dir}/server" clean
+make -s -C "${scratch_dir}/server" CFLAGS="-Werror -Wall -O2 -g -pthread" \
+    aesdsocket aesdsocket-bench > /dev/null || exit 1
+
+# Start a server on an empty log, so every run sees the same echo-backs
+start_server() {
+    rm -f "${scratch_dir}"/data*
+    "${scratch_dir}/server/aesdsocket" -p "${port}" -o "${scratch_dir}/data" -s 0 &
+    server_pid=$!
+    for _ in $(seq 50); do
+        if (exec 3<> "/dev/tcp/127.0.0.1/${port}") 2>/dev/null; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    echo "Server did not start listening on port ${port}" >&2
+    exit 1
+}
+
+stop_server() {
+    kill -TERM "${server_pid}"
+    wait "${server_pid}"
+    server_pid=
+}
+
+# Run the server bench with the given arguments against a fresh server,
+# leaving what it printed in output
+server_bench() {
+    start_server
+    output=$("${scratch_dir}/server/aesdsocket-bench" -p "${port}" "$@")
+    stop_server
+    if [ "$(field "failed connections" "${output}")" != "0" ]; then
+        echo "${output}" >&2
+        echo "Server bench $* had failed connections" >&2
+        exit 1
+    fi
+}
+
+for run in $(seq "${runs}"); do
+    echo "Run ${run} of ${runs}"
+
+    output=$("${cb_bench}") || exit 1
+    record circular_buffer_add_ns "$(field "add (ns/op)" "${output}")"
+    record circular_buffer_find_ns "$(field "find (ns/op)" "${output}")"
+
+    # Every packet echoed back with the whole log
+    server_bench -c 4 -n 500
+    record echo_packets_per_s "$(field "packets/s" "${output}")"
+    record echo_p99_us "$(p99 "${output}")"
+
+    # Pipelined packets, acknowledged rather than echoed
+    server_bench -c 4 -n 20000 -A -P 16
+    record ack_packets_per_s "$(field "packets/s" "${output}")"
+    record ack_p99_us "$(p99 "${output}")"
+    record ack_server_cpu_us "$(field "server cpu/packet (us)" "${output}")"
+done
+
+if ${update}; then
+    awk -v results="$(for metric in "${!result[@]}"; do echo "${metric}=${result[${metric}]}"; done)" '
+        BEGIN {
+            n = split(results, pairs, "\n")
+            for (i = 1; i <= n; i++) {
+                split(pairs[i], kv, "=")
+                measured[kv[1]] = kv[2]
+            }
+        }
+        /^#/ || NF == 0 || !($1 in measured) { print; next }
+        { printf "%-28s %12s %6s  %s\n", $1, measured[$1], $3, $4 }
+    ' "${baseline_file}" > "${scratch_dir}/baseline" &&
+        cp "${scratch_dir}/baseline" "${baseline_file}"
+    echo "Baseline updated in ${baseline_file}"
+    exit 0
+fi
+
+failed=0
+printf "%-28s %12s %12s %9s %6s\n" metric baseline measured change limit
+for metric in "${metrics[@]}"; do
+    value=${result[${metric}]:-}
+    if [ -z "${value}" ]; then
+        echo "${metric} is in the baseline but was not measured" >&2
+        failed=1
+        continue
+    fi
+    # change is how much worse than the baseline, in percent
+    if ! awk -v v="${value}" -v base="${baseline[${metric}]}" -v tol="${tolerance[${metric}]}" \
+        -v b="${better[${metric}]}" -v m="${metric}" '
+        BEGIN {
+            if (base <= 0) {
+                printf "%-28s %12s %12s no baseline, run perf-test.sh --update\n", m, base, v
+                exit 1
+            }
+            change = (b == "higher" ? base - v : v - base) * 100 / base
+            verdict = change > tol ? "REGRESSED" : "ok"
+            printf "%-28s %12s %12s %8.1f%% %5s%% %s\n", m, base, v, change, tol, verdict
+            exit change > tol
+        }'; then
+        failed=1
+    fi
+done
+
+if [ ${failed} -ne 0 ]; then
+    echo "Performance regression gate failed"
+    exit 1
+fi
+echo "Performance regression gate passed"
@@ -0,0 +1,396 @@
+/**
+ * @file aesd-capture.c
+ * @brief Recording of the traffic connections receive, for replay
+ */
+
+#include "aesd-capture.h"
+#include "aesd-stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct capture_buffer_s
+{
+    uint8_t *data;
+    size_t len;
+} capture_buffer_t;
+
+// Everything below is guarded by captureMutex
+static pthread_mutex_t captureMutex = PTHREAD_MUTEX_INITIALIZER;
+// Signalled when a buffer is ready to write or the writer should stop
+static pthread_cond_t writerWake = PTHREAD_COND_INITIALIZER;
+// Set while records are accepted, which stops at the size limit while the
+// writer keeps running until the trace is switched
+static bool capturing = false;
+static bool writerRunning = false;
+static bool stopRequested = false;
+static pthread_t writerThread;
+static int traceFd = -1;
+static char tracePath[PATH_MAX];
+static uint64_t traceMaxBytes;
+static uint64_t traceBytes;
+// Ids keep counting from one trace to the next, so connections left over
+// from an earlier trace are told apart by being below firstTraceId
+static uint64_t nextId = 1;
+static uint64_t firstTraceId;
+static uint64_t lastRecordUs;
+// Connections append to filling while the writer writes out writing
+static capture_buffer_t buffers[2];
+static capture_buffer_t *filling = &buffers[0];
+static capture_buffer_t *writing = NULL;
+static uint64_t droppedRecords;
+
+static uint64_t monotonicUs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static size_t writeVarint(uint8_t *pos, uint64_t value)
+{
+    size_t len = 0;
+
+    do
+    {
+        pos[len] = value & 0x7f;
+        value >>= 7;
+        pos[len] |= value != 0 ? 0x80 : 0;
+        len++;
+    } while (value != 0);
+
+    return len;
+}
+
+size_t aesd_capture_read_varint(const uint8_t *pos, const uint8_t *end, uint64_t *value)
+{
+    size_t len = 0;
+    int shift = 0;
+
+    *value = 0;
+    while (pos + len < end && shift < 64)
+    {
+        *value |= (uint64_t)(pos[len] & 0x7f) << shift;
+        if ((pos[len++] & 0x80) == 0)
+        {
+            return len;
+        }
+        shift += 7;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Write all of buf to the trace
+ *
+ * @return int
+ * @retval -1 Error
+ * @retval  0 Success
+ */
+static int writeAll(int fd, const uint8_t *buf, size_t len)
+{
+    ssize_t writeRet;
+
+    while (len > 0)
+    {
+        writeRet = write(fd, buf, len);
+        if (writeRet < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        buf += writeRet;
+        len -= writeRet;
+    }
+
+    return 0;
+}
+
+static void *writerThreadMain(void *arg)
+{
+    struct timespec deadline;
+    capture_buffer_t *buffer;
+    bool stopping;
+    int fd;
+
+    pthread_mutex_lock(&captureMutex);
+    fd = traceFd;
+
+    while (true)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += CAPTURE_FLUSH_MS / 1000;
+        deadline.tv_nsec += (CAPTURE_FLUSH_MS % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        while (writing == NULL && !stopRequested &&
+               pthread_cond_timedwait(&writerWake, &captureMutex, &deadline) != ETIMEDOUT)
+        {
+        }
+
+        // A buffer that is not full still goes out every CAPTURE_FLUSH_MS,
+        // and whatever is left once stopping
+        if (writing == NULL && filling->len > 0)
+        {
+            writing = filling;
+            filling = filling == &buffers[0] ? &buffers[1] : &buffers[0];
+        }
+        stopping = stopRequested;
+        buffer = writing;
+
+        if (buffer != NULL)
+        {
+            pthread_mutex_unlock(&captureMutex);
+            if (writeAll(fd, buffer->data, buffer->len) != 0)
+            {
+                perror("write() error on capture trace");
+            }
+            pthread_mutex_lock(&captureMutex);
+            buffer->len = 0;
+            writing = NULL;
+        }
+        else if (stopping)
+        {
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&captureMutex);
+    return NULL;
+}
+
+/**
+ * @brief Stop the writer once it has written everything out, and close
+ *  the trace. Called without captureMutex held.
+ */
+static void stopCapture(void)
+{
+    pthread_mutex_lock(&captureMutex);
+    if (!writerRunning)
+    {
+        pthread_mutex_unlock(&captureMutex);
+        return;
+    }
+    capturing = false;
+    writerRunning = false;
+    stopRequested = true;
+    pthread_cond_signal(&writerWake);
+    pthread_mutex_unlock(&captureMutex);
+
+    pthread_join(writerThread, NULL);
+
+    syslog(LOG_INFO, "Capture to %s stopped after %llu bytes, %llu records dropped", tracePath,
+           (unsigned long long)traceBytes, (unsigned long long)droppedRecords);
+    close(traceFd);
+    traceFd = -1;
+    tracePath[0] = '\0';
+    free(buffers[0].data);
+    free(buffers[1].data);
+    buffers[0].data = NULL;
+    buffers[1].data = NULL;
+}
+
+static int startCapture(const char *path, uint64_t maxBytes)
+{
+    sigset_t allSignals;
+    sigset_t oldSignals;
+    int retVal;
+
+    if (strlen(path) >= sizeof(tracePath))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    buffers[0].data = malloc(CAPTURE_BUFFER_BYTES);
+    buffers[1].data = malloc(CAPTURE_BUFFER_BYTES);
+    traceFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (buffers[0].data == NULL || buffers[1].data == NULL || traceFd == -1 ||
+        writeAll(traceFd, (const uint8_t *)CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != 0)
+    {
+        perror("Cannot start capture");
+        goto cleanup;
+    }
+
+    pthread_mutex_lock(&captureMutex);
+    strcpy(tracePath, path);
+    traceMaxBytes = maxBytes;
+    traceBytes = CAPTURE_MAGIC_LEN;
+    firstTraceId = nextId;
+    lastRecordUs = monotonicUs();
+    buffers[0].len = 0;
+    buffers[1].len = 0;
+    filling = &buffers[0];
+    writing = NULL;
+    droppedRecords = 0;
+    stopRequested = false;
+
+    // Signals are for the main thread, the writer inherits this mask
+    sigfillset(&allSignals);
+    pthread_sigmask(SIG_BLOCK, &allSignals, &oldSignals);
+    retVal = pthread_create(&writerThread, NULL, writerThreadMain, NULL);
+    pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+
+    if (retVal != 0)
+    {
+        pthread_mutex_unlock(&captureMutex);
+        errno = retVal;
+        perror("pthread_create() error for capture writer");
+        goto cleanup;
+    }
+
+    capturing = true;
+    writerRunning = true;
+    pthread_mutex_unlock(&captureMutex);
+
+    syslog(LOG_INFO, "Capturing traffic to %s", path);
+    return 0;
+
+cleanup:
+    if (traceFd != -1)
+    {
+        close(traceFd);
+        traceFd = -1;
+    }
+    free(buffers[0].data);
+    free(buffers[1].data);
+    buffers[0].data = NULL;
+    buffers[1].data = NULL;
+    return -1;
+}
+
+int aesd_capture_configure(const char *path, uint64_t maxBytes)
+{
+    bool unchanged;
+
+    pthread_mutex_lock(&captureMutex);
+    unchanged = writerRunning ? path != NULL && strcmp(path, tracePath) == 0 : path == NULL;
+    if (unchanged)
+    {
+        traceMaxBytes = maxBytes;
+    }
+    pthread_mutex_unlock(&captureMutex);
+
+    if (unchanged)
+    {
+        return 0;
+    }
+
+    stopCapture();
+    return path != NULL ? startCapture(path, maxBytes) : 0;
+}
+
+/**
+ * @brief Append one record, or drop it if there is no room. Called with
+ *  captureMutex held.
+ */
+static void appendRecord(aesd_capture_type_t type, uint64_t id, uint64_t extra,
+                         const void *payload, size_t payloadLen)
+{
+    uint8_t header[CAPTURE_HEADER_MAX];
+    uint64_t nowUs = monotonicUs();
+    size_t headerLen = 0;
+
+    header[headerLen++] = type;
+    headerLen += writeVarint(header + headerLen, nowUs - lastRecordUs);
+    headerLen += writeVarint(header + headerLen, id - firstTraceId + 1);
+    if (type != CAPTURE_CLOSE)
+    {
+        headerLen += writeVarint(header + headerLen, extra);
+    }
+
+    if (traceMaxBytes != 0 && traceBytes + headerLen + payloadLen > traceMaxBytes)
+    {
+        // Stopped for good, the writer keeps running until reconfigured
+        capturing = false;
+        syslog(LOG_WARNING, "Capture to %s reached its size limit", tracePath);
+        return;
+    }
+
+    if (headerLen + payloadLen > CAPTURE_BUFFER_BYTES - filling->len)
+    {
+        // Hand the full buffer over, unless the writer is still busy
+        if (writing != NULL || headerLen + payloadLen > CAPTURE_BUFFER_BYTES)
+        {
+            droppedRecords++;
+            aesd_stats_add(STAT_CAPTURE_DROPPED, 1);
+            return;
+        }
+        writing = filling;
+        filling = filling == &buffers[0] ? &buffers[1] : &buffers[0];
+        pthread_cond_signal(&writerWake);
+    }
+
+    memcpy(filling->data + filling->len, header, headerLen);
+    memcpy(filling->data + filling->len + headerLen, payload, payloadLen);
+    filling->len += headerLen + payloadLen;
+    traceBytes += headerLen + payloadLen;
+    lastRecordUs = nowUs;
+
+    aesd_stats_add(STAT_CAPTURE_RECORDS, 1);
+    aesd_stats_add(STAT_CAPTURE_BYTES, headerLen + payloadLen);
+}
+
+uint64_t aesd_capture_open(bool local)
+{
+    uint64_t id = 0;
+
+    pthread_mutex_lock(&captureMutex);
+    if (capturing)
+    {
+        id = nextId++;
+        appendRecord(CAPTURE_OPEN, id, local ? CAPTURE_TRANSPORT_UNIX : CAPTURE_TRANSPORT_TCP,
+                     NULL, 0);
+    }
+    pthread_mutex_unlock(&captureMutex);
+
+    return id;
+}
+
+void aesd_capture_data(uint64_t id, const void *buf, size_t len)
+{
+    if (id == 0)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&captureMutex);
+    if (capturing && id >= firstTraceId)
+    {
+        appendRecord(CAPTURE_DATA, id, len, buf, len);
+    }
+    pthread_mutex_unlock(&captureMutex);
+}
+
+void aesd_capture_close(uint64_t id)
+{
+    if (id == 0)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&captureMutex);
+    if (capturing && id >= firstTraceId)
+    {
+        appendRecord(CAPTURE_CLOSE, id, 0, NULL, 0);
+    }
+    pthread_mutex_unlock(&captureMutex);
+}
@@ -0,0 +1,88 @@
+/**
+ * @file aesd-capture.h
+ * @brief Recording of the traffic connections receive, for replay
+ *
+ * Every connection opening, every chunk of bytes it receives and its
+ * closing are written to a trace as they happen, so aesd-replay can play
+ * the same mix of packets, commands and connection churn back later. The
+ * bytes are recorded as received, before framing, so commands, binary
+ * records and partial packets replay exactly. Datagrams and the
+ * shared-memory ring are not recorded.
+ *
+ * Connections append records to a buffer under a lock held only for the
+ * copy, and a writer thread writes full buffers out. If the writer falls
+ * behind, records are dropped and counted rather than holding connections
+ * up.
+ *
+ * A trace is CAPTURE_MAGIC followed by records, each a type byte and then
+ * unsigned LEB128 integers: microseconds since the previous record and the
+ * connection id, then for CAPTURE_OPEN the transport and for CAPTURE_DATA
+ * the length and that many bytes. Connection ids start from 1 in each
+ * trace.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CAPTURE_MAGIC           "AESDTRC1"
+#define CAPTURE_MAGIC_LEN       8
+// Each of the two buffers connections append to while the other is written
+#define CAPTURE_BUFFER_BYTES    (4 * 1024 * 1024)
+// How long the writer lets records sit in a buffer that is not full
+#define CAPTURE_FLUSH_MS        1000
+// Longest a record header can be: type and three 64-bit LEB128 integers
+#define CAPTURE_HEADER_MAX      (1 + 3 * 10)
+
+typedef enum aesd_capture_type_e
+{
+    // Followed by CAPTURE_TRANSPORT_TCP or CAPTURE_TRANSPORT_UNIX
+    CAPTURE_OPEN = 1,
+    CAPTURE_DATA = 2,
+    CAPTURE_CLOSE = 3,
+} aesd_capture_type_t;
+
+#define CAPTURE_TRANSPORT_TCP   0
+#define CAPTURE_TRANSPORT_UNIX  1
+
+/**
+ * @brief Start recording to path, stop recording, or switch to another
+ *  trace, at any time. Only updates maxBytes if path is the trace already
+ *  being written.
+ *
+ * Connections already open when a trace starts are not recorded in it. A
+ * trace that reaches maxBytes records nothing more, even if the limit is
+ * raised, until recording switches to another.
+ *
+ * @param path Trace to create or truncate, or NULL to stop recording
+ * @param maxBytes Size at which recording stops, or 0 for no limit
+ * @return int
+ * @retval -1 Error, recording is stopped
+ * @retval  0 Success
+ */
+int aesd_capture_configure(const char *path, uint64_t maxBytes);
+
+/**
+ * @brief Record a new connection
+ *
+ * @param local Connected over the unix domain socket
+ * @return uint64_t Id to record its traffic under, 0 if not recording
+ */
+uint64_t aesd_capture_open(bool local);
+
+/**
+ * @brief Record bytes received on a connection. Does nothing for id 0 or a
+ *  connection from before the current trace.
+ */
+void aesd_capture_data(uint64_t id, const void *buf, size_t len);
+
+void aesd_capture_close(uint64_t id);
+
+/**
+ * @brief Read one LEB128 integer from a trace
+ *
+ * @return size_t Bytes it took, or 0 if it runs past end or overflows
+ */
+size_t aesd_capture_read_varint(const uint8_t *pos, const uint8_t *end, uint64_t *value);
@@ -0,0 +1,1249 @@
+/**
+ * @file aesd-channel.c
+ * @brief Named, independently locked logs that connections append to
+ */
+
+// POLLRDHUP
+#define _GNU_SOURCE
+
+#include "aesd-channel.h"
+#include "aesd-memory.h"
+#include "aesd-stats.h"
+#include "aesd-trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#define CHANNEL_IO_BUFF_SIZE    65536
+// Most packets a subscriber takes references on (and sends with one
+// sendmsg()) per trip through the channel lock
+#define FOLLOW_BATCH_SIZE       64
+// How often an idle subscriber checks whether its peer went away
+#define FOLLOW_IDLE_CHECK_SEC   1
+// A fair lock's average hold time moves this fraction of the way to each
+// new hold time
+#define HOLD_AVERAGE_WEIGHT     8
+
+struct aesd_shared_packet_s
+{
+    atomic_uint refCount;
+    size_t len;
+    char data[];
+};
+
+static SLIST_HEAD(channel_list_s, aesd_channel_s) channelList =
+    SLIST_HEAD_INITIALIZER(channelList);
+static pthread_mutex_t registryMutex = PTHREAD_MUTEX_INITIALIZER;
+static aesd_channel_t *defaultChannel = NULL;
+// Leaves room for the channel name and index suffix in a PATH_MAX path
+static char pathPrefix[PATH_MAX - CHANNEL_NAME_MAX - sizeof(".idx")];
+static bool fairLocks = false;
+// Set by aesd_channel_stop_followers(), until the registry is set up again
+static atomic_bool followersStopped = false;
+
+static uint64_t monotonicNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Sleep while *word still holds expected
+ *
+ * @return int 0 once woken, -1 with errno EAGAIN if word had already
+ *  changed, ETIMEDOUT or EINTR
+ */
+static int futexWait(atomic_uint_least32_t *word, uint32_t expected,
+                     const struct timespec *timeout)
+{
+    return syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, timeout, NULL, 0);
+}
+
+static void futexWakeAll(atomic_uint_least32_t *word)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/**
+ * @brief Wake whoever waits for the log to grow. Caller must hold the
+ *  channel lock.
+ */
+static void notifyAppend(aesd_channel_t *channel)
+{
+    if (channel->appendWaiters > 0)
+    {
+        atomic_fetch_add(&channel->appendEvents, 1);
+        futexWakeAll(&channel->appendEvents);
+    }
+}
+
+static void releasePacket(aesd_shared_packet_t *packet)
+{
+    if (packet != NULL && atomic_fetch_sub(&packet->refCount, 1) == 1)
+    {
+        aesd_memory_release(MEM_RESPONSE, sizeof(aesd_shared_packet_t) + packet->len);
+        free(packet);
+    }
+}
+
+static void freePublishRing(aesd_channel_t *channel)
+{
+    uint32_t i;
+
+    if (channel->publishRing == NULL)
+    {
+        return;
+    }
+
+    for (i = 0; i < SUBSCRIBER_RING_SIZE; i++)
+    {
+        releasePacket(channel->publishRing[i]);
+    }
+    free(channel->publishRing);
+    channel->publishRing = NULL;
+}
+
+/**
+ * @brief Make a complete packet available to subscribers. Caller must hold
+ *  the channel lock.
+ */
+static int publishPacket(aesd_channel_t *channel, const char *buf, size_t len)
+{
+    aesd_shared_packet_t *packet;
+    uint32_t slot = channel->publishSeq % SUBSCRIBER_RING_SIZE;
+
+    packet = malloc(sizeof(aesd_shared_packet_t) + len);
+    if (packet == NULL)
+    {
+        return -1;
+    }
+
+    // Already in the log, so charged whatever the budget says. Readers
+    // holding back under the pressure it adds is what bounds it.
+    aesd_memory_charge(MEM_RESPONSE, sizeof(aesd_shared_packet_t) + len);
+
+    // The ring owns one reference, each subscriber sending it takes another
+    atomic_init(&packet->refCount, 1);
+    packet->len = len;
+    memcpy(packet->data, buf, len);
+
+    releasePacket(channel->publishRing[slot]);
+    channel->publishRing[slot] = packet;
+    channel->publishSeq++;
+
+    atomic_fetch_add(&channel->publishEvents, 1);
+    if (channel->publishWaiters > 0)
+    {
+        futexWakeAll(&channel->publishEvents);
+    }
+    return 0;
+}
+
+static int openChannel(aesd_channel_t *channel)
+{
+    struct stat dataStat;
+    int openFlags = O_RDWR | O_CREAT;
+
+    // The driver ignores the file position on write, regular files need
+    // O_APPEND so appends from the timer and connections never overlap
+    if (!channel->charDevice)
+    {
+        openFlags |= O_APPEND;
+    }
+
+    channel->fd = open(channel->dataPath, openFlags,
+                       S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (channel->fd == -1)
+    {
+        perror("open() error on channel log");
+        return -1;
+    }
+
+    if (!channel->charDevice)
+    {
+        if (fstat(channel->fd, &dataStat) != 0)
+        {
+            perror("fstat() error on channel log");
+            close(channel->fd);
+            return -1;
+        }
+        channel->dataLength = dataStat.st_size;
+
+        if (aesd_packet_index_open(&channel->index, channel->dataPath,
+                                   channel->indexPath) != 0)
+        {
+            close(channel->fd);
+            return -1;
+        }
+    }
+
+    if (pthread_mutex_init(&channel->mutex, NULL) != 0)
+    {
+        perror("pthread_mutex_init() error");
+        if (!channel->charDevice)
+        {
+            aesd_packet_index_close(&channel->index);
+        }
+        close(channel->fd);
+        return -1;
+    }
+
+    channel->snapshotFd = -1;
+    channel->fairLock = fairLocks;
+    atomic_init(&channel->nextTicket, 0);
+    atomic_init(&channel->nowServing, 0);
+    atomic_init(&channel->lockWaiters, 0);
+    atomic_init(&channel->holdNsAverage, 0);
+    atomic_init(&channel->publishEvents, 0);
+    atomic_init(&channel->appendEvents, 0);
+
+    syslog(LOG_INFO, "Opened channel %s at %s", channel->name, channel->dataPath);
+    return 0;
+}
+
+int aesd_channel_registry_init(const char *defaultDataPath, const char *defaultIndexPath,
+                               const char *channelPathPrefix, bool fairLocking)
+{
+    aesd_channel_t *channel = calloc(1, sizeof(aesd_channel_t));
+
+    if (channel == NULL)
+    {
+        return -1;
+    }
+
+    strcpy(channel->name, DEFAULT_CHANNEL_NAME);
+    snprintf(channel->dataPath, sizeof(channel->dataPath), "%s", defaultDataPath);
+    if (defaultIndexPath != NULL)
+    {
+        snprintf(channel->indexPath, sizeof(channel->indexPath), "%s", defaultIndexPath);
+    }
+    channel->charDevice = (defaultIndexPath == NULL);
+    fairLocks = fairLocking;
+    atomic_store(&followersStopped, false);
+
+    if (openChannel(channel) != 0)
+    {
+        free(channel);
+        return -1;
+    }
+
+    snprintf(pathPrefix, sizeof(pathPrefix), "%s", channelPathPrefix);
+    defaultChannel = channel;
+    SLIST_INSERT_HEAD(&channelList, channel, entries);
+    return 0;
+}
+
+void aesd_channel_registry_cleanup(void)
+{
+    aesd_channel_t *channel;
+
+    pthread_mutex_lock(&registryMutex);
+    while (!SLIST_EMPTY(&channelList))
+    {
+        channel = SLIST_FIRST(&channelList);
+        SLIST_REMOVE_HEAD(&channelList, entries);
+
+        if (!channel->charDevice)
+        {
+            aesd_packet_index_close(&channel->index);
+        }
+        close(channel->fd);
+        if (channel->snapshotFd != -1)
+        {
+            close(channel->snapshotFd);
+            aesd_memory_release(MEM_SNAPSHOT, channel->snapshotSize);
+        }
+        freePublishRing(channel);
+        pthread_mutex_destroy(&channel->mutex);
+        free(channel);
+    }
+    defaultChannel = NULL;
+    pthread_mutex_unlock(&registryMutex);
+}
+
+void aesd_channel_registry_remove_files(void)
+{
+    aesd_channel_t *channel;
+
+    // Connection threads may still be adding channels
+    pthread_mutex_lock(&registryMutex);
+    SLIST_FOREACH(channel, &channelList, entries)
+    {
+        if (channel != defaultChannel)
+        {
+            unlink(channel->dataPath);
+            unlink(channel->indexPath);
+        }
+    }
+    pthread_mutex_unlock(&registryMutex);
+}
+
+void aesd_channel_stop_followers(void)
+{
+    aesd_channel_t *channel;
+
+    atomic_store(&followersStopped, true);
+
+    pthread_mutex_lock(&registryMutex);
+    SLIST_FOREACH(channel, &channelList, entries)
+    {
+        // Under the lock, so a subscriber either sees the flag before it
+        // sleeps or is asleep and gets woken
+        if (aesd_channel_lock(channel) == 0)
+        {
+            atomic_fetch_add(&channel->publishEvents, 1);
+            futexWakeAll(&channel->publishEvents);
+            aesd_channel_unlock(channel);
+        }
+    }
+    pthread_mutex_unlock(&registryMutex);
+}
+
+aesd_channel_t *aesd_channel_default(void)
+{
+    return defaultChannel;
+}
+
+bool aesd_channel_name_valid(const char *name)
+{
+    size_t i;
+
+    for (i = 0; name[i] != '\0'; i++)
+    {
+        if (i == CHANNEL_NAME_MAX)
+        {
+            return false;
+        }
+
+        if (!((name[i] >= 'a' && name[i] <= 'z') ||
+              (name[i] >= 'A' && name[i] <= 'Z') ||
+              (name[i] >= '0' && name[i] <= '9') ||
+              name[i] == '_' || name[i] == '-'))
+        {
+            return false;
+        }
+    }
+
+    return i > 0;
+}
+
+aesd_channel_t *aesd_channel_get(const char *name)
+{
+    aesd_channel_t *channel;
+
+    if (!aesd_channel_name_valid(name))
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&registryMutex);
+
+    SLIST_FOREACH(channel, &channelList, entries)
+    {
+        if (strcmp(channel->name, name) == 0)
+        {
+            pthread_mutex_unlock(&registryMutex);
+            return channel;
+        }
+    }
+
+    channel = calloc(1, sizeof(aesd_channel_t));
+    if (channel != NULL)
+    {
+        strcpy(channel->name, name);
+        snprintf(channel->dataPath, sizeof(channel->dataPath), "%s%s", pathPrefix, name);
+        snprintf(channel->indexPath, sizeof(channel->indexPath), "%s%s.idx", pathPrefix, name);
+        channel->charDevice = false;
+
+        if (openChannel(channel) == 0)
+        {
+            SLIST_INSERT_HEAD(&channelList, channel, entries);
+        }
+        else
+        {
+            free(channel);
+            channel = NULL;
+        }
+    }
+
+    pthread_mutex_unlock(&registryMutex);
+    return channel;
+}
+
+int aesd_channel_lock(aesd_channel_t *channel)
+{
+    uint64_t waitStart = aesd_trace_clock();
+    uint32_t ticket;
+    uint32_t serving;
+    int lockRet;
+
+    if (channel->fairLock)
+    {
+        ticket = atomic_fetch_add(&channel->nextTicket, 1);
+        while ((serving = atomic_load(&channel->nowServing)) != ticket)
+        {
+            futexWait(&channel->nowServing, serving, NULL);
+        }
+        // Free by now, but taking it anyway keeps both kinds of lock on
+        // one path
+        lockRet = pthread_mutex_lock(&channel->mutex);
+    }
+    else
+    {
+        atomic_fetch_add_explicit(&channel->lockWaiters, 1, memory_order_relaxed);
+        lockRet = pthread_mutex_lock(&channel->mutex);
+        atomic_fetch_sub_explicit(&channel->lockWaiters, 1, memory_order_relaxed);
+    }
+
+    if (lockRet != 0)
+    {
+        errno = lockRet;
+        perror("pthread_mutex_lock() error");
+        return -1;
+    }
+
+    if (channel->fairLock)
+    {
+        channel->lockedAtNs = monotonicNs();
+    }
+    aesd_trace_charge(TRACE_LOCK, waitStart);
+    return 0;
+}
+
+int aesd_channel_lock_timed(aesd_channel_t *channel, uint32_t timeoutMs)
+{
+    uint64_t waitStart;
+    uint64_t queueNs;
+    struct timespec deadline;
+    int lockRet;
+
+    if (timeoutMs == 0)
+    {
+        return aesd_channel_lock(channel);
+    }
+
+    if (channel->fairLock)
+    {
+        // Tickets not yet served include the holder's, whose hold is partly
+        // over already
+        queueNs = (uint64_t)(atomic_load(&channel->nextTicket) -
+                             atomic_load(&channel->nowServing)) *
+                  atomic_load_explicit(&channel->holdNsAverage, memory_order_relaxed);
+        if (queueNs > (uint64_t)timeoutMs * 1000000)
+        {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        return aesd_channel_lock(channel);
+    }
+
+    waitStart = aesd_trace_clock();
+    // pthread_mutex_timedlock() only takes CLOCK_REALTIME deadlines
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeoutMs / 1000;
+    deadline.tv_nsec += (long)(timeoutMs % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    atomic_fetch_add_explicit(&channel->lockWaiters, 1, memory_order_relaxed);
+    lockRet = pthread_mutex_timedlock(&channel->mutex, &deadline);
+    atomic_fetch_sub_explicit(&channel->lockWaiters, 1, memory_order_relaxed);
+    aesd_trace_charge(TRACE_LOCK, waitStart);
+    if (lockRet != 0)
+    {
+        errno = lockRet;
+        if (lockRet != ETIMEDOUT)
+        {
+            perror("pthread_mutex_timedlock() error");
+        }
+        return -1;
+    }
+
+    return 0;
+}
+
+int aesd_channel_unlock(aesd_channel_t *channel)
+{
+    int64_t average;
+    int64_t held;
+    uint32_t serving;
+    int lockRet;
+
+    // Only the holder updates it, so a plain load and store will do
+    if (channel->fairLock)
+    {
+        average = atomic_load_explicit(&channel->holdNsAverage, memory_order_relaxed);
+        held = monotonicNs() - channel->lockedAtNs;
+        atomic_store_explicit(&channel->holdNsAverage,
+                              average + (held - average) / HOLD_AVERAGE_WEIGHT,
+                              memory_order_relaxed);
+    }
+
+    lockRet = pthread_mutex_unlock(&channel->mutex);
+
+    if (lockRet != 0)
+    {
+        errno = lockRet;
+        perror("pthread_mutex_unlock() error");
+        return -1;
+    }
+
+    if (channel->fairLock)
+    {
+        // Pairs with a locker taking its ticket and then checking
+        // nowServing: either it sees its turn or we see its ticket. Every
+        // waiter is woken since a futex cannot single out the next ticket.
+        serving = atomic_fetch_add(&channel->nowServing, 1) + 1;
+        if (atomic_load(&channel->nextTicket) != serving)
+        {
+            futexWakeAll(&channel->nowServing);
+        }
+    }
+
+    return 0;
+}
+
+bool aesd_channel_contended(aesd_channel_t *channel)
+{
+    // The holder counts itself among the tickets not yet served, but never
+    // among the waiters
+    if (channel->fairLock)
+    {
+        return atomic_load_explicit(&channel->nextTicket, memory_order_relaxed) -
+                   atomic_load_explicit(&channel->nowServing, memory_order_relaxed) > 1;
+    }
+    return atomic_load_explicit(&channel->lockWaiters, memory_order_relaxed) > 0;
+}
+
+int aesd_channel_append(aesd_channel_t *channel, const char *buf, size_t len)
+{
+    uint64_t appendStart = aesd_trace_clock();
+    ssize_t writeRet;
+    size_t bytesLeft = len;
+
+    // The driver only consumes up to the first newline per write
+    while (bytesLeft > 0)
+    {
+        writeRet = write(channel->fd, buf + len - bytesLeft, bytesLeft);
+        if (writeRet < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("write() error on channel log");
+            return -1;
+        }
+        bytesLeft -= writeRet;
+    }
+
+    aesd_trace_charge(TRACE_APPEND, appendStart);
+    channel->generation++;
+
+    if (len == 0 || buf[len - 1] != '\n')
+    {
+        if (!channel->charDevice)
+        {
+            channel->dataLength += len;
+            notifyAppend(channel);
+        }
+        return 0;
+    }
+
+    // Nobody to push to, don't pay for the copy
+    if (channel->subscriberCount > 0 && publishPacket(channel, buf, len) != 0)
+    {
+        perror("Publishing packet to subscribers failed");
+    }
+
+    if (channel->charDevice)
+    {
+        return 0;
+    }
+
+    channel->dataLength += len;
+    notifyAppend(channel);
+
+    if (aesd_packet_index_append(&channel->index, channel->dataLength) != 0)
+    {
+        perror("Packet index append error");
+        return -1;
+    }
+
+    return 0;
+}
+
+int aesd_channel_append_packets(aesd_channel_t *channel, const struct iovec *packets,
+                                uint32_t count)
+{
+    struct iovec pending[CHANNEL_APPEND_BATCH_MAX];
+    uint64_t packetEnds[CHANNEL_APPEND_BATCH_MAX];
+    uint64_t end = channel->dataLength;
+    uint64_t appendStart;
+    uint32_t firstIov = 0;
+    ssize_t writeRet;
+    uint32_t i;
+
+    if (count > CHANNEL_APPEND_BATCH_MAX)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // The driver wants a write per packet anyway
+    if (channel->charDevice)
+    {
+        for (i = 0; i < count; i++)
+        {
+            if (aesd_channel_append(channel, packets[i].iov_base, packets[i].iov_len) != 0)
+            {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    appendStart = aesd_trace_clock();
+    memcpy(pending, packets, count * sizeof(pending[0]));
+    while (firstIov < count)
+    {
+        writeRet = writev(channel->fd, &pending[firstIov], count - firstIov);
+        if (writeRet < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("writev() error on channel log");
+            return -1;
+        }
+
+        channel->dataLength += writeRet;
+        while (firstIov < count && (size_t)writeRet >= pending[firstIov].iov_len)
+        {
+            writeRet -= pending[firstIov].iov_len;
+            firstIov++;
+        }
+        if (firstIov < count)
+        {
+            pending[firstIov].iov_base = (char *)pending[firstIov].iov_base + writeRet;
+            pending[firstIov].iov_len -= writeRet;
+        }
+    }
+
+    aesd_trace_charge(TRACE_APPEND, appendStart);
+    channel->generation++;
+    notifyAppend(channel);
+
+    for (i = 0; i < count; i++)
+    {
+        end += packets[i].iov_len;
+        packetEnds[i] = end;
+
+        if (channel->subscriberCount > 0 &&
+            publishPacket(channel, packets[i].iov_base, packets[i].iov_len) != 0)
+        {
+            perror("Publishing packet to subscribers failed");
+        }
+    }
+
+    if (aesd_packet_index_append_batch(&channel->index, packetEnds, count) != 0)
+    {
+        perror("Packet index append error");
+        return -1;
+    }
+
+    return 0;
+}
+
+int aesd_channel_rewind(aesd_channel_t *channel)
+{
+    uint64_t seekStart = aesd_trace_clock();
+    off_t retval = lseek(channel->fd, 0, SEEK_SET);
+
+    aesd_trace_charge(TRACE_SEEK, seekStart);
+
+    if (retval < 0)
+    {
+        perror("lseek() error in returning socket input to peer");
+        return -1;
+    }
+
+    return 0;
+}
+
+int aesd_channel_seek(aesd_channel_t *channel, uint32_t writeCmd, uint32_t writeCmdOffset)
+{
+    struct aesd_seekto aesd_seekto_params;
+    uint64_t seekStart = aesd_trace_clock();
+    off_t seekOffset;
+    long ioctlRes;
+
+    if (channel->charDevice)
+    {
+        aesd_seekto_params.write_cmd = writeCmd;
+        aesd_seekto_params.write_cmd_offset = writeCmdOffset;
+
+        ioctlRes = ioctl(channel->fd, AESDCHAR_IOCSEEKTO, &aesd_seekto_params);
+        aesd_trace_charge(TRACE_SEEK, seekStart);
+        syslog(LOG_INFO, "ioctl result (f_pos): %ld", ioctlRes);
+        return ioctlRes == 0 ? 0 : -1;
+    }
+
+    // Same contract as the driver's ioctl: an out of range request
+    // leaves the file position untouched
+    if (aesd_packet_index_lookup(&channel->index, writeCmd, writeCmdOffset,
+                                 &seekOffset) != 0)
+    {
+        return -1;
+    }
+
+    seekOffset = lseek(channel->fd, seekOffset, SEEK_SET);
+    aesd_trace_charge(TRACE_SEEK, seekStart);
+    syslog(LOG_INFO, "Index seek result (f_pos): %ld", (long)seekOffset);
+    return seekOffset < 0 ? -1 : 0;
+}
+
+ssize_t aesd_channel_read(aesd_channel_t *channel, char *buf, size_t len)
+{
+    size_t bytesRead = 0;
+    ssize_t readRet;
+
+    // The driver hands back at most one entry per read
+    while (bytesRead < len)
+    {
+        readRet = read(channel->fd, buf + bytesRead, len - bytesRead);
+        if (readRet == 0)
+        {
+            break;
+        }
+        if (readRet < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN)
+            {
+                continue;
+            }
+            perror("read() error on channel log");
+            return -1;
+        }
+        bytesRead += readRet;
+    }
+
+    return bytesRead;
+}
+
+int aesd_channel_extent(aesd_channel_t *channel, uint64_t *packetCount, uint64_t *size)
+{
+    char readBuff[CHANNEL_IO_BUFF_SIZE];
+    char *nlPtr;
+    ssize_t readRet;
+
+    if (!channel->charDevice)
+    {
+        *packetCount = channel->index.count;
+        *size = channel->dataLength;
+        return 0;
+    }
+
+    // The driver keeps no totals, but holds at most
+    // AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries, so count them
+    *packetCount = 0;
+    *size = 0;
+
+    if (aesd_channel_rewind(channel) != 0)
+    {
+        // An empty buffer cannot be seeked into
+        return 0;
+    }
+
+    while ((readRet = aesd_channel_read(channel, readBuff, sizeof(readBuff))) > 0)
+    {
+        *size += readRet;
+        nlPtr = readBuff;
+        while ((nlPtr = memchr(nlPtr, '\n', readRet - (nlPtr - readBuff))) != NULL)
+        {
+            (*packetCount)++;
+            nlPtr++;
+        }
+    }
+
+    return readRet < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Send every iovec in full, consuming iov as it goes
+ */
+static int sendIovecs(int sockfd, struct iovec *iov, uint32_t count, int flags)
+{
+    struct msghdr msg;
+    uint32_t firstIov = 0;
+    ssize_t sendRet;
+
+    while (firstIov < count)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov[firstIov];
+        msg.msg_iovlen = count - firstIov;
+
+        sendRet = sendmsg(sockfd, &msg, flags | MSG_NOSIGNAL);
+        if (sendRet < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+
+        // Step past whatever was fully sent, trim a partially sent iovec
+        while (firstIov < count && (size_t)sendRet >= iov[firstIov].iov_len)
+        {
+            sendRet -= iov[firstIov].iov_len;
+            firstIov++;
+        }
+        if (firstIov < count)
+        {
+            iov[firstIov].iov_base = (char *)iov[firstIov].iov_base + sendRet;
+            iov[firstIov].iov_len -= sendRet;
+        }
+    }
+
+    return 0;
+}
+
+int aesd_channel_send_contents(aesd_channel_t *channel, int sockfd, bool framed,
+                               aesd_zerocopy_t *zc)
+{
+    return aesd_channel_send_until(channel, sockfd, framed, zc, UINT64_MAX);
+}
+
+int aesd_channel_send_until(aesd_channel_t *channel, int sockfd, bool framed,
+                            aesd_zerocopy_t *zc, uint64_t end)
+{
+    char readBuff[CHANNEL_IO_BUFF_SIZE];
+    struct iovec iov[2];
+    uint32_t frameHeader;
+    uint64_t left = UINT64_MAX;
+    uint64_t phaseStart;
+    ssize_t readRet;
+    off_t pos;
+
+    if (zc != NULL)
+    {
+        // Unmap whatever earlier replies no longer need, even once this
+        // connection has gone back to copying
+        aesd_zerocopy_reap(zc, 0);
+    }
+
+    // Without an end the log is read to EOF, which the driver needs
+    if (end > channel->dataLength)
+    {
+        end = channel->dataLength;
+    }
+    else if (!channel->charDevice)
+    {
+        pos = lseek(channel->fd, 0, SEEK_CUR);
+        left = pos != -1 && (uint64_t)pos < end ? end - pos : 0;
+    }
+
+    // The driver's buffer cannot be mapped, only file-backed channels are
+    // sent straight from the page cache
+    if (zc != NULL && !channel->charDevice &&
+        (pos = lseek(channel->fd, 0, SEEK_CUR)) != -1 &&
+        (uint64_t)pos < end &&
+        aesd_zerocopy_wanted(zc, end - pos))
+    {
+        phaseStart = aesd_trace_clock();
+        readRet = aesd_zerocopy_send_file(zc, channel->fd, pos, end - pos, framed);
+        aesd_trace_charge(TRACE_SEND, phaseStart);
+        if (readRet < 0)
+        {
+            perror("send() error in returning socket input to peer");
+            return -1;
+        }
+
+        // Whatever could not go zero-copy is read and copied below
+        if (lseek(channel->fd, pos + readRet, SEEK_SET) == -1)
+        {
+            perror("lseek() error in returning socket input to peer");
+            return -1;
+        }
+        if (left != UINT64_MAX)
+        {
+            left -= readRet;
+        }
+    }
+
+    // Read until EOF, or end
+    phaseStart = aesd_trace_clock();
+    while (left > 0 && (readRet = read(channel->fd, readBuff,
+                                       left < sizeof(readBuff) ? left : sizeof(readBuff))) != 0)
+    {
+        aesd_trace_charge(TRACE_READ, phaseStart);
+        phaseStart = aesd_trace_clock();
+        if (readRet < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN)
+            {
+                continue;
+            }
+            perror("read() error in returning socket input to peer");
+            return -1;
+        }
+
+        frameHeader = htonl(readRet);
+        iov[0].iov_base = &frameHeader;
+        iov[0].iov_len = framed ? sizeof(frameHeader) : 0;
+        iov[1].iov_base = readBuff;
+        iov[1].iov_len = readRet;
+
+        // Corked until the empty frame, so a short reply is one segment
+        if (sendIovecs(sockfd, iov, 2, framed ? MSG_MORE : 0) != 0)
+        {
+            perror("send() error in returning socket input to peer");
+            return -1;
+        }
+        aesd_trace_charge(TRACE_SEND, phaseStart);
+        phaseStart = aesd_trace_clock();
+        if (left != UINT64_MAX)
+        {
+            left -= readRet;
+        }
+    }
+    aesd_trace_charge(TRACE_READ, phaseStart);
+
+    // An empty frame tells the peer the reply is complete
+    frameHeader = 0;
+    phaseStart = aesd_trace_clock();
+    if (framed && send(sockfd, &frameHeader, sizeof(frameHeader), MSG_NOSIGNAL) !=
+                      sizeof(frameHeader))
+    {
+        perror("send() error in returning socket input to peer");
+        return -1;
+    }
+    aesd_trace_charge(TRACE_SEND, phaseStart);
+
+    return 0;
+}
+
+/**
+ * @brief Copy the whole log into fd, which must be empty
+ *
+ * @return int
+ * @retval -1 Error
+ * @retval  0 Success
+ */
+static int copyContents(aesd_channel_t *channel, int fd, uint64_t *size)
+{
+    char readBuff[CHANNEL_IO_BUFF_SIZE];
+    off_t offset = 0;
+    ssize_t readRet;
+    ssize_t copyRet;
+
+    // Regular files are copied by the kernel, without moving the shared
+    // file position
+    if (!channel->charDevice)
+    {
+        while ((uint64_t)offset < channel->dataLength)
+        {
+            copyRet = sendfile(fd, channel->fd, &offset, channel->dataLength - offset);
+            if (copyRet <= 0)
+            {
+                if (copyRet < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                perror("sendfile() error copying channel log to snapshot");
+                return -1;
+            }
+        }
+        *size = offset;
+        return 0;
+    }
+
+    *size = 0;
+    if (aesd_channel_rewind(channel) != 0)
+    {
+        // An empty buffer cannot be seeked into
+        return 0;
+    }
+
+    while ((readRet = aesd_channel_read(channel, readBuff, sizeof(readBuff))) > 0)
+    {
+        if (write(fd, readBuff, readRet) != readRet)
+        {
+            perror("write() error copying channel log to snapshot");
+            return -1;
+        }
+        *size += readRet;
+    }
+
+    return readRet < 0 ? -1 : 0;
+}
+
+int aesd_channel_snapshot(aesd_channel_t *channel, uint64_t *generation, uint64_t *size)
+{
+    uint64_t snapshotSize;
+    int fd;
+
+    if (channel->snapshotFd != -1 && channel->snapshotGeneration == channel->generation)
+    {
+        aesd_stats_add(STAT_SNAPSHOTS_SHARED, 1);
+        *generation = channel->snapshotGeneration;
+        *size = channel->snapshotSize;
+        return channel->snapshotFd;
+    }
+
+    fd = memfd_create("aesdsocket-snapshot", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1)
+    {
+        perror("memfd_create() error for snapshot");
+        return -1;
+    }
+
+    // Sealed before any reader sees it, so the contents can never change
+    // under a mapping
+    if (copyContents(channel, fd, &snapshotSize) != 0 ||
+        fcntl(fd, F_ADD_SEALS, F_SEAL_WRITE | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0)
+    {
+        perror("Building channel snapshot failed");
+        close(fd);
+        return -1;
+    }
+
+    // Readers holding the previous snapshot keep their own reference to it,
+    // only the copy kept here counts against the budget
+    if (channel->snapshotFd != -1)
+    {
+        close(channel->snapshotFd);
+        aesd_memory_release(MEM_SNAPSHOT, channel->snapshotSize);
+        channel->snapshotFd = -1;
+    }
+
+    if (!aesd_memory_try_charge(MEM_SNAPSHOT, snapshotSize))
+    {
+        aesd_stats_add(STAT_MEM_CHARGES_REFUSED, 1);
+        close(fd);
+        errno = ENOMEM;
+        return -1;
+    }
+    channel->snapshotFd = fd;
+    channel->snapshotGeneration = channel->generation;
+    channel->snapshotSize = snapshotSize;
+    aesd_stats_add(STAT_SNAPSHOTS_BUILT, 1);
+
+    *generation = channel->snapshotGeneration;
+    *size = snapshotSize;
+    return fd;
+}
+
+/**
+ * @brief Check, without blocking, whether a subscriber's peer has closed the
+ *  connection. Anything the peer sends is discarded.
+ */
+static bool subscriberGone(int sockfd)
+{
+    struct pollfd pfd = {.fd = sockfd, .events = POLLIN | POLLRDHUP};
+    char discardBuff[CHANNEL_IO_BUFF_SIZE];
+    ssize_t recvRet;
+
+    while (poll(&pfd, 1, 0) > 0)
+    {
+        if (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR))
+        {
+            return true;
+        }
+
+        recvRet = recv(sockfd, discardBuff, sizeof(discardBuff), MSG_DONTWAIT);
+        if (recvRet == 0 || (recvRet < 0 && errno != EAGAIN && errno != EINTR))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief Send a batch of shared packets with as few syscalls as possible
+ */
+static int sendPackets(int sockfd, aesd_shared_packet_t **packets, uint32_t count)
+{
+    struct iovec iov[FOLLOW_BATCH_SIZE];
+    uint32_t i;
+
+    for (i = 0; i < count; i++)
+    {
+        iov[i].iov_base = packets[i]->data;
+        iov[i].iov_len = packets[i]->len;
+    }
+
+    return sendIovecs(sockfd, iov, count, 0);
+}
+
+int64_t aesd_channel_wait_append(aesd_channel_t *channel, uint64_t length,
+                                 const struct timespec *timeout)
+{
+    uint32_t events;
+    int64_t now;
+
+    if (aesd_channel_lock(channel) != 0)
+    {
+        return -1;
+    }
+
+    if (channel->dataLength <= length)
+    {
+        // Sleep with the lock dropped, as subscribers do
+        events = atomic_load(&channel->appendEvents);
+        channel->appendWaiters++;
+        aesd_channel_unlock(channel);
+
+        futexWait(&channel->appendEvents, events, timeout);
+
+        if (aesd_channel_lock(channel) != 0)
+        {
+            return -1;
+        }
+        channel->appendWaiters--;
+    }
+
+    now = channel->dataLength;
+    aesd_channel_unlock(channel);
+    return now;
+}
+
+int aesd_channel_follow(aesd_channel_t *channel, int sockfd, uint32_t maxLag,
+                        subscriber_lag_policy_t lagPolicy)
+{
+    aesd_shared_packet_t *batch[FOLLOW_BATCH_SIZE];
+    const struct timespec idleCheck = {.tv_sec = FOLLOW_IDLE_CHECK_SEC};
+    uint32_t events;
+    bool timedOut;
+    uint64_t nextSeq;
+    uint32_t batchLen;
+    uint32_t i;
+    int retVal = 0;
+
+    if (maxLag == 0 || maxLag > SUBSCRIBER_RING_SIZE)
+    {
+        maxLag = SUBSCRIBER_RING_SIZE;
+    }
+
+    if (aesd_channel_lock(channel) != 0)
+    {
+        return -1;
+    }
+
+    if (channel->publishRing == NULL)
+    {
+        channel->publishRing = calloc(SUBSCRIBER_RING_SIZE, sizeof(aesd_shared_packet_t *));
+        if (channel->publishRing == NULL)
+        {
+            aesd_channel_unlock(channel);
+            return -1;
+        }
+    }
+
+    channel->subscriberCount++;
+    // Only packets appended after subscribing are pushed
+    nextSeq = channel->publishSeq;
+
+    while (!atomic_load(&followersStopped))
+    {
+        if (nextSeq == channel->publishSeq)
+        {
+            // Sleep with the lock dropped, a fair lock would otherwise keep
+            // every appender queued behind us
+            events = atomic_load(&channel->publishEvents);
+            channel->publishWaiters++;
+            aesd_channel_unlock(channel);
+
+            timedOut = futexWait(&channel->publishEvents, events, &idleCheck) != 0 &&
+                       errno == ETIMEDOUT;
+
+            if (aesd_channel_lock(channel) != 0)
+            {
+                return -1;
+            }
+            channel->publishWaiters--;
+
+            if (timedOut && subscriberGone(sockfd))
+            {
+                break;
+            }
+            continue;
+        }
+
+        if (channel->publishSeq - nextSeq > maxLag)
+        {
+            if (lagPolicy == LAG_DISCONNECT)
+            {
+                syslog(LOG_INFO, "Subscriber on %s fell %llu packets behind, disconnecting",
+                       channel->name, (unsigned long long)(channel->publishSeq - nextSeq));
+                retVal = -1;
+                break;
+            }
+
+            syslog(LOG_INFO, "Subscriber on %s skipping %llu packets",
+                   channel->name, (unsigned long long)(channel->publishSeq - 1 - nextSeq));
+            nextSeq = channel->publishSeq - 1;
+        }
+
+        for (batchLen = 0; batchLen < FOLLOW_BATCH_SIZE && nextSeq < channel->publishSeq;
+             batchLen++, nextSeq++)
+        {
+            batch[batchLen] = channel->publishRing[nextSeq % SUBSCRIBER_RING_SIZE];
+            atomic_fetch_add(&batch[batchLen]->refCount, 1);
+        }
+
+        aesd_channel_unlock(channel);
+
+        retVal = sendPackets(sockfd, batch, batchLen);
+        for (i = 0; i < batchLen; i++)
+        {
+            releasePacket(batch[i]);
+        }
+
+        if (aesd_channel_lock(channel) != 0)
+        {
+            return -1;
+        }
+
+        if (retVal != 0)
+        {
+            break;
+        }
+    }
+
+    // Packets kept for subscribers are charged to MEM_RESPONSE, and with
+    // none left nobody will send them. Later ones only ever see newer
+    // packets, so the ring can start over empty.
+    if (--channel->subscriberCount == 0)
+    {
+        freePublishRing(channel);
+    }
+    aesd_channel_unlock(channel);
+    return retVal;
+}
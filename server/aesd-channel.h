@@ -0,0 +1,377 @@
+/**
+ * @file aesd-channel.h
+ * @brief Named, independently locked logs that connections append to
+ *
+ * The default channel is the log aesdsocket has always written to (the
+ * aesdchar driver or the data file). Further channels are created on first
+ * use, are always file-backed and each carry their own lock, so producers
+ * on different channels never wait on one another.
+ */
+
+#pragma once
+
+#include "./queue.h"
+#include "./aesd-packet-index.h"
+#include "./aesd-zerocopy.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#define CHANNEL_NAME_MAX        32
+#define DEFAULT_CHANNEL_NAME    "default"
+
+// Number of recently appended packets kept for subscribers, which bounds
+// how far behind a subscriber can fall
+#define SUBSCRIBER_RING_SIZE    1024
+
+// Most packets aesd_channel_append_packets() takes at once
+#define CHANNEL_APPEND_BATCH_MAX    64
+
+#define AESD_IOC_MAGIC 0x16
+
+// Define a write command from the user point of view, use command number 1
+#define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+
+/**
+ * A structure to be passed by IOCTL from user space to kernel space, describing the type
+ * of seek performed on the aesdchar driver
+ */
+struct aesd_seekto {
+    /**
+     * The zero referenced write command to seek into
+     */
+    uint32_t write_cmd;
+    /**
+     * The zero referenced offset within the write
+     */
+    uint32_t write_cmd_offset;
+};
+
+typedef struct aesd_channel_s aesd_channel_t;
+typedef struct aesd_shared_packet_s aesd_shared_packet_t;
+
+/**
+ * What a subscriber that falls more than its allowed lag behind gets
+ */
+typedef enum subscriber_lag_policy_e
+{
+    LAG_DISCONNECT,
+    LAG_SKIP_FORWARD,
+} subscriber_lag_policy_t;
+
+struct aesd_channel_s
+{
+    char name[CHANNEL_NAME_MAX + 1];
+    char dataPath[PATH_MAX];
+    char indexPath[PATH_MAX];
+    /**
+     * True when the channel is backed by the aesdchar driver, which does its
+     * own packet bookkeeping, rather than by a regular file and an index
+     */
+    bool charDevice;
+    /**
+     * Descriptor shared by every connection bound to the channel. Its file
+     * position is only meaningful while the channel lock is held.
+     */
+    int fd;
+    /**
+     * Bytes written to a file-backed channel
+     */
+    uint64_t dataLength;
+    aesd_packet_index_t index;
+    pthread_mutex_t mutex;
+    /**
+     * Hand the lock over in the order it was asked for, see
+     * aesd_channel_lock()
+     */
+    bool fairLock;
+    // Ticket the next locker takes, and the ticket whose turn it is
+    atomic_uint_least32_t nextTicket;
+    atomic_uint_least32_t nowServing;
+    // Plain locks only: threads waiting for the mutex
+    atomic_uint_least32_t lockWaiters;
+    /**
+     * Fair locks only: when the holder took the lock, and a moving average
+     * of how long it is held, for aesd_channel_lock_timed() to tell how
+     * long the queue ahead will take
+     */
+    uint64_t lockedAtNs;
+    atomic_uint_least64_t holdNsAverage;
+    /**
+     * Packets published to subscribers, slot seq % SUBSCRIBER_RING_SIZE
+     * holds packet seq. Allocated when the first subscriber arrives.
+     */
+    aesd_shared_packet_t **publishRing;
+    /**
+     * Sequence number the next published packet will get
+     */
+    uint64_t publishSeq;
+    uint32_t subscriberCount;
+    /**
+     * Bumped whenever a packet is published, futex word subscribers with
+     * nothing to send sleep on once they have dropped the lock
+     */
+    atomic_uint_least32_t publishEvents;
+    // Subscribers asleep on publishEvents
+    uint32_t publishWaiters;
+    /**
+     * Bumped by appends to a file-backed channel while anybody waits in
+     * aesd_channel_wait_append(), partial packets included
+     */
+    atomic_uint_least32_t appendEvents;
+    uint32_t appendWaiters;
+    /**
+     * Bumped by every append, so equal generations mean equal contents
+     */
+    uint64_t generation;
+    /**
+     * Sealed memfd copy of the log as of snapshotGeneration, or -1. Handed
+     * to every reader asking for that generation.
+     */
+    int snapshotFd;
+    uint64_t snapshotGeneration;
+    uint64_t snapshotSize;
+    SLIST_ENTRY(aesd_channel_s) entries;
+};
+
+/**
+ * @brief Open the default channel and prepare the channel registry
+ *
+ * @param defaultDataPath Path of the default channel's log
+ * @param defaultIndexPath Path of the default channel's packet index, or
+ *  NULL if defaultDataPath is the aesdchar driver
+ * @param channelPathPrefix Prefix prepended to a channel name to form the
+ *  path of its data file
+ * @param fairLocking Give every channel a fair lock
+ * @return int
+ * @retval -1 Error
+ * @retval  0 Success
+ */
+int aesd_channel_registry_init(const char *defaultDataPath, const char *defaultIndexPath,
+                               const char *channelPathPrefix, bool fairLocking);
+
+/**
+ * @brief Close every channel and free the registry
+ */
+void aesd_channel_registry_cleanup(void);
+
+/**
+ * @brief Remove the data and index files of every named channel
+ */
+void aesd_channel_registry_remove_files(void);
+
+/**
+ * @brief Have every aesd_channel_follow() return, now and from then on,
+ *  so subscribers' connections end when the server stops
+ */
+void aesd_channel_stop_followers(void);
+
+/**
+ * @brief The channel connections are bound to until they select another
+ */
+aesd_channel_t *aesd_channel_default(void);
+
+/**
+ * @brief Check that a channel name only uses [A-Za-z0-9_-] and fits in
+ *  CHANNEL_NAME_MAX characters
+ */
+bool aesd_channel_name_valid(const char *name);
+
+/**
+ * @brief Look up a channel by name, creating and opening it on first use
+ *
+ * @param name Channel name, DEFAULT_CHANNEL_NAME for the default channel
+ * @return aesd_channel_t* The channel, or NULL on invalid name or error
+ */
+aesd_channel_t *aesd_channel_get(const char *name);
+
+/**
+ * @brief Take the channel lock
+ *
+ * A plain mutex goes to whoever runs first once it is released, which may
+ * be the last holder coming back for it. Holders that see
+ * aesd_channel_contended() let go early, so waits stay short, but their
+ * order is up to the scheduler. With a fair lock lockers take a ticket and
+ * get the lock strictly in ticket order, which bounds any wait by the hold
+ * times of those queued ahead.
+ *
+ * @return int
+ * @retval -1 Error
+ * @retval  0 Success
+ */
+int aesd_channel_lock(aesd_channel_t *channel);
+
+/**
+ * @brief Take the channel lock unless that takes longer than timeoutMs
+ *
+ * A plain mutex is waited for until the deadline. A fair lock cannot be
+ * given up once a ticket is taken, so the locker is instead turned away up
+ * front when those queued ahead of it would, at their average hold time,
+ * keep the lock past the deadline.
+ *
+ * @param timeoutMs Longest wait, 0 to wait as long as it takes
+ * @return int
+ * @retval -1 Error, errno ETIMEDOUT if the lock could not be had in time
+ * @retval  0 Success
+ */
+int aesd_channel_lock_timed(aesd_channel_t *channel, uint32_t timeoutMs);
+
+int aesd_channel_unlock(aesd_channel_t *channel);
+
+/**
+ * @brief Whether anybody is waiting for the lock the caller holds, so a
+ *  long hold should be cut short
+ */
+bool aesd_channel_contended(aesd_channel_t *channel);
+
+/**
+ * @brief Append bytes to the channel, indexing the packet if they complete
+ *  one and publishing it to any subscribers
+ *
+ * Caller must hold the channel lock.
+ *
+ * @return int
+ * @retval -1 Error
+ * @retval  0 Success
+ */
+int aesd_channel_append(aesd_channel_t *channel, const char *buf, size_t len);
+
+/**
+ * @brief Append several complete packets, each ending in a newline, with a
+ *  single write to the log and a single write to the index
+ *
+ * Caller must hold the channel lock.
+ *
+ * @param packets One iovec per packet
+ * @param count Number of packets, at most CHANNEL_APPEND_BATCH_MAX
+ * @return int
+ * @retval -1 Error
+ * @retval  0 Success
+ */
+int aesd_channel_append_packets(aesd_channel_t *channel, const struct iovec *packets,
+                                uint32_t count);
+
+/**
+ * @brief Position the channel at the start of its log
+ *
+ * Caller must hold the channel lock.
+ */
+int aesd_channel_rewind(aesd_channel_t *channel);
+
+/**
+ * @brief Position the channel at an offset within a packet
+ *
+ * Caller must hold the channel lock.
+ *
+ * @param writeCmd Zero referenced packet to seek into
+ * @param writeCmdOffset Zero referenced offset within that packet
+ * @return int
+ * @retval -1 Out of range or error, position unchanged
+ * @retval  0 Success
+ */
+int aesd_channel_seek(aesd_channel_t *channel, uint32_t writeCmd, uint32_t writeCmdOffset);
+
+/**
+ * @brief Read up to len bytes of the log from the current position
+ *
+ * Caller must hold the channel lock.
+ *
+ * @return ssize_t Bytes read, less than len only at the end of the log, or
+ *  -1 on error
+ */
+ssize_t aesd_channel_read(aesd_channel_t *channel, char *buf, size_t len);
+
+/**
+ * @brief Find how many complete packets and bytes the channel holds
+ *
+ * Caller must hold the channel lock. For the aesdchar driver this reads the
+ * whole (bounded) circular buffer and leaves the position at its end.
+ *
+ * @return int
+ * @retval -1 Error
+ * @retval  0 Success
+ */
+int aesd_channel_extent(aesd_channel_t *channel, uint64_t *packetCount, uint64_t *size);
+
+/**
+ * @brief Send the log from the current position to its end
+ *
+ * Caller must hold the channel lock.
+ *
+ * @param sockfd Connected socket to send to
+ * @param framed Send the log as frames, each preceded by its length as a
+ *  big-endian uint32_t, followed by an empty frame
+ * @param zc Zero-copy state of sockfd, to send large replies from a
+ *  file-backed channel zero-copy, or NULL to always copy
+ * @return int
+ * @retval -1 Error reading the log or sending to the peer
+ * @retval  0 Success
+ */
+int aesd_channel_send_contents(aesd_channel_t *channel, int sockfd, bool framed,
+                               aesd_zerocopy_t *zc);
+
+/**
+ * @brief Send a file-backed channel's log from the current position up to
+ *  byte end, or to its end if that comes first, as for
+ *  aesd_channel_send_contents()
+ */
+int aesd_channel_send_until(aesd_channel_t *channel, int sockfd, bool framed,
+                            aesd_zerocopy_t *zc, uint64_t end);
+
+/**
+ * @brief Get a sealed, read-only memfd holding the whole log as it is now
+ *
+ * The snapshot is built on the first request after an append and shared by
+ * every request until the next one. Readers map it and read the log with no
+ * further copies, and it stays valid for them however long it is kept.
+ * Caller must hold the channel lock. For the aesdchar driver this leaves the
+ * position at the end of the log.
+ *
+ * @param generation Set to the generation the snapshot was taken at
+ * @param size Set to the number of bytes in the snapshot
+ * @return int Descriptor of the snapshot, owned by the channel, or -1 on
+ *  error, errno ENOMEM if keeping it would go over the memory budget
+ */
+int aesd_channel_snapshot(aesd_channel_t *channel, uint64_t *generation, uint64_t *size);
+
+/**
+ * @brief Wait until a file-backed channel's log is longer than length
+ *
+ * Must be called without the channel lock held.
+ *
+ * @param timeout How long to wait, NULL to wait for good
+ * @return int64_t Bytes in the log now, which is length if the wait timed
+ *  out, or -1 on error
+ */
+int64_t aesd_channel_wait_append(aesd_channel_t *channel, uint64_t length,
+                                 const struct timespec *timeout);
+
+/**
+ * @brief Push every packet appended to the channel from now on to a peer,
+ *  until the peer disconnects or falls too far behind
+ *
+ * Each packet is copied once when published and sent to every subscriber
+ * from that shared copy. The channel lock is not held while sending, so a
+ * slow subscriber never holds up appends. Must be called without the
+ * channel lock held.
+ *
+ * @param sockfd Connected socket of the subscriber
+ * @param maxLag Most packets the subscriber may be behind, at most
+ *  SUBSCRIBER_RING_SIZE
+ * @param lagPolicy Whether to disconnect a subscriber that exceeds maxLag or
+ *  skip it forward to the newest packet
+ * @return int
+ * @retval -1 Error or subscriber disconnected for lagging
+ * @retval  0 Peer closed the connection, or aesd_channel_stop_followers()
+ *  was called
+ */
+int aesd_channel_follow(aesd_channel_t *channel, int sockfd, uint32_t maxLag,
+                        subscriber_lag_policy_t lagPolicy);
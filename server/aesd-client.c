@@ -0,0 +1,951 @@
+/**
+ * @file aesd-client.c
+ * @brief Client for aesdsocket over TCP or its unix domain socket
+ *
+ * Replies arrive in the order their requests were sent. The server answers
+ * every packet queued ahead of a command before the command itself, so a
+ * reply is an acknowledgement or echo-back while packets queued before the
+ * oldest waiting command are unanswered, and that command's reply once
+ * they all are.
+ */
+
+#include "aesd-client.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define BINARY_CMD_STR      "AESDCHAR_BINARY\n"
+#define BINARY_ACK_STR      "AESDCHAR_BINARY:OK\n"
+#define CHANNEL_CMD_STR     "AESDCHAR_CHANNEL:"
+#define ECHOMODE_CMD_STR    "AESDCHAR_ECHOMODE:"
+#define FOLLOWER_CMD_STR    "AESDCHAR_FOLLOWER:"
+#define SEEK_CMD_STR        "AESDCHAR_IOCSEEKTO:"
+#define ACK_REPLY_PREFIX    "AESDCHAR_ACK:"
+#define ERROR_REPLY_PREFIX  "AESDCHAR_ERROR:"
+#define BUSY_REPLY_STR      "AESDCHAR_ERROR:EBUSY\n"
+
+#define RECORD_HEADER_LEN   4
+#define RECORD_COMMAND_FLAG 0x80000000u
+#define COMMAND_MAX_LEN     1024
+
+static const struct
+{
+    const char *name;
+    int value;
+} errnoNames[] = {
+    {"EINVAL", EINVAL}, {"E2BIG", E2BIG},   {"ENOMEM", ENOMEM},
+    {"ENOTSUP", ENOTSUP}, {"ENOSYS", ENOSYS}, {"EIO", EIO},
+    {"ENOTCONN", ENOTCONN}, {"ETIMEDOUT", ETIMEDOUT}, {"ERANGE", ERANGE},
+    {"EROFS", EROFS}, {"EBUSY", EBUSY},
+};
+
+static int dialUnix(const char *path)
+{
+    struct sockaddr_un addr;
+    int sockfd;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sockfd != -1 && connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        perror("connect() error");
+        close(sockfd);
+        sockfd = -1;
+    }
+
+    return sockfd;
+}
+
+int aesd_client_dial(const aesd_client_config_t *config)
+{
+    struct addrinfo hints;
+    struct addrinfo *res;
+    struct addrinfo *ai;
+    int sockfd = -1;
+
+    if (config->unixPath != NULL)
+    {
+        return dialUnix(config->unixPath);
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(config->host, config->port, &hints, &res) != 0)
+    {
+        fprintf(stderr, "getaddrinfo() error for %s:%s\n", config->host, config->port);
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+
+    for (ai = res; ai != NULL && sockfd == -1; ai = ai->ai_next)
+    {
+        sockfd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (sockfd != -1 && connect(sockfd, ai->ai_addr, ai->ai_addrlen) != 0)
+        {
+            close(sockfd);
+            sockfd = -1;
+        }
+    }
+    freeaddrinfo(res);
+
+    if (sockfd == -1)
+    {
+        perror("connect() error");
+        return -1;
+    }
+
+    // Batching is done here, the kernel should not hold anything back
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+    return sockfd;
+}
+
+int aesd_client_send_all(int sockfd, const void *buf, size_t len)
+{
+    const char *bufp = buf;
+    ssize_t sendRet;
+
+    while (len > 0)
+    {
+        sendRet = send(sockfd, bufp, len, MSG_NOSIGNAL);
+        if (sendRet < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        bufp += sendRet;
+        len -= sendRet;
+    }
+
+    return 0;
+}
+
+int aesd_client_recv_all(int sockfd, void *buf, size_t len)
+{
+    char *bufp = buf;
+    ssize_t recvRet;
+
+    while (len > 0)
+    {
+        recvRet = recv(sockfd, bufp, len, 0);
+        if (recvRet <= 0)
+        {
+            if (recvRet < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (recvRet == 0)
+            {
+                errno = ECONNRESET;
+            }
+            return -1;
+        }
+        bufp += recvRet;
+        len -= recvRet;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Mark the connection unusable, keeping errno
+ */
+static int fail(aesd_client_conn_t *conn, int err)
+{
+    conn->broken = true;
+    errno = err;
+    return -1;
+}
+
+static int waitLimitMs(const aesd_client_conn_t *conn)
+{
+    return conn->config->timeoutMs > 0 ? conn->config->timeoutMs : AESD_CLIENT_TIMEOUT_MS;
+}
+
+static uint32_t windowSize(const aesd_client_conn_t *conn)
+{
+    return conn->config->window > 0 ? conn->config->window : AESD_CLIENT_WINDOW_DEFAULT;
+}
+
+/**
+ * @brief Queue one record, growing the send buffer if it does not fit
+ */
+static int queueRecord(aesd_client_conn_t *conn, uint32_t flags, const char *buf, size_t len)
+{
+    uint32_t header = htonl(len | flags);
+    size_t need = RECORD_HEADER_LEN + len;
+    size_t newSize;
+    char *newBuff;
+
+    if (conn->sendPos > 0)
+    {
+        memmove(conn->sendBuff, conn->sendBuff + conn->sendPos, conn->sendLen - conn->sendPos);
+        conn->sendLen -= conn->sendPos;
+        conn->sendPos = 0;
+    }
+
+    if (conn->sendSize - conn->sendLen < need)
+    {
+        newSize = conn->sendSize;
+        while (newSize - conn->sendLen < need)
+        {
+            newSize *= 2;
+        }
+        newBuff = realloc(conn->sendBuff, newSize);
+        if (newBuff == NULL)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        conn->sendBuff = newBuff;
+        conn->sendSize = newSize;
+    }
+
+    memcpy(conn->sendBuff + conn->sendLen, &header, RECORD_HEADER_LEN);
+    memcpy(conn->sendBuff + conn->sendLen + RECORD_HEADER_LEN, buf, len);
+    conn->sendLen += need;
+    return 0;
+}
+
+/**
+ * @brief Send as much of what is queued as the socket takes without
+ *  blocking
+ */
+static int sendQueued(aesd_client_conn_t *conn)
+{
+    ssize_t sendRet;
+
+    while (conn->sendPos < conn->sendLen)
+    {
+        sendRet = send(conn->sockfd, conn->sendBuff + conn->sendPos,
+                       conn->sendLen - conn->sendPos, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sendRet < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            return fail(conn, errno);
+        }
+        conn->sendPos += sendRet;
+    }
+
+    conn->sendPos = 0;
+    conn->sendLen = 0;
+    return 0;
+}
+
+/**
+ * @brief Set errno from an error reply
+ *
+ * @return bool True if the reply was an error
+ */
+static bool isErrorReply(const char *reply, size_t len)
+{
+    size_t prefixLen = strlen(ERROR_REPLY_PREFIX);
+    size_t nameLen;
+    size_t i;
+
+    if (len <= prefixLen || memcmp(reply, ERROR_REPLY_PREFIX, prefixLen) != 0)
+    {
+        return false;
+    }
+
+    errno = EIO;
+    nameLen = len - prefixLen - (reply[len - 1] == '\n');
+    for (i = 0; i < sizeof(errnoNames) / sizeof(errnoNames[0]); i++)
+    {
+        if (strlen(errnoNames[i].name) == nameLen &&
+            memcmp(reply + prefixLen, errnoNames[i].name, nameLen) == 0)
+        {
+            errno = errnoNames[i].value;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Hand a complete reply to whoever is waiting for it
+ */
+static int handleReply(aesd_client_conn_t *conn)
+{
+    const aesd_client_config_t *config = conn->config;
+    aesd_client_request_t *request = STAILQ_FIRST(&conn->requests);
+    uint64_t answeredUpTo = request != NULL ? request->afterSeq : conn->queuedSeq;
+    unsigned long count;
+    char *endPtr;
+
+    if (conn->ackedSeq < answeredUpTo)
+    {
+        if (config->echo)
+        {
+            if (config->onEcho != NULL)
+            {
+                config->onEcho(config->arg, conn->ackedSeq, conn->reply, conn->replyLen);
+            }
+            count = 1;
+        }
+        else
+        {
+            // A NUL makes the reply safe to parse, there is always room
+            conn->reply[conn->replyLen] = '\0';
+            if (strcmp(conn->reply, BUSY_REPLY_STR) == 0)
+            {
+                // Answers the oldest packet alone
+                if (config->onBusy != NULL)
+                {
+                    config->onBusy(config->arg, conn->ackedSeq);
+                }
+                conn->ackedSeq++;
+                return 0;
+            }
+            // Such as a channel that could not be had, which nothing else
+            // answers
+            if (isErrorReply(conn->reply, conn->replyLen))
+            {
+                return fail(conn, errno);
+            }
+            if (strncmp(conn->reply, ACK_REPLY_PREFIX, strlen(ACK_REPLY_PREFIX)) != 0)
+            {
+                return fail(conn, EPROTO);
+            }
+            count = strtoul(conn->reply + strlen(ACK_REPLY_PREFIX), &endPtr, 10);
+            if (config->ackLength && *endPtr == ',')
+            {
+                conn->logLength = strtoull(endPtr + 1, &endPtr, 10);
+            }
+            if (*endPtr != '\n' || count > answeredUpTo - conn->ackedSeq)
+            {
+                return fail(conn, EPROTO);
+            }
+        }
+
+        if (config->onAck != NULL && count > 0)
+        {
+            config->onAck(config->arg, conn->ackedSeq, count);
+        }
+        conn->ackedSeq += count;
+        return 0;
+    }
+
+    if (request == NULL)
+    {
+        return fail(conn, EPROTO);
+    }
+
+    STAILQ_REMOVE_HEAD(&conn->requests, entries);
+    if (request->onReply != NULL)
+    {
+        request->onReply(request->arg, conn->reply, conn->replyLen);
+    }
+    free(request);
+    return 0;
+}
+
+/**
+ * @brief Split received bytes into frames, handling each reply once its
+ *  empty frame arrives
+ */
+static int parseReplies(aesd_client_conn_t *conn, const char *buf, size_t len)
+{
+    size_t chunkLen;
+    size_t newSize;
+    char *newReply;
+
+    while (len > 0)
+    {
+        if (conn->frameLeft > 0)
+        {
+            chunkLen = conn->frameLeft < len ? conn->frameLeft : len;
+            // One spare byte for the NUL handleReply() may add
+            if (conn->replySize - conn->replyLen <= chunkLen)
+            {
+                newSize = conn->replySize;
+                while (newSize - conn->replyLen <= chunkLen)
+                {
+                    newSize *= 2;
+                }
+                newReply = realloc(conn->reply, newSize);
+                if (newReply == NULL)
+                {
+                    return fail(conn, ENOMEM);
+                }
+                conn->reply = newReply;
+                conn->replySize = newSize;
+            }
+            memcpy(conn->reply + conn->replyLen, buf, chunkLen);
+            conn->replyLen += chunkLen;
+            conn->frameLeft -= chunkLen;
+            buf += chunkLen;
+            len -= chunkLen;
+            continue;
+        }
+
+        conn->frameHeader[conn->frameHeaderLen++] = *buf++;
+        len--;
+        if (conn->frameHeaderLen < RECORD_HEADER_LEN)
+        {
+            continue;
+        }
+
+        conn->frameHeaderLen = 0;
+        conn->frameLeft = (uint32_t)conn->frameHeader[0] << 24 | conn->frameHeader[1] << 16 |
+                          conn->frameHeader[2] << 8 | conn->frameHeader[3];
+        if (conn->frameLeft > 0)
+        {
+            continue;
+        }
+
+        if (handleReply(conn) != 0)
+        {
+            return -1;
+        }
+        conn->replyLen = 0;
+    }
+
+    return 0;
+}
+
+static int recvReplies(aesd_client_conn_t *conn)
+{
+    ssize_t recvRet;
+
+    while (true)
+    {
+        recvRet = recv(conn->sockfd, conn->recvBuff, AESD_CLIENT_RECV_BYTES, MSG_DONTWAIT);
+        if (recvRet < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            return fail(conn, errno);
+        }
+        if (recvRet == 0)
+        {
+            return fail(conn, ECONNRESET);
+        }
+
+        if (parseReplies(conn, conn->recvBuff, recvRet) != 0)
+        {
+            return -1;
+        }
+    }
+}
+
+/**
+ * @brief Wait up to waitMs for the socket, then send what it takes and
+ *  handle what arrived
+ */
+static int pump(aesd_client_conn_t *conn, int waitMs)
+{
+    struct pollfd pollFd = {.fd = conn->sockfd, .events = POLLIN};
+    int pollRet;
+
+    if (conn->broken)
+    {
+        errno = EPIPE;
+        return -1;
+    }
+
+    if (conn->sendPos < conn->sendLen)
+    {
+        pollFd.events |= POLLOUT;
+    }
+
+    pollRet = poll(&pollFd, 1, waitMs);
+    if (pollRet < 0)
+    {
+        return errno == EINTR ? 0 : fail(conn, errno);
+    }
+
+    if ((pollFd.revents & POLLOUT) && sendQueued(conn) != 0)
+    {
+        return -1;
+    }
+
+    if ((pollFd.revents & (POLLIN | POLLHUP | POLLERR)) && recvReplies(conn) != 0)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int64_t nowMs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+typedef bool (*wait_done_fn)(const aesd_client_conn_t *conn, const void *ctx);
+
+/**
+ * @brief Pump until done() holds, failing the connection if the server
+ *  stops making progress for the timeout
+ */
+static int waitUntil(aesd_client_conn_t *conn, wait_done_fn done, const void *ctx)
+{
+    int64_t deadline = nowMs() + waitLimitMs(conn);
+    uint64_t lastAcked = conn->ackedSeq;
+    size_t lastSent = conn->sendPos;
+    int64_t now;
+
+    while (!done(conn, ctx))
+    {
+        now = nowMs();
+        if (conn->ackedSeq != lastAcked || conn->sendPos != lastSent)
+        {
+            lastAcked = conn->ackedSeq;
+            lastSent = conn->sendPos;
+            deadline = now + waitLimitMs(conn);
+        }
+        if (now >= deadline)
+        {
+            return fail(conn, ETIMEDOUT);
+        }
+        if (pump(conn, deadline - now) != 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static bool windowOpen(const aesd_client_conn_t *conn, const void *ctx)
+{
+    return conn->queuedSeq - conn->ackedSeq < windowSize(conn);
+}
+
+static bool allSent(const aesd_client_conn_t *conn, const void *ctx)
+{
+    return conn->sendLen == 0;
+}
+
+static bool allAnswered(const aesd_client_conn_t *conn, const void *ctx)
+{
+    return conn->sendLen == 0 && conn->ackedSeq == conn->queuedSeq &&
+           STAILQ_EMPTY(&conn->requests);
+}
+
+int aesd_client_open(aesd_client_conn_t *conn, const aesd_client_config_t *config)
+{
+    char reply[sizeof(BINARY_ACK_STR) - 1];
+    char command[COMMAND_MAX_LEN];
+    int commandLen;
+
+    memset(conn, 0, sizeof(*conn));
+    conn->config = config;
+    STAILQ_INIT(&conn->requests);
+
+    conn->sendSize = AESD_CLIENT_BATCH_BYTES;
+    conn->replySize = AESD_CLIENT_RECV_BYTES;
+    conn->sendBuff = malloc(conn->sendSize);
+    conn->recvBuff = malloc(AESD_CLIENT_RECV_BYTES);
+    conn->reply = malloc(conn->replySize);
+    if (conn->sendBuff == NULL || conn->recvBuff == NULL || conn->reply == NULL)
+    {
+        errno = ENOMEM;
+        goto freeBuffs;
+    }
+
+    conn->sockfd = aesd_client_dial(config);
+    if (conn->sockfd == -1)
+    {
+        goto freeBuffs;
+    }
+
+    // Acknowledged in text, everything after it is records
+    if (aesd_client_send_all(conn->sockfd, BINARY_CMD_STR, strlen(BINARY_CMD_STR)) != 0 ||
+        aesd_client_recv_all(conn->sockfd, reply, sizeof(reply)) != 0)
+    {
+        goto closeSock;
+    }
+    if (memcmp(reply, BINARY_ACK_STR, sizeof(reply)) != 0)
+    {
+        fprintf(stderr, "Server did not accept binary framing\n");
+        errno = EPROTO;
+        goto closeSock;
+    }
+
+    // None has a reply unless the channel cannot be had, all go out with
+    // the first packets
+    if (config->channel != NULL)
+    {
+        commandLen = snprintf(command, sizeof(command), "%s%s", CHANNEL_CMD_STR, config->channel);
+        if (commandLen >= (int)sizeof(command))
+        {
+            errno = ENAMETOOLONG;
+            goto closeSock;
+        }
+        queueRecord(conn, RECORD_COMMAND_FLAG, command, commandLen);
+    }
+    if (config->followerToken != NULL)
+    {
+        commandLen = snprintf(command, sizeof(command), "%s%s", FOLLOWER_CMD_STR,
+                              config->followerToken);
+        if (commandLen >= (int)sizeof(command))
+        {
+            errno = EINVAL;
+            goto closeSock;
+        }
+        queueRecord(conn, RECORD_COMMAND_FLAG, command, commandLen);
+    }
+    commandLen = snprintf(command, sizeof(command), "%s%s", ECHOMODE_CMD_STR,
+                          config->echo ? "line" : config->ackLength ? "length" : "ack");
+    queueRecord(conn, RECORD_COMMAND_FLAG, command, commandLen);
+
+    return 0;
+
+closeSock:
+    close(conn->sockfd);
+freeBuffs:
+    free(conn->sendBuff);
+    free(conn->recvBuff);
+    free(conn->reply);
+    return -1;
+}
+
+int aesd_client_append(aesd_client_conn_t *conn, const char *buf, size_t len)
+{
+    if (len == 0 || (len == 1 && buf[0] == '\n'))
+    {
+        // The server stores nothing for it, so would never answer it
+        errno = EINVAL;
+        return -1;
+    }
+    if (len > AESD_CLIENT_RECORD_MAX)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if (waitUntil(conn, windowOpen, NULL) != 0 || queueRecord(conn, 0, buf, len) != 0)
+    {
+        return -1;
+    }
+    conn->queuedSeq++;
+
+    if (conn->sendLen - conn->sendPos >= AESD_CLIENT_BATCH_BYTES)
+    {
+        return aesd_client_flush(conn);
+    }
+
+    return 0;
+}
+
+int aesd_client_append_batch(aesd_client_conn_t *conn, const struct iovec *packets,
+                             size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++)
+    {
+        if (aesd_client_append(conn, packets[i].iov_base, packets[i].iov_len) != 0)
+        {
+            return -1;
+        }
+    }
+
+    return aesd_client_flush(conn);
+}
+
+int aesd_client_command(aesd_client_conn_t *conn, const char *command,
+                        aesd_client_reply_fn onReply, void *arg)
+{
+    aesd_client_request_t *request;
+    size_t commandLen = strlen(command);
+
+    if (conn->broken)
+    {
+        errno = EPIPE;
+        return -1;
+    }
+    if (commandLen >= COMMAND_MAX_LEN)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    request = malloc(sizeof(*request));
+    if (request == NULL)
+    {
+        return -1;
+    }
+    request->afterSeq = conn->queuedSeq;
+    request->onReply = onReply;
+    request->arg = arg;
+
+    if (queueRecord(conn, RECORD_COMMAND_FLAG, command, commandLen) != 0)
+    {
+        free(request);
+        return -1;
+    }
+    STAILQ_INSERT_TAIL(&conn->requests, request, entries);
+
+    // Somebody is waiting for the reply, do not leave it in the buffer
+    return aesd_client_flush(conn);
+}
+
+typedef struct query_s
+{
+    char *buf;
+    size_t size;
+    ssize_t len;
+    bool answered;
+} query_t;
+
+static void copyReply(void *arg, const char *reply, size_t len)
+{
+    query_t *query = arg;
+
+    memcpy(query->buf, reply, len < query->size ? len : query->size);
+    query->len = len;
+    query->answered = true;
+}
+
+static bool queryAnswered(const aesd_client_conn_t *conn, const void *ctx)
+{
+    return ((const query_t *)ctx)->answered;
+}
+
+ssize_t aesd_client_query(aesd_client_conn_t *conn, const char *command, char *buf,
+                          size_t size)
+{
+    query_t query = {.buf = buf, .size = size, .len = 0, .answered = false};
+
+    if (aesd_client_command(conn, command, copyReply, &query) != 0 ||
+        waitUntil(conn, queryAnswered, &query) != 0)
+    {
+        if (!query.answered)
+        {
+            // The request points at query, which is about to go away
+            conn->broken = true;
+        }
+        return -1;
+    }
+
+    if (isErrorReply(buf, query.len < (ssize_t)size ? (size_t)query.len : size))
+    {
+        return -1;
+    }
+
+    return query.len;
+}
+
+int aesd_client_seek(aesd_client_conn_t *conn, uint32_t writeCmd, uint32_t offset,
+                     aesd_client_reply_fn onReply, void *arg)
+{
+    char command[64];
+
+    snprintf(command, sizeof(command), "%s%u,%u", SEEK_CMD_STR, writeCmd, offset);
+    return aesd_client_command(conn, command, onReply, arg);
+}
+
+ssize_t aesd_client_seek_read(aesd_client_conn_t *conn, uint32_t writeCmd, uint32_t offset,
+                              char *buf, size_t size)
+{
+    char command[64];
+
+    snprintf(command, sizeof(command), "%s%u,%u", SEEK_CMD_STR, writeCmd, offset);
+    return aesd_client_query(conn, command, buf, size);
+}
+
+int aesd_client_flush(aesd_client_conn_t *conn)
+{
+    if (conn->broken)
+    {
+        errno = EPIPE;
+        return -1;
+    }
+
+    // Most of the time it all goes out at once, without a poll()
+    if (sendQueued(conn) != 0)
+    {
+        return -1;
+    }
+
+    return waitUntil(conn, allSent, NULL);
+}
+
+int aesd_client_poll(aesd_client_conn_t *conn, int timeoutMs)
+{
+    return pump(conn, timeoutMs);
+}
+
+int aesd_client_sync(aesd_client_conn_t *conn)
+{
+    return waitUntil(conn, allAnswered, NULL);
+}
+
+uint64_t aesd_client_unacked(const aesd_client_conn_t *conn)
+{
+    return conn->queuedSeq - conn->ackedSeq;
+}
+
+uint64_t aesd_client_log_length(const aesd_client_conn_t *conn)
+{
+    return conn->logLength;
+}
+
+void aesd_client_close(aesd_client_conn_t *conn)
+{
+    aesd_client_request_t *request;
+
+    if (!conn->broken)
+    {
+        aesd_client_sync(conn);
+    }
+
+    while ((request = STAILQ_FIRST(&conn->requests)) != NULL)
+    {
+        STAILQ_REMOVE_HEAD(&conn->requests, entries);
+        free(request);
+    }
+
+    close(conn->sockfd);
+    free(conn->sendBuff);
+    free(conn->recvBuff);
+    free(conn->reply);
+}
+
+int aesd_client_pool_init(aesd_client_pool_t *pool, const aesd_client_config_t *config,
+                          uint32_t maxOpen)
+{
+    if (maxOpen == 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pool->config = config;
+    pool->open = 0;
+    pool->maxOpen = maxOpen;
+    SLIST_INIT(&pool->idle);
+
+    if (pthread_mutex_init(&pool->mutex, NULL) != 0)
+    {
+        return -1;
+    }
+    if (pthread_cond_init(&pool->released, NULL) != 0)
+    {
+        pthread_mutex_destroy(&pool->mutex);
+        return -1;
+    }
+
+    return 0;
+}
+
+aesd_client_conn_t *aesd_client_pool_acquire(aesd_client_pool_t *pool)
+{
+    aesd_client_conn_t *conn = NULL;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (SLIST_EMPTY(&pool->idle) && pool->open >= pool->maxOpen)
+    {
+        pthread_cond_wait(&pool->released, &pool->mutex);
+    }
+
+    if (!SLIST_EMPTY(&pool->idle))
+    {
+        conn = SLIST_FIRST(&pool->idle);
+        SLIST_REMOVE_HEAD(&pool->idle, entries);
+        pthread_mutex_unlock(&pool->mutex);
+        return conn;
+    }
+
+    // Counted before connecting, so others wait rather than overshoot
+    pool->open++;
+    pthread_mutex_unlock(&pool->mutex);
+
+    conn = malloc(sizeof(*conn));
+    if (conn != NULL && aesd_client_open(conn, pool->config) != 0)
+    {
+        free(conn);
+        conn = NULL;
+    }
+
+    if (conn == NULL)
+    {
+        pthread_mutex_lock(&pool->mutex);
+        pool->open--;
+        pthread_cond_signal(&pool->released);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    return conn;
+}
+
+void aesd_client_pool_release(aesd_client_pool_t *pool, aesd_client_conn_t *conn)
+{
+    if (conn->broken)
+    {
+        aesd_client_close(conn);
+        free(conn);
+        conn = NULL;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    if (conn != NULL)
+    {
+        SLIST_INSERT_HEAD(&pool->idle, conn, entries);
+    }
+    else
+    {
+        pool->open--;
+    }
+    pthread_cond_signal(&pool->released);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void aesd_client_pool_destroy(aesd_client_pool_t *pool)
+{
+    aesd_client_conn_t *conn;
+
+    while ((conn = SLIST_FIRST(&pool->idle)) != NULL)
+    {
+        SLIST_REMOVE_HEAD(&pool->idle, entries);
+        aesd_client_close(conn);
+        free(conn);
+    }
+    pool->open = 0;
+
+    pthread_cond_destroy(&pool->released);
+    pthread_mutex_destroy(&pool->mutex);
+}
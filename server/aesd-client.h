@@ -0,0 +1,307 @@
+/**
+ * @file aesd-client.h
+ * @brief Client for aesdsocket over TCP or its unix domain socket
+ *
+ * A connection switches to length-prefixed records as soon as it connects,
+ * so every reply the server sends arrives whole and in order, and asks for
+ * a count of the packets appended per burst rather than an echo-back of
+ * the log. Packets are queued into a send buffer and go out together once
+ * it fills or is flushed, while up to a window of them may be waiting for
+ * the server's acknowledgement. Acknowledgements, echo-backs and command
+ * replies are handed to callbacks as they arrive, from whichever call on
+ * the connection happens to receive them.
+ *
+ * A connection is used by one thread at a time. A pool hands connections
+ * out to any number of threads and keeps them open between uses, so
+ * producers need not connect for every packet.
+ *
+ * Link with libaesdclient.a.
+ */
+
+#pragma once
+
+#include "./queue.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Queued bytes that are sent without waiting for a flush
+#define AESD_CLIENT_BATCH_BYTES     (64 * 1024)
+#define AESD_CLIENT_RECV_BYTES      (64 * 1024)
+// Packets sent but not acknowledged before sending more waits
+#define AESD_CLIENT_WINDOW_DEFAULT  256
+// How long any call waits for the server to make progress
+#define AESD_CLIENT_TIMEOUT_MS      30000
+// Largest packet the server accepts as one record
+#define AESD_CLIENT_RECORD_MAX      (64 * 1024 * 1024)
+
+/**
+ * @brief Packets firstSeq..firstSeq + count - 1 were appended, numbered
+ *  from 0 in the order they were queued on the connection
+ */
+typedef void (*aesd_client_ack_fn)(void *arg, uint64_t firstSeq, uint32_t count);
+
+/**
+ * @brief Packet seq was appended and the log then held what follows
+ */
+typedef void (*aesd_client_echo_fn)(void *arg, uint64_t seq, const char *log, size_t len);
+
+/**
+ * @brief Packet seq was not appended, the server having answered it
+ *  AESDCHAR_ERROR:EBUSY for waiting past its lock deadline. It may be
+ *  appended again.
+ */
+typedef void (*aesd_client_busy_fn)(void *arg, uint64_t seq);
+
+/**
+ * @brief A command was answered, with AESDCHAR_ERROR:<errno name> if it
+ *  failed
+ */
+typedef void (*aesd_client_reply_fn)(void *arg, const char *reply, size_t len);
+
+typedef struct aesd_client_config_s
+{
+    // Where the server listens, unixPath if set and host and port otherwise
+    const char *host;
+    const char *port;
+    const char *unixPath;
+    // Channel connections are bound to, NULL for the default channel
+    const char *channel;
+    // Token a follower forwarding to its leader presents, see
+    // aesd-replica.h, NULL for any other client
+    const char *followerToken;
+    // Echo the log back after every packet rather than count each burst
+    bool echo;
+    // Have each count come with the log's length after the burst, see
+    // aesd_client_log_length(). Ignored with echo.
+    bool ackLength;
+    // Packets in flight, 0 for AESD_CLIENT_WINDOW_DEFAULT
+    uint32_t window;
+    // How long to wait for the server, 0 for AESD_CLIENT_TIMEOUT_MS
+    int timeoutMs;
+    // Any may be NULL. Without echo a packet turned away answers onBusy,
+    // with echo onEcho gets the error reply as its log.
+    aesd_client_ack_fn onAck;
+    aesd_client_echo_fn onEcho;
+    aesd_client_busy_fn onBusy;
+    void *arg;
+} aesd_client_config_t;
+
+typedef struct aesd_client_request_s aesd_client_request_t;
+
+struct aesd_client_request_s
+{
+    // Packets queued ahead of the command, which are answered before it is
+    uint64_t afterSeq;
+    aesd_client_reply_fn onReply;
+    void *arg;
+    STAILQ_ENTRY(aesd_client_request_s) entries;
+};
+
+typedef struct aesd_client_conn_s aesd_client_conn_t;
+
+struct aesd_client_conn_s
+{
+    int sockfd;
+    // Kept by reference, and must outlive the connection
+    const aesd_client_config_t *config;
+    // Records queued, sent from sendPos up to sendLen
+    char *sendBuff;
+    size_t sendPos;
+    size_t sendLen;
+    size_t sendSize;
+    char *recvBuff;
+    // Frames of the reply being received, and how much of the frame in
+    // progress and its header are still to come
+    char *reply;
+    size_t replyLen;
+    size_t replySize;
+    uint8_t frameHeader[4];
+    size_t frameHeaderLen;
+    uint32_t frameLeft;
+    // Packets queued and packets acknowledged since connecting
+    uint64_t queuedSeq;
+    uint64_t ackedSeq;
+    // Length of the log after the last burst acknowledged, with ackLength
+    uint64_t logLength;
+    // Commands waiting for their replies, oldest first
+    STAILQ_HEAD(aesd_client_request_list_s, aesd_client_request_s) requests;
+    // Set once the connection failed and can only be closed
+    bool broken;
+    SLIST_ENTRY(aesd_client_conn_s) entries;
+};
+
+typedef struct aesd_client_pool_s
+{
+    const aesd_client_config_t *config;
+    pthread_mutex_t mutex;
+    pthread_cond_t released;
+    // Connected and not handed out
+    SLIST_HEAD(aesd_client_conn_list_s, aesd_client_conn_s) idle;
+    // Connections open, whether idle or handed out
+    uint32_t open;
+    uint32_t maxOpen;
+} aesd_client_pool_t;
+
+/**
+ * @brief Connect to the server without setting anything up, for callers
+ *  speaking the protocol themselves. TCP connections have Nagle's algorithm
+ *  turned off.
+ *
+ * @return int The connected socket, or -1 on error
+ */
+int aesd_client_dial(const aesd_client_config_t *config);
+
+/**
+ * @brief Send or receive exactly len bytes on a blocking socket
+ *
+ * @return int
+ * @retval -1 Error, including the peer closing the connection
+ * @retval  0 Success
+ */
+int aesd_client_send_all(int sockfd, const void *buf, size_t len);
+int aesd_client_recv_all(int sockfd, void *buf, size_t len);
+
+/**
+ * @brief Connect and switch the connection to records, binding it to the
+ *  configured channel and echo mode
+ *
+ * @return int
+ * @retval -1 Error
+ * @retval  0 Success
+ */
+int aesd_client_open(aesd_client_conn_t *conn, const aesd_client_config_t *config);
+
+/**
+ * @brief Queue a packet for appending, adding its newline if it lacks one
+ *
+ * Waits, handling replies, while the window is full. The packet is sent
+ * once AESD_CLIENT_BATCH_BYTES are queued or the connection is flushed.
+ *
+ * @return int
+ * @retval -1 Error, errno EINVAL for an empty packet, EMSGSIZE for one
+ *  over AESD_CLIENT_RECORD_MAX
+ * @retval  0 Success
+ */
+int aesd_client_append(aesd_client_conn_t *conn, const char *buf, size_t len);
+
+/**
+ * @brief Queue every packet and send them together, in as few writes as
+ *  the window allows
+ *
+ * @return int
+ * @retval -1 Error, some of the packets may have been queued
+ * @retval  0 Success
+ */
+int aesd_client_append_batch(aesd_client_conn_t *conn, const struct iovec *packets,
+                             size_t count);
+
+/**
+ * @brief Queue a command, given without its newline, whose reply is
+ *  handed to onReply once the packets queued before it are answered
+ *
+ * @return int
+ * @retval -1 Error
+ * @retval  0 Success
+ */
+int aesd_client_command(aesd_client_conn_t *conn, const char *command,
+                        aesd_client_reply_fn onReply, void *arg);
+
+/**
+ * @brief Run a command and wait for its reply
+ *
+ * @param buf Filled with the reply, truncated to size
+ * @return ssize_t Length of the whole reply, or -1 on error, with errno set
+ *  from the name in an error reply
+ */
+ssize_t aesd_client_query(aesd_client_conn_t *conn, const char *command, char *buf,
+                          size_t size);
+
+/**
+ * @brief Queue AESDCHAR_IOCSEEKTO:writeCmd,offset, whose reply is the log
+ *  from that byte of that packet onwards
+ */
+int aesd_client_seek(aesd_client_conn_t *conn, uint32_t writeCmd, uint32_t offset,
+                     aesd_client_reply_fn onReply, void *arg);
+
+/**
+ * @brief Read the log from byte offset of packet writeCmd onwards
+ *
+ * @return ssize_t Length of the log from there, or -1 on error, errno
+ *  EINVAL if the position is out of range
+ */
+ssize_t aesd_client_seek_read(aesd_client_conn_t *conn, uint32_t writeCmd, uint32_t offset,
+                              char *buf, size_t size);
+
+/**
+ * @brief Send everything queued, handling replies meanwhile
+ */
+int aesd_client_flush(aesd_client_conn_t *conn);
+
+/**
+ * @brief Handle whatever replies arrive within timeoutMs, 0 to only handle
+ *  those already received
+ *
+ * @return int
+ * @retval -1 Error
+ * @retval  0 Success
+ */
+int aesd_client_poll(aesd_client_conn_t *conn, int timeoutMs);
+
+/**
+ * @brief Send everything queued and wait for every packet to be
+ *  acknowledged and every command answered
+ */
+int aesd_client_sync(aesd_client_conn_t *conn);
+
+/**
+ * @brief Packets queued and not acknowledged yet
+ */
+uint64_t aesd_client_unacked(const aesd_client_conn_t *conn);
+
+/**
+ * @brief Length of the log once the last packet acknowledged was appended,
+ *  for a connection configured with ackLength. A sync first makes it the
+ *  length just after every packet queued.
+ */
+uint64_t aesd_client_log_length(const aesd_client_conn_t *conn);
+
+/**
+ * @brief Sync unless the connection is broken, then close it. Commands
+ *  still waiting are dropped without their callbacks.
+ */
+void aesd_client_close(aesd_client_conn_t *conn);
+
+/**
+ * @brief Start a pool that connects on demand, up to maxOpen at once
+ *
+ * @param config Must outlive the pool
+ * @return int
+ * @retval -1 Error
+ * @retval  0 Success
+ */
+int aesd_client_pool_init(aesd_client_pool_t *pool, const aesd_client_config_t *config,
+                          uint32_t maxOpen);
+
+/**
+ * @brief Hand out an idle connection, connecting a new one while under
+ *  the limit and waiting for one to be released otherwise
+ *
+ * @return aesd_client_conn_t* The connection, or NULL if connecting failed
+ */
+aesd_client_conn_t *aesd_client_pool_acquire(aesd_client_pool_t *pool);
+
+/**
+ * @brief Hand a connection back for reuse, or close it if it is broken.
+ *  Packets still in flight keep being acknowledged to the next user.
+ */
+void aesd_client_pool_release(aesd_client_pool_t *pool, aesd_client_conn_t *conn);
+
+/**
+ * @brief Close every connection, which must all have been released
+ */
+void aesd_client_pool_destroy(aesd_client_pool_t *pool);
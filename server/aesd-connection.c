@@ -0,0 +1,2009 @@
+/**
+ * @file aesd-connection.c
+ * @brief The aesdsocket protocol spoken with one connected peer: packet and
+ *  record framing, commands and echo-backs
+ */
+
+// pthread_setaffinity_np()
+#define _GNU_SOURCE
+
+#include "aesd-connection.h"
+#include "aesd-capture.h"
+#include "aesd-ingest.h"
+#include "aesd-memory.h"
+#include "aesd-replica.h"
+#include "aesd-scan.h"
+#include "aesd-stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/uio.h>
+
+static const char IOCSEEK_CMD_STR[] = "AESDCHAR_IOCSEEKTO";
+static const char CHANNEL_CMD_STR[] = "AESDCHAR_CHANNEL";
+// Takes optional arguments as AESDCHAR_SUBSCRIBE:<max lag>[,skip]
+static const char SUBSCRIBE_CMD_STR[] = "AESDCHAR_SUBSCRIBE";
+// AESDCHAR_ECHOMODE:line echoes after every packet, :burst (the default)
+// once per burst of pipelined packets, those that arrived together in one
+// receive, and :ack answers each burst with
+// ACK_REPLY_STR, ':' and the number of packets appended instead of the log.
+// :length adds ',' and the length of the log after the burst, which is what
+// a follower's echo-back of a forwarded burst ends at.
+static const char ECHOMODE_CMD_STR[] = "AESDCHAR_ECHOMODE";
+static const char ACK_REPLY_STR[] = "AESDCHAR_ACK";
+// AESDCHAR_READ:X,Y,N returns N bytes starting at byte Y of packet X
+static const char READ_CMD_STR[] = "AESDCHAR_READ";
+// AESDCHAR_READV:X,Y,N;X,Y,N;... returns every range in one reply, each
+// preceded by its length in decimal and a newline
+static const char READV_CMD_STR[] = "AESDCHAR_READV";
+// Reply with the number of complete packets, or bytes, in the channel
+static const char COUNT_CMD_STR[] = "AESDCHAR_COUNT";
+static const char SIZE_CMD_STR[] = "AESDCHAR_SIZE";
+
+// Switches a connection to length-prefixed records for good, acknowledged
+// by BINARY_ACK_STR. Normally sent right after connecting.
+static const char BINARY_CMD_STR[] = "AESDCHAR_BINARY";
+static const char BINARY_ACK_STR[] = "AESDCHAR_BINARY:OK\n";
+
+// Reply with the server's counters, one "name value" line each
+static const char STATS_CMD_STR[] = "AESDCHAR_STATS";
+
+// Over the unix domain socket only, replies AESDCHAR_SHMRING:<size> with
+// the shared-memory ingest ring's memfd attached
+static const char SHMRING_CMD_STR[] = "AESDCHAR_SHMRING";
+
+// Over the unix domain socket only, replies
+// AESDCHAR_SNAPSHOT:<generation>,<size> with a sealed memfd holding the
+// channel's whole log attached
+static const char SNAPSHOT_CMD_STR[] = "AESDCHAR_SNAPSHOT";
+
+// Reply with a "role tid=... node=... cpu=... migrations=..." line for
+// every server thread, to check where threads ended up
+static const char THREADS_CMD_STR[] = "AESDCHAR_THREADS";
+
+// Sent by a follower, see aesd-replica.h. Answered with
+// AESDCHAR_REPLICATE:OK:<token> and then the log in frames, for as long as
+// the follower stays.
+static const char REPLICATE_CMD_STR[] = "AESDCHAR_REPLICATE";
+// Sent by a follower's connections forwarding appends, with the token
+static const char FOLLOWER_CMD_STR[] = "AESDCHAR_FOLLOWER";
+
+// Reply with a "role ..." line and a line per replication stream
+static const char REPLICATION_CMD_STR[] = "AESDCHAR_REPLICATION";
+
+// Reply with a line per request in the trace ring, see aesd-trace.h
+static const char TRACE_CMD_STR[] = "AESDCHAR_TRACE";
+
+// Replies to query commands that cannot be answered are this, ':' and an
+// errno name. A packet that could not get the channel lock within the lock
+// deadline is answered with EBUSY in place of its echo-back, and dropped.
+static const char ERROR_REPLY_STR[] = "AESDCHAR_ERROR";
+
+static SLIST_HEAD(connection_list_s, socket_data_s) connections =
+    SLIST_HEAD_INITIALIZER(connections);
+// Guards the connections list, so connections may be started from any
+// thread
+static pthread_mutex_t connectionsMutex = PTHREAD_MUTEX_INITIALIZER;
+// Broadcast whenever a connection thread is done and can be joined
+static pthread_cond_t connectionDone = PTHREAD_COND_INITIALIZER;
+
+// Read by every connection, set by aesd_connection_limits() at any time
+static atomic_uint idleTimeoutSec = CONNECTION_IDLE_TIMEOUT_SEC;
+static atomic_uint readTimeoutSec = CONNECTION_READ_TIMEOUT_SEC;
+static atomic_size_t recvBuffSize = BUFF_SIZE;
+static atomic_uint lockDeadlineMs = 0;
+
+static uint32_t busyPollSpinUs = 0;
+// Core each slot is pinned to, -1 for none
+static int busyPollCpus[AESDSOCKET_BUSY_POLL_MAX_CPUS];
+static size_t busyPollSlotCount = 0;
+static atomic_bool busyPollSlotTaken[AESDSOCKET_BUSY_POLL_MAX_CPUS];
+
+void aesd_connection_limits(uint32_t idleSec, uint32_t readSec, size_t recvSize,
+                            uint32_t lockMs)
+{
+    atomic_store(&idleTimeoutSec, idleSec != 0 ? idleSec : CONNECTION_IDLE_TIMEOUT_SEC);
+    atomic_store(&readTimeoutSec, readSec != 0 ? readSec : CONNECTION_READ_TIMEOUT_SEC);
+    atomic_store(&recvBuffSize, recvSize != 0 ? recvSize : BUFF_SIZE);
+    atomic_store(&lockDeadlineMs, lockMs);
+}
+
+int aesd_connection_busy_poll(uint32_t spinUs, const int *cpus, size_t cpuCount)
+{
+    long onlineCpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t i;
+
+    if (cpuCount > AESDSOCKET_BUSY_POLL_MAX_CPUS)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (cpus == NULL)
+    {
+        cpuCount = onlineCpus < 1 ? 1 :
+                   onlineCpus > AESDSOCKET_BUSY_POLL_MAX_CPUS ? AESDSOCKET_BUSY_POLL_MAX_CPUS :
+                   (size_t)onlineCpus;
+    }
+
+    for (i = 0; i < cpuCount; i++)
+    {
+        busyPollCpus[i] = cpus != NULL ? cpus[i] : -1;
+        atomic_init(&busyPollSlotTaken[i], false);
+    }
+
+    busyPollSlotCount = spinUs != 0 ? cpuCount : 0;
+    busyPollSpinUs = spinUs;
+    return 0;
+}
+
+/**
+ * @brief Take a free busy-poll slot for the calling connection thread, and
+ *  set its socket and core up for spinning
+ */
+static void claimBusyPollSlot(socket_data_t *socket_data)
+{
+    cpu_set_t cpuSet;
+    size_t i;
+
+    socket_data->busyPollSlot = -1;
+
+    for (i = 0; i < busyPollSlotCount; i++)
+    {
+        if (!atomic_exchange(&busyPollSlotTaken[i], true))
+        {
+            socket_data->busyPollSlot = i;
+            break;
+        }
+    }
+
+    if (socket_data->busyPollSlot == -1)
+    {
+        return;
+    }
+
+    // Also has blocking receives poll the device queue before sleeping
+    if (setsockopt(socket_data->connectedSock, SOL_SOCKET, SO_BUSY_POLL,
+                   &(int){busyPollSpinUs}, sizeof(int)) == -1)
+    {
+        perror("setsockopt() SO_BUSY_POLL error");
+    }
+
+    if (busyPollCpus[i] != -1)
+    {
+        CPU_ZERO(&cpuSet);
+        CPU_SET(busyPollCpus[i], &cpuSet);
+        errno = pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+        if (errno != 0)
+        {
+            perror("pthread_setaffinity_np() error for busy-poll thread");
+        }
+    }
+}
+
+static void releaseBusyPollSlot(socket_data_t *socket_data)
+{
+    if (socket_data->busyPollSlot == -1)
+    {
+        return;
+    }
+
+    atomic_store(&busyPollSlotTaken[socket_data->busyPollSlot], false);
+    socket_data->busyPollSlot = -1;
+}
+
+static inline void cpuRelax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/**
+ * @brief Receive like recv(), spinning on non-blocking receives for up to
+ *  the busy-poll time before parking in a blocking one
+ */
+static ssize_t spinRecv(socket_data_t *socket_data, void *buf, size_t len)
+{
+    uint64_t spinNs = busyPollSpinUs * 1000ULL;
+    struct timespec start;
+    struct timespec now;
+    ssize_t recvRet;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    do
+    {
+        recvRet = recv(socket_data->connectedSock, buf, len, MSG_DONTWAIT);
+        if (recvRet >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+        {
+            aesd_stats_add(STAT_BUSY_POLL_HITS, 1);
+            return recvRet;
+        }
+
+        cpuRelax();
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while ((uint64_t)(now.tv_sec - start.tv_sec) * 1000000000ULL + now.tv_nsec -
+                 start.tv_nsec < spinNs);
+
+    aesd_stats_add(STAT_BUSY_POLL_PARKS, 1);
+    return recv(socket_data->connectedSock, buf, len, 0);
+}
+
+/**
+ * @brief Close connections that have gone idle or stalled mid-packet, runs
+ *  on the timer wheel thread
+ */
+static uint64_t connectionTimerExpired(void *arg, uint64_t nowMs)
+{
+    socket_data_t *socket_data = arg;
+    uint64_t idleDeadline = atomic_load(&socket_data->lastActivityMs) +
+                            atomic_load(&idleTimeoutSec) * 1000ULL;
+    uint64_t partialSince = atomic_load(&socket_data->partialSinceMs);
+    // With no packet in progress one could start right now
+    uint64_t readDeadline = (partialSince ? partialSince : nowMs) +
+                            atomic_load(&readTimeoutSec) * 1000ULL;
+
+    if (nowMs >= idleDeadline || nowMs >= readDeadline)
+    {
+        syslog(LOG_INFO, "Closing connection after %s timeout",
+               nowMs >= idleDeadline ? "idle" : "read");
+        aesd_stats_add(nowMs >= idleDeadline ? STAT_IDLE_TIMEOUTS : STAT_READ_TIMEOUTS, 1);
+
+        // The connection thread wakes up to an end of stream and cleans up
+        // as if the peer had closed
+        shutdown(socket_data->connectedSock, SHUT_RDWR);
+        return 0;
+    }
+
+    return idleDeadline < readDeadline ? idleDeadline : readDeadline;
+}
+
+int aesd_connection_start(int connectedSock, const struct sockaddr_storage *peeraddr)
+{
+    const unsigned idleSec = atomic_load(&idleTimeoutSec);
+    const unsigned readSec = atomic_load(&readTimeoutSec);
+    const unsigned firstCheckSec = idleSec < readSec ? idleSec : readSec;
+    socket_data_t *socket_data;
+    pthread_attr_t attr;
+    sigset_t allSignals;
+    sigset_t oldSignals;
+    int retVal;
+
+    socket_data = (socket_data_t *)malloc(sizeof(socket_data_t));
+    if (socket_data == NULL)
+    {
+        close(connectedSock);
+        return -1;
+    }
+
+    // Initialize arguments to be used by thread
+    socket_data->connectedSock = connectedSock;
+    socket_data->peeraddr = *peeraddr;
+    socket_data->threadCompleteFlag = false;
+    socket_data->channel = aesd_channel_default();
+    socket_data->recvBuff = NULL;
+    socket_data->recvBuffSize = atomic_load(&recvBuffSize);
+    socket_data->packetBuff = NULL;
+    socket_data->packetLen = 0;
+    socket_data->packetCapacity = 0;
+    socket_data->echoPending = false;
+    socket_data->forwarded = false;
+    socket_data->upstream = NULL;
+    socket_data->perLineEcho = false;
+    socket_data->ackEcho = false;
+    socket_data->ackLength = false;
+    socket_data->fromFollower = false;
+    socket_data->burstPackets = 0;
+    socket_data->binaryFraming = false;
+    socket_data->recordHeaderLen = 0;
+    socket_data->recordLen = 0;
+    atomic_init(&socket_data->lastActivityMs, aesd_timer_wheel_now());
+    atomic_init(&socket_data->partialSinceMs, 0);
+    socket_data->busyPollSlot = -1;
+    socket_data->captureId = 0;
+    // Listed by AESDCHAR_THREADS only once the thread has filled it in
+    socket_data->place.tid = 0;
+    socket_data->memHeld = 0;
+    aesd_timer_init(&socket_data->timer, connectionTimerExpired, socket_data);
+
+    aesd_stats_add(STAT_CONNECTIONS_ACCEPTED, 1);
+    aesd_stats_add(STAT_CONNECTIONS_ACTIVE, 1);
+
+    // Armed before the thread exists, which cancels it before closing the
+    // socket. The callback works out the real deadlines when it runs.
+    aesd_timer_arm(&socket_data->timer, aesd_timer_wheel_now() + 1000ULL * firstCheckSec);
+
+    // Signals are for the embedding application's own threads, and a
+    // handler must never find a connection holding its channel lock
+    sigfillset(&allSignals);
+    pthread_attr_init(&attr);
+    socket_data->node = aesd_placement_worker_attr(&attr);
+    pthread_sigmask(SIG_BLOCK, &allSignals, &oldSignals);
+    retVal = pthread_create(&socket_data->threadHandle, &attr, recvAndSendAndLog, socket_data);
+    pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+    pthread_attr_destroy(&attr);
+
+    if (retVal != 0)
+    {
+        errno = retVal;
+        perror("pthread_create() error");
+        aesd_timer_cancel(&socket_data->timer);
+        aesd_stats_add(STAT_CONNECTIONS_ACTIVE, -1);
+        close(connectedSock);
+        free(socket_data);
+        return -1;
+    }
+
+    pthread_mutex_lock(&connectionsMutex);
+    SLIST_INSERT_HEAD(&connections, socket_data, entries);
+    pthread_mutex_unlock(&connectionsMutex);
+    return 0;
+}
+
+/**
+ * @brief Join and free completed connections. Caller must hold
+ *  connectionsMutex.
+ */
+static void reapLocked(void)
+{
+    socket_data_t *listSearchp = NULL;
+    socket_data_t *tmpItem = NULL;
+
+    // Check list for completed threads
+    SLIST_FOREACH_SAFE(listSearchp, &connections, entries, tmpItem)
+    {
+        if (listSearchp->threadCompleteFlag)
+        {
+            pthread_join(listSearchp->threadHandle, NULL);
+            SLIST_REMOVE(&connections, listSearchp, socket_data_s, entries);
+            free(listSearchp);
+        }
+    }
+}
+
+void aesd_connection_reap(void)
+{
+    pthread_mutex_lock(&connectionsMutex);
+    reapLocked();
+    pthread_mutex_unlock(&connectionsMutex);
+}
+
+size_t aesd_connection_format_threads(char *buf, size_t len)
+{
+    socket_data_t *socket_data;
+    size_t used = 0;
+
+    pthread_mutex_lock(&connectionsMutex);
+    SLIST_FOREACH(socket_data, &connections, entries)
+    {
+        if (used == len)
+        {
+            break;
+        }
+        if (!socket_data->threadCompleteFlag && socket_data->place.tid != 0)
+        {
+            used += aesd_placement_format_thread(&socket_data->place, buf + used, len - used);
+        }
+    }
+    pthread_mutex_unlock(&connectionsMutex);
+
+    return used;
+}
+
+void aesd_connection_wait_all(void)
+{
+    socket_data_t *socket_data;
+
+    pthread_mutex_lock(&connectionsMutex);
+
+    // Each thread wakes up to an end of stream, or a failed send, and
+    // cleans up as if its peer had closed. The socket of a completed thread
+    // is already closed and its descriptor may belong to something else.
+    SLIST_FOREACH(socket_data, &connections, entries)
+    {
+        if (!socket_data->threadCompleteFlag)
+        {
+            shutdown(socket_data->connectedSock, SHUT_RDWR);
+        }
+    }
+
+    reapLocked();
+    while (!SLIST_EMPTY(&connections))
+    {
+        pthread_cond_wait(&connectionDone, &connectionsMutex);
+        reapLocked();
+    }
+
+    pthread_mutex_unlock(&connectionsMutex);
+}
+
+/**
+ * @brief Sleep for up to timeoutMs without reading from the connection
+ *
+ * @return bool True if the connection was shut down meanwhile, by a
+ *  timeout or the server stopping
+ */
+static bool sleepUnlessShutDown(socket_data_t *socket_data, int timeoutMs)
+{
+    // With no events asked for, only a hang-up or error wakes this early
+    struct pollfd pollFd = {.fd = socket_data->connectedSock, .events = 0};
+
+    // Zero-copy reports arrive as errors too, go back to sleep after them
+    while (poll(&pollFd, 1, timeoutMs) > 0)
+    {
+        if ((pollFd.revents & POLLHUP) || aesd_zerocopy_reap(&socket_data->zerocopy, 0) <= 0)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief Charge the memory budget for the connection, waiting without
+ *  reading until the charge fits
+ *
+ * An echo-back owed is sent first, so the channel lock is never held while
+ * waiting on memory other connections have to give back.
+ *
+ * @return int
+ * @retval -1 Error, errno ENOMEM if the charge did not fit within
+ *  MEMORY_WAIT_MAX_MS or ECONNRESET if the connection was shut down while
+ *  waiting
+ * @retval  0 Success
+ */
+static int chargeOrWait(socket_data_t *socket_data, aesd_mem_kind_t kind, size_t bytes)
+{
+    int waitedMs = 0;
+
+    while (!aesd_memory_try_charge(kind, bytes))
+    {
+        if (!aesd_memory_fits(bytes) || waitedMs >= MEMORY_WAIT_MAX_MS)
+        {
+            aesd_stats_add(STAT_MEM_CHARGES_REFUSED, 1);
+            errno = ENOMEM;
+            return -1;
+        }
+
+        if (waitedMs == 0)
+        {
+            aesd_stats_add(STAT_MEM_READ_STALLS, 1);
+            if (socket_data->echoPending && flushEcho(socket_data) != 0)
+            {
+                return -1;
+            }
+        }
+        if (sleepUnlessShutDown(socket_data, MEMORY_RETRY_MS))
+        {
+            errno = ECONNRESET;
+            return -1;
+        }
+        waitedMs += MEMORY_RETRY_MS;
+    }
+
+    socket_data->memHeld += bytes;
+    return 0;
+}
+
+static void releaseMemory(socket_data_t *socket_data, aesd_mem_kind_t kind, size_t bytes)
+{
+    aesd_memory_release(kind, bytes);
+    socket_data->memHeld -= bytes;
+}
+
+/**
+ * @brief Stop reading while memory is short and the connection is one of
+ *  its largest users
+ *
+ * A packet buffer with nothing in it is given back first, which is often
+ * all it takes for the connection to no longer be one of the largest.
+ *
+ * @return int
+ * @retval -1 The connection was shut down while waiting
+ * @retval  0 Reading may go on
+ */
+static int throttleReads(socket_data_t *socket_data)
+{
+    bool stalled = false;
+
+    while (aesd_memory_throttled(socket_data->memHeld))
+    {
+        if (socket_data->packetLen == 0 && socket_data->recordHeaderLen == 0 &&
+            socket_data->packetCapacity != 0)
+        {
+            releaseMemory(socket_data, MEM_RECEIVE, socket_data->packetCapacity);
+            free(socket_data->packetBuff);
+            socket_data->packetBuff = NULL;
+            socket_data->packetCapacity = 0;
+            continue;
+        }
+
+        if (!stalled)
+        {
+            aesd_stats_add(STAT_MEM_READ_STALLS, 1);
+            stalled = true;
+        }
+        if (sleepUnlessShutDown(socket_data, MEMORY_RETRY_MS))
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Make room for at least needed bytes in the connection's packet
+ *  buffer, charged to the memory budget
+ */
+static int reservePacketBuff(socket_data_t *socket_data, size_t needed)
+{
+    size_t newCapacity;
+    char *newPacketBuff;
+
+    if (needed <= socket_data->packetCapacity)
+    {
+        return 0;
+    }
+
+    newCapacity = socket_data->packetCapacity ? socket_data->packetCapacity : BUFF_SIZE;
+    while (newCapacity < needed)
+    {
+        newCapacity *= 2;
+    }
+
+    if (chargeOrWait(socket_data, MEM_RECEIVE, newCapacity - socket_data->packetCapacity) != 0)
+    {
+        perror("No memory budget for packet buffer");
+        return -1;
+    }
+
+    newPacketBuff = realloc(socket_data->packetBuff, newCapacity);
+    if (newPacketBuff == NULL)
+    {
+        perror("realloc() error on packet buffer");
+        releaseMemory(socket_data, MEM_RECEIVE, newCapacity - socket_data->packetCapacity);
+        return -1;
+    }
+    socket_data->packetBuff = newPacketBuff;
+    socket_data->packetCapacity = newCapacity;
+    return 0;
+}
+
+static int consumeRecords(socket_data_t *socket_data, const char *buf, size_t len);
+static int queueUpstream(socket_data_t *socket_data, const char *packet, size_t packetLen);
+static void closeUpstream(socket_data_t *socket_data);
+
+/**
+ * @brief Split received bytes at each newline, handling every packet as soon
+ *  as it is complete and holding on to a trailing partial one
+ */
+static int consumePackets(socket_data_t *socket_data, const char *buf, size_t len)
+{
+    const char *nlPtr;
+    size_t chunkLen;
+
+    while (len > 0)
+    {
+        nlPtr = aesd_scan_newline(buf, len);
+        chunkLen = nlPtr ? (size_t)(nlPtr - buf + 1) : len;
+
+        if (reservePacketBuff(socket_data, socket_data->packetLen + chunkLen) != 0)
+        {
+            return -1;
+        }
+
+        memcpy(socket_data->packetBuff + socket_data->packetLen, buf, chunkLen);
+        socket_data->packetLen += chunkLen;
+        buf += chunkLen;
+        len -= chunkLen;
+
+        if (nlPtr)
+        {
+            if (handlePacket(socket_data, socket_data->packetBuff,
+                             socket_data->packetLen) != 0)
+            {
+                return -1;
+            }
+            socket_data->packetLen = 0;
+
+            // Whatever follows AESDCHAR_BINARY is already length-prefixed
+            if (socket_data->binaryFraming)
+            {
+                return consumeRecords(socket_data, buf, len);
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Split received bytes into length-prefixed records, handling every
+ *  record as soon as it is complete
+ */
+static int consumeRecords(socket_data_t *socket_data, const char *buf, size_t len)
+{
+    uint32_t recordHeader;
+    size_t chunkLen;
+
+    while (len > 0)
+    {
+        if (socket_data->recordHeaderLen < RECORD_HEADER_LEN)
+        {
+            chunkLen = RECORD_HEADER_LEN - socket_data->recordHeaderLen;
+            chunkLen = chunkLen < len ? chunkLen : len;
+            memcpy(socket_data->recordHeader + socket_data->recordHeaderLen, buf, chunkLen);
+            socket_data->recordHeaderLen += chunkLen;
+            buf += chunkLen;
+            len -= chunkLen;
+
+            if (socket_data->recordHeaderLen < RECORD_HEADER_LEN)
+            {
+                break;
+            }
+
+            memcpy(&recordHeader, socket_data->recordHeader, sizeof(recordHeader));
+            recordHeader = ntohl(recordHeader);
+            socket_data->recordLen = recordHeader & ~RECORD_COMMAND_FLAG;
+            if (socket_data->recordLen > RECORD_MAX_LEN)
+            {
+                syslog(LOG_ERR, "Record of %u bytes is over the limit, closing",
+                       socket_data->recordLen);
+                return -1;
+            }
+
+            // Room for the newline handleRecord() may add
+            if (reservePacketBuff(socket_data, socket_data->recordLen + 1) != 0)
+            {
+                return -1;
+            }
+        }
+
+        chunkLen = socket_data->recordLen - socket_data->packetLen;
+        chunkLen = chunkLen < len ? chunkLen : len;
+        memcpy(socket_data->packetBuff + socket_data->packetLen, buf, chunkLen);
+        socket_data->packetLen += chunkLen;
+        buf += chunkLen;
+        len -= chunkLen;
+
+        if (socket_data->packetLen == socket_data->recordLen && handleRecord(socket_data) != 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void *recvAndSendAndLog(void *socket_data_arg)
+{
+    socket_data_t *socket_data = (socket_data_t *)socket_data_arg;
+
+    // Determine IP address of client for logging
+    char peerName[INET_ADDRSTRLEN] = "local socket";
+    if (socket_data->peeraddr.ss_family == AF_INET)
+    {
+        inet_ntop(AF_INET, &((struct sockaddr_in *)&socket_data->peeraddr)->sin_addr,
+                  peerName, sizeof(peerName));
+    }
+
+    syslog(LOG_INFO, "Accepted connection from %s", peerName);
+
+    // Before anything is allocated, so buffers come from the thread's node
+    aesd_placement_enter(&socket_data->place, "connection", socket_data->node);
+    claimBusyPollSlot(socket_data);
+    aesd_memory_consumers(1);
+    aesd_zerocopy_open(&socket_data->zerocopy, socket_data->connectedSock);
+    socket_data->captureId = aesd_capture_open(socket_data->peeraddr.ss_family == AF_UNIX);
+
+    char *recvTarget;
+    size_t recvLen;
+    ssize_t recvRet;
+    bool directRecv;
+
+    if (chargeOrWait(socket_data, MEM_RECEIVE, socket_data->recvBuffSize) != 0)
+    {
+        perror("No memory budget for receive buffer");
+        goto closeConnection;
+    }
+    socket_data->recvBuff = malloc(socket_data->recvBuffSize);
+    if (socket_data->recvBuff == NULL)
+    {
+        perror("malloc() error on receive buffer");
+        releaseMemory(socket_data, MEM_RECEIVE, socket_data->recvBuffSize);
+        goto closeConnection;
+    }
+
+    while (true)
+    {
+        // Backpressure on the largest users of memory, once what is owed
+        // has been echoed back
+        if (!socket_data->echoPending && throttleReads(socket_data) != 0)
+        {
+            goto closeConnection;
+        }
+
+        // The rest of a large record goes straight into the packet buffer,
+        // it has no newlines to look for and needs no second copy
+        directRecv = socket_data->binaryFraming &&
+                     socket_data->recordHeaderLen == RECORD_HEADER_LEN &&
+                     socket_data->recordLen - socket_data->packetLen >= socket_data->recvBuffSize;
+        recvTarget = directRecv ? socket_data->packetBuff + socket_data->packetLen
+                                : socket_data->recvBuff;
+        recvLen = directRecv ? socket_data->recordLen - socket_data->packetLen
+                             : socket_data->recvBuffSize;
+
+        // While a forwarded burst is owed an echo-back, only take what has
+        // already arrived so every packet of it goes to the leader before
+        // one echo-back. Appended bursts never get here holding the lock.
+        if (socket_data->busyPollSlot != -1 && !socket_data->echoPending)
+        {
+            recvRet = spinRecv(socket_data, recvTarget, recvLen);
+        }
+        else
+        {
+            recvRet = recv(socket_data->connectedSock, recvTarget, recvLen,
+                           socket_data->echoPending ? MSG_DONTWAIT : 0);
+        }
+
+        if (recvRet < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+            socket_data->echoPending)
+        {
+            if (flushEcho(socket_data) != 0)
+            {
+                goto closeConnection;
+            }
+            continue;
+        }
+
+        if (recvRet == 0)
+        {
+            break;
+        }
+
+        if (recvRet < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("recv() error");
+            break;
+        }
+
+        atomic_store_explicit(&socket_data->lastActivityMs, aesd_timer_wheel_now(),
+                              memory_order_relaxed);
+        aesd_placement_sample();
+        aesd_capture_data(socket_data->captureId, recvTarget, recvRet);
+
+        if (directRecv)
+        {
+            socket_data->packetLen += recvRet;
+            if (socket_data->packetLen == socket_data->recordLen &&
+                handleRecord(socket_data) != 0)
+            {
+                goto closeConnection;
+            }
+        }
+        else if (socket_data->binaryFraming)
+        {
+            if (consumeRecords(socket_data, socket_data->recvBuff, recvRet) != 0)
+            {
+                goto closeConnection;
+            }
+        }
+        else if (consumePackets(socket_data, socket_data->recvBuff, recvRet) != 0)
+        {
+            goto closeConnection;
+        }
+
+        // A burst is what one receive brought in. The peer may keep
+        // sending for as long as it likes, the lock must not wait on it.
+        if (socket_data->echoPending && !socket_data->forwarded &&
+            flushEcho(socket_data) != 0)
+        {
+            goto closeConnection;
+        }
+
+        // The read timeout runs from the first byte of a packet
+        if (socket_data->packetLen == 0 && socket_data->recordHeaderLen == 0)
+        {
+            atomic_store_explicit(&socket_data->partialSinceMs, 0, memory_order_relaxed);
+        }
+        else if (atomic_load_explicit(&socket_data->partialSinceMs, memory_order_relaxed) == 0)
+        {
+            atomic_store_explicit(&socket_data->partialSinceMs, aesd_timer_wheel_now(),
+                                  memory_order_relaxed);
+        }
+    }
+
+    // The peer may only have shut down its sending side, so still answer
+    // the last burst
+    if (socket_data->echoPending && flushEcho(socket_data) != 0)
+    {
+        goto closeConnection;
+    }
+
+    // Like the byte-at-a-time writes this replaced, an unterminated packet
+    // still makes it to the log when the peer goes away. A truncated record
+    // does not.
+    if (!socket_data->binaryFraming && socket_data->packetLen > 0 && aesd_replica_following())
+    {
+        // Goes to the leader with a newline added, nothing else can send one
+        if (queueUpstream(socket_data, socket_data->packetBuff, socket_data->packetLen) != 0)
+        {
+            syslog(LOG_ERR, "Cannot forward last packet to the leader: %s", strerror(errno));
+        }
+    }
+    else if (!socket_data->binaryFraming && socket_data->packetLen > 0 &&
+             aesd_channel_lock(socket_data->channel) == 0)
+    {
+        aesd_channel_append(socket_data->channel, socket_data->packetBuff,
+                            socket_data->packetLen);
+        aesd_channel_unlock(socket_data->channel);
+    }
+
+closeConnection:
+    aesd_trace_abandon();
+    aesd_capture_close(socket_data->captureId);
+    aesd_timer_cancel(&socket_data->timer);
+    aesd_stats_add(STAT_CONNECTIONS_ACTIVE, -1);
+    releaseBusyPollSlot(socket_data);
+
+    if (socket_data->echoPending && !socket_data->forwarded)
+    {
+        aesd_channel_unlock(socket_data->channel);
+    }
+    socket_data->echoPending = false;
+    socket_data->forwarded = false;
+    // Waits for the leader to take whatever is still queued
+    closeUpstream(socket_data);
+
+    syslog(LOG_INFO, "Closed connection from %s", peerName);
+    aesd_zerocopy_close(&socket_data->zerocopy);
+    free(socket_data->packetBuff);
+    socket_data->packetBuff = NULL;
+    releaseMemory(socket_data, MEM_RECEIVE, socket_data->packetCapacity);
+    socket_data->packetCapacity = 0;
+    if (socket_data->recvBuff != NULL)
+    {
+        free(socket_data->recvBuff);
+        socket_data->recvBuff = NULL;
+        releaseMemory(socket_data, MEM_RECEIVE, socket_data->recvBuffSize);
+    }
+    aesd_memory_consumers(-1);
+
+    aesd_placement_leave();
+
+    // Closed together with marking the thread done, so
+    // aesd_connection_wait_all() never shuts down a descriptor reused since
+    pthread_mutex_lock(&connectionsMutex);
+    close(socket_data->connectedSock);
+    socket_data->threadCompleteFlag = true;
+    pthread_cond_broadcast(&connectionDone);
+    pthread_mutex_unlock(&connectionsMutex);
+
+    pthread_exit(socket_data);
+}
+
+static int sendReply(socket_data_t *socket_data, const char *reply, size_t replyLen);
+static int sendErrorReply(socket_data_t *socket_data, const char *reason);
+static int handleSubscribeCommand(socket_data_t *socket_data, const char *args);
+
+typedef int (*command_handler_t)(socket_data_t *socket_data, const char *args);
+
+typedef struct command_s
+{
+    const char *cmdStr;
+    command_handler_t handler;
+} command_t;
+
+// Every command is its name alone on a line, or followed by ':' and
+// arguments
+static const command_t commandTable[] = {
+    {IOCSEEK_CMD_STR, handleSeekCommand},
+    {CHANNEL_CMD_STR, handleChannelCommand},
+    {SUBSCRIBE_CMD_STR, handleSubscribeCommand},
+    {ECHOMODE_CMD_STR, handleEchoModeCommand},
+    {READ_CMD_STR, handleReadCommand},
+    {READV_CMD_STR, handleReadvCommand},
+    {COUNT_CMD_STR, handleCountCommand},
+    {SIZE_CMD_STR, handleSizeCommand},
+    {BINARY_CMD_STR, handleBinaryCommand},
+    {STATS_CMD_STR, handleStatsCommand},
+    {SHMRING_CMD_STR, handleShmRingCommand},
+    {SNAPSHOT_CMD_STR, handleSnapshotCommand},
+    {THREADS_CMD_STR, handleThreadsCommand},
+    {REPLICATE_CMD_STR, handleReplicateCommand},
+    {FOLLOWER_CMD_STR, handleFollowerCommand},
+    {REPLICATION_CMD_STR, handleReplicationCommand},
+    {TRACE_CMD_STR, handleTraceCommand},
+};
+
+/**
+ * @brief Run the packet if it is a command
+ *
+ * @return int
+ * @retval -1 Error, the connection should be closed
+ * @retval  0 Command run
+ * @retval  1 Not a command
+ */
+static int runCommand(socket_data_t *socket_data, const char *packet, size_t packetLen)
+{
+    char args[CMD_MAX_LEN];
+    size_t cmdLen;
+    size_t argsLen;
+    size_t i;
+    int retVal;
+
+    // Most packets are data, turn them away without walking the table
+    if (!aesd_scan_is_command(packet, packetLen))
+    {
+        return 1;
+    }
+
+    for (i = 0; i < sizeof(commandTable) / sizeof(commandTable[0]); i++)
+    {
+        cmdLen = strlen(commandTable[i].cmdStr);
+
+        if (packetLen <= cmdLen || memcmp(packet, commandTable[i].cmdStr, cmdLen) != 0 ||
+            (packet[cmdLen] != ':' && packet[cmdLen] != '\n'))
+        {
+            continue;
+        }
+
+        // Drop the separator and the trailing newline
+        argsLen = packet[cmdLen] == ':' ? packetLen - cmdLen - 2 : 0;
+        if (argsLen >= sizeof(args))
+        {
+            syslog(LOG_ERR, "%s command too long, ignoring", commandTable[i].cmdStr);
+            return 0;
+        }
+        memcpy(args, packet + cmdLen + 1, argsLen);
+        args[argsLen] = '\0';
+
+        // Replies go out in the order their requests arrived
+        if (socket_data->echoPending && flushEcho(socket_data) != 0)
+        {
+            return -1;
+        }
+
+        aesd_trace_begin();
+        retVal = commandTable[i].handler(socket_data, args);
+        aesd_trace_end(commandTable[i].cmdStr + strlen("AESDCHAR_"), socket_data->channel->name,
+                       0);
+        return retVal;
+    }
+
+    return 1;
+}
+
+static void closeUpstream(socket_data_t *socket_data)
+{
+    if (socket_data->upstream != NULL)
+    {
+        aesd_client_close(socket_data->upstream);
+        free(socket_data->upstream);
+        socket_data->upstream = NULL;
+    }
+}
+
+/**
+ * @brief Queue a packet for the leader, connecting to it first if need be
+ *
+ * @return int
+ * @retval -1 Could not reach the leader
+ * @retval  0 Success
+ */
+static int queueUpstream(socket_data_t *socket_data, const char *packet, size_t packetLen)
+{
+    if (socket_data->upstream == NULL)
+    {
+        socket_data->upstreamConfig = *aesd_replica_leader();
+        socket_data->upstreamConfig.channel = socket_data->channel->name;
+        socket_data->upstreamConfig.ackLength = true;
+        // Only the leader's stream of this channel's copy has a token, and
+        // presenting it exempts the forwarded packets from the lock deadline
+        aesd_replica_token(socket_data->channel, socket_data->upstreamToken);
+        socket_data->upstreamConfig.followerToken =
+            socket_data->upstreamToken[0] != '\0' ? socket_data->upstreamToken : NULL;
+        socket_data->upstream = malloc(sizeof(aesd_client_conn_t));
+        if (socket_data->upstream == NULL ||
+            aesd_client_open(socket_data->upstream, &socket_data->upstreamConfig) != 0)
+        {
+            free(socket_data->upstream);
+            socket_data->upstream = NULL;
+            return -1;
+        }
+    }
+
+    if (aesd_client_append(socket_data->upstream, packet, packetLen) != 0)
+    {
+        closeUpstream(socket_data);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief On a follower, forward a complete packet to the leader, with an
+ *  echo-back to follow once the local copy has it
+ */
+static int forwardPacket(socket_data_t *socket_data, const char *packet, size_t packetLen)
+{
+    uint64_t forwardStart = aesd_trace_clock();
+
+    if (queueUpstream(socket_data, packet, packetLen) != 0)
+    {
+        aesd_trace_abandon();
+        syslog(LOG_ERR, "Cannot forward to the leader: %s", strerror(errno));
+        return sendErrorReply(socket_data, "ENOTCONN");
+    }
+    aesd_trace_charge(TRACE_FORWARD, forwardStart);
+
+    socket_data->echoPending = true;
+    socket_data->forwarded = true;
+    socket_data->burstPackets++;
+
+    if (socket_data->perLineEcho)
+    {
+        return flushEcho(socket_data);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Append a complete packet to the connection's channel, with an
+ *  echo-back of the channel contents to follow
+ */
+static int appendPacket(socket_data_t *socket_data, const char *packet, size_t packetLen)
+{
+    aesd_channel_t *channel = socket_data->channel;
+    uint32_t deadlineMs;
+
+    // The request runs from the first packet of a burst to its echo-back
+    aesd_trace_begin();
+
+    if (aesd_replica_following())
+    {
+        return forwardPacket(socket_data, packet, packetLen);
+    }
+
+    // The lock is taken with the first packet of a burst and held until its
+    // echo-back is sent, so the echo ends with this connection's packets.
+    // Bursts end with the data of the receive they came in, see
+    // recvAndSendAndLog().
+    if (!socket_data->echoPending)
+    {
+        // A follower forwarding its peers' packets always waits, it could
+        // not pass a refusal on to them
+        deadlineMs = socket_data->fromFollower ? 0 : atomic_load(&lockDeadlineMs);
+        if (aesd_channel_lock_timed(channel, deadlineMs) != 0)
+        {
+            if (errno != ETIMEDOUT)
+            {
+                return -1;
+            }
+            aesd_stats_add(STAT_LOCK_DEADLINE_BUSY, 1);
+            aesd_trace_end("busy", channel->name, 0);
+            return sendErrorReply(socket_data, "EBUSY");
+        }
+        if (deadlineMs != 0)
+        {
+            aesd_stats_add(STAT_LOCK_DEADLINE_MET, 1);
+        }
+        socket_data->echoPending = true;
+    }
+
+    if (aesd_channel_append(channel, packet, packetLen) != 0)
+    {
+        return -1;
+    }
+    socket_data->burstPackets++;
+
+    // A large receive buffer can hold many packets, so end the burst early
+    // once another connection is queued for the lock
+    if (socket_data->perLineEcho || aesd_channel_contended(channel))
+    {
+        return flushEcho(socket_data);
+    }
+
+    return 0;
+}
+
+int handlePacket(socket_data_t *socket_data, const char *packet, size_t packetLen)
+{
+    int retVal = runCommand(socket_data, packet, packetLen);
+
+    if (retVal != 1)
+    {
+        return retVal;
+    }
+
+    return appendPacket(socket_data, packet, packetLen);
+}
+
+int handleRecord(socket_data_t *socket_data)
+{
+    char *record = socket_data->packetBuff;
+    size_t recordLen = socket_data->recordLen;
+    bool isCommand = socket_data->recordHeader[0] & (RECORD_COMMAND_FLAG >> 24);
+    int retVal = 0;
+
+    socket_data->recordHeaderLen = 0;
+    socket_data->packetLen = 0;
+
+    // Records carry no newline of their own, but are stored as one packet
+    // and commands are matched as lines. packetBuff has room for it.
+    if (recordLen == 0 || record[recordLen - 1] != '\n')
+    {
+        record[recordLen++] = '\n';
+    }
+
+    if (isCommand)
+    {
+        retVal = runCommand(socket_data, record, recordLen);
+        if (retVal == 1)
+        {
+            syslog(LOG_ERR, "Unknown command record");
+            retVal = sendErrorReply(socket_data, "ENOSYS");
+        }
+        return retVal;
+    }
+
+    if (recordLen == 1)
+    {
+        // Empty record, nothing to store
+        return 0;
+    }
+
+    return appendPacket(socket_data, record, recordLen);
+}
+
+/**
+ * @brief Echo back a burst forwarded to the leader, once the local copy
+ *  has caught up with the leader's log as it was after the burst. The
+ *  echo-back ends there, with the burst's last packet, like the leader's.
+ */
+static int flushForwarded(socket_data_t *socket_data)
+{
+    aesd_channel_t *channel = socket_data->channel;
+    uint32_t burstPackets = socket_data->burstPackets;
+    uint64_t forwardStart = aesd_trace_clock();
+    char reply[32];
+    int replyLen;
+    uint64_t leaderSize;
+    int retVal;
+
+    socket_data->burstPackets = 0;
+    socket_data->echoPending = false;
+    socket_data->forwarded = false;
+
+    if (aesd_client_sync(socket_data->upstream) != 0)
+    {
+        syslog(LOG_ERR, "Leader did not take forwarded packets: %s", strerror(errno));
+        closeUpstream(socket_data);
+        return sendErrorReply(socket_data, "ENOTCONN");
+    }
+    leaderSize = aesd_client_log_length(socket_data->upstream);
+
+    if (aesd_replica_wait(channel, leaderSize, REPLICA_CATCH_UP_MS) != 0)
+    {
+        syslog(LOG_WARNING, "Copy of %s did not reach %llu in time", channel->name,
+               (unsigned long long)leaderSize);
+        return sendErrorReply(socket_data, "ETIMEDOUT");
+    }
+    aesd_trace_charge(TRACE_FORWARD, forwardStart);
+
+    if (socket_data->ackEcho)
+    {
+        replyLen = snprintf(reply, sizeof(reply), "%s:%u\n", ACK_REPLY_STR, burstPackets);
+        return sendReply(socket_data, reply, replyLen);
+    }
+
+    if (aesd_channel_lock(channel) != 0)
+    {
+        return -1;
+    }
+    retVal = aesd_channel_rewind(channel);
+    if (retVal == 0)
+    {
+        retVal = aesd_channel_send_until(channel, socket_data->connectedSock,
+                                         socket_data->binaryFraming, &socket_data->zerocopy,
+                                         leaderSize);
+    }
+    aesd_channel_unlock(channel);
+    return retVal;
+}
+
+/**
+ * @brief Answer the pending burst, with an acknowledgement or echo-back
+ */
+static int sendEcho(socket_data_t *socket_data)
+{
+    aesd_channel_t *channel = socket_data->channel;
+    uint64_t packetCount;
+    uint64_t size;
+    char ack[64];
+    int ackLen;
+    int retVal;
+
+    if (socket_data->forwarded)
+    {
+        return flushForwarded(socket_data);
+    }
+
+    if (socket_data->ackLength)
+    {
+        // Taken before the lock goes, so nothing appended since counts
+        if (aesd_channel_extent(channel, &packetCount, &size) != 0)
+        {
+            size = 0;
+        }
+        ackLen = snprintf(ack, sizeof(ack), "%s:%u,%llu\n", ACK_REPLY_STR,
+                          socket_data->burstPackets, (unsigned long long)size);
+        socket_data->burstPackets = 0;
+        socket_data->echoPending = false;
+        aesd_channel_unlock(channel);
+        return sendReply(socket_data, ack, ackLen);
+    }
+
+    if (socket_data->ackEcho)
+    {
+        // Nothing is read back, so the lock can go before replying
+        ackLen = snprintf(ack, sizeof(ack), "%s:%u\n", ACK_REPLY_STR, socket_data->burstPackets);
+        socket_data->burstPackets = 0;
+        socket_data->echoPending = false;
+        aesd_channel_unlock(channel);
+        return sendReply(socket_data, ack, ackLen);
+    }
+    socket_data->burstPackets = 0;
+
+    // Output contents of the channel to the peer
+    retVal = aesd_channel_rewind(channel);
+    if (retVal == 0)
+    {
+        retVal = aesd_channel_send_contents(channel, socket_data->connectedSock,
+                                           socket_data->binaryFraming, &socket_data->zerocopy);
+    }
+
+    socket_data->echoPending = false;
+    aesd_channel_unlock(channel);
+    return retVal;
+}
+
+int flushEcho(socket_data_t *socket_data)
+{
+    uint32_t packets = socket_data->burstPackets;
+    bool acked = socket_data->ackEcho || socket_data->ackLength;
+    int retVal = sendEcho(socket_data);
+
+    aesd_trace_end(acked ? "ack" : "echo", socket_data->channel->name, packets);
+    return retVal;
+}
+
+/**
+ * @brief Parse count comma-separated unsigned 32-bit values from str
+ *
+ * @return Pointer just past the last value, or NULL if malformed
+ */
+static const char *parseUint32List(const char *str, uint32_t *values, int count)
+{
+    unsigned long value;
+    char *endPtr;
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        if (i > 0)
+        {
+            if (*str != ',')
+            {
+                return NULL;
+            }
+            str++;
+        }
+
+        // strtoul() would quietly accept leading whitespace and a sign
+        if (*str < '0' || *str > '9')
+        {
+            return NULL;
+        }
+
+        errno = 0;
+        value = strtoul(str, &endPtr, 10);
+        if (errno != 0 || value > UINT32_MAX)
+        {
+            return NULL;
+        }
+
+        values[i] = value;
+        str = endPtr;
+    }
+
+    return str;
+}
+
+static int sendAll(int sockfd, const void *buf, size_t len, int flags)
+{
+    const char *bufp = buf;
+    ssize_t sendRet;
+
+    while (len > 0)
+    {
+        sendRet = send(sockfd, bufp, len, flags | MSG_NOSIGNAL);
+        if (sendRet < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("send() error in replying to peer");
+            return -1;
+        }
+        bufp += sendRet;
+        len -= sendRet;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Send a complete reply, as a single frame and an empty one when the
+ *  connection uses binary framing
+ */
+static int sendReply(socket_data_t *socket_data, const char *reply, size_t replyLen)
+{
+    uint32_t frameHeader = htonl(replyLen);
+    const uint32_t frameEnd = 0;
+    uint64_t sendStart = aesd_trace_clock();
+    int retVal;
+
+    if (!socket_data->binaryFraming)
+    {
+        retVal = sendAll(socket_data->connectedSock, reply, replyLen, 0);
+    }
+    // MSG_MORE keeps the three pieces in as few segments as possible
+    else if (sendAll(socket_data->connectedSock, &frameHeader, sizeof(frameHeader),
+                     MSG_MORE) != 0 ||
+             sendAll(socket_data->connectedSock, reply, replyLen, MSG_MORE) != 0)
+    {
+        retVal = -1;
+    }
+    else
+    {
+        retVal = sendAll(socket_data->connectedSock, &frameEnd, sizeof(frameEnd), 0);
+    }
+
+    aesd_trace_charge(TRACE_SEND, sendStart);
+    return retVal;
+}
+
+static int sendErrorReply(socket_data_t *socket_data, const char *reason)
+{
+    char reply[64];
+    int replyLen = snprintf(reply, sizeof(reply), "%s:%s\n", ERROR_REPLY_STR, reason);
+
+    return sendReply(socket_data, reply, replyLen);
+}
+
+int handleSeekCommand(socket_data_t *socket_data, const char *args)
+{
+    aesd_channel_t *channel = socket_data->channel;
+    uint32_t seekArgs[2];
+    const char *argsEnd = parseUint32List(args, seekArgs, 2);
+    int retVal = 0;
+
+    // Answered with an error rather than silence, so a pipelining peer
+    // always gets one reply per seek
+    if (argsEnd == NULL || *argsEnd != '\0')
+    {
+        syslog(LOG_ERR, "Malformed seek command arguments: %s", args);
+        return sendErrorReply(socket_data, "EINVAL");
+    }
+
+    syslog(LOG_INFO, "Seek to %u,%u on channel %s", seekArgs[0], seekArgs[1],
+           channel->name);
+
+    // The lock is held across the seek and the read back so that the
+    // position cannot be moved by another connection in between
+    if (aesd_channel_lock(channel) != 0)
+    {
+        return -1;
+    }
+
+    if (aesd_channel_seek(channel, seekArgs[0], seekArgs[1]) == 0)
+    {
+        retVal = aesd_channel_send_contents(channel, socket_data->connectedSock,
+                                           socket_data->binaryFraming, &socket_data->zerocopy);
+    }
+    else
+    {
+        syslog(LOG_ERR, "Seek to %u,%u out of range", seekArgs[0], seekArgs[1]);
+        retVal = 1;
+    }
+
+    aesd_channel_unlock(channel);
+    return retVal == 1 ? sendErrorReply(socket_data, "EINVAL") : retVal;
+}
+
+/**
+ * @brief Read every range into one reply and send it
+ *
+ * @param framed Precede each range with its length and a newline
+ */
+static int sendRanges(socket_data_t *socket_data, const uint32_t (*ranges)[3],
+                      int rangeCount, bool framed)
+{
+    aesd_channel_t *channel = socket_data->channel;
+    char *reply;
+    size_t replySize = 0;
+    size_t replyLen = 0;
+    ssize_t readRet;
+    int headerLen;
+    int retVal = 0;
+    int i;
+
+    for (i = 0; i < rangeCount; i++)
+    {
+        replySize += ranges[i][2] + (framed ? RANGE_HEADER_MAX : 0);
+    }
+
+    if (replySize > RANGE_REPLY_MAX)
+    {
+        return sendErrorReply(socket_data, "E2BIG");
+    }
+    replySize = replySize ? replySize : 1;
+
+    if (chargeOrWait(socket_data, MEM_RESPONSE, replySize) != 0)
+    {
+        return errno == ENOMEM ? sendErrorReply(socket_data, "ENOMEM") : -1;
+    }
+
+    reply = malloc(replySize);
+    if (reply == NULL)
+    {
+        releaseMemory(socket_data, MEM_RESPONSE, replySize);
+        return sendErrorReply(socket_data, "ENOMEM");
+    }
+
+    if (aesd_channel_lock(channel) != 0)
+    {
+        free(reply);
+        releaseMemory(socket_data, MEM_RESPONSE, replySize);
+        return -1;
+    }
+
+    for (i = 0; i < rangeCount; i++)
+    {
+        if (aesd_channel_seek(channel, ranges[i][0], ranges[i][1]) != 0)
+        {
+            aesd_channel_unlock(channel);
+            free(reply);
+            releaseMemory(socket_data, MEM_RESPONSE, replySize);
+            return sendErrorReply(socket_data, "EINVAL");
+        }
+
+        // Leave room for the length header, filled in once it is known
+        headerLen = framed ? RANGE_HEADER_MAX : 0;
+
+        readRet = aesd_channel_read(channel, reply + replyLen + headerLen, ranges[i][2]);
+        if (readRet < 0)
+        {
+            retVal = -1;
+            break;
+        }
+
+        if (framed)
+        {
+            headerLen = snprintf(reply + replyLen, RANGE_HEADER_MAX, "%zd\n", readRet);
+            memmove(reply + replyLen + headerLen, reply + replyLen + RANGE_HEADER_MAX, readRet);
+        }
+        replyLen += headerLen + readRet;
+    }
+
+    aesd_channel_unlock(channel);
+
+    if (retVal == 0)
+    {
+        retVal = sendReply(socket_data, reply, replyLen);
+    }
+
+    free(reply);
+    releaseMemory(socket_data, MEM_RESPONSE, replySize);
+    return retVal;
+}
+
+int handleReadCommand(socket_data_t *socket_data, const char *args)
+{
+    uint32_t range[1][3];
+    const char *argsEnd = parseUint32List(args, range[0], 3);
+
+    if (argsEnd == NULL || *argsEnd != '\0')
+    {
+        syslog(LOG_ERR, "Malformed read command arguments: %s", args);
+        return sendErrorReply(socket_data, "EINVAL");
+    }
+
+    return sendRanges(socket_data, (const uint32_t (*)[3])range, 1, false);
+}
+
+int handleReadvCommand(socket_data_t *socket_data, const char *args)
+{
+    uint32_t ranges[READV_MAX_RANGES][3];
+    const char *argsPos = args;
+    int rangeCount = 0;
+
+    while (true)
+    {
+        if (rangeCount == READV_MAX_RANGES)
+        {
+            return sendErrorReply(socket_data, "E2BIG");
+        }
+
+        argsPos = parseUint32List(argsPos, ranges[rangeCount], 3);
+        if (argsPos == NULL || (*argsPos != ';' && *argsPos != '\0'))
+        {
+            syslog(LOG_ERR, "Malformed readv command arguments: %s", args);
+            return sendErrorReply(socket_data, "EINVAL");
+        }
+        rangeCount++;
+
+        if (*argsPos == '\0')
+        {
+            break;
+        }
+        argsPos++;
+    }
+
+    return sendRanges(socket_data, (const uint32_t (*)[3])ranges, rangeCount, true);
+}
+
+/**
+ * @brief Reply with either the packet count or the byte size of the channel
+ */
+static int sendExtent(socket_data_t *socket_data, bool wantSize)
+{
+    aesd_channel_t *channel = socket_data->channel;
+    uint64_t packetCount;
+    uint64_t size;
+    char reply[32];
+    int replyLen;
+    int retVal;
+
+    if (aesd_channel_lock(channel) != 0)
+    {
+        return -1;
+    }
+    retVal = aesd_channel_extent(channel, &packetCount, &size);
+    aesd_channel_unlock(channel);
+
+    if (retVal != 0)
+    {
+        return sendErrorReply(socket_data, "EIO");
+    }
+
+    replyLen = snprintf(reply, sizeof(reply), "%llu\n",
+                        (unsigned long long)(wantSize ? size : packetCount));
+    return sendReply(socket_data, reply, replyLen);
+}
+
+int handleCountCommand(socket_data_t *socket_data, const char *args)
+{
+    return sendExtent(socket_data, false);
+}
+
+int handleSizeCommand(socket_data_t *socket_data, const char *args)
+{
+    return sendExtent(socket_data, true);
+}
+
+int handleStatsCommand(socket_data_t *socket_data, const char *args)
+{
+    char reply[2048];
+
+    return sendReply(socket_data, reply, aesd_stats_format(reply, sizeof(reply)));
+}
+
+/**
+ * @brief Send a one line reply with a descriptor attached
+ *
+ * @return int
+ * @retval -1 Error, the connection should be closed
+ * @retval  0 Success
+ */
+static int sendFdReply(socket_data_t *socket_data, int fd, const char *reply, size_t replyLen)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    ssize_t sendRet;
+
+    memset(control, 0, sizeof(control));
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = (void *)reply;
+    iov.iov_len = replyLen;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    while ((sendRet = sendmsg(socket_data->connectedSock, &msg, MSG_NOSIGNAL)) < 0)
+    {
+        if (errno != EINTR)
+        {
+            perror("sendmsg() error handing out descriptor");
+            return -1;
+        }
+    }
+
+    // The descriptor went with the first byte, the rest can follow plainly
+    if ((size_t)sendRet < replyLen &&
+        sendAll(socket_data->connectedSock, reply + sendRet, replyLen - sendRet, 0) != 0)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+int handleShmRingCommand(socket_data_t *socket_data, const char *args)
+{
+    aesd_ring_t *ring = aesd_ingest_ring();
+    char reply[64];
+    int replyLen;
+
+    // Descriptors only travel over unix domain sockets, and a binary peer
+    // would not expect one alongside its frame
+    if (ring == NULL || socket_data->peeraddr.ss_family != AF_UNIX ||
+        socket_data->binaryFraming)
+    {
+        return sendErrorReply(socket_data, "ENOTSUP");
+    }
+
+    replyLen = snprintf(reply, sizeof(reply), "%s:%llu\n", SHMRING_CMD_STR,
+                        (unsigned long long)ring->header->dataSize);
+    if (sendFdReply(socket_data, ring->fd, reply, replyLen) != 0)
+    {
+        return -1;
+    }
+
+    syslog(LOG_INFO, "Handed shared-memory ring to a local producer");
+    return 0;
+}
+
+int handleSnapshotCommand(socket_data_t *socket_data, const char *args)
+{
+    aesd_channel_t *channel = socket_data->channel;
+    uint64_t generation;
+    uint64_t size;
+    char reply[80];
+    int replyLen;
+    int snapshotFd;
+    int retVal;
+
+    if (socket_data->peeraddr.ss_family != AF_UNIX || socket_data->binaryFraming)
+    {
+        return sendErrorReply(socket_data, "ENOTSUP");
+    }
+
+    if (aesd_channel_lock(channel) != 0)
+    {
+        return -1;
+    }
+    // An append may replace the channel's snapshot as soon as the lock is
+    // dropped, so send a descriptor of our own
+    snapshotFd = aesd_channel_snapshot(channel, &generation, &size);
+    if (snapshotFd != -1)
+    {
+        snapshotFd = fcntl(snapshotFd, F_DUPFD_CLOEXEC, 0);
+    }
+    aesd_channel_unlock(channel);
+
+    if (snapshotFd == -1)
+    {
+        return sendErrorReply(socket_data, errno == ENOMEM ? "ENOMEM" : "EIO");
+    }
+
+    replyLen = snprintf(reply, sizeof(reply), "%s:%llu,%llu\n", SNAPSHOT_CMD_STR,
+                        (unsigned long long)generation, (unsigned long long)size);
+    retVal = sendFdReply(socket_data, snapshotFd, reply, replyLen);
+    close(snapshotFd);
+    return retVal;
+}
+
+int handleThreadsCommand(socket_data_t *socket_data, const char *args)
+{
+    char *reply;
+    size_t replyLen;
+    int retVal;
+
+    if (chargeOrWait(socket_data, MEM_RESPONSE, THREADS_REPLY_MAX) != 0)
+    {
+        return errno == ENOMEM ? sendErrorReply(socket_data, "ENOMEM") : -1;
+    }
+
+    reply = malloc(THREADS_REPLY_MAX);
+    if (reply == NULL)
+    {
+        releaseMemory(socket_data, MEM_RESPONSE, THREADS_REPLY_MAX);
+        return sendErrorReply(socket_data, "ENOMEM");
+    }
+
+    replyLen = aesd_placement_format(reply, THREADS_REPLY_MAX);
+    replyLen += aesd_connection_format_threads(reply + replyLen, THREADS_REPLY_MAX - replyLen);
+    retVal = sendReply(socket_data, reply, replyLen);
+
+    free(reply);
+    releaseMemory(socket_data, MEM_RESPONSE, THREADS_REPLY_MAX);
+    return retVal;
+}
+
+int handleTraceCommand(socket_data_t *socket_data, const char *args)
+{
+    char *reply;
+    size_t replyLen;
+    int retVal;
+
+    if (chargeOrWait(socket_data, MEM_RESPONSE, TRACE_REPLY_MAX) != 0)
+    {
+        return errno == ENOMEM ? sendErrorReply(socket_data, "ENOMEM") : -1;
+    }
+
+    reply = malloc(TRACE_REPLY_MAX);
+    if (reply == NULL)
+    {
+        releaseMemory(socket_data, MEM_RESPONSE, TRACE_REPLY_MAX);
+        return sendErrorReply(socket_data, "ENOMEM");
+    }
+
+    replyLen = aesd_trace_format(reply, TRACE_REPLY_MAX);
+    retVal = sendReply(socket_data, reply, replyLen);
+
+    free(reply);
+    releaseMemory(socket_data, MEM_RESPONSE, TRACE_REPLY_MAX);
+    return retVal;
+}
+
+int handleChannelCommand(socket_data_t *socket_data, const char *args)
+{
+    aesd_channel_t *channel = aesd_channel_get(args);
+
+    // A bad name is the peer's mistake, a channel that cannot be opened the
+    // server's. Either way the connection stays where it was.
+    if (channel == NULL)
+    {
+        syslog(LOG_ERR, "Cannot select channel \"%s\", staying on %s", args,
+               socket_data->channel->name);
+        return sendErrorReply(socket_data, aesd_channel_name_valid(args) ? "EIO" : "EINVAL");
+    }
+
+    // A follower copies a channel from its first use, and forwards its
+    // appends over a connection bound to it
+    if (aesd_replica_track(channel) != 0)
+    {
+        syslog(LOG_ERR, "Cannot replicate channel %s", channel->name);
+    }
+    closeUpstream(socket_data);
+
+    syslog(LOG_INFO, "Connection bound to channel %s", channel->name);
+    socket_data->channel = channel;
+    return 0;
+}
+
+int handleReplicateCommand(socket_data_t *socket_data, const char *args)
+{
+    const char *comma = strrchr(args, ',');
+    char name[CHANNEL_NAME_MAX + 1];
+    aesd_channel_t *channel;
+    unsigned long long offset;
+    uint64_t length;
+    char *endPtr;
+
+    // Frames are sent raw, a binary peer would take them for records
+    if (socket_data->binaryFraming)
+    {
+        return sendErrorReply(socket_data, "ENOTSUP");
+    }
+
+    errno = 0;
+    offset = comma != NULL ? strtoull(comma + 1, &endPtr, 10) : 0;
+    if (comma == NULL || (size_t)(comma - args) > CHANNEL_NAME_MAX || errno != 0 ||
+        endPtr == comma + 1 || *endPtr != '\0')
+    {
+        syslog(LOG_ERR, "Malformed replicate command arguments: %s", args);
+        return sendErrorReply(socket_data, "EINVAL");
+    }
+    memcpy(name, args, comma - args);
+    name[comma - args] = '\0';
+
+    channel = aesd_channel_get(name);
+    if (channel == NULL || channel->charDevice)
+    {
+        syslog(LOG_ERR, "Cannot replicate channel \"%s\"", name);
+        return sendErrorReply(socket_data, "EINVAL");
+    }
+
+    if (aesd_channel_lock(channel) != 0)
+    {
+        return -1;
+    }
+    length = channel->dataLength;
+    aesd_channel_unlock(channel);
+
+    // A longer copy has diverged, and nothing sent would fix it
+    if (offset > length)
+    {
+        syslog(LOG_ERR, "Follower of %s has %llu bytes, more than the %llu here",
+               channel->name, offset, (unsigned long long)length);
+        return sendErrorReply(socket_data, "ERANGE");
+    }
+
+    // Heartbeats keep the stream busy, and reports of earlier zero-copy
+    // sends would look like an error on the socket
+    aesd_timer_cancel(&socket_data->timer);
+    aesd_zerocopy_close(&socket_data->zerocopy);
+
+    syslog(LOG_INFO, "Replicating channel %s from %llu", channel->name, offset);
+    aesd_trace_abandon();
+    return aesd_replica_serve(channel, socket_data->connectedSock, offset);
+}
+
+int handleFollowerCommand(socket_data_t *socket_data, const char *args)
+{
+    if (!aesd_replica_is_follower_token(args))
+    {
+        syslog(LOG_WARNING, "Connection presented an unknown follower token");
+        return 0;
+    }
+
+    syslog(LOG_INFO, "Connection forwards for a follower");
+    socket_data->fromFollower = true;
+    return 0;
+}
+
+int handleReplicationCommand(socket_data_t *socket_data, const char *args)
+{
+    char reply[4096];
+
+    return sendReply(socket_data, reply, aesd_replica_format(reply, sizeof(reply)));
+}
+
+/**
+ * @brief Run AESDCHAR_SUBSCRIBE[:lag[,skip]], turning the connection into a
+ *  push-only follower of its channel for the rest of its life
+ *
+ * Malformed arguments are answered AESDCHAR_ERROR:EINVAL and leave the
+ * connection as it was.
+ *
+ * @param socket_data Connection the command arrived on
+ * @param args NULL-terminated text following the command string, empty for
+ *  the defaults
+ * @return int
+ * @retval -1 The connection is finished once it stops following
+ * @retval  0 Subscription refused with an error reply
+ */
+static int handleSubscribeCommand(socket_data_t *socket_data, const char *args)
+{
+    unsigned long maxLag = SUBSCRIBER_MAX_LAG;
+    subscriber_lag_policy_t lagPolicy = LAG_DISCONNECT;
+    char *endPtr;
+
+    // Pushed packets are not framed, so a binary peer could not split them
+    if (socket_data->binaryFraming)
+    {
+        return sendErrorReply(socket_data, "ENOTSUP");
+    }
+
+    if (args[0] != '\0')
+    {
+        errno = 0;
+        maxLag = strtoul(args, &endPtr, 10);
+        if (errno != 0 || endPtr == args || maxLag == 0 || maxLag > SUBSCRIBER_RING_SIZE ||
+            (*endPtr != '\0' && strcmp(endPtr, ",skip") != 0))
+        {
+            syslog(LOG_ERR, "Malformed subscribe command arguments: %s", args);
+            return sendErrorReply(socket_data, "EINVAL");
+        }
+
+        if (*endPtr != '\0')
+        {
+            lagPolicy = LAG_SKIP_FORWARD;
+        }
+    }
+
+    // A subscriber only ever listens, it is not idle for not sending
+    aesd_timer_cancel(&socket_data->timer);
+
+    // Reports of earlier zero-copy sends would look like an error on the
+    // socket to the follower, wait for them now
+    aesd_zerocopy_close(&socket_data->zerocopy);
+
+    syslog(LOG_INFO, "Connection subscribed to channel %s, max lag %lu%s",
+           socket_data->channel->name, maxLag,
+           lagPolicy == LAG_SKIP_FORWARD ? " (skip)" : "");
+
+    aesd_trace_abandon();
+    aesd_channel_follow(socket_data->channel, socket_data->connectedSock,
+                        maxLag, lagPolicy);
+    return -1;
+}
+
+int handleBinaryCommand(socket_data_t *socket_data, const char *args)
+{
+    if (socket_data->binaryFraming)
+    {
+        return sendErrorReply(socket_data, "EINVAL");
+    }
+
+    // Acknowledged in text, everything after it is length-prefixed
+    if (sendReply(socket_data, BINARY_ACK_STR, strlen(BINARY_ACK_STR)) != 0)
+    {
+        return -1;
+    }
+
+    syslog(LOG_INFO, "Connection switched to binary framing");
+    socket_data->binaryFraming = true;
+    return 0;
+}
+
+int handleEchoModeCommand(socket_data_t *socket_data, const char *args)
+{
+    if (strcmp(args, "line") == 0)
+    {
+        socket_data->perLineEcho = true;
+        socket_data->ackEcho = false;
+        socket_data->ackLength = false;
+    }
+    else if (strcmp(args, "burst") == 0)
+    {
+        socket_data->perLineEcho = false;
+        socket_data->ackEcho = false;
+        socket_data->ackLength = false;
+    }
+    else if (strcmp(args, "ack") == 0)
+    {
+        socket_data->perLineEcho = false;
+        socket_data->ackEcho = true;
+        socket_data->ackLength = false;
+    }
+    else if (strcmp(args, "length") == 0)
+    {
+        socket_data->perLineEcho = false;
+        socket_data->ackEcho = true;
+        socket_data->ackLength = true;
+    }
+    else
+    {
+        syslog(LOG_ERR, "Unknown echo mode \"%s\"", args);
+        return sendErrorReply(socket_data, "EINVAL");
+    }
+
+    syslog(LOG_INFO, "Echo-back per %s", args);
+    return 0;
+}
@@ -0,0 +1,457 @@
+/**
+ * @file aesd-connection.h
+ * @brief The aesdsocket protocol spoken with one connected peer: packet and
+ *  record framing, commands and echo-backs
+ *
+ * Every connection is served on a thread of its own, started by
+ * aesd_connection_start() and joined again by aesd_connection_reap() once
+ * its peer has gone.
+ */
+
+#pragma once
+
+#include "./queue.h"
+#include "./aesd-channel.h"
+#include "./aesd-client.h"
+#include "./aesd-placement.h"
+#include "./aesd-replica.h"
+#include "./aesd-timer-wheel.h"
+#include "./aesd-trace.h"
+#include "./libaesdsocket.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+// Receive buffer size unless aesd_connection_limits() sets another, and
+// the size packet buffers start at
+#define BUFF_SIZE   4096
+
+// Ranges are cut short at the end of the log, and a batch may ask for at
+// most RANGE_REPLY_MAX bytes in total
+#define READV_MAX_RANGES    64
+#define RANGE_REPLY_MAX     (1024 * 1024)
+// Room for a range's length header, "4294967295\n"
+#define RANGE_HEADER_MAX    12
+
+// Packets a subscriber may fall behind before it is disconnected (or, if
+// it asked for skip, moved forward to the newest packet)
+#define SUBSCRIBER_MAX_LAG 256
+
+// Longest command line (including arguments) that will be parsed
+#define CMD_MAX_LEN 1024
+
+// Largest AESDCHAR_THREADS reply, threads past it are left out
+#define THREADS_REPLY_MAX   (64 * 1024)
+// Largest AESDCHAR_TRACE reply, the whole ring
+#define TRACE_REPLY_MAX     (TRACE_RING_SIZE * TRACE_LINE_MAX)
+
+// How often a connection waiting for memory looks again, and how long it
+// waits before giving up. Connections that all hold half a packet and need
+// more to finish it would otherwise wait on each other until they time
+// out.
+#define MEMORY_RETRY_MS     10
+#define MEMORY_WAIT_MAX_MS  1000
+
+// A binary record is a big-endian uint32_t length and that many bytes. With
+// RECORD_COMMAND_FLAG set in the length the bytes are a command, without its
+// newline. Replies come back as frames of the same shape, ended by an empty
+// one.
+#define RECORD_HEADER_LEN   4
+#define RECORD_COMMAND_FLAG 0x80000000u
+#define RECORD_MAX_LEN      (64 * 1024 * 1024)
+
+// A connection is closed once it has received nothing for the idle timeout,
+// or has spent the read timeout on a packet it has not completed. These
+// are the defaults, aesd_connection_limits() can set others.
+#ifndef CONNECTION_IDLE_TIMEOUT_SEC
+#define CONNECTION_IDLE_TIMEOUT_SEC 300
+#endif
+#ifndef CONNECTION_READ_TIMEOUT_SEC
+#define CONNECTION_READ_TIMEOUT_SEC 30
+#endif
+
+typedef struct socket_data_s socket_data_t;
+
+struct socket_data_s{
+    pthread_t threadHandle;
+    int connectedSock;
+    struct sockaddr_storage peeraddr;
+    bool threadCompleteFlag;
+    // Log this connection appends to and reads back from
+    aesd_channel_t *channel;
+    // What recv() reads into, sized when the connection starts
+    char *recvBuff;
+    size_t recvBuffSize;
+    // Bytes of a packet whose newline has not been received yet
+    char *packetBuff;
+    size_t packetLen;
+    size_t packetCapacity;
+    // Set while the channel lock is held for packets not yet echoed back
+    bool echoPending;
+    // On a follower, set instead while packets forwarded to the leader
+    // are owed an echo-back, with the channel lock not held
+    bool forwarded;
+    // Connection to the leader that packets are forwarded over, opened on
+    // the first one and bound to the connection's channel
+    aesd_client_conn_t *upstream;
+    aesd_client_config_t upstreamConfig;
+    char upstreamToken[REPLICA_TOKEN_LEN + 1];
+    // Echo back after every packet rather than once per burst
+    bool perLineEcho;
+    // Acknowledge each burst with a packet count rather than echoing back
+    bool ackEcho;
+    // Follow the count with the log length the burst left behind
+    bool ackLength;
+    // Set once the peer presented a token the leader issued for a
+    // replication stream, so the connection forwards a follower's packets
+    bool fromFollower;
+    // Packets appended since the last echo-back or acknowledgement
+    uint32_t burstPackets;
+    // Length-prefixed records rather than newline-terminated packets
+    bool binaryFraming;
+    // Length prefix of the record being received, and how much of it has
+    // arrived. The record itself accumulates in packetBuff.
+    uint8_t recordHeader[RECORD_HEADER_LEN];
+    size_t recordHeaderLen;
+    uint32_t recordLen;
+    // Idle and read timeouts, checked against the two times below when it
+    // expires so that receiving never has to touch the timer wheel
+    aesd_timer_t timer;
+    // Wheel clock time anything was last received
+    atomic_uint_fast64_t lastActivityMs;
+    // Wheel clock time the packet or record in progress started, 0 if none
+    atomic_uint_fast64_t partialSinceMs;
+    // Busy-poll slot the connection spins in, -1 if it blocks as usual
+    int busyPollSlot;
+    // Where the connection thread runs, filled in once it starts
+    aesd_thread_place_t place;
+    // Node the thread is confined to, -1 if it may run anywhere
+    int node;
+    // Bytes charged to the memory budget on the connection's behalf, only
+    // touched by its own thread
+    size_t memHeld;
+    // Large echo-backs sent zero-copy and waiting to be reported
+    aesd_zerocopy_t zerocopy;
+    // What its traffic is recorded under, 0 if it is not
+    uint64_t captureId;
+    SLIST_ENTRY(socket_data_s) entries;
+};
+
+/**
+ * @brief Set the timeouts, receive buffer size and lock deadline, at any
+ *  time
+ *
+ * Timeouts apply to every connection from its next timeout check, the
+ * receive buffer size to connections started afterwards and the lock
+ * deadline to the next burst of every connection.
+ *
+ * @param idleSec Idle timeout, 0 for CONNECTION_IDLE_TIMEOUT_SEC
+ * @param readSec Read timeout, 0 for CONNECTION_READ_TIMEOUT_SEC
+ * @param recvSize Receive buffer size, 0 for BUFF_SIZE
+ * @param lockMs Longest the first packet of a burst waits for the channel
+ *  lock before it is answered EBUSY, 0 to wait as long as it takes
+ */
+void aesd_connection_limits(uint32_t idleSec, uint32_t readSec, size_t recvSize,
+                            uint32_t lockMs);
+
+/**
+ * @brief Have connections spin on non-blocking receives before parking in
+ *  a blocking one. Call before the first connection starts.
+ *
+ * Each core given is a slot one connection at a time spins in, pinned to
+ * that core. Connections arriving while every slot is taken block as
+ * usual, so spinning never takes more cores than it was given.
+ *
+ * @param spinUs How long to spin, also set as SO_BUSY_POLL on spinning
+ *  sockets. 0 turns busy polling off.
+ * @param cpus Cores to spin on, or NULL for one unpinned slot per online
+ *  core
+ * @param cpuCount Number of cores in cpus, at most AESDSOCKET_BUSY_POLL_MAX_CPUS
+ * @return int
+ * @retval -1 Error, errno EINVAL for too many cores
+ * @retval  0 Success
+ */
+int aesd_connection_busy_poll(uint32_t spinUs, const int *cpus, size_t cpuCount);
+
+/**
+ * @brief Serve a connected peer on a thread of its own, bound to the
+ *  default channel until it selects another
+ *
+ * @param connectedSock Connected stream socket, owned by the connection
+ *  from now on whether or not this succeeds
+ * @param peeraddr Address of the peer, AF_UNIX for a local socket
+ * @return int
+ * @retval -1 Error
+ * @retval  0 Success
+ */
+int aesd_connection_start(int connectedSock, const struct sockaddr_storage *peeraddr);
+
+/**
+ * @brief Join the threads of connections whose peers have gone
+ */
+void aesd_connection_reap(void);
+
+/**
+ * @brief Shut down the socket of every connection, then wait for each to
+ *  finish and join its thread
+ *
+ * Connections started meanwhile are waited for but not shut down.
+ */
+void aesd_connection_wait_all(void);
+
+/**
+ * @brief Write a placement line for every running connection thread, as
+ *  aesd_placement_format_thread() does
+ *
+ * @return size_t Number of bytes written, truncated to fit
+ */
+size_t aesd_connection_format_threads(char *buf, size_t len);
+
+void* recvAndSendAndLog(void* socket_data_arg);
+
+/**
+ * @brief Act on one complete, newline-terminated packet from a peer: run it
+ *  if it is a command, otherwise append it to the connection's channel with
+ *  an echo-back of the channel contents to follow
+ *
+ * @param socket_data Connection the packet arrived on
+ * @param packet Packet contents, including the trailing newline
+ * @param packetLen Number of bytes in packet
+ * @return int
+ * @retval -1 Error, the connection should be closed
+ * @retval  0 Success
+ */
+int handlePacket(socket_data_t *socket_data, const char *packet, size_t packetLen);
+
+/**
+ * @brief Act on one complete binary record held in the packet buffer: run
+ *  it if it is flagged as a command, otherwise append it to the
+ *  connection's channel as a packet
+ *
+ * A newline is added to records that do not end with one, so they are
+ *  stored as exactly one packet.
+ *
+ * @param socket_data Connection the record arrived on
+ * @return int
+ * @retval -1 Error, the connection should be closed
+ * @retval  0 Success
+ */
+int handleRecord(socket_data_t *socket_data);
+
+/**
+ * @brief Send the channel contents to the peer, or just how many packets
+ *  were appended in ack mode, for the packets appended since the last
+ *  echo-back and release the channel lock
+ *
+ * @param socket_data Connection with an echo-back pending
+ * @return int
+ * @retval -1 Error, the connection should be closed
+ * @retval  0 Success
+ */
+int flushEcho(socket_data_t *socket_data);
+
+/**
+ * @brief Run AESDCHAR_IOCSEEKTO:X,Y, returning the channel contents from
+ *  byte Y of packet X onwards, or an error reply if X,Y is out of range
+ *
+ * @param socket_data Connection the command arrived on
+ * @param args NULL-terminated text following the command string
+ * @return int
+ * @retval -1 Error, the connection should be closed
+ * @retval  0 Success
+ */
+int handleSeekCommand(socket_data_t *socket_data, const char *args);
+
+/**
+ * @brief Run AESDCHAR_CHANNEL:name, binding the connection to the named
+ *  channel for all later packets and commands
+ *
+ * Nothing is sent back on success. A name that is not valid is answered
+ * AESDCHAR_ERROR:EINVAL, and a channel that cannot be opened
+ * AESDCHAR_ERROR:EIO, leaving the connection on its channel.
+ *
+ * @param socket_data Connection the command arrived on
+ * @param args NULL-terminated channel name
+ * @return int
+ * @retval -1 Error, the connection should be closed
+ * @retval  0 Success
+ */
+int handleChannelCommand(socket_data_t *socket_data, const char *args);
+
+/**
+ * @brief Run AESDCHAR_ECHOMODE:line|burst|ack|length, choosing whether the
+ *  connection gets an echo-back after every packet, once per burst, or only
+ *  a count of the packets appended once per burst, with the length of the
+ *  log after it for length
+ *
+ * Nothing is sent back on success. A mode that is none of these is
+ * answered AESDCHAR_ERROR:EINVAL, leaving the connection in its mode.
+ *
+ * @param socket_data Connection the command arrived on
+ * @param args NULL-terminated mode name
+ * @return int
+ * @retval -1 Error, the connection should be closed
+ * @retval  0 Success
+ */
+int handleEchoModeCommand(socket_data_t *socket_data, const char *args);
+
+/**
+ * @brief Run AESDCHAR_READ:X,Y,N, returning at most N bytes from byte Y of
+ *  packet X without streaming the rest of the log
+ *
+ * @param socket_data Connection the command arrived on
+ * @param args NULL-terminated text following the command string
+ * @return int
+ * @retval -1 Error, the connection should be closed
+ * @retval  0 Success
+ */
+int handleReadCommand(socket_data_t *socket_data, const char *args);
+
+/**
+ * @brief Run AESDCHAR_READV, answering a batch of AESDCHAR_READ ranges in a
+ *  single reply with each range framed by its length
+ *
+ * @param socket_data Connection the command arrived on
+ * @param args NULL-terminated, ';' separated X,Y,N ranges
+ * @return int
+ * @retval -1 Error, the connection should be closed
+ * @retval  0 Success
+ */
+int handleReadvCommand(socket_data_t *socket_data, const char *args);
+
+/**
+ * @brief Run AESDCHAR_COUNT, replying with the number of complete packets in
+ *  the channel
+ *
+ * @param socket_data Connection the command arrived on
+ * @param args Ignored
+ * @return int
+ * @retval -1 Error, the connection should be closed
+ * @retval  0 Success
+ */
+int handleCountCommand(socket_data_t *socket_data, const char *args);
+
+/**
+ * @brief Run AESDCHAR_SIZE, replying with the number of bytes in the channel
+ *
+ * @param socket_data Connection the command arrived on
+ * @param args Ignored
+ * @return int
+ * @retval -1 Error, the connection should be closed
+ * @retval  0 Success
+ */
+int handleSizeCommand(socket_data_t *socket_data, const char *args);
+
+/**
+ * @brief Run AESDCHAR_BINARY, switching the connection from newline-
+ *  terminated packets to length-prefixed records
+ *
+ * @param socket_data Connection the command arrived on
+ * @param args Ignored
+ * @return int
+ * @retval -1 Error, the connection should be closed
+ * @retval  0 Success
+ */
+int handleBinaryCommand(socket_data_t *socket_data, const char *args);
+
+/**
+ * @brief Run AESDCHAR_STATS, replying with the server's counters
+ *
+ * @param socket_data Connection the command arrived on
+ * @param args Ignored
+ * @return int
+ * @retval -1 Error, the connection should be closed
+ * @retval  0 Success
+ */
+int handleStatsCommand(socket_data_t *socket_data, const char *args);
+
+/**
+ * @brief Run AESDCHAR_SHMRING, handing the shared-memory ingest ring to a
+ *  local producer
+ *
+ * @param socket_data Connection the command arrived on, which must be a
+ *  unix domain socket in text mode
+ * @param args Ignored
+ * @return int
+ * @retval -1 Error, the connection should be closed
+ * @retval  0 Success
+ */
+int handleShmRingCommand(socket_data_t *socket_data, const char *args);
+
+/**
+ * @brief Run AESDCHAR_SNAPSHOT, handing a local reader a sealed memfd copy
+ *  of the connection's channel to map
+ *
+ * @param socket_data Connection the command arrived on, which must be a
+ *  unix domain socket in text mode
+ * @param args Ignored
+ * @return int
+ * @retval -1 Error, the connection should be closed
+ * @retval  0 Success
+ */
+int handleSnapshotCommand(socket_data_t *socket_data, const char *args);
+
+/**
+ * @brief Run AESDCHAR_THREADS, replying with the node, core and migration
+ *  count of every server thread
+ *
+ * @param socket_data Connection the command arrived on
+ * @param args Ignored
+ * @return int
+ * @retval -1 Error, the connection should be closed
+ * @retval  0 Success
+ */
+int handleThreadsCommand(socket_data_t *socket_data, const char *args);
+
+/**
+ * @brief Run AESDCHAR_REPLICATE:channel,offset, turning the connection into
+ *  a replication stream of the channel's log from offset for a follower
+ *
+ * @param socket_data Connection the command arrived on
+ * @param args Channel name and offset
+ * @return int
+ * @retval -1 The stream has ended, the connection should be closed
+ * @retval  0 Refused with an error reply
+ */
+int handleReplicateCommand(socket_data_t *socket_data, const char *args);
+
+/**
+ * @brief Run AESDCHAR_FOLLOWER:token, marking the connection as one a
+ *  follower forwards appends over if the token was issued for a
+ *  replication stream still being served. Nothing is replied either way,
+ *  an unknown token leaves the connection subject to the lock deadline.
+ *
+ * @param socket_data Connection the command arrived on
+ * @param args Token from the AESDCHAR_REPLICATE:OK answer
+ * @return int
+ * @retval  0 Always
+ */
+int handleFollowerCommand(socket_data_t *socket_data, const char *args);
+
+/**
+ * @brief Run AESDCHAR_REPLICATION, replying with whether this server leads
+ *  or follows and how far behind each replication stream is
+ *
+ * @param socket_data Connection the command arrived on
+ * @param args Ignored
+ * @return int
+ * @retval -1 Error, the connection should be closed
+ * @retval  0 Success
+ */
+int handleReplicationCommand(socket_data_t *socket_data, const char *args);
+
+/**
+ * @brief Run AESDCHAR_TRACE, replying with the latency breakdown of every
+ *  request in the trace ring, oldest first
+ *
+ * @param socket_data Connection the command arrived on
+ * @param args Ignored
+ * @return int
+ * @retval -1 Error, the connection should be closed
+ * @retval  0 Success
+ */
+int handleTraceCommand(socket_data_t *socket_data, const char *args);
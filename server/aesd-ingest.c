@@ -0,0 +1,304 @@
+/**
+ * @file aesd-ingest.c
+ * @brief Fire-and-forget ingest of datagrams into a channel
+ */
+
+#define _GNU_SOURCE
+
+#include "aesd-ingest.h"
+#include "aesd-placement.h"
+#include "aesd-scan.h"
+#include "aesd-stats.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+// One spare byte per slot to terminate a datagram that lacks its newline
+#define INGEST_SLOT_SIZE    (INGEST_DATAGRAM_MAX + 1)
+
+static pthread_t ingestThread;
+static bool ingestRunning = false;
+static pthread_t ringThread;
+static bool ringRunning = false;
+static atomic_bool stopRequested = false;
+static int ingestSock = -1;
+static aesd_channel_t *ingestChannel = NULL;
+static aesd_ring_t *ingestRing = NULL;
+static aesd_channel_t *ringChannel = NULL;
+
+/**
+ * @brief Turn a received batch into packets, dropping what can't be one
+ *
+ * @return uint32_t Number of packets filled in
+ */
+static uint32_t collectPackets(struct mmsghdr *msgs, int received, char *slots,
+                               struct iovec *packets)
+{
+    uint32_t packetCount = 0;
+    char *datagram;
+    size_t len;
+    int i;
+
+    for (i = 0; i < received; i++)
+    {
+        datagram = slots + (size_t)i * INGEST_SLOT_SIZE;
+        len = msgs[i].msg_len;
+
+        // There is nobody to reply to, so a command can't be run and
+        // shouldn't be logged as data either
+        if ((msgs[i].msg_hdr.msg_flags & MSG_TRUNC) || aesd_scan_is_command(datagram, len))
+        {
+            aesd_stats_add(STAT_DATAGRAMS_DROPPED, 1);
+            continue;
+        }
+        if (len == 0)
+        {
+            continue;
+        }
+
+        if (datagram[len - 1] != '\n')
+        {
+            datagram[len++] = '\n';
+        }
+        packets[packetCount].iov_base = datagram;
+        packets[packetCount].iov_len = len;
+        packetCount++;
+    }
+
+    return packetCount;
+}
+
+static void *ingestThreadMain(void *arg)
+{
+    struct mmsghdr msgs[INGEST_BATCH_SIZE];
+    struct iovec slotIovs[INGEST_BATCH_SIZE];
+    struct iovec packets[INGEST_BATCH_SIZE];
+    uint32_t packetCount;
+    char *slots;
+    int received;
+    int i;
+
+    aesd_placement_register("datagram-ingest", (int)(intptr_t)arg);
+
+    slots = malloc((size_t)INGEST_BATCH_SIZE * INGEST_SLOT_SIZE);
+    if (slots == NULL)
+    {
+        perror("Ingest buffer allocation failed");
+        aesd_placement_leave();
+        return NULL;
+    }
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < INGEST_BATCH_SIZE; i++)
+    {
+        slotIovs[i].iov_base = slots + (size_t)i * INGEST_SLOT_SIZE;
+        slotIovs[i].iov_len = INGEST_DATAGRAM_MAX;
+        msgs[i].msg_hdr.msg_iov = &slotIovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while (!atomic_load(&stopRequested))
+    {
+        // Block for the first datagram only, then take whatever else is
+        // already queued
+        received = recvmmsg(ingestSock, msgs, INGEST_BATCH_SIZE, MSG_WAITFORONE, NULL);
+        if (received < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("recvmmsg() error on ingest socket");
+            break;
+        }
+
+        aesd_placement_sample();
+        packetCount = collectPackets(msgs, received, slots, packets);
+        if (packetCount == 0)
+        {
+            continue;
+        }
+
+        aesd_channel_lock(ingestChannel);
+        if (aesd_channel_append_packets(ingestChannel, packets, packetCount) != 0)
+        {
+            syslog(LOG_ERR, "Dropped %u ingested packets on append error", packetCount);
+            aesd_stats_add(STAT_DATAGRAMS_DROPPED, packetCount);
+        }
+        else
+        {
+            aesd_stats_add(STAT_DATAGRAMS_INGESTED, packetCount);
+        }
+        aesd_channel_unlock(ingestChannel);
+    }
+
+    free(slots);
+    aesd_placement_leave();
+    return NULL;
+}
+
+/**
+ * @brief Drop packets that look like commands, there is nobody to reply to
+ *
+ * @return uint32_t Number of packets left, compacted to the front
+ */
+static uint32_t dropCommands(struct iovec *packets, uint32_t count)
+{
+    uint32_t kept = 0;
+    uint32_t i;
+
+    for (i = 0; i < count; i++)
+    {
+        if (aesd_scan_is_command(packets[i].iov_base, packets[i].iov_len))
+        {
+            continue;
+        }
+        packets[kept++] = packets[i];
+    }
+
+    return kept;
+}
+
+static void *ringThreadMain(void *arg)
+{
+    struct iovec packets[CHANNEL_APPEND_BATCH_MAX];
+    int received;
+    uint32_t packetCount;
+
+    aesd_placement_register("ring-ingest", (int)(intptr_t)arg);
+
+    while (!atomic_load(&stopRequested))
+    {
+        received = aesd_ring_read(ingestRing, packets, CHANNEL_APPEND_BATCH_MAX);
+        if (received < 0)
+        {
+            syslog(LOG_ERR, "Shared-memory ring corrupted, no longer draining it");
+            break;
+        }
+        if (received == 0)
+        {
+            aesd_ring_wait(ingestRing, INGEST_RING_WAIT_MS);
+            continue;
+        }
+
+        aesd_placement_sample();
+        packetCount = dropCommands(packets, received);
+        aesd_stats_add(STAT_RING_PACKETS_DROPPED, received - packetCount);
+
+        // Appended straight from the ring, the space is only handed back
+        // once the write is done
+        aesd_channel_lock(ringChannel);
+        if (packetCount > 0 && aesd_channel_append_packets(ringChannel, packets, packetCount) != 0)
+        {
+            syslog(LOG_ERR, "Dropped %u ring packets on append error", packetCount);
+            aesd_stats_add(STAT_RING_PACKETS_DROPPED, packetCount);
+        }
+        else
+        {
+            aesd_stats_add(STAT_RING_PACKETS_INGESTED, packetCount);
+        }
+        aesd_channel_unlock(ringChannel);
+
+        aesd_ring_release(ingestRing);
+    }
+
+    aesd_placement_leave();
+    return NULL;
+}
+
+static int startThread(pthread_t *thread, void *(*threadMain)(void *), const char *name)
+{
+    pthread_attr_t attr;
+    sigset_t allSignals;
+    sigset_t oldSignals;
+    int node;
+    int retVal;
+
+    // Ingest threads are workers like connections, and run where they do
+    pthread_attr_init(&attr);
+    node = aesd_placement_worker_attr(&attr);
+
+    // A signal handler that appends to the channel must never interrupt
+    // an ingest thread while it holds the channel lock
+    sigfillset(&allSignals);
+    pthread_sigmask(SIG_BLOCK, &allSignals, &oldSignals);
+    retVal = pthread_create(thread, &attr, threadMain, (void *)(intptr_t)node);
+    pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+    pthread_attr_destroy(&attr);
+
+    if (retVal != 0)
+    {
+        errno = retVal;
+        fprintf(stderr, "pthread_create() error for %s thread: %s\n", name, strerror(retVal));
+        return -1;
+    }
+
+    return 0;
+}
+
+int aesd_ingest_start(int sockfd, aesd_channel_t *channel)
+{
+    ingestSock = sockfd;
+    ingestChannel = channel;
+    atomic_store(&stopRequested, false);
+
+    if (startThread(&ingestThread, ingestThreadMain, "datagram ingest") != 0)
+    {
+        return -1;
+    }
+
+    ingestRunning = true;
+    return 0;
+}
+
+int aesd_ingest_ring_start(aesd_ring_t *ring, aesd_channel_t *channel)
+{
+    ingestRing = ring;
+    ringChannel = channel;
+    atomic_store(&stopRequested, false);
+
+    if (startThread(&ringThread, ringThreadMain, "ring ingest") != 0)
+    {
+        return -1;
+    }
+
+    ringRunning = true;
+    return 0;
+}
+
+aesd_ring_t *aesd_ingest_ring(void)
+{
+    return ringRunning ? ingestRing : NULL;
+}
+
+void aesd_ingest_stop(void)
+{
+    atomic_store(&stopRequested, true);
+
+    if (ingestRunning)
+    {
+        // Wakes a blocked recvmmsg() with an empty batch
+        shutdown(ingestSock, SHUT_RD);
+        pthread_join(ingestThread, NULL);
+
+        close(ingestSock);
+        ingestSock = -1;
+        ingestRunning = false;
+    }
+
+    if (ringRunning)
+    {
+        aesd_ring_wake(ingestRing);
+        pthread_join(ringThread, NULL);
+        ringRunning = false;
+    }
+}
@@ -0,0 +1,61 @@
+/**
+ * @file aesd-ingest.h
+ * @brief Fire-and-forget ingest of datagrams into a channel
+ *
+ * Each datagram received on the ingest socket is one packet. Datagrams are
+ * read in batches with recvmmsg() and each batch is appended to the channel
+ * under a single lock hold with a single write, so producers that never
+ * read an echo pay for neither connection setup nor the echo.
+ *
+ * Local producers can go further and write packets straight into a
+ * shared-memory ring, which its own thread drains into the channel the
+ * same way.
+ */
+
+#pragma once
+
+#include "./aesd-channel.h"
+#include "./aesd-ring.h"
+
+// Datagrams read and appended per batch
+#define INGEST_BATCH_SIZE       CHANNEL_APPEND_BATCH_MAX
+// Largest datagram accepted, anything longer is dropped as truncated
+#define INGEST_DATAGRAM_MAX     65535
+// Longest the ring thread sleeps before looking at the ring again anyway
+#define INGEST_RING_WAIT_MS     1000
+
+/**
+ * @brief Start the thread that drains a bound datagram socket into a channel
+ *
+ * @param sockfd Bound datagram socket, owned by the ingest thread from now on
+ * @param channel Channel every datagram is appended to
+ * @return int
+ * @retval -1 Error
+ * @retval  0 Success
+ */
+int aesd_ingest_start(int sockfd, aesd_channel_t *channel);
+
+/**
+ * @brief Start the thread that drains a shared-memory ring into a channel
+ *
+ * @param ring Ring created with aesd_ring_create(), which must outlive the
+ *  thread
+ * @param channel Channel every packet is appended to
+ * @return int
+ * @retval -1 Error
+ * @retval  0 Success
+ */
+int aesd_ingest_ring_start(aesd_ring_t *ring, aesd_channel_t *channel);
+
+/**
+ * @brief The ring being drained, to hand out to producers
+ *
+ * @return aesd_ring_t* The ring, or NULL if no ring thread is running
+ */
+aesd_ring_t *aesd_ingest_ring(void);
+
+/**
+ * @brief Stop the ingest threads and close the datagram socket. A batch
+ *  already received is appended first.
+ */
+void aesd_ingest_stop(void);
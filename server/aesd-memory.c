@@ -0,0 +1,94 @@
+/**
+ * @file aesd-memory.c
+ * @brief Server-wide budget for memory held on behalf of peers
+ *
+ * Usage is one atomic counter, so charging is a compare-and-swap and never
+ * takes a lock. The per-kind breakdown lives in the stats counters.
+ */
+
+#include "aesd-memory.h"
+#include "aesd-stats.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Read without ordering, a new budget only has to show up eventually
+static atomic_size_t memoryBudget = 0;
+static atomic_size_t usedBytes = 0;
+static atomic_int consumerCount = 0;
+
+static const aesd_stat_t kindStats[] = {
+    [MEM_RECEIVE] = STAT_MEM_RECEIVE_BYTES,
+    [MEM_RESPONSE] = STAT_MEM_RESPONSE_BYTES,
+    [MEM_SNAPSHOT] = STAT_MEM_SNAPSHOT_BYTES,
+};
+
+void aesd_memory_init(size_t budget)
+{
+    size_t oldBudget = atomic_exchange_explicit(&memoryBudget, budget, memory_order_relaxed);
+
+    aesd_stats_add(STAT_MEM_BUDGET_BYTES, (int64_t)budget - (int64_t)oldBudget);
+}
+
+bool aesd_memory_fits(size_t bytes)
+{
+    size_t budget = atomic_load_explicit(&memoryBudget, memory_order_relaxed);
+
+    return budget == 0 || bytes <= budget;
+}
+
+static void account(aesd_mem_kind_t kind, int64_t delta)
+{
+    aesd_stats_add(kindStats[kind], delta);
+    aesd_stats_add(STAT_MEM_USED_BYTES, delta);
+}
+
+bool aesd_memory_try_charge(aesd_mem_kind_t kind, size_t bytes)
+{
+    size_t budget = atomic_load_explicit(&memoryBudget, memory_order_relaxed);
+    size_t used = atomic_load_explicit(&usedBytes, memory_order_relaxed);
+
+    do
+    {
+        if (budget != 0 && (used >= budget || bytes > budget - used))
+        {
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&usedBytes, &used, used + bytes,
+                                                    memory_order_relaxed, memory_order_relaxed));
+
+    account(kind, bytes);
+    return true;
+}
+
+void aesd_memory_charge(aesd_mem_kind_t kind, size_t bytes)
+{
+    atomic_fetch_add_explicit(&usedBytes, bytes, memory_order_relaxed);
+    account(kind, bytes);
+}
+
+void aesd_memory_release(aesd_mem_kind_t kind, size_t bytes)
+{
+    atomic_fetch_sub_explicit(&usedBytes, bytes, memory_order_relaxed);
+    account(kind, -(int64_t)bytes);
+}
+
+void aesd_memory_consumers(int delta)
+{
+    atomic_fetch_add_explicit(&consumerCount, delta, memory_order_relaxed);
+}
+
+bool aesd_memory_throttled(size_t held)
+{
+    size_t budget = atomic_load_explicit(&memoryBudget, memory_order_relaxed);
+    size_t used = atomic_load_explicit(&usedBytes, memory_order_relaxed);
+    int consumers = atomic_load_explicit(&consumerCount, memory_order_relaxed);
+
+    if (budget == 0 || held == 0 || used < budget / 100 * MEMORY_PRESSURE_PERCENT)
+    {
+        return false;
+    }
+
+    // Above an even share of what is in use makes it one of the largest
+    return held > used / (consumers > 1 ? consumers : 1);
+}
@@ -0,0 +1,73 @@
+/**
+ * @file aesd-memory.h
+ * @brief Server-wide budget for memory held on behalf of peers
+ *
+ * Receive buffers, pending responses and cached snapshots are charged
+ * against one budget. Charges that can wait are refused once they would
+ * take usage past it. Charges that cannot, like packets already appended
+ * and waiting for subscribers, always succeed but count towards pressure.
+ *
+ * Once usage passes MEMORY_PRESSURE_PERCENT of the budget, consumers
+ * holding more than an even share of it are asked to stop reading until
+ * usage falls back, so the connections responsible for the pressure are
+ * the ones held back.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Usage from which the largest consumers stop reading
+#define MEMORY_PRESSURE_PERCENT 90
+
+typedef enum aesd_mem_kind_e
+{
+    // Buffers holding packets still being received
+    MEM_RECEIVE,
+    // Replies being built and packets waiting for subscribers
+    MEM_RESPONSE,
+    // Log snapshots kept for local readers
+    MEM_SNAPSHOT,
+} aesd_mem_kind_t;
+
+/**
+ * @brief Set the budget, at any time. A budget below what is already in use
+ *  refuses new charges until enough has been released.
+ *
+ * @param budget Bytes, or 0 for no limit
+ */
+void aesd_memory_init(size_t budget);
+
+/**
+ * @brief Whether a charge of this size could ever succeed
+ */
+bool aesd_memory_fits(size_t bytes);
+
+/**
+ * @brief Charge bytes unless that would take usage past the budget
+ *
+ * @return bool True if charged
+ */
+bool aesd_memory_try_charge(aesd_mem_kind_t kind, size_t bytes);
+
+/**
+ * @brief Charge bytes whatever the budget says, for memory that is already
+ *  committed to
+ */
+void aesd_memory_charge(aesd_mem_kind_t kind, size_t bytes);
+
+void aesd_memory_release(aesd_mem_kind_t kind, size_t bytes);
+
+/**
+ * @brief Count a consumer that aesd_memory_throttled() weighs against the
+ *  others, or with delta -1 forget one
+ */
+void aesd_memory_consumers(int delta);
+
+/**
+ * @brief Whether a consumer holding this much should stop reading
+ *
+ * @param held Bytes charged on the consumer's behalf
+ */
+bool aesd_memory_throttled(size_t held);
@@ -0,0 +1,329 @@
+/**
+ * @file aesd-packet-index.c
+ * @brief Append-only index of packet boundaries in a file-backed log
+ *
+ * The index is persisted as a flat array of native-endian uint64_t packet
+ * end offsets next to the data file. It is only a cache of where the
+ * newlines are, so anything that does not match the data file is thrown
+ * away and recomputed on open.
+ */
+
+#include "aesd-packet-index.h"
+#include "aesd-scan.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define INDEX_INITIAL_CAPACITY  64
+#define INDEX_SCAN_BUFF_SIZE    65536
+
+static int growIndex(aesd_packet_index_t *index)
+{
+    uint32_t newCapacity = index->capacity ? index->capacity * 2 : INDEX_INITIAL_CAPACITY;
+    uint64_t *newEnds = realloc(index->packetEnds, newCapacity * sizeof(uint64_t));
+
+    if (newEnds == NULL)
+    {
+        return -1;
+    }
+
+    index->packetEnds = newEnds;
+    index->capacity = newCapacity;
+    return 0;
+}
+
+static int pushPacketEnd(aesd_packet_index_t *index, uint64_t packetEnd)
+{
+    if (index->count == index->capacity && growIndex(index) != 0)
+    {
+        return -1;
+    }
+
+    index->packetEnds[index->count++] = packetEnd;
+    return 0;
+}
+
+static int writeAll(int fd, const void *buf, size_t len)
+{
+    const char *bufp = buf;
+    ssize_t ret;
+
+    while (len > 0)
+    {
+        ret = write(fd, bufp, len);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        bufp += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Load the persisted entries, keeping the longest prefix that is
+ *  consistent with a data file of dataSize bytes
+ */
+static int loadPersisted(aesd_packet_index_t *index, off_t dataSize)
+{
+    struct stat indexStat;
+    uint64_t prevEnd = 0;
+    uint32_t storedCount;
+    uint32_t i;
+    size_t bytesRead = 0;
+    ssize_t readRet;
+
+    if (fstat(index->indexFd, &indexStat) != 0)
+    {
+        return -1;
+    }
+
+    storedCount = indexStat.st_size / sizeof(uint64_t);
+
+    while (index->capacity < storedCount)
+    {
+        if (growIndex(index) != 0)
+        {
+            return -1;
+        }
+    }
+
+    // Pull the whole index in with as few reads as possible
+    while (bytesRead < storedCount * sizeof(uint64_t))
+    {
+        readRet = pread(index->indexFd, (char *)index->packetEnds + bytesRead,
+                        storedCount * sizeof(uint64_t) - bytesRead, bytesRead);
+        if (readRet <= 0)
+        {
+            if (readRet < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        bytesRead += readRet;
+    }
+    storedCount = bytesRead / sizeof(uint64_t);
+
+    for (i = 0; i < storedCount; i++)
+    {
+        if (index->packetEnds[i] <= prevEnd || index->packetEnds[i] > (uint64_t)dataSize)
+        {
+            syslog(LOG_INFO, "Packet index stale after %u entries, rescanning", i);
+            break;
+        }
+        prevEnd = index->packetEnds[i];
+    }
+    index->count = i;
+
+    // Drop whatever did not validate (including a torn trailing entry) so
+    // that appends continue from a consistent point
+    if (ftruncate(index->indexFd, index->count * sizeof(uint64_t)) != 0 ||
+        lseek(index->indexFd, 0, SEEK_END) < 0)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Index any complete packets between the last indexed packet and the
+ *  end of the data file
+ */
+static int scanDataTail(aesd_packet_index_t *index, int dataFd)
+{
+    char *scanBuff;
+    char *nlPtr;
+    ssize_t readRet;
+    uint64_t buffStart;
+    uint32_t firstNew = index->count;
+    off_t scanStart = index->count ? index->packetEnds[index->count - 1] : 0;
+    int retVal = 0;
+
+    scanBuff = malloc(INDEX_SCAN_BUFF_SIZE);
+    if (scanBuff == NULL)
+    {
+        return -1;
+    }
+
+    buffStart = scanStart;
+    while ((readRet = pread(dataFd, scanBuff, INDEX_SCAN_BUFF_SIZE, buffStart)) != 0)
+    {
+        if (readRet < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            retVal = -1;
+            break;
+        }
+
+        nlPtr = scanBuff;
+        while ((nlPtr = (char *)aesd_scan_newline(nlPtr, readRet - (nlPtr - scanBuff))) != NULL)
+        {
+            nlPtr++;
+            if (pushPacketEnd(index, buffStart + (nlPtr - scanBuff)) != 0)
+            {
+                retVal = -1;
+                goto out;
+            }
+        }
+
+        buffStart += readRet;
+    }
+
+    if (index->count > firstNew)
+    {
+        syslog(LOG_INFO, "Indexed %u packets from data file tail",
+               index->count - firstNew);
+        retVal = writeAll(index->indexFd, &index->packetEnds[firstNew],
+                          (index->count - firstNew) * sizeof(uint64_t));
+    }
+
+out:
+    free(scanBuff);
+    return retVal;
+}
+
+int aesd_packet_index_open(aesd_packet_index_t *index, const char *dataPath,
+                           const char *indexPath)
+{
+    struct stat dataStat;
+    int dataFd;
+
+    memset(index, 0, sizeof(*index));
+
+    index->indexFd = open(indexPath, O_RDWR | O_CREAT,
+                          S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (index->indexFd == -1)
+    {
+        perror("open() error on packet index");
+        return -1;
+    }
+
+    dataFd = open(dataPath, O_RDONLY);
+    if (dataFd == -1)
+    {
+        if (errno != ENOENT)
+        {
+            perror("open() error on data file");
+            goto error;
+        }
+
+        // No data yet, so nothing persisted can be valid either
+        if (ftruncate(index->indexFd, 0) != 0)
+        {
+            perror("ftruncate() error on packet index");
+            goto error;
+        }
+    }
+    else
+    {
+        if (fstat(dataFd, &dataStat) != 0 ||
+            loadPersisted(index, dataStat.st_size) != 0 ||
+            scanDataTail(index, dataFd) != 0)
+        {
+            perror("Error rebuilding packet index");
+            close(dataFd);
+            goto error;
+        }
+        close(dataFd);
+    }
+
+    // Every later write is a single entry appended at the end
+    if (fcntl(index->indexFd, F_SETFL, O_APPEND) != 0)
+    {
+        perror("fcntl() error on packet index");
+        goto error;
+    }
+
+    syslog(LOG_INFO, "Packet index ready with %u packets", index->count);
+    return 0;
+
+error:
+    aesd_packet_index_close(index);
+    return -1;
+}
+
+int aesd_packet_index_append(aesd_packet_index_t *index, uint64_t packetEnd)
+{
+    if (pushPacketEnd(index, packetEnd) != 0)
+    {
+        return -1;
+    }
+
+    return writeAll(index->indexFd, &packetEnd, sizeof(packetEnd));
+}
+
+int aesd_packet_index_append_batch(aesd_packet_index_t *index, const uint64_t *packetEnds,
+                                   uint32_t count)
+{
+    uint32_t first = index->count;
+    uint32_t i;
+    int retVal = 0;
+
+    for (i = 0; i < count; i++)
+    {
+        if (pushPacketEnd(index, packetEnds[i]) != 0)
+        {
+            retVal = -1;
+            break;
+        }
+    }
+
+    // The new entries sit next to each other in packetEnds, persist whatever
+    // made it in with one write
+    if (writeAll(index->indexFd, &index->packetEnds[first],
+                 (index->count - first) * sizeof(index->packetEnds[0])) != 0)
+    {
+        return -1;
+    }
+
+    return retVal;
+}
+
+int aesd_packet_index_lookup(const aesd_packet_index_t *index, uint32_t writeCmd,
+                             uint32_t writeCmdOffset, off_t *fileOffset)
+{
+    uint64_t packetStart;
+
+    if (writeCmd >= index->count)
+    {
+        return -1;
+    }
+
+    packetStart = writeCmd ? index->packetEnds[writeCmd - 1] : 0;
+
+    if (writeCmdOffset >= index->packetEnds[writeCmd] - packetStart)
+    {
+        return -1;
+    }
+
+    *fileOffset = packetStart + writeCmdOffset;
+    return 0;
+}
+
+void aesd_packet_index_close(aesd_packet_index_t *index)
+{
+    if (index->indexFd != -1)
+    {
+        close(index->indexFd);
+    }
+    free(index->packetEnds);
+    memset(index, 0, sizeof(*index));
+    index->indexFd = -1;
+}
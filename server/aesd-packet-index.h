@@ -0,0 +1,103 @@
+/**
+ * @file aesd-packet-index.h
+ * @brief Append-only index of packet boundaries in a file-backed log, used
+ *  to resolve AESDCHAR_IOCSEEKTO requests without the aesdchar driver
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef struct aesd_packet_index_s aesd_packet_index_t;
+
+struct aesd_packet_index_s
+{
+    /**
+     * End offset (one past the terminating newline) of each complete packet.
+     * The start of packet i is the end of packet i - 1, or 0 for the first.
+     */
+    uint64_t *packetEnds;
+    /**
+     * Number of complete packets in packetEnds
+     */
+    uint32_t count;
+    /**
+     * Number of packetEnds slots currently allocated
+     */
+    uint32_t capacity;
+    /**
+     * Descriptor of the persisted index, opened for appending
+     */
+    int indexFd;
+};
+
+/**
+ * @brief Load the persisted index for a data file and bring it up to date
+ *
+ * Entries that do not agree with the data file (not strictly increasing or
+ * past its end) are dropped, then any packets written after the last valid
+ * entry are found with a single scan of the file tail.
+ *
+ * @param index Index to initialize
+ * @param dataPath Path of the log file the index describes
+ * @param indexPath Path the index is persisted at
+ * @return int
+ * @retval -1 Error
+ * @retval  0 Success
+ */
+int aesd_packet_index_open(aesd_packet_index_t *index, const char *dataPath,
+                           const char *indexPath);
+
+/**
+ * @brief Record a packet that was just completed in the data file
+ *
+ * Any necessary locking must be performed by caller.
+ *
+ * @param index Index to append to
+ * @param packetEnd File offset one past the packet's terminating newline
+ * @return int
+ * @retval -1 Error
+ * @retval  0 Success
+ */
+int aesd_packet_index_append(aesd_packet_index_t *index, uint64_t packetEnd);
+
+/**
+ * @brief Record several packets just completed in the data file, persisting
+ *  them with a single write
+ *
+ * Any necessary locking must be performed by caller.
+ *
+ * @param index Index to append to
+ * @param packetEnds File offsets one past each packet's terminating newline,
+ *  in increasing order
+ * @param count Number of entries in packetEnds
+ * @return int
+ * @retval -1 Error
+ * @retval  0 Success
+ */
+int aesd_packet_index_append_batch(aesd_packet_index_t *index, const uint64_t *packetEnds,
+                                   uint32_t count);
+
+/**
+ * @brief Translate a (write command, offset) pair into a file offset
+ *
+ * Any necessary locking must be performed by caller.
+ *
+ * @param index Index to search
+ * @param writeCmd Zero referenced packet to seek into
+ * @param writeCmdOffset Zero referenced offset within that packet
+ * @param fileOffset Location to store the resulting file offset
+ * @return int
+ * @retval -1 Packet or offset out of range
+ * @retval  0 Success
+ */
+int aesd_packet_index_lookup(const aesd_packet_index_t *index, uint32_t writeCmd,
+                             uint32_t writeCmdOffset, off_t *fileOffset);
+
+/**
+ * @brief Free the in-memory index and close the persisted copy
+ *
+ * @param index Index to close
+ */
+void aesd_packet_index_close(aesd_packet_index_t *index);
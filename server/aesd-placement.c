@@ -0,0 +1,357 @@
+/**
+ * @file aesd-placement.c
+ * @brief Which cores server threads run on and which NUMA node their
+ *  memory comes from
+ *
+ * Nodes come from sysfs and memory policy is set with the raw system call,
+ * so there is no dependency on libnuma. A machine without NUMA shows up as
+ * a single node 0.
+ */
+
+#define _GNU_SOURCE
+
+#include "aesd-placement.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+
+#define BITS_PER_LONG   (8 * sizeof(unsigned long))
+
+typedef struct node_cpus_s
+{
+    int node;
+    cpu_set_t cpus;
+} node_cpus_t;
+
+static node_cpus_t workerNodes[PLACEMENT_MAX_NODES];
+static size_t workerNodeCount = 0;
+// Next group handed out, round robin
+static atomic_uint nextWorkerNode = 0;
+
+static aesd_thread_place_t registered[PLACEMENT_MAX_THREADS];
+static bool registeredUsed[PLACEMENT_MAX_THREADS];
+static pthread_mutex_t registeredMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static _Thread_local aesd_thread_place_t *currentPlace = NULL;
+static _Thread_local int currentSlot = -1;
+
+/**
+ * @brief Look up the node a core belongs to from its sysfs directory
+ */
+static int cpuNode(int cpu)
+{
+    char path[64];
+    struct dirent *entry;
+    DIR *dir;
+    int node = 0;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    dir = opendir(path);
+    if (dir == NULL)
+    {
+        return 0;
+    }
+
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (sscanf(entry->d_name, "node%d", &node) == 1)
+        {
+            break;
+        }
+    }
+
+    closedir(dir);
+    return node;
+}
+
+int aesd_placement_init(const int *cpus, size_t cpuCount)
+{
+    cpu_set_t allowed;
+    size_t i;
+    size_t j;
+    int node;
+
+    workerNodeCount = 0;
+    atomic_store(&nextWorkerNode, 0);
+    if (cpus == NULL || cpuCount == 0)
+    {
+        return 0;
+    }
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    {
+        return -1;
+    }
+
+    for (i = 0; i < cpuCount; i++)
+    {
+        if (cpus[i] < 0 || cpus[i] >= CPU_SETSIZE || !CPU_ISSET(cpus[i], &allowed))
+        {
+            workerNodeCount = 0;
+            errno = EINVAL;
+            return -1;
+        }
+
+        node = cpuNode(cpus[i]);
+        for (j = 0; j < workerNodeCount && workerNodes[j].node != node; j++)
+        {
+        }
+
+        if (j == workerNodeCount)
+        {
+            if (workerNodeCount == PLACEMENT_MAX_NODES)
+            {
+                workerNodeCount = 0;
+                errno = EINVAL;
+                return -1;
+            }
+            workerNodes[j].node = node;
+            CPU_ZERO(&workerNodes[j].cpus);
+            workerNodeCount++;
+        }
+        CPU_SET(cpus[i], &workerNodes[j].cpus);
+    }
+
+    return 0;
+}
+
+int aesd_placement_worker_attr(pthread_attr_t *attr)
+{
+    node_cpus_t *group;
+    int retVal;
+
+    if (workerNodeCount == 0)
+    {
+        return -1;
+    }
+
+    group = &workerNodes[atomic_fetch_add(&nextWorkerNode, 1) % workerNodeCount];
+    retVal = pthread_attr_setaffinity_np(attr, sizeof(group->cpus), &group->cpus);
+    if (retVal != 0)
+    {
+        errno = retVal;
+        perror("pthread_attr_setaffinity_np() error");
+        return -1;
+    }
+
+    return group->node;
+}
+
+int aesd_placement_pin_self(const int *cpus, size_t cpuCount, int *node)
+{
+    cpu_set_t cpuSet;
+    size_t i;
+    int retVal;
+
+    *node = cpuCount > 0 ? cpuNode(cpus[0]) : -1;
+
+    CPU_ZERO(&cpuSet);
+    for (i = 0; i < cpuCount; i++)
+    {
+        if (cpus[i] < 0 || cpus[i] >= CPU_SETSIZE)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        CPU_SET(cpus[i], &cpuSet);
+        if (*node != -1 && cpuNode(cpus[i]) != *node)
+        {
+            *node = -1;
+        }
+    }
+
+    retVal = pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+    if (retVal != 0)
+    {
+        errno = retVal;
+        perror("pthread_setaffinity_np() error");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Prefer a node for the memory the calling thread faults in
+ */
+static void preferNode(int node)
+{
+    unsigned long nodeMask[PLACEMENT_MAX_NODES / BITS_PER_LONG] = {0};
+
+    if (node < 0 || node >= PLACEMENT_MAX_NODES)
+    {
+        return;
+    }
+
+    // Preferred rather than bound, a full node still falls back to another
+    nodeMask[node / BITS_PER_LONG] = 1UL << (node % BITS_PER_LONG);
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodeMask, PLACEMENT_MAX_NODES + 1) != 0)
+    {
+        perror("set_mempolicy() error");
+    }
+}
+
+void aesd_placement_enter(aesd_thread_place_t *place, const char *role, int node)
+{
+    place->role = role;
+    place->tid = gettid();
+    place->node = node;
+    atomic_init(&place->lastCpu, sched_getcpu());
+    atomic_init(&place->observedMigrations, 0);
+    currentPlace = place;
+
+    preferNode(node);
+}
+
+void aesd_placement_register(const char *role, int node)
+{
+    int slot;
+
+    pthread_mutex_lock(&registeredMutex);
+    for (slot = 0; slot < PLACEMENT_MAX_THREADS && registeredUsed[slot]; slot++)
+    {
+    }
+    if (slot < PLACEMENT_MAX_THREADS)
+    {
+        registeredUsed[slot] = true;
+        aesd_placement_enter(&registered[slot], role, node);
+        currentSlot = slot;
+    }
+    pthread_mutex_unlock(&registeredMutex);
+}
+
+void aesd_placement_leave(void)
+{
+    if (currentSlot != -1)
+    {
+        pthread_mutex_lock(&registeredMutex);
+        registeredUsed[currentSlot] = false;
+        pthread_mutex_unlock(&registeredMutex);
+        currentSlot = -1;
+    }
+    currentPlace = NULL;
+}
+
+void aesd_placement_sample(void)
+{
+    int cpu;
+
+    if (currentPlace == NULL)
+    {
+        return;
+    }
+
+    cpu = sched_getcpu();
+    if (cpu != atomic_load_explicit(&currentPlace->lastCpu, memory_order_relaxed))
+    {
+        atomic_store_explicit(&currentPlace->lastCpu, cpu, memory_order_relaxed);
+        atomic_fetch_add_explicit(&currentPlace->observedMigrations, 1, memory_order_relaxed);
+    }
+}
+
+/**
+ * @brief Read the scheduler's migration count and current core for a
+ *  thread of this process
+ *
+ * @return int
+ * @retval -1 The kernel does not expose the count
+ * @retval  0 Success, cpu is left alone if it could not be read
+ */
+static int readSchedMigrations(pid_t tid, uint64_t *migrations, int *cpu)
+{
+    char path[64];
+    char line[512];
+    char *field;
+    int retVal = -1;
+    FILE *file;
+    int i;
+
+    snprintf(path, sizeof(path), "/proc/self/task/%d/sched", (int)tid);
+    file = fopen(path, "r");
+    if (file == NULL)
+    {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        if (strncmp(line, "se.nr_migrations", strlen("se.nr_migrations")) == 0 &&
+            (field = strchr(line, ':')) != NULL)
+        {
+            *migrations = strtoull(field + 1, NULL, 10);
+            retVal = 0;
+            break;
+        }
+    }
+    fclose(file);
+
+    // The processor last run on is field 39 of stat, the 37th after the
+    // command name
+    snprintf(path, sizeof(path), "/proc/self/task/%d/stat", (int)tid);
+    file = fopen(path, "r");
+    if (file != NULL && fgets(line, sizeof(line), file) != NULL &&
+        (field = strrchr(line, ')')) != NULL)
+    {
+        for (i = 0; i < 37 && field != NULL; i++)
+        {
+            field = strchr(field + 1, ' ');
+        }
+        if (field != NULL)
+        {
+            *cpu = atoi(field + 1);
+        }
+    }
+    if (file != NULL)
+    {
+        fclose(file);
+    }
+
+    return retVal;
+}
+
+size_t aesd_placement_format_thread(const aesd_thread_place_t *place, char *buf, size_t len)
+{
+    uint64_t migrations = atomic_load(&place->observedMigrations);
+    int cpu = atomic_load(&place->lastCpu);
+    int ret;
+
+    if (len == 0)
+    {
+        return 0;
+    }
+
+    readSchedMigrations(place->tid, &migrations, &cpu);
+
+    ret = snprintf(buf, len, "%s tid=%d node=%d cpu=%d migrations=%llu\n", place->role,
+                   (int)place->tid, place->node, cpu, (unsigned long long)migrations);
+    if (ret < 0)
+    {
+        return 0;
+    }
+    return (size_t)ret < len ? (size_t)ret : len - 1;
+}
+
+size_t aesd_placement_format(char *buf, size_t len)
+{
+    size_t used = 0;
+    int slot;
+
+    pthread_mutex_lock(&registeredMutex);
+    for (slot = 0; slot < PLACEMENT_MAX_THREADS && used < len; slot++)
+    {
+        if (registeredUsed[slot])
+        {
+            used += aesd_placement_format_thread(&registered[slot], buf + used, len - used);
+        }
+    }
+    pthread_mutex_unlock(&registeredMutex);
+
+    return used;
+}
@@ -0,0 +1,118 @@
+/**
+ * @file aesd-placement.h
+ * @brief Which cores server threads run on and which NUMA node their
+ *  memory comes from
+ *
+ * Worker threads (connections and ingest) are confined to the cores
+ * configured for them. Those cores are grouped by NUMA node and each new
+ * worker is handed one node's group in turn, so it may float between the
+ * cores of its node but never leaves it. Workers then prefer their node for
+ * every page they fault in, so the buffers they grow come from memory next
+ * to the cores using them.
+ *
+ * Migrations are counted by the scheduler when the kernel exposes its
+ * per-thread count in /proc, and otherwise by noticing a thread on a
+ * different core than the last time it looked.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Threads other than connections that can be listed at once
+#define PLACEMENT_MAX_THREADS   16
+// Nodes workers can be spread over
+#define PLACEMENT_MAX_NODES     64
+
+typedef struct aesd_thread_place_s aesd_thread_place_t;
+
+struct aesd_thread_place_s
+{
+    // What the thread does, as listed by AESDCHAR_THREADS
+    const char *role;
+    pid_t tid;
+    // Node the thread was confined to, -1 if it may run anywhere
+    int node;
+    // Core last seen running the thread, and how often that changed
+    atomic_int lastCpu;
+    atomic_uint_fast64_t observedMigrations;
+};
+
+/**
+ * @brief Set up the cores workers run on. Call before any worker starts.
+ *
+ * @param cpus Cores for workers, or NULL to leave them wherever the
+ *  scheduler puts them
+ * @param cpuCount Number of cores in cpus
+ * @return int
+ * @retval -1 Error, errno EINVAL for a core that is not online
+ * @retval  0 Success
+ */
+int aesd_placement_init(const int *cpus, size_t cpuCount);
+
+/**
+ * @brief Confine a thread about to be created to the next node's worker
+ *  cores
+ *
+ * @param attr Attributes the thread will be created with
+ * @return int Node the thread will run on, -1 if workers are not confined
+ */
+int aesd_placement_worker_attr(pthread_attr_t *attr);
+
+/**
+ * @brief Pin the calling thread to some cores
+ *
+ * @param node Set to the node all of the cores are on, or -1 if they span
+ *  several
+ * @return int
+ * @retval -1 Error
+ * @retval  0 Success
+ */
+int aesd_placement_pin_self(const int *cpus, size_t cpuCount, int *node);
+
+/**
+ * @brief Record the calling thread in place and, if it was confined to a
+ *  node, prefer that node for its memory from now on. Call first thing in
+ *  a new thread.
+ *
+ * @param place Record to fill in, must outlive the thread
+ * @param role What the thread does
+ * @param node Node the thread was confined to, or -1
+ */
+void aesd_placement_enter(aesd_thread_place_t *place, const char *role, int node);
+
+/**
+ * @brief Like aesd_placement_enter() for threads with no record of their
+ *  own, listed by aesd_placement_format() until aesd_placement_leave()
+ */
+void aesd_placement_register(const char *role, int node);
+
+/**
+ * @brief Forget the calling thread, before it exits
+ */
+void aesd_placement_leave(void);
+
+/**
+ * @brief Notice whether the calling thread has moved to another core since
+ *  it last looked. Cheap enough to call on every receive.
+ */
+void aesd_placement_sample(void);
+
+/**
+ * @brief Write one "role tid=... node=... cpu=... migrations=..." line
+ *  about a thread
+ *
+ * @return size_t Number of bytes written, truncated to fit
+ */
+size_t aesd_placement_format_thread(const aesd_thread_place_t *place, char *buf, size_t len);
+
+/**
+ * @brief Write a line for every registered thread
+ *
+ * @return size_t Number of bytes written, truncated to fit
+ */
+size_t aesd_placement_format(char *buf, size_t len);
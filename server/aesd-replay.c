@@ -0,0 +1,730 @@
+/**
+ * @file aesd-replay.c
+ * @brief Play traffic recorded with aesdsocket -R back against a server
+ *
+ * Connections are opened, sent to and closed as the trace has them, at the
+ * recorded pace or sped up, so a production mix of packets, commands and
+ * connection churn can be rerun against a build under test. The trace's
+ * connections are spread over -c threads, each keeping its own to the
+ * schedule and reading whatever the server sends back in the meantime.
+ *
+ * Reports how far the replay fell behind the schedule, how long the server
+ * took to start replying after each send, and how the rate achieved
+ * compares with the recorded one.
+ */
+
+#include "aesd-capture.h"
+#include "aesd-client.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+// How long a send may wait for the server to read before the connection is
+// given up on, and how long connections get to close once the trace ends
+#define REPLAY_STALL_MS     AESD_CLIENT_TIMEOUT_MS
+#define REPLAY_DRAIN_MS     5000
+
+typedef struct replay_event_s
+{
+    aesd_capture_type_t type;
+    uint64_t id;
+    // Microseconds since the start of the trace
+    uint64_t atUs;
+    // Transport of a CAPTURE_OPEN
+    uint64_t transport;
+    // Bytes of a CAPTURE_DATA, in the mapped trace
+    const uint8_t *data;
+    size_t len;
+} replay_event_t;
+
+typedef struct replay_conn_s
+{
+    int sockfd;
+    // Index in its worker's openIds while sockfd is open
+    size_t slot;
+    // Shut down for writing, waiting for the server to close
+    bool closing;
+    // When the first send not yet followed by a reply went out, 0 if none
+    double sentAt;
+} replay_conn_t;
+
+typedef struct replay_samples_s
+{
+    double *values;
+    size_t count;
+    size_t size;
+} replay_samples_t;
+
+typedef struct replay_config_s
+{
+    aesd_client_config_t tcpConfig;
+    aesd_client_config_t unixConfig;
+    replay_event_t *events;
+    size_t eventCount;
+    uint64_t connCount;
+    uint64_t dataBytes;
+    // Indexed by connection id
+    replay_conn_t *conns;
+    // 0 replays as fast as possible
+    double speed;
+    int workerCount;
+    double start;
+} replay_config_t;
+
+typedef struct replay_worker_s
+{
+    const replay_config_t *config;
+    int index;
+    pthread_t thread;
+    char *recvBuff;
+    // Ids of the connections open, and a poll entry for each
+    uint64_t *openIds;
+    struct pollfd *pollfds;
+    size_t openCount;
+    replay_samples_t lags;
+    replay_samples_t latencies;
+    double finishedAt;
+    uint64_t events;
+    uint64_t bytesSent;
+    uint64_t bytesReceived;
+    uint64_t failedConnects;
+    uint64_t droppedConns;
+    uint64_t skippedEvents;
+} replay_worker_t;
+
+static double nowSeconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void addSample(replay_samples_t *samples, double value)
+{
+    double *grown;
+
+    if (samples->count == samples->size)
+    {
+        grown = realloc(samples->values,
+                        (samples->size != 0 ? samples->size * 2 : 1024) * sizeof(double));
+        if (grown == NULL)
+        {
+            return;
+        }
+        samples->values = grown;
+        samples->size = samples->size != 0 ? samples->size * 2 : 1024;
+    }
+    samples->values[samples->count++] = value;
+}
+
+/**
+ * @brief Map a trace and turn its records into events
+ *
+ * A trace cut short in the middle of a record, as one still being written
+ * can be, is replayed up to that record.
+ *
+ * @return int
+ * @retval -1 Error
+ * @retval  0 Success
+ */
+static int loadTrace(const char *path, replay_config_t *config)
+{
+    const uint8_t *pos;
+    const uint8_t *end;
+    replay_event_t *event;
+    struct stat st;
+    uint64_t fields[3];
+    uint64_t atUs = 0;
+    size_t maxEvents;
+    size_t fieldLen;
+    size_t used;
+    int fieldCount;
+    int fd;
+    int i;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &st) != 0)
+    {
+        perror("Could not open the trace");
+        return -1;
+    }
+    if (st.st_size < CAPTURE_MAGIC_LEN)
+    {
+        fprintf(stderr, "%s is not a trace\n", path);
+        close(fd);
+        return -1;
+    }
+
+    pos = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (pos == MAP_FAILED)
+    {
+        perror("Could not map the trace");
+        return -1;
+    }
+    end = pos + st.st_size;
+    if (memcmp(pos, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != 0)
+    {
+        fprintf(stderr, "%s is not a trace\n", path);
+        return -1;
+    }
+    pos += CAPTURE_MAGIC_LEN;
+
+    // Every record takes at least three bytes
+    maxEvents = (end - pos) / 3 + 1;
+    config->events = malloc(maxEvents * sizeof(replay_event_t));
+    if (config->events == NULL)
+    {
+        perror("Could not load the trace");
+        return -1;
+    }
+
+    while (pos < end)
+    {
+        event = &config->events[config->eventCount];
+        event->type = pos[0];
+        fieldCount = event->type == CAPTURE_CLOSE ? 2 : 3;
+        if (event->type < CAPTURE_OPEN || event->type > CAPTURE_CLOSE)
+        {
+            fprintf(stderr, "Unknown record type %d, replaying the trace up to it\n",
+                    event->type);
+            break;
+        }
+
+        used = 1;
+        for (i = 0; i < fieldCount; i++)
+        {
+            fieldLen = aesd_capture_read_varint(pos + used, end, &fields[i]);
+            if (fieldLen == 0)
+            {
+                break;
+            }
+            used += fieldLen;
+        }
+        if (i < fieldCount || fields[1] == 0 ||
+            (event->type == CAPTURE_DATA && fields[2] > (uint64_t)(end - pos - used)))
+        {
+            fprintf(stderr, "Trace ends in the middle of a record, replaying it up to there\n");
+            break;
+        }
+
+        atUs += fields[0];
+        event->atUs = atUs;
+        event->id = fields[1];
+        event->transport = event->type == CAPTURE_OPEN ? fields[2] : 0;
+        event->data = event->type == CAPTURE_DATA ? pos + used : NULL;
+        event->len = event->type == CAPTURE_DATA ? fields[2] : 0;
+        pos += used + event->len;
+
+        config->connCount = event->id > config->connCount ? event->id : config->connCount;
+        config->dataBytes += event->len;
+        config->eventCount++;
+    }
+
+    return 0;
+}
+
+static bool ownsConn(const replay_worker_t *worker, uint64_t id)
+{
+    return (id - 1) % worker->config->workerCount == (uint64_t)worker->index;
+}
+
+static void closeConn(replay_worker_t *worker, uint64_t id)
+{
+    replay_conn_t *conn = &worker->config->conns[id];
+    uint64_t lastId = worker->openIds[--worker->openCount];
+
+    worker->openIds[conn->slot] = lastId;
+    worker->config->conns[lastId].slot = conn->slot;
+    close(conn->sockfd);
+    conn->sockfd = -1;
+}
+
+/**
+ * @brief Read whatever the server sent on a connection, timing the first
+ *  reply after a send, and close the connection once the server does
+ */
+static void drainConn(replay_worker_t *worker, uint64_t id)
+{
+    replay_conn_t *conn = &worker->config->conns[id];
+    ssize_t recvRet;
+
+    while (true)
+    {
+        recvRet = recv(conn->sockfd, worker->recvBuff, AESD_CLIENT_RECV_BYTES, MSG_DONTWAIT);
+        if (recvRet > 0)
+        {
+            worker->bytesReceived += recvRet;
+            if (conn->sentAt != 0)
+            {
+                addSample(&worker->latencies, nowSeconds() - conn->sentAt);
+                conn->sentAt = 0;
+            }
+            continue;
+        }
+        if (recvRet < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        {
+            return;
+        }
+
+        // Only expected once the trace has closed the connection itself
+        if (!conn->closing)
+        {
+            worker->droppedConns++;
+        }
+        closeConn(worker, id);
+        return;
+    }
+}
+
+/**
+ * @brief Handle replies on every open connection for up to timeoutMs
+ *
+ * @param sending Connection to also wait to be able to send on, or NULL
+ * @return int
+ * @retval -1 Error
+ * @retval  0 Nothing could be sent on sending
+ * @retval  1 sending can take more
+ */
+static int pollWorker(replay_worker_t *worker, const replay_conn_t *sending, int timeoutMs)
+{
+    replay_conn_t *conn;
+    size_t count = worker->openCount;
+    int writable = 0;
+    int pollRet;
+    size_t i;
+
+    for (i = 0; i < count; i++)
+    {
+        conn = &worker->config->conns[worker->openIds[i]];
+        worker->pollfds[i].fd = conn->sockfd;
+        worker->pollfds[i].events = POLLIN | (conn == sending ? POLLOUT : 0);
+        worker->pollfds[i].revents = 0;
+    }
+
+    pollRet = poll(worker->pollfds, count, timeoutMs);
+    if (pollRet < 0)
+    {
+        return errno == EINTR ? 0 : -1;
+    }
+
+    // Backwards, since closing a connection moves the last one into its slot
+    for (i = count; i-- > 0;)
+    {
+        conn = &worker->config->conns[worker->openIds[i]];
+        if (conn == sending && (worker->pollfds[i].revents & POLLOUT))
+        {
+            writable = 1;
+        }
+        if (worker->pollfds[i].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            drainConn(worker, worker->openIds[i]);
+        }
+    }
+
+    return writable;
+}
+
+/**
+ * @brief Send all of an event's bytes, reading replies whenever the server
+ *  cannot take more so neither side waits on the other
+ */
+static void sendData(replay_worker_t *worker, uint64_t id, const uint8_t *buf, size_t len)
+{
+    replay_conn_t *conn = &worker->config->conns[id];
+    double stalledSince = 0;
+    ssize_t sendRet;
+
+    while (len > 0 && conn->sockfd != -1)
+    {
+        sendRet = send(conn->sockfd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sendRet > 0)
+        {
+            if (conn->sentAt == 0)
+            {
+                conn->sentAt = nowSeconds();
+            }
+            worker->bytesSent += sendRet;
+            buf += sendRet;
+            len -= sendRet;
+            stalledSince = 0;
+            continue;
+        }
+        if (sendRet < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            worker->droppedConns++;
+            closeConn(worker, id);
+            return;
+        }
+
+        if (stalledSince == 0)
+        {
+            stalledSince = nowSeconds();
+        }
+        else if (nowSeconds() - stalledSince > REPLAY_STALL_MS / 1000.0)
+        {
+            fprintf(stderr, "Connection %llu stalled, giving up on it\n",
+                    (unsigned long long)id);
+            worker->droppedConns++;
+            closeConn(worker, id);
+            return;
+        }
+        pollWorker(worker, conn, REPLAY_STALL_MS);
+    }
+}
+
+static void openConn(replay_worker_t *worker, const replay_event_t *event)
+{
+    const replay_config_t *config = worker->config;
+    replay_conn_t *conn = &config->conns[event->id];
+
+    if (conn->sockfd != -1)
+    {
+        return;
+    }
+
+    // Unix domain socket connections go over TCP unless -U is given
+    conn->sockfd = aesd_client_dial(event->transport == CAPTURE_TRANSPORT_UNIX &&
+                                            config->unixConfig.unixPath != NULL
+                                        ? &config->unixConfig
+                                        : &config->tcpConfig);
+    if (conn->sockfd == -1)
+    {
+        worker->failedConnects++;
+        return;
+    }
+
+    conn->closing = false;
+    conn->sentAt = 0;
+    conn->slot = worker->openCount;
+    worker->openIds[worker->openCount++] = event->id;
+}
+
+static void endConn(replay_worker_t *worker, uint64_t id)
+{
+    replay_conn_t *conn = &worker->config->conns[id];
+
+    if (conn->sockfd != -1 && !conn->closing)
+    {
+        shutdown(conn->sockfd, SHUT_WR);
+        conn->closing = true;
+    }
+}
+
+static void *workerThread(void *arg)
+{
+    replay_worker_t *worker = arg;
+    const replay_config_t *config = worker->config;
+    const replay_event_t *event;
+    double due;
+    double now;
+    double drainUntil;
+    size_t i;
+
+    for (i = 0; i < config->eventCount; i++)
+    {
+        event = &config->events[i];
+        if (!ownsConn(worker, event->id))
+        {
+            continue;
+        }
+
+        due = config->start + (config->speed > 0 ? event->atUs / 1e6 / config->speed : 0);
+        while ((now = nowSeconds()) < due)
+        {
+            // Whatever is left under a millisecond is waited out by polling
+            pollWorker(worker, NULL, (int)((due - now) * 1000));
+        }
+        if (config->speed > 0)
+        {
+            addSample(&worker->lags, now - due);
+        }
+        else
+        {
+            pollWorker(worker, NULL, 0);
+        }
+        worker->events++;
+
+        switch (event->type)
+        {
+        case CAPTURE_OPEN:
+            openConn(worker, event);
+            break;
+        case CAPTURE_DATA:
+            if (config->conns[event->id].sockfd == -1)
+            {
+                worker->skippedEvents++;
+                break;
+            }
+            sendData(worker, event->id, event->data, event->len);
+            break;
+        case CAPTURE_CLOSE:
+            endConn(worker, event->id);
+            break;
+        }
+    }
+    worker->finishedAt = nowSeconds();
+
+    // Close what the trace left open, and let the server finish replying
+    for (i = 0; i < worker->openCount; i++)
+    {
+        endConn(worker, worker->openIds[i]);
+    }
+    drainUntil = nowSeconds() + REPLAY_DRAIN_MS / 1000.0;
+    while (worker->openCount > 0 && (now = nowSeconds()) < drainUntil)
+    {
+        pollWorker(worker, NULL, (int)((drainUntil - now) * 1000) + 1);
+    }
+    while (worker->openCount > 0)
+    {
+        closeConn(worker, worker->openIds[0]);
+    }
+
+    return NULL;
+}
+
+static int compareDoubles(const void *a, const void *b)
+{
+    double lhs = *(const double *)a;
+    double rhs = *(const double *)b;
+
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+static double percentile(const replay_samples_t *samples, double fraction)
+{
+    if (samples->count == 0)
+    {
+        return 0.0;
+    }
+
+    return samples->values[(size_t)(fraction * (samples->count - 1))];
+}
+
+/**
+ * @brief Gather every worker's samples of one kind, sorted
+ */
+static void mergeSamples(const replay_worker_t *workers, int workerCount, bool lags,
+                         replay_samples_t *merged)
+{
+    const replay_samples_t *samples;
+    int i;
+
+    for (i = 0; i < workerCount; i++)
+    {
+        samples = lags ? &workers[i].lags : &workers[i].latencies;
+        merged->size += samples->count;
+    }
+    merged->values = malloc((merged->size != 0 ? merged->size : 1) * sizeof(double));
+    if (merged->values == NULL)
+    {
+        merged->size = 0;
+        return;
+    }
+
+    for (i = 0; i < workerCount; i++)
+    {
+        samples = lags ? &workers[i].lags : &workers[i].latencies;
+        memcpy(merged->values + merged->count, samples->values, samples->count * sizeof(double));
+        merged->count += samples->count;
+    }
+    qsort(merged->values, merged->count, sizeof(double), compareDoubles);
+}
+
+static void printSamples(const char *what, const replay_samples_t *samples)
+{
+    printf("%-20s p50 %10.1f  p99 %10.1f  p99.9 %10.1f  max %10.1f  (%zu)\n", what,
+           percentile(samples, 0.5) * 1e6, percentile(samples, 0.99) * 1e6,
+           percentile(samples, 0.999) * 1e6, percentile(samples, 1.0) * 1e6, samples->count);
+}
+
+static void printResult(const replay_config_t *config, const replay_worker_t *workers)
+{
+    double traceSeconds = config->eventCount > 0
+                              ? config->events[config->eventCount - 1].atUs / 1e6
+                              : 0.0;
+    double elapsed = 0;
+    uint64_t events = 0;
+    uint64_t bytesSent = 0;
+    uint64_t bytesReceived = 0;
+    uint64_t failedConnects = 0;
+    uint64_t droppedConns = 0;
+    uint64_t skippedEvents = 0;
+    replay_samples_t lags = {0};
+    replay_samples_t latencies = {0};
+    int i;
+
+    for (i = 0; i < config->workerCount; i++)
+    {
+        if (workers[i].finishedAt - config->start > elapsed)
+        {
+            elapsed = workers[i].finishedAt - config->start;
+        }
+        events += workers[i].events;
+        bytesSent += workers[i].bytesSent;
+        bytesReceived += workers[i].bytesReceived;
+        failedConnects += workers[i].failedConnects;
+        droppedConns += workers[i].droppedConns;
+        skippedEvents += workers[i].skippedEvents;
+    }
+    elapsed = elapsed > 0 ? elapsed : 1e-9;
+    traceSeconds = traceSeconds > 0 ? traceSeconds : 1e-9;
+
+    printf("trace:       %llu connections, %zu events, %llu bytes over %.3f s\n",
+           (unsigned long long)config->connCount, config->eventCount,
+           (unsigned long long)config->dataBytes, traceSeconds);
+    if (config->speed > 0)
+    {
+        printf("replay:      %.3f s at %gx, scheduled %.3f s (%+.1f%%)\n", elapsed, config->speed,
+               traceSeconds / config->speed,
+               (elapsed / (traceSeconds / config->speed) - 1) * 100);
+    }
+    else
+    {
+        printf("replay:      %.3f s as fast as possible, %.1fx the recorded pace\n", elapsed,
+               traceSeconds / elapsed);
+    }
+    printf("throughput:  %.0f events/s, %.2f MB/s (recorded %.0f events/s, %.2f MB/s)\n",
+           events / elapsed, bytesSent / elapsed / 1e6, config->eventCount / traceSeconds,
+           config->dataBytes / traceSeconds / 1e6);
+    printf("received:    %llu bytes\n", (unsigned long long)bytesReceived);
+    printf("connections: %llu failed to connect, %llu dropped, %llu events skipped\n",
+           (unsigned long long)failedConnects, (unsigned long long)droppedConns,
+           (unsigned long long)skippedEvents);
+
+    mergeSamples(workers, config->workerCount, true, &lags);
+    mergeSamples(workers, config->workerCount, false, &latencies);
+    if (config->speed > 0)
+    {
+        printSamples("schedule lag (us)", &lags);
+    }
+    printSamples("reply latency (us)", &latencies);
+    free(lags.values);
+    free(latencies.values);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "USAGE: %s -f trace [-H host] [-p port] [-U unix socket path] [-x speed]\n"
+            "          [-c threads]\n\n"
+            "  Replays a trace recorded with aesdsocket -R. -x 1 keeps to the\n"
+            "  recorded pace, -x 10 to ten times it, and -x 0 sends as fast as\n"
+            "  possible. Connections are spread over -c threads, and recorded\n"
+            "  unix domain socket connections go over -U if given, TCP otherwise.\n"
+            "  Schedule lag is how late each event went out, reply latency how\n"
+            "  long the server took to start replying after a send.\n",
+            prog);
+}
+
+int main(int argc, char *argv[])
+{
+    replay_config_t config;
+    replay_worker_t *workers;
+    const char *tracePath = NULL;
+    uint64_t owned;
+    uint64_t id;
+    int opt;
+    int i;
+
+    memset(&config, 0, sizeof(config));
+    config.tcpConfig.host = "localhost";
+    config.tcpConfig.port = "9000";
+    config.speed = 1.0;
+    config.workerCount = 4;
+
+    while ((opt = getopt(argc, argv, "f:H:p:U:x:c:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'f':
+            tracePath = optarg;
+            break;
+        case 'H':
+            config.tcpConfig.host = optarg;
+            break;
+        case 'p':
+            config.tcpConfig.port = optarg;
+            break;
+        case 'U':
+            config.unixConfig.unixPath = optarg;
+            break;
+        case 'x':
+            config.speed = strtod(optarg, NULL);
+            break;
+        case 'c':
+            config.workerCount = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (tracePath == NULL || config.speed < 0 || config.workerCount < 1)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+
+    if (loadTrace(tracePath, &config) != 0)
+    {
+        return -1;
+    }
+
+    config.conns = malloc((config.connCount + 1) * sizeof(replay_conn_t));
+    workers = calloc(config.workerCount, sizeof(replay_worker_t));
+    if (config.conns == NULL || workers == NULL)
+    {
+        perror("Could not set up the replay");
+        return -1;
+    }
+    for (id = 0; id <= config.connCount; id++)
+    {
+        config.conns[id].sockfd = -1;
+    }
+
+    // Threads start once all are created, so none is behind from the start
+    config.start = nowSeconds() + 0.1;
+    for (i = 0; i < config.workerCount; i++)
+    {
+        workers[i].config = &config;
+        workers[i].index = i;
+        owned = config.connCount / config.workerCount + 1;
+        workers[i].recvBuff = malloc(AESD_CLIENT_RECV_BYTES);
+        workers[i].openIds = malloc(owned * sizeof(uint64_t));
+        workers[i].pollfds = malloc(owned * sizeof(struct pollfd));
+        if (workers[i].recvBuff == NULL || workers[i].openIds == NULL ||
+            workers[i].pollfds == NULL)
+        {
+            perror("Could not set up the replay");
+            return -1;
+        }
+        if (pthread_create(&workers[i].thread, NULL, workerThread, &workers[i]) != 0)
+        {
+            perror("pthread_create() error");
+            return -1;
+        }
+    }
+
+    for (i = 0; i < config.workerCount; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    printResult(&config, workers);
+    return 0;
+}
@@ -0,0 +1,790 @@
+/**
+ * @file aesd-replica.c
+ * @brief Leader/follower replication of file-backed channels
+ *
+ * A follower runs a thread per replicated channel, which connects to the
+ * leader, applies the frames it streams and reconnects when the stream
+ * breaks. Bytes after the last newline received are held back until their
+ * packet completes, so the copy is appended to in whole packets, indexed
+ * and published to subscribers just as on the leader.
+ */
+
+#include "aesd-replica.h"
+#include "aesd-scan.h"
+#include "aesd-stats.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+
+#define REPLICATE_CMD_STR   "AESDCHAR_REPLICATE:"
+// Followed by the stream's token and a newline
+#define REPLICATE_OK_STR    "AESDCHAR_REPLICATE:OK:"
+// Random bytes in a token, which is twice as many hex digits
+#define TOKEN_BYTES         (REPLICA_TOKEN_LEN / 2)
+// Longest first line of the leader's answer that is read, OK or an error
+#define ANSWER_LINE_MAX     64
+
+typedef struct replica_stream_s replica_stream_t;
+
+/**
+ * A channel copied from the leader by a follower, or streamed to a
+ * follower by the leader
+ */
+struct replica_stream_s
+{
+    aesd_channel_t *channel;
+    pthread_t thread;
+    // Connection to the leader, -1 while there is none
+    int sockfd;
+    // Bytes of the log in the copy, or sent to the follower
+    uint64_t offset;
+    // Length of the leader's log as last heard
+    uint64_t leaderLength;
+    // Monotonic time offset last reached leaderLength
+    uint64_t caughtUpMs;
+    // Share of STAT_REPLICATION_LAG_BYTES that is a copy's
+    uint64_t lagCounted;
+    // Bytes received past the last newline, waiting for the rest of their
+    // packet
+    char *partial;
+    size_t partialLen;
+    size_t partialSize;
+    char *frame;
+    // Issued by the leader for this stream, and presented by the follower's
+    // connections forwarding appends. Empty while a copy is not connected.
+    char token[REPLICA_TOKEN_LEN + 1];
+    SLIST_ENTRY(replica_stream_s) entries;
+};
+
+// Everything below is guarded by replicaMutex
+static pthread_mutex_t replicaMutex = PTHREAD_MUTEX_INITIALIZER;
+// Broadcast whenever a copy grows, and when streams should stop
+static pthread_cond_t replicaProgress = PTHREAD_COND_INITIALIZER;
+static SLIST_HEAD(replica_stream_list_s, replica_stream_s) copies =
+    SLIST_HEAD_INITIALIZER(copies);
+static struct replica_stream_list_s served = SLIST_HEAD_INITIALIZER(served);
+static bool following = false;
+static bool stopping = false;
+static char leaderHost[NI_MAXHOST];
+static char leaderPort[NI_MAXSERV];
+static aesd_client_config_t leaderConfig;
+
+static uint64_t monotonicMs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void deadlineIn(struct timespec *deadline, int timeoutMs)
+{
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec += timeoutMs / 1000;
+    deadline->tv_nsec += (timeoutMs % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L)
+    {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+static uint64_t lagBytes(const replica_stream_t *stream)
+{
+    return stream->leaderLength > stream->offset ? stream->leaderLength - stream->offset : 0;
+}
+
+/**
+ * @brief Note the leader's length, and when the stream last caught up with
+ *  it. Called with replicaMutex held.
+ */
+static void updateLag(replica_stream_t *stream, uint64_t leaderLength)
+{
+    stream->leaderLength = leaderLength;
+    if (lagBytes(stream) == 0)
+    {
+        stream->caughtUpMs = monotonicMs();
+    }
+}
+
+static int reservePartial(replica_stream_t *stream, size_t needed)
+{
+    char *grown;
+    size_t size = stream->partialSize != 0 ? stream->partialSize : 4096;
+
+    if (needed <= stream->partialSize)
+    {
+        return 0;
+    }
+
+    while (size < needed)
+    {
+        size *= 2;
+    }
+    grown = realloc(stream->partial, size);
+    if (grown == NULL)
+    {
+        return -1;
+    }
+    stream->partial = grown;
+    stream->partialSize = size;
+    return 0;
+}
+
+/**
+ * @brief Append whole packets to the copy, adding their bytes to applied.
+ *  Caller must hold the channel lock.
+ */
+static int appendBatch(replica_stream_t *stream, const struct iovec *packets, uint32_t count,
+                       uint64_t *applied)
+{
+    uint32_t i;
+
+    if (aesd_channel_append_packets(stream->channel, packets, count) != 0)
+    {
+        return -1;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        *applied += packets[i].iov_len;
+    }
+    // Held back bytes only ever go out with the first batch
+    stream->partialLen = 0;
+    return 0;
+}
+
+/**
+ * @brief Append every packet completed by buf to the copy, in batches, and
+ *  hold on to whatever follows the last newline
+ *
+ * @return int
+ * @retval -1 Error
+ * @retval  0 Success
+ */
+static int applyBytes(replica_stream_t *stream, const char *buf, size_t len)
+{
+    struct iovec packets[CHANNEL_APPEND_BATCH_MAX];
+    const char *nlPtr;
+    uint32_t count = 0;
+    uint64_t applied = 0;
+    size_t pos = 0;
+    size_t end;
+    int retVal = 0;
+
+    if (aesd_channel_lock(stream->channel) != 0)
+    {
+        return -1;
+    }
+
+    while (retVal == 0 && (nlPtr = aesd_scan_newline(buf + pos, len - pos)) != NULL)
+    {
+        end = nlPtr - buf + 1;
+
+        // The first packet completes what was held back, and must go out
+        // as one piece to be indexed as one packet
+        if (stream->partialLen > 0 && count == 0 && pos == 0)
+        {
+            if (reservePartial(stream, stream->partialLen + end) != 0)
+            {
+                retVal = -1;
+                break;
+            }
+            memcpy(stream->partial + stream->partialLen, buf, end);
+            stream->partialLen += end;
+            packets[count].iov_base = stream->partial;
+            packets[count].iov_len = stream->partialLen;
+        }
+        else
+        {
+            packets[count].iov_base = (char *)buf + pos;
+            packets[count].iov_len = end - pos;
+        }
+        count++;
+        pos = end;
+
+        if (count == CHANNEL_APPEND_BATCH_MAX)
+        {
+            retVal = appendBatch(stream, packets, count, &applied);
+            count = 0;
+        }
+    }
+
+    if (retVal == 0 && count > 0)
+    {
+        retVal = appendBatch(stream, packets, count, &applied);
+    }
+    aesd_channel_unlock(stream->channel);
+
+    if (retVal == 0)
+    {
+        if (reservePartial(stream, stream->partialLen + len - pos) != 0)
+        {
+            return -1;
+        }
+        memcpy(stream->partial + stream->partialLen, buf + pos, len - pos);
+        stream->partialLen += len - pos;
+    }
+
+    pthread_mutex_lock(&replicaMutex);
+    stream->offset += applied;
+    pthread_cond_broadcast(&replicaProgress);
+    pthread_mutex_unlock(&replicaMutex);
+
+    aesd_stats_add(STAT_REPLICATION_BYTES, applied);
+    return retVal;
+}
+
+/**
+ * @brief Connect to the leader and ask for the channel from the end of the
+ *  copy
+ *
+ * @return int
+ * @retval -1 Error, or stopping
+ * @retval  0 Success, frames follow on stream->sockfd
+ */
+static int connectStream(replica_stream_t *stream)
+{
+    char request[CHANNEL_NAME_MAX + 64];
+    char answer[ANSWER_LINE_MAX];
+    size_t answerLen = 0;
+    const char *token;
+    uint64_t offset;
+    int requestLen;
+    int sockfd;
+
+    if (aesd_channel_lock(stream->channel) != 0)
+    {
+        return -1;
+    }
+    offset = stream->channel->dataLength;
+    aesd_channel_unlock(stream->channel);
+
+    sockfd = aesd_client_dial(&leaderConfig);
+    if (sockfd == -1)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&replicaMutex);
+    if (stopping)
+    {
+        pthread_mutex_unlock(&replicaMutex);
+        close(sockfd);
+        return -1;
+    }
+    // From here on a stop shuts it down to get the thread out of recv()
+    stream->sockfd = sockfd;
+    stream->offset = offset;
+    stream->partialLen = 0;
+    stream->token[0] = '\0';
+    pthread_mutex_unlock(&replicaMutex);
+
+    requestLen = snprintf(request, sizeof(request), "%s%s,%llu\n", REPLICATE_CMD_STR,
+                          stream->channel->name, (unsigned long long)offset);
+    if (aesd_client_send_all(sockfd, request, requestLen) != 0)
+    {
+        return -1;
+    }
+
+    // The answer is a line of its own, frames only start after it
+    do
+    {
+        if (aesd_client_recv_all(sockfd, answer + answerLen, 1) != 0)
+        {
+            return -1;
+        }
+    } while (answer[answerLen++] != '\n' && answerLen < sizeof(answer) - 1);
+    answer[answerLen] = '\0';
+
+    token = answer + strlen(REPLICATE_OK_STR);
+    if (strncmp(answer, REPLICATE_OK_STR, strlen(REPLICATE_OK_STR)) != 0 ||
+        answerLen != strlen(REPLICATE_OK_STR) + REPLICA_TOKEN_LEN + 1 ||
+        strspn(token, "0123456789abcdef") != REPLICA_TOKEN_LEN)
+    {
+        syslog(LOG_ERR, "Leader refused to replicate %s from %llu: %s", stream->channel->name,
+               (unsigned long long)offset, answer);
+        return -1;
+    }
+
+    pthread_mutex_lock(&replicaMutex);
+    memcpy(stream->token, token, REPLICA_TOKEN_LEN);
+    stream->token[REPLICA_TOKEN_LEN] = '\0';
+    pthread_mutex_unlock(&replicaMutex);
+
+    syslog(LOG_INFO, "Replicating %s from %s:%s at %llu", stream->channel->name, leaderHost,
+           leaderPort, (unsigned long long)offset);
+    return 0;
+}
+
+/**
+ * @brief Apply frames until the stream breaks
+ */
+static void applyFrames(replica_stream_t *stream)
+{
+    uint8_t header[REPLICA_FRAME_HEADER_LEN];
+    uint64_t frameOffset;
+    uint64_t leaderLength;
+    uint32_t frameLen;
+
+    while (aesd_client_recv_all(stream->sockfd, header, sizeof(header)) == 0)
+    {
+        memcpy(&frameOffset, header, sizeof(frameOffset));
+        memcpy(&frameLen, header + 8, sizeof(frameLen));
+        memcpy(&leaderLength, header + 12, sizeof(leaderLength));
+        frameOffset = be64toh(frameOffset);
+        frameLen = be32toh(frameLen);
+        leaderLength = be64toh(leaderLength);
+
+        // Frames follow on from one another, anything else is a broken stream
+        if (frameOffset != stream->offset + stream->partialLen || frameLen > REPLICA_FRAME_MAX)
+        {
+            syslog(LOG_ERR, "Replication of %s got a frame of %u bytes at %llu, expected %llu",
+                   stream->channel->name, frameLen, (unsigned long long)frameOffset,
+                   (unsigned long long)(stream->offset + stream->partialLen));
+            return;
+        }
+
+        if (aesd_client_recv_all(stream->sockfd, stream->frame, frameLen) != 0 ||
+            (frameLen > 0 && applyBytes(stream, stream->frame, frameLen) != 0))
+        {
+            return;
+        }
+
+        pthread_mutex_lock(&replicaMutex);
+        updateLag(stream, leaderLength);
+        aesd_stats_add(STAT_REPLICATION_LAG_BYTES,
+                       (int64_t)lagBytes(stream) - (int64_t)stream->lagCounted);
+        stream->lagCounted = lagBytes(stream);
+        pthread_mutex_unlock(&replicaMutex);
+    }
+}
+
+static void *copyThread(void *arg)
+{
+    replica_stream_t *stream = arg;
+    struct timespec retryAt;
+    bool reconnecting = false;
+
+    pthread_mutex_lock(&replicaMutex);
+    while (!stopping)
+    {
+        pthread_mutex_unlock(&replicaMutex);
+
+        if (reconnecting)
+        {
+            aesd_stats_add(STAT_REPLICATION_RECONNECTS, 1);
+        }
+        if (connectStream(stream) == 0)
+        {
+            applyFrames(stream);
+            syslog(LOG_WARNING, "Replication of %s from %s:%s broke, reconnecting",
+                   stream->channel->name, leaderHost, leaderPort);
+        }
+        reconnecting = true;
+
+        pthread_mutex_lock(&replicaMutex);
+        if (stream->sockfd != -1)
+        {
+            close(stream->sockfd);
+            stream->sockfd = -1;
+        }
+        stream->token[0] = '\0';
+
+        deadlineIn(&retryAt, REPLICA_RETRY_MS);
+        while (!stopping &&
+               pthread_cond_timedwait(&replicaProgress, &replicaMutex, &retryAt) != ETIMEDOUT)
+        {
+        }
+    }
+    pthread_mutex_unlock(&replicaMutex);
+
+    return NULL;
+}
+
+int aesd_replica_init(const char *host, const char *port)
+{
+    pthread_mutex_lock(&replicaMutex);
+    following = false;
+    stopping = false;
+    pthread_mutex_unlock(&replicaMutex);
+
+    if (host == NULL)
+    {
+        return 0;
+    }
+
+    if (aesd_channel_default()->charDevice)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    snprintf(leaderHost, sizeof(leaderHost), "%s", host);
+    snprintf(leaderPort, sizeof(leaderPort), "%s", port);
+    memset(&leaderConfig, 0, sizeof(leaderConfig));
+    leaderConfig.host = leaderHost;
+    leaderConfig.port = leaderPort;
+
+    pthread_mutex_lock(&replicaMutex);
+    following = true;
+    pthread_mutex_unlock(&replicaMutex);
+
+    if (aesd_replica_track(aesd_channel_default()) != 0)
+    {
+        aesd_replica_stop();
+        pthread_mutex_lock(&replicaMutex);
+        following = false;
+        pthread_mutex_unlock(&replicaMutex);
+        return -1;
+    }
+
+    syslog(LOG_INFO, "Following the leader at %s:%s", host, port);
+    return 0;
+}
+
+void aesd_replica_stop(void)
+{
+    replica_stream_t *stream;
+
+    pthread_mutex_lock(&replicaMutex);
+    stopping = true;
+    SLIST_FOREACH(stream, &copies, entries)
+    {
+        if (stream->sockfd != -1)
+        {
+            shutdown(stream->sockfd, SHUT_RDWR);
+        }
+    }
+    // Their connection threads see the stream break and close them
+    SLIST_FOREACH(stream, &served, entries)
+    {
+        shutdown(stream->sockfd, SHUT_RDWR);
+    }
+    pthread_cond_broadcast(&replicaProgress);
+    pthread_mutex_unlock(&replicaMutex);
+
+    // Nothing adds copies once stopping
+    while (!SLIST_EMPTY(&copies))
+    {
+        stream = SLIST_FIRST(&copies);
+        SLIST_REMOVE_HEAD(&copies, entries);
+        pthread_join(stream->thread, NULL);
+
+        aesd_stats_add(STAT_REPLICATION_LAG_BYTES, -(int64_t)stream->lagCounted);
+        free(stream->partial);
+        free(stream->frame);
+        free(stream);
+    }
+}
+
+bool aesd_replica_following(void)
+{
+    bool isFollowing;
+
+    pthread_mutex_lock(&replicaMutex);
+    isFollowing = following;
+    pthread_mutex_unlock(&replicaMutex);
+
+    return isFollowing;
+}
+
+const aesd_client_config_t *aesd_replica_leader(void)
+{
+    return &leaderConfig;
+}
+
+void aesd_replica_token(const aesd_channel_t *channel, char *token)
+{
+    replica_stream_t *stream;
+
+    token[0] = '\0';
+    pthread_mutex_lock(&replicaMutex);
+    SLIST_FOREACH(stream, &copies, entries)
+    {
+        if (stream->channel == channel)
+        {
+            memcpy(token, stream->token, sizeof(stream->token));
+            break;
+        }
+    }
+    pthread_mutex_unlock(&replicaMutex);
+}
+
+static replica_stream_t *findCopy(const aesd_channel_t *channel)
+{
+    replica_stream_t *stream;
+
+    SLIST_FOREACH(stream, &copies, entries)
+    {
+        if (stream->channel == channel)
+        {
+            return stream;
+        }
+    }
+
+    return NULL;
+}
+
+int aesd_replica_track(aesd_channel_t *channel)
+{
+    replica_stream_t *stream;
+    sigset_t allSignals;
+    sigset_t oldSignals;
+    int retVal;
+
+    pthread_mutex_lock(&replicaMutex);
+    if (!following || stopping || findCopy(channel) != NULL)
+    {
+        pthread_mutex_unlock(&replicaMutex);
+        return 0;
+    }
+
+    stream = calloc(1, sizeof(replica_stream_t));
+    if (stream == NULL || (stream->frame = malloc(REPLICA_FRAME_MAX)) == NULL)
+    {
+        pthread_mutex_unlock(&replicaMutex);
+        free(stream);
+        return -1;
+    }
+    stream->channel = channel;
+    stream->sockfd = -1;
+    stream->caughtUpMs = monotonicMs();
+
+    // Signals are for the main thread, the copier inherits this mask
+    sigfillset(&allSignals);
+    pthread_sigmask(SIG_BLOCK, &allSignals, &oldSignals);
+    retVal = pthread_create(&stream->thread, NULL, copyThread, stream);
+    pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+
+    if (retVal != 0)
+    {
+        pthread_mutex_unlock(&replicaMutex);
+        errno = retVal;
+        perror("pthread_create() error for replication");
+        free(stream->frame);
+        free(stream);
+        return -1;
+    }
+
+    SLIST_INSERT_HEAD(&copies, stream, entries);
+    pthread_mutex_unlock(&replicaMutex);
+    return 0;
+}
+
+int aesd_replica_wait(aesd_channel_t *channel, uint64_t length, int timeoutMs)
+{
+    replica_stream_t *stream;
+    struct timespec deadline;
+    int retVal = 0;
+
+    deadlineIn(&deadline, timeoutMs);
+
+    pthread_mutex_lock(&replicaMutex);
+    stream = findCopy(channel);
+    while (retVal == 0 && (stream == NULL || stream->offset < length))
+    {
+        if (stream == NULL || stopping ||
+            pthread_cond_timedwait(&replicaProgress, &replicaMutex, &deadline) == ETIMEDOUT)
+        {
+            retVal = -1;
+        }
+    }
+    pthread_mutex_unlock(&replicaMutex);
+
+    return retVal;
+}
+
+/**
+ * @brief Fill token with REPLICA_TOKEN_LEN random hex digits and a NUL
+ *
+ * @return int
+ * @retval -1 Error
+ * @retval  0 Success
+ */
+static int newToken(char *token)
+{
+    uint8_t bytes[TOKEN_BYTES];
+    size_t i;
+
+    if (getrandom(bytes, sizeof(bytes), 0) != (ssize_t)sizeof(bytes))
+    {
+        perror("getrandom() error for replication token");
+        return -1;
+    }
+    for (i = 0; i < sizeof(bytes); i++)
+    {
+        snprintf(token + 2 * i, 3, "%02x", bytes[i]);
+    }
+
+    return 0;
+}
+
+int aesd_replica_serve(aesd_channel_t *channel, int sockfd, uint64_t offset)
+{
+    const struct timespec heartbeat = {
+        .tv_sec = REPLICA_HEARTBEAT_MS / 1000,
+        .tv_nsec = (REPLICA_HEARTBEAT_MS % 1000) * 1000000L,
+    };
+    replica_stream_t stream = {
+        .channel = channel,
+        .sockfd = sockfd,
+        .offset = offset,
+        .caughtUpMs = monotonicMs(),
+    };
+    uint8_t *frame = malloc(REPLICA_FRAME_HEADER_LEN + REPLICA_FRAME_MAX);
+    char answer[sizeof(REPLICATE_OK_STR) + REPLICA_TOKEN_LEN + 1];
+    uint64_t beOffset;
+    uint64_t beLength;
+    uint32_t beLen;
+    int64_t length;
+    size_t frameLen;
+    ssize_t readRet;
+
+    if (frame == NULL || newToken(stream.token) != 0)
+    {
+        free(frame);
+        return -1;
+    }
+
+    pthread_mutex_lock(&replicaMutex);
+    if (stopping)
+    {
+        pthread_mutex_unlock(&replicaMutex);
+        free(frame);
+        return -1;
+    }
+    SLIST_INSERT_HEAD(&served, &stream, entries);
+    pthread_mutex_unlock(&replicaMutex);
+    aesd_stats_add(STAT_REPLICAS_CONNECTED, 1);
+
+    // Only once the token is listed, so a forwarding connection can never
+    // present it too early
+    snprintf(answer, sizeof(answer), "%s%s\n", REPLICATE_OK_STR, stream.token);
+    if (aesd_client_send_all(sockfd, answer, strlen(answer)) != 0)
+    {
+        goto unlist;
+    }
+
+    // Appends past the end of the log wake this up, otherwise a heartbeat
+    // goes out, which is also how a follower that went away is noticed
+    while ((length = aesd_channel_wait_append(channel, offset, &heartbeat)) >= 0)
+    {
+        frameLen = (uint64_t)length - offset < REPLICA_FRAME_MAX ? (uint64_t)length - offset
+                                                                 : REPLICA_FRAME_MAX;
+
+        // The log is only ever appended to, so this is read without the lock
+        readRet = frameLen > 0 ? pread(channel->fd, frame + REPLICA_FRAME_HEADER_LEN, frameLen,
+                                       offset)
+                               : 0;
+        if (readRet < 0)
+        {
+            perror("pread() error replicating channel log");
+            break;
+        }
+        frameLen = readRet;
+
+        beOffset = htobe64(offset);
+        beLen = htobe32(frameLen);
+        beLength = htobe64(length);
+        memcpy(frame, &beOffset, sizeof(beOffset));
+        memcpy(frame + 8, &beLen, sizeof(beLen));
+        memcpy(frame + 12, &beLength, sizeof(beLength));
+        if (aesd_client_send_all(sockfd, frame, REPLICA_FRAME_HEADER_LEN + frameLen) != 0)
+        {
+            break;
+        }
+        offset += frameLen;
+
+        pthread_mutex_lock(&replicaMutex);
+        stream.offset = offset;
+        updateLag(&stream, length);
+        pthread_mutex_unlock(&replicaMutex);
+    }
+
+unlist:
+    pthread_mutex_lock(&replicaMutex);
+    SLIST_REMOVE(&served, &stream, replica_stream_s, entries);
+    pthread_mutex_unlock(&replicaMutex);
+    aesd_stats_add(STAT_REPLICAS_CONNECTED, -1);
+    free(frame);
+
+    syslog(LOG_INFO, "Follower of %s went away at %llu", channel->name,
+           (unsigned long long)offset);
+    return -1;
+}
+
+bool aesd_replica_is_follower_token(const char *token)
+{
+    replica_stream_t *stream;
+    bool found = false;
+
+    pthread_mutex_lock(&replicaMutex);
+    SLIST_FOREACH(stream, &served, entries)
+    {
+        if (strcmp(stream->token, token) == 0)
+        {
+            found = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&replicaMutex);
+
+    return found;
+}
+
+size_t aesd_replica_format(char *buf, size_t len)
+{
+    const struct replica_stream_list_s *list;
+    replica_stream_t *stream;
+    uint64_t nowMs = monotonicMs();
+    size_t used;
+    int written;
+
+    pthread_mutex_lock(&replicaMutex);
+
+    if (following)
+    {
+        written = snprintf(buf, len, "role follower leader=%s:%s\n", leaderHost, leaderPort);
+        list = &copies;
+    }
+    else
+    {
+        written = snprintf(buf, len, "role leader followers=%llu\n",
+                           (unsigned long long)aesd_stats_get(STAT_REPLICAS_CONNECTED));
+        list = &served;
+    }
+    used = written < 0 ? 0 : (size_t)written < len ? (size_t)written : len;
+
+    SLIST_FOREACH(stream, list, entries)
+    {
+        written = snprintf(buf + used, len - used,
+                           "%s %s offset=%llu leader_length=%llu lag_bytes=%llu lag_ms=%llu\n",
+                           following ? "copy" : "follower", stream->channel->name,
+                           (unsigned long long)stream->offset,
+                           (unsigned long long)stream->leaderLength,
+                           (unsigned long long)lagBytes(stream),
+                           (unsigned long long)(lagBytes(stream) > 0
+                                                    ? nowMs - stream->caughtUpMs
+                                                    : 0));
+        if (written < 0 || (size_t)written >= len - used)
+        {
+            break;
+        }
+        used += written;
+    }
+
+    pthread_mutex_unlock(&replicaMutex);
+    return used;
+}
@@ -0,0 +1,132 @@
+/**
+ * @file aesd-replica.h
+ * @brief Leader/follower replication of file-backed channels
+ *
+ * A follower keeps a byte-for-byte copy of every channel it serves,
+ * streamed from the leader, and answers echo-backs, seeks, reads and
+ * subscribers from that copy. Packets its connections send are forwarded
+ * to the leader, and their echo-back waits until the copy has caught up
+ * past them, so a peer still reads its own writes.
+ *
+ * A follower asks for a channel with AESDCHAR_REPLICATE:<channel>,<offset>,
+ * offset being how much of the log it already has. The leader answers
+ * AESDCHAR_REPLICATE:OK:<token>, or AESDCHAR_ERROR:<errno name>, and
+ * streams the log from there in frames: the frame's offset in the log, its length and
+ * the leader's log length at the time, all big-endian, then the bytes. An
+ * empty frame goes out every REPLICA_HEARTBEAT_MS that nothing is
+ * appended, keeping the follower's lag current. Whenever the stream breaks
+ * the follower reconnects and resumes from the length of its own copy.
+ *
+ * The token is random and lasts as long as its stream. A follower's
+ * connections forwarding appends present it with AESDCHAR_FOLLOWER:<token>
+ * as they connect, which is what exempts their packets from the leader's
+ * lock deadline.
+ *
+ * The leader cannot tell a follower's copy has diverged from its log as
+ * long as the copy is not the longer one, so a follower must start empty
+ * or from a copy it made itself.
+ */
+
+#pragma once
+
+#include "./aesd-channel.h"
+#include "./aesd-client.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Offset, length and the leader's log length
+#define REPLICA_FRAME_HEADER_LEN    20
+// Most bytes sent in one frame
+#define REPLICA_FRAME_MAX       (1024 * 1024)
+#define REPLICA_HEARTBEAT_MS    1000
+// How long a follower waits before connecting again after a stream breaks
+#define REPLICA_RETRY_MS        1000
+// Hex digits in the token a leader issues per stream
+#define REPLICA_TOKEN_LEN       32
+// How long a forwarded burst waits for the copy to catch up before its
+// echo-back is answered with an error instead
+#define REPLICA_CATCH_UP_MS     5000
+
+/**
+ * @brief Lead, with host NULL, or follow the leader at host and port,
+ *  replicating the default channel straight away and other channels once
+ *  used
+ *
+ * @return int
+ * @retval -1 Error, errno EINVAL if the default channel is the aesdchar
+ *  driver, which cannot be replicated into
+ * @retval  0 Success
+ */
+int aesd_replica_init(const char *host, const char *port);
+
+/**
+ * @brief Stop every replication stream, copied or served, so connections
+ *  streaming to followers end. Appends are still forwarded to the leader.
+ */
+void aesd_replica_stop(void);
+
+/**
+ * @brief Whether this server follows a leader, so appends go to it
+ */
+bool aesd_replica_following(void);
+
+/**
+ * @brief Where the leader listens, for connections forwarding appends.
+ *  Only meaningful while following.
+ */
+const aesd_client_config_t *aesd_replica_leader(void);
+
+/**
+ * @brief Copy the token the leader issued for the stream copying channel
+ *  into token, REPLICA_TOKEN_LEN + 1 bytes, or an empty string while the
+ *  stream is not connected. Only meaningful while following.
+ */
+void aesd_replica_token(const aesd_channel_t *channel, char *token);
+
+/**
+ * @brief Start replicating a channel, if following and not already
+ *
+ * @return int
+ * @retval -1 Error
+ * @retval  0 Success, or nothing to do
+ */
+int aesd_replica_track(aesd_channel_t *channel);
+
+/**
+ * @brief Wait until the copy of a channel holds at least length bytes
+ *
+ * @return int
+ * @retval -1 Timed out, or the channel is not replicated
+ * @retval  0 Success
+ */
+int aesd_replica_wait(aesd_channel_t *channel, uint64_t length, int timeoutMs);
+
+/**
+ * @brief Answer AESDCHAR_REPLICATE:OK with a new token and stream a
+ *  channel's log to a follower from offset, as the leader, until the
+ *  follower goes away
+ *
+ * The caller should check the channel is file-backed and offset is not past
+ * its end first.
+ *
+ * @return int
+ * @retval -1 Error or follower gone
+ */
+int aesd_replica_serve(aesd_channel_t *channel, int sockfd, uint64_t offset);
+
+/**
+ * @brief Whether token was issued for a stream still being served, as the
+ *  leader
+ */
+bool aesd_replica_is_follower_token(const char *token);
+
+/**
+ * @brief Write a "role ..." line and a line per replicated channel, as a
+ *  follower, or per follower served, as a leader, with how far behind each
+ *  is in bytes and milliseconds
+ *
+ * @return size_t Number of bytes written, truncated to fit len
+ */
+size_t aesd_replica_format(char *buf, size_t len);
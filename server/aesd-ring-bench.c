@@ -0,0 +1,315 @@
+/**
+ * @file aesd-ring-bench.c
+ * @brief Load generator for the shared-memory ingest ring
+ *
+ * Fetches the ring from aesdsocket over its unix domain socket, then has
+ * every producer thread append its packets through libaesdring, retrying
+ * whenever the ring is full. Reports how fast producers got their packets
+ * in, and how fast the server appended them to the log going by its
+ * ring_packets_ingested counter.
+ */
+
+#include "aesd-ring-client.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define INGEST_STAT_NAME    "ring_packets_ingested "
+// Ingest is done once the server's count has not moved for this long
+#define INGEST_SETTLE_SEC   0.5
+
+typedef struct bench_config_s
+{
+    const char *unixPath;
+    int producers;
+    int packets;
+    int packetSize;
+} bench_config_t;
+
+typedef struct bench_thread_s
+{
+    pthread_t threadHandle;
+    int id;
+    const bench_config_t *config;
+    aesd_ring_client_t *client;
+    uint64_t packetsSent;
+    // Appends that found the ring full and had to be retried
+    uint64_t fullRetries;
+    bool failed;
+} bench_thread_t;
+
+static uint32_t runNonce;
+
+static double nowSeconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fillPacket(char *packet, int packetSize, int id, int seq)
+{
+    int headerLen = snprintf(packet, packetSize, "%08x r%d s%d ", runNonce, id, seq);
+
+    if (headerLen >= packetSize)
+    {
+        headerLen = packetSize - 1;
+    }
+    memset(packet + headerLen, 'x', packetSize - headerLen - 1);
+    packet[packetSize - 1] = '\n';
+}
+
+static void *producerThread(void *arg)
+{
+    bench_thread_t *thread = arg;
+    const bench_config_t *config = thread->config;
+    char *packet = malloc(config->packetSize);
+    int seq;
+
+    thread->failed = true;
+    if (packet == NULL)
+    {
+        return NULL;
+    }
+
+    for (seq = 0; seq < config->packets; seq++)
+    {
+        fillPacket(packet, config->packetSize, thread->id, seq);
+        while (aesd_ring_client_append(thread->client, packet, config->packetSize) != 0)
+        {
+            if (errno != EAGAIN)
+            {
+                perror("Ring append failed");
+                free(packet);
+                return NULL;
+            }
+            thread->fullRetries++;
+            sched_yield();
+        }
+        thread->packetsSent++;
+    }
+
+    thread->failed = false;
+    free(packet);
+    return NULL;
+}
+
+/**
+ * @brief Ask the server how many ring packets it has appended so far
+ *
+ * @return int
+ * @retval -1 Error or counter missing from the reply
+ * @retval  0 Success
+ */
+static int queryIngested(const char *unixPath, uint64_t *ingested)
+{
+    const char statsCmd[] = "AESDCHAR_STATS\n";
+    struct sockaddr_un addr;
+    char reply[2048];
+    size_t replyLen = 0;
+    ssize_t recvRet;
+    char *line;
+    int retVal = -1;
+    int sockfd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, unixPath, sizeof(addr.sun_path) - 1);
+
+    sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd == -1)
+    {
+        return -1;
+    }
+
+    if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        send(sockfd, statsCmd, strlen(statsCmd), MSG_NOSIGNAL) < 0)
+    {
+        goto out;
+    }
+
+    // The reply has no terminator of its own, read until the line we want
+    // is complete
+    while (replyLen < sizeof(reply) - 1)
+    {
+        recvRet = recv(sockfd, reply + replyLen, sizeof(reply) - 1 - replyLen, 0);
+        if (recvRet <= 0)
+        {
+            break;
+        }
+        replyLen += recvRet;
+        reply[replyLen] = '\0';
+
+        line = strstr(reply, INGEST_STAT_NAME);
+        if (line != NULL && (line == reply || line[-1] == '\n') && strchr(line, '\n') != NULL)
+        {
+            *ingested = strtoull(line + strlen(INGEST_STAT_NAME), NULL, 10);
+            retVal = 0;
+            break;
+        }
+    }
+
+out:
+    close(sockfd);
+    return retVal;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "USAGE: %s -U unix socket path [-c producers] [-n packets] [-s packet size]\n\n"
+            "  Needs aesdsocket running with -u and -m. Each of -c threads\n"
+            "  appends -n packets of -s bytes to the shared-memory ring.\n",
+            prog);
+}
+
+int main(int argc, char *argv[])
+{
+    bench_config_t config = {
+        .unixPath = NULL,
+        .producers = 4,
+        .packets = 100000,
+        .packetSize = 64,
+    };
+    aesd_ring_client_t client;
+    bench_thread_t *threads;
+    uint64_t startCount;
+    uint64_t lastCount;
+    uint64_t count;
+    uint64_t sent = 0;
+    uint64_t fullRetries = 0;
+    double startTime;
+    double produceElapsed;
+    double lastChange;
+    int failures = 0;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "U:c:n:s:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'U':
+            config.unixPath = optarg;
+            break;
+        case 'c':
+            config.producers = atoi(optarg);
+            break;
+        case 'n':
+            config.packets = atoi(optarg);
+            break;
+        case 's':
+            config.packetSize = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    // Room for the identifying header and the newline
+    if (config.unixPath == NULL || config.producers < 1 || config.packets < 1 ||
+        config.packetSize < 32)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+
+    runNonce = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
+
+    if (aesd_ring_client_open(&client, config.unixPath) != 0)
+    {
+        perror("Could not get the ring from the server");
+        return -1;
+    }
+
+    if ((size_t)config.packetSize > aesd_ring_max_packet(&client.ring))
+    {
+        fprintf(stderr, "Packets of %d bytes can never fit a ring of %llu bytes\n",
+                config.packetSize, (unsigned long long)client.ring.header->dataSize);
+        aesd_ring_client_close(&client);
+        return -1;
+    }
+
+    if (queryIngested(config.unixPath, &startCount) != 0)
+    {
+        fprintf(stderr, "Could not read ring_packets_ingested from the server\n");
+        aesd_ring_client_close(&client);
+        return -1;
+    }
+
+    threads = calloc(config.producers, sizeof(bench_thread_t));
+    if (threads == NULL)
+    {
+        aesd_ring_client_close(&client);
+        return -1;
+    }
+
+    startTime = nowSeconds();
+
+    for (i = 0; i < config.producers; i++)
+    {
+        threads[i].id = i;
+        threads[i].config = &config;
+        threads[i].client = &client;
+        if (pthread_create(&threads[i].threadHandle, NULL, producerThread, &threads[i]) != 0)
+        {
+            perror("pthread_create() error");
+            return -1;
+        }
+    }
+
+    for (i = 0; i < config.producers; i++)
+    {
+        pthread_join(threads[i].threadHandle, NULL);
+        sent += threads[i].packetsSent;
+        fullRetries += threads[i].fullRetries;
+        failures += threads[i].failed;
+    }
+
+    produceElapsed = nowSeconds() - startTime;
+
+    lastCount = startCount;
+    lastChange = nowSeconds();
+    while (lastCount - startCount < sent && nowSeconds() - lastChange < INGEST_SETTLE_SEC)
+    {
+        if (queryIngested(config.unixPath, &count) != 0)
+        {
+            break;
+        }
+        if (count != lastCount)
+        {
+            lastCount = count;
+            lastChange = nowSeconds();
+        }
+        usleep(1000);
+    }
+
+    printf("transport:          shared-memory ring (%llu bytes)\n",
+           (unsigned long long)client.ring.header->dataSize);
+    printf("producers:          %d\n", config.producers);
+    printf("packet size:        %d\n", config.packetSize);
+    printf("packets appended:   %llu\n", (unsigned long long)sent);
+    printf("append elapsed (s): %.3f\n", produceElapsed);
+    printf("appends/s:          %.0f\n", sent / produceElapsed);
+    printf("ring full retries:  %llu\n", (unsigned long long)fullRetries);
+    printf("packets ingested:   %llu\n", (unsigned long long)(lastCount - startCount));
+    printf("ingest elapsed (s): %.3f\n", lastChange - startTime);
+    printf("lines/s ingested:   %.0f\n", (lastCount - startCount) / (lastChange - startTime));
+    printf("failed producers:   %d\n", failures);
+
+    free(threads);
+    aesd_ring_client_close(&client);
+    return failures || lastCount - startCount != sent ? -1 : 0;
+}
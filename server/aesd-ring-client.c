@@ -0,0 +1,140 @@
+/**
+ * @file aesd-ring-client.c
+ * @brief Producer side of the aesdsocket shared-memory ingest ring
+ */
+
+#include "aesd-ring-client.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define RING_CMD_STR        "AESDCHAR_SHMRING\n"
+#define RING_REPLY_PREFIX   "AESDCHAR_SHMRING:"
+
+/**
+ * @brief Receive a one line reply and the descriptor travelling with it
+ *
+ * @return int The descriptor, or -1 on error
+ */
+static int recvFdReply(int sockfd, const char *replyPrefix, char *reply, size_t replySize)
+{
+    size_t replyLen = 0;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    ssize_t recvRet;
+    int fd = -1;
+
+    while (replyLen < replySize - 1 && memchr(reply, '\n', replyLen) == NULL)
+    {
+        iov.iov_base = reply + replyLen;
+        iov.iov_len = replySize - 1 - replyLen;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        recvRet = recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC);
+        if (recvRet <= 0)
+        {
+            if (recvRet < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        replyLen += recvRet;
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+                fd == -1)
+            {
+                memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+            }
+        }
+    }
+    reply[replyLen] = '\0';
+
+    if (strncmp(reply, replyPrefix, strlen(replyPrefix)) != 0 || fd == -1)
+    {
+        fprintf(stderr, "Server did not hand out a descriptor: %s", reply);
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+
+    return fd;
+}
+
+int aesd_local_request_fd(const char *unixPath, const char *request, const char *replyPrefix,
+                          char *reply, size_t replySize)
+{
+    struct sockaddr_un addr;
+    int sockfd;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(unixPath) >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, unixPath);
+
+    sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sockfd == -1)
+    {
+        return -1;
+    }
+
+    if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        send(sockfd, request, strlen(request), MSG_NOSIGNAL) < 0)
+    {
+        close(sockfd);
+        return -1;
+    }
+
+    fd = recvFdReply(sockfd, replyPrefix, reply, replySize);
+    // What the descriptor refers to outlives the connection it came over
+    close(sockfd);
+    return fd;
+}
+
+int aesd_ring_client_open(aesd_ring_client_t *client, const char *unixPath)
+{
+    char reply[128];
+    int ringFd;
+
+    memset(client, 0, sizeof(*client));
+    client->ring.fd = -1;
+
+    ringFd = aesd_local_request_fd(unixPath, RING_CMD_STR, RING_REPLY_PREFIX, reply,
+                                   sizeof(reply));
+    if (ringFd == -1)
+    {
+        return -1;
+    }
+
+    return aesd_ring_attach(&client->ring, ringFd);
+}
+
+int aesd_ring_client_append(aesd_ring_client_t *client, const char *buf, size_t len)
+{
+    return aesd_ring_write(&client->ring, buf, len);
+}
+
+void aesd_ring_client_close(aesd_ring_client_t *client)
+{
+    aesd_ring_close(&client->ring);
+}
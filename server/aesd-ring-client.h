@@ -0,0 +1,64 @@
+/**
+ * @file aesd-ring-client.h
+ * @brief Producer side of the aesdsocket shared-memory ingest ring
+ *
+ * A producer connects once to the server's unix domain socket, receives the
+ * ring's memfd and from then on appends packets by copying them into
+ * shared memory, with no system call unless the server is asleep and needs
+ * waking. Packets from every producer sharing the ring land in the default
+ * channel in the order their space was reserved. Nothing is echoed back.
+ *
+ * Link with libaesdring.a.
+ */
+
+#pragma once
+
+#include "./aesd-ring.h"
+
+#include <stddef.h>
+
+typedef struct aesd_ring_client_s aesd_ring_client_t;
+
+struct aesd_ring_client_s
+{
+    aesd_ring_t ring;
+};
+
+/**
+ * @brief Fetch the ring from a server started with -u and -m
+ *
+ * @param unixPath Path of the server's unix domain socket
+ * @return int
+ * @retval -1 Error, including a server without a ring
+ * @retval  0 Success
+ */
+int aesd_ring_client_open(aesd_ring_client_t *client, const char *unixPath);
+
+/**
+ * @brief Append one packet, adding its newline if it lacks one. Safe to
+ *  call from any number of threads at once.
+ *
+ * Never blocks: a full ring is reported so the caller can decide whether to
+ * retry, drop or fall back to a socket.
+ *
+ * @return int
+ * @retval -1 Error, errno EAGAIN if the ring is full or EMSGSIZE if the
+ *  packet can never fit
+ * @retval  0 Success
+ */
+int aesd_ring_client_append(aesd_ring_client_t *client, const char *buf, size_t len);
+
+void aesd_ring_client_close(aesd_ring_client_t *client);
+
+/**
+ * @brief Send a command over a fresh connection to the server's unix domain
+ *  socket and receive the descriptor its one line reply carries
+ *
+ * @param request Command line to send, including its newline
+ * @param replyPrefix What a successful reply starts with
+ * @param reply Filled with the reply, NUL terminated
+ * @param replySize Size of reply
+ * @return int The descriptor, or -1 on error, including an error reply
+ */
+int aesd_local_request_fd(const char *unixPath, const char *request, const char *replyPrefix,
+                          char *reply, size_t replySize);
@@ -0,0 +1,307 @@
+/**
+ * @file aesd-ring.c
+ * @brief Shared-memory multi-producer, single-consumer packet ring
+ *
+ * A record is an 8 byte header followed by the packet, padded to
+ * AESD_RING_ALIGN. A producer reserves header and packet together, plus a
+ * padding record first whenever the packet would otherwise run past the end
+ * of the data area. It fills in len and the packet, then publishes the
+ * record with a release store of its state. The consumer walks records from
+ * the tail with acquire loads and stops at the first one still empty, so
+ * packets come out in reservation order even if a later producer commits
+ * first.
+ *
+ * Consumed space is zeroed before the tail moves past it, which keeps every
+ * state word the consumer can reach empty until a producer commits it.
+ */
+
+#define _GNU_SOURCE
+
+#include "aesd-ring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#define RECORD_HEADER_LEN   sizeof(aesd_ring_record_t)
+
+static uint64_t recordSize(size_t len)
+{
+    return (RECORD_HEADER_LEN + len + AESD_RING_ALIGN - 1) & ~(uint64_t)(AESD_RING_ALIGN - 1);
+}
+
+static aesd_ring_record_t *recordAt(const aesd_ring_t *ring, uint64_t pos)
+{
+    return (aesd_ring_record_t *)(ring->data + (pos & ring->mask));
+}
+
+static int mapRing(aesd_ring_t *ring, int fd, size_t mapLen)
+{
+    ring->header = mmap(NULL, mapLen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ring->header == MAP_FAILED)
+    {
+        perror("mmap() error on ring");
+        return -1;
+    }
+
+    ring->fd = fd;
+    ring->mapLen = mapLen;
+    ring->data = (char *)ring->header + AESD_RING_DATA_OFFSET;
+    return 0;
+}
+
+int aesd_ring_create(aesd_ring_t *ring, size_t size)
+{
+    uint64_t dataSize = AESD_RING_MIN_SIZE;
+    int fd;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+    while (dataSize < size)
+    {
+        dataSize <<= 1;
+    }
+
+    fd = memfd_create("aesdsocket-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1)
+    {
+        perror("memfd_create() error for ring");
+        return -1;
+    }
+
+    if (ftruncate(fd, AESD_RING_DATA_OFFSET + dataSize) != 0 ||
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0)
+    {
+        perror("Sizing ring memfd failed");
+        close(fd);
+        return -1;
+    }
+
+    if (mapRing(ring, fd, AESD_RING_DATA_OFFSET + dataSize) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    // A fresh memfd reads as zeros, so every record starts out empty
+    ring->header->magic = AESD_RING_MAGIC;
+    ring->header->version = AESD_RING_VERSION;
+    ring->header->dataSize = dataSize;
+    atomic_init(&ring->header->head, 0);
+    atomic_init(&ring->header->tail, 0);
+    atomic_init(&ring->header->consumerWaiting, 0);
+    atomic_init(&ring->header->wakeSeq, 0);
+    ring->mask = dataSize - 1;
+    return 0;
+}
+
+int aesd_ring_attach(aesd_ring_t *ring, int fd)
+{
+    struct stat st;
+    uint64_t dataSize;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+
+    if (fstat(fd, &st) != 0 || st.st_size < AESD_RING_DATA_OFFSET + AESD_RING_MIN_SIZE)
+    {
+        fprintf(stderr, "Not an aesdsocket ring: too small\n");
+        close(fd);
+        return -1;
+    }
+
+    if (mapRing(ring, fd, st.st_size) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    dataSize = ring->header->dataSize;
+    if (ring->header->magic != AESD_RING_MAGIC || ring->header->version != AESD_RING_VERSION ||
+        dataSize < AESD_RING_MIN_SIZE || (dataSize & (dataSize - 1)) != 0 ||
+        dataSize > (uint64_t)st.st_size - AESD_RING_DATA_OFFSET)
+    {
+        fprintf(stderr, "Not an aesdsocket ring: bad header\n");
+        aesd_ring_close(ring);
+        return -1;
+    }
+
+    ring->mask = dataSize - 1;
+    return 0;
+}
+
+void aesd_ring_close(aesd_ring_t *ring)
+{
+    if (ring->header != NULL)
+    {
+        munmap(ring->header, ring->mapLen);
+        ring->header = NULL;
+    }
+    if (ring->fd != -1)
+    {
+        close(ring->fd);
+    }
+    ring->fd = -1;
+}
+
+size_t aesd_ring_max_packet(const aesd_ring_t *ring)
+{
+    // Half the ring, so a record plus the padding in front of it always fits
+    // once the consumer catches up
+    return (ring->mask + 1) / 2 - RECORD_HEADER_LEN;
+}
+
+static void futexWake(atomic_uint_least32_t *word)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+int aesd_ring_write(aesd_ring_t *ring, const char *buf, size_t len)
+{
+    aesd_ring_header_t *header = ring->header;
+    bool addNewline = len == 0 || buf[len - 1] != '\n';
+    size_t packetLen = len + addNewline;
+    uint64_t need = recordSize(packetLen);
+    uint64_t dataSize = ring->mask + 1;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t pad;
+    aesd_ring_record_t *record;
+
+    if (packetLen > aesd_ring_max_packet(ring))
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    head = atomic_load_explicit(&header->head, memory_order_relaxed);
+    do
+    {
+        tail = atomic_load_explicit(&header->tail, memory_order_acquire);
+        pad = (head & ring->mask) + need > dataSize ? dataSize - (head & ring->mask) : 0;
+        if (head + pad + need - tail > dataSize)
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&header->head, &head, head + pad + need,
+                                                    memory_order_relaxed,
+                                                    memory_order_relaxed));
+
+    if (pad != 0)
+    {
+        record = recordAt(ring, head);
+        atomic_store_explicit(&record->len, pad - RECORD_HEADER_LEN, memory_order_relaxed);
+        atomic_store_explicit(&record->state, RING_RECORD_PADDING, memory_order_release);
+        head += pad;
+    }
+
+    record = recordAt(ring, head);
+    atomic_store_explicit(&record->len, packetLen, memory_order_relaxed);
+    memcpy(record->data, buf, len);
+    if (addNewline)
+    {
+        record->data[len] = '\n';
+    }
+
+    // Pairs with the consumer setting consumerWaiting and then re-checking
+    // the ring: one of the two sides is bound to see the other
+    atomic_store_explicit(&record->state, RING_RECORD_PACKET, memory_order_seq_cst);
+    if (atomic_load(&header->consumerWaiting) &&
+        atomic_exchange(&header->consumerWaiting, 0))
+    {
+        aesd_ring_wake(ring);
+    }
+
+    return 0;
+}
+
+int aesd_ring_read(aesd_ring_t *ring, struct iovec *packets, int max)
+{
+    uint64_t dataSize = ring->mask + 1;
+    uint64_t pos = ring->tail;
+    uint64_t offset;
+    aesd_ring_record_t *record;
+    uint32_t state;
+    uint32_t len;
+    int count = 0;
+
+    while (count < max)
+    {
+        offset = pos & ring->mask;
+        record = recordAt(ring, pos);
+        state = atomic_load_explicit(&record->state, memory_order_acquire);
+        if (state == RING_RECORD_EMPTY)
+        {
+            break;
+        }
+
+        // Producers share the page, so only this copy of len is trusted.
+        // Everything handed out must fit in the ring behind the tail too.
+        len = atomic_load_explicit(&record->len, memory_order_relaxed);
+        if ((state != RING_RECORD_PACKET && state != RING_RECORD_PADDING) ||
+            len > dataSize - offset - RECORD_HEADER_LEN ||
+            pos + recordSize(len) - ring->tail > dataSize ||
+            (state == RING_RECORD_PADDING && offset + recordSize(len) != dataSize))
+        {
+            return -1;
+        }
+
+        if (state == RING_RECORD_PACKET)
+        {
+            packets[count].iov_base = record->data;
+            packets[count].iov_len = len;
+            count++;
+        }
+        pos += recordSize(len);
+    }
+
+    ring->readPos = pos;
+    return count;
+}
+
+void aesd_ring_release(aesd_ring_t *ring)
+{
+    uint64_t offset = ring->tail & ring->mask;
+    uint64_t len = ring->readPos - ring->tail;
+    uint64_t firstLen = len < ring->mask + 1 - offset ? len : ring->mask + 1 - offset;
+
+    memset(ring->data + offset, 0, firstLen);
+    memset(ring->data, 0, len - firstLen);
+
+    ring->tail = ring->readPos;
+    atomic_store_explicit(&ring->header->tail, ring->tail, memory_order_release);
+}
+
+void aesd_ring_wait(aesd_ring_t *ring, int timeoutMs)
+{
+    aesd_ring_header_t *header = ring->header;
+    uint32_t seq = atomic_load(&header->wakeSeq);
+    struct timespec timeout = {timeoutMs / 1000, (timeoutMs % 1000) * 1000000L};
+    aesd_ring_record_t *record;
+
+    atomic_store(&header->consumerWaiting, 1);
+
+    record = recordAt(ring, ring->tail);
+    if (atomic_load(&record->state) == RING_RECORD_EMPTY)
+    {
+        // Returns straight away if a producer bumped wakeSeq since it was read
+        syscall(SYS_futex, &header->wakeSeq, FUTEX_WAIT, seq, &timeout, NULL, 0);
+    }
+
+    atomic_store(&header->consumerWaiting, 0);
+}
+
+void aesd_ring_wake(aesd_ring_t *ring)
+{
+    atomic_fetch_add(&ring->header->wakeSeq, 1);
+    futexWake(&ring->header->wakeSeq);
+}
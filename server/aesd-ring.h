@@ -0,0 +1,166 @@
+/**
+ * @file aesd-ring.h
+ * @brief Shared-memory multi-producer, single-consumer packet ring
+ *
+ * The ring lives in a memfd that aesdsocket creates and hands to local
+ * producers over its unix domain socket. Producers reserve space by
+ * advancing a shared head with compare-and-swap, copy a packet in and mark
+ * its record committed. The server drains committed records in order,
+ * appends them to the log straight from the mapping and zeroes what it
+ * consumed before handing the space back.
+ *
+ * Wakeups use a futex on the shared mapping, and only when the consumer
+ * has said it is about to sleep, so a busy ring costs producers no system
+ * calls at all.
+ *
+ * Producers are trusted not to die between reserving and committing a
+ * record, which would stall the ring. The consumer keeps its own tail,
+ * reads each record's length once and checks it against the mapping's
+ * bounds before using it, so a misbehaving producer rewriting the shared
+ * page can corrupt packets but never make the server read or zero outside
+ * the ring.
+ */
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define AESD_RING_MAGIC         0x52445341u
+#define AESD_RING_VERSION       1
+// Records start after a page holding the shared header
+#define AESD_RING_DATA_OFFSET   4096
+#define AESD_RING_ALIGN         8
+#define AESD_RING_MIN_SIZE      4096
+
+typedef struct aesd_ring_header_s aesd_ring_header_t;
+typedef struct aesd_ring_record_s aesd_ring_record_t;
+typedef struct aesd_ring_s aesd_ring_t;
+
+typedef enum aesd_ring_record_state_e
+{
+    RING_RECORD_EMPTY = 0,
+    RING_RECORD_PACKET,
+    // Skips from here to the end of the data area, so no record wraps
+    RING_RECORD_PADDING,
+} aesd_ring_record_state_t;
+
+/**
+ * Layout of the first page of the mapping, shared by every process
+ */
+struct aesd_ring_header_s
+{
+    uint32_t magic;
+    uint32_t version;
+    // Bytes of record space after AESD_RING_DATA_OFFSET, a power of two
+    uint64_t dataSize;
+    /**
+     * Next byte producers will reserve. Positions only ever grow, a record
+     * sits at position & (dataSize - 1).
+     */
+    _Alignas(64) atomic_uint_fast64_t head;
+    /**
+     * First byte the consumer has not handed back yet. Only the consumer
+     * stores it, and it never reads it back.
+     */
+    _Alignas(64) atomic_uint_fast64_t tail;
+    // Set by the consumer just before it sleeps on wakeSeq
+    atomic_uint_least32_t consumerWaiting;
+    // Futex word, bumped by whoever wakes the consumer
+    atomic_uint_least32_t wakeSeq;
+};
+
+struct aesd_ring_record_s
+{
+    // An aesd_ring_record_state_t, stored last by the producer
+    atomic_uint_least32_t state;
+    // Loaded once by the consumer, a producer may rewrite it at any time
+    atomic_uint_least32_t len;
+    char data[];
+};
+
+struct aesd_ring_s
+{
+    int fd;
+    size_t mapLen;
+    aesd_ring_header_t *header;
+    char *data;
+    uint64_t mask;
+    // Consumer only, first byte not handed back yet and end of the records
+    // handed out by the last read
+    uint64_t tail;
+    uint64_t readPos;
+};
+
+/**
+ * @brief Create a ring in a new memfd, sealed against resizing so no
+ *  producer can pull the mapping out from under the server
+ *
+ * @param size Record space in bytes, rounded up to a power of two
+ * @return int
+ * @retval -1 Error
+ * @retval  0 Success
+ */
+int aesd_ring_create(aesd_ring_t *ring, size_t size);
+
+/**
+ * @brief Map a ring created by aesd_ring_create(), after checking it is one
+ *
+ * @param fd Descriptor received from the server, owned by the ring from now
+ *  on
+ * @return int
+ * @retval -1 Error, fd is closed
+ * @retval  0 Success
+ */
+int aesd_ring_attach(aesd_ring_t *ring, int fd);
+
+void aesd_ring_close(aesd_ring_t *ring);
+
+/**
+ * @brief Largest packet aesd_ring_write() takes, including the newline it
+ *  may add
+ */
+size_t aesd_ring_max_packet(const aesd_ring_t *ring);
+
+/**
+ * @brief Copy one packet into the ring, safe from any thread of any process
+ *
+ * A newline is added if the packet does not already end with one.
+ *
+ * @return int
+ * @retval -1 Error, errno EAGAIN if the ring is full or EMSGSIZE if the
+ *  packet is larger than aesd_ring_max_packet()
+ * @retval  0 Success
+ */
+int aesd_ring_write(aesd_ring_t *ring, const char *buf, size_t len);
+
+/**
+ * @brief Hand out up to max committed packets, in order, without copying
+ *
+ * Consumer only. The packets stay valid until aesd_ring_release().
+ *
+ * @param packets Filled with one iovec per packet, pointing into the ring
+ * @return int Number of packets, or -1 if the ring holds a record that
+ *  does not fit in it
+ */
+int aesd_ring_read(aesd_ring_t *ring, struct iovec *packets, int max);
+
+/**
+ * @brief Give the space of everything aesd_ring_read() handed out back to
+ *  producers. Consumer only.
+ */
+void aesd_ring_release(aesd_ring_t *ring);
+
+/**
+ * @brief Sleep until a producer commits a packet, aesd_ring_wake() is
+ *  called or timeoutMs passes. Consumer only.
+ */
+void aesd_ring_wait(aesd_ring_t *ring, int timeoutMs);
+
+/**
+ * @brief Wake the consumer whether or not anything was written
+ */
+void aesd_ring_wake(aesd_ring_t *ring);
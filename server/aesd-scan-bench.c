@@ -0,0 +1,289 @@
+/**
+ * @file aesd-scan-bench.c
+ * @brief Microbenchmark for the packet scanning variants in aesd-scan.c
+ *
+ * Frames a buffer of packets of a given size the way aesdsocket does, one
+ * newline search per packet, with every variant the CPU supports and with
+ * libc memchr() for reference. Each variant is first checked against
+ * memchr() so a wrong answer can't masquerade as a fast one.
+ */
+
+#include "aesd-scan.h"
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CHECK_ITERATIONS    100000
+
+typedef struct bench_variant_s
+{
+    const char *name;
+    const char *(*findNewline)(const char *buf, size_t len);
+    bool (*isCommand)(const char *buf, size_t len);
+} bench_variant_t;
+
+static const char *findNewlineLibc(const char *buf, size_t len)
+{
+    return memchr(buf, '\n', len);
+}
+
+static bool isCommandLibc(const char *buf, size_t len)
+{
+    return len >= AESD_COMMAND_PREFIX_LEN &&
+           memcmp(buf, AESD_COMMAND_PREFIX, AESD_COMMAND_PREFIX_LEN) == 0;
+}
+
+static double nowSeconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Fill buf with packets of packetSize bytes, or with no newlines at
+ *  all if packetSize is 0
+ */
+static void fillPackets(char *buf, size_t len, size_t packetSize)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        buf[i] = packetSize && i % packetSize == packetSize - 1 ? '\n' : 'a' + i % 26;
+    }
+}
+
+static int checkVariant(const bench_variant_t *variant, char *buf, size_t len)
+{
+    const char *probe = "AESDCHAR_IOCSEEKTO:1,2\n";
+    size_t start;
+    size_t span;
+    size_t nl;
+    int i;
+
+    srand(1);
+    for (i = 0; i < CHECK_ITERATIONS; i++)
+    {
+        // Random windows over random newline placements, including none
+        start = rand() % 4096;
+        span = rand() % 300;
+        nl = rand() % 320;
+        fillPackets(buf + start, span + 64, 0);
+        if (nl < span)
+        {
+            buf[start + nl] = '\n';
+        }
+
+        if (variant->findNewline(buf + start, span) != memchr(buf + start, '\n', span))
+        {
+            fprintf(stderr, "%s: wrong newline for span %zu, newline at %zu\n",
+                    variant->name, span, nl);
+            return -1;
+        }
+    }
+
+    for (span = 0; span <= strlen(probe); span++)
+    {
+        memcpy(buf, probe, span);
+        if (variant->isCommand(buf, span) != isCommandLibc(buf, span))
+        {
+            fprintf(stderr, "%s: wrong command match for length %zu\n", variant->name, span);
+            return -1;
+        }
+        buf[span / 2] ^= 1;
+        if (variant->isCommand(buf, strlen(probe)) != isCommandLibc(buf, strlen(probe)))
+        {
+            fprintf(stderr, "%s: wrong command match with byte %zu changed\n",
+                    variant->name, span / 2);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Frame every packet in buf repeatedly for at least minSeconds
+ *
+ * @return double GB/s scanned
+ */
+static double benchNewline(const bench_variant_t *variant, const char *buf, size_t len,
+                           double minSeconds)
+{
+    const char *pos;
+    const char *nlPtr;
+    size_t packets = 0;
+    uint64_t bytes = 0;
+    double startTime = nowSeconds();
+    double elapsed;
+
+    do
+    {
+        pos = buf;
+        while ((nlPtr = variant->findNewline(pos, len - (pos - buf))) != NULL)
+        {
+            pos = nlPtr + 1;
+            packets++;
+        }
+        bytes += len;
+        elapsed = nowSeconds() - startTime;
+    } while (elapsed < minSeconds);
+
+    // Keep the loop from being optimized away
+    if (packets == SIZE_MAX)
+    {
+        printf(" ");
+    }
+
+    return bytes / elapsed / 1e9;
+}
+
+/**
+ * @brief Classify packets as command or data repeatedly for at least
+ *  minSeconds
+ *
+ * @return double Millions of packets classified per second
+ */
+static double benchCommand(const bench_variant_t *variant, double minSeconds)
+{
+    // A data packet that shares most of the prefix, and a real command
+    static const char packets[2][64] = {
+        "AESDCHAR-not-a-command, just data that happens to look close\n",
+        "AESDCHAR_IOCSEEKTO:12,34\n",
+    };
+    uint64_t checks = 0;
+    uint64_t commands = 0;
+    double startTime = nowSeconds();
+    double elapsed;
+    int i;
+
+    do
+    {
+        for (i = 0; i < 1024; i++)
+        {
+            commands += variant->isCommand(packets[i & 1], sizeof(packets[0]));
+        }
+        checks += 1024;
+        elapsed = nowSeconds() - startTime;
+    } while (elapsed < minSeconds);
+
+    if (commands == UINT64_MAX)
+    {
+        printf(" ");
+    }
+
+    return checks / elapsed / 1e6;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "USAGE: %s [-b buffer MiB] [-t seconds per run]\n\n"
+            "  Reports newline scan throughput in GB/s for packets of 64 B,\n"
+            "  1 KiB, 16 KiB and a buffer with no newline at all\n",
+            prog);
+}
+
+int main(int argc, char *argv[])
+{
+    const size_t packetSizes[] = {64, 1024, 16384, 0};
+    const aesd_scan_variant_t *scanVariants;
+    const aesd_scan_variant_t *picked;
+    bench_variant_t variants[8];
+    size_t variantCount = 0;
+    size_t scanCount;
+    size_t bufferSize = 16;
+    double minSeconds = 0.2;
+    char *buf;
+    size_t i;
+    size_t j;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:t:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            bufferSize = atoi(optarg);
+            break;
+        case 't':
+            minSeconds = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (bufferSize < 1 || minSeconds <= 0)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+    bufferSize *= 1024 * 1024;
+
+    picked = aesd_scan_init();
+    scanVariants = aesd_scan_variants(&scanCount);
+
+    variants[variantCount++] = (bench_variant_t){"memchr", findNewlineLibc, isCommandLibc};
+    for (i = 0; i < scanCount; i++)
+    {
+        if (scanVariants[i].supported())
+        {
+            variants[variantCount++] = (bench_variant_t){
+                scanVariants[i].name, scanVariants[i].findNewline, scanVariants[i].isCommand};
+        }
+    }
+
+    buf = malloc(bufferSize);
+    if (buf == NULL)
+    {
+        fprintf(stderr, "Buffer allocation failed\n");
+        return -1;
+    }
+
+    for (i = 0; i < variantCount; i++)
+    {
+        if (checkVariant(&variants[i], buf, bufferSize) != 0)
+        {
+            free(buf);
+            return -1;
+        }
+    }
+
+    printf("selected variant: %s\n", picked->name);
+    printf("%-8s", "variant");
+    for (j = 0; j < sizeof(packetSizes) / sizeof(packetSizes[0]); j++)
+    {
+        if (packetSizes[j])
+        {
+            printf(" %7zu B", packetSizes[j]);
+        }
+        else
+        {
+            printf(" %9s", "no nl");
+        }
+    }
+    printf(" %11s\n", "cmd Mpkt/s");
+
+    for (i = 0; i < variantCount; i++)
+    {
+        printf("%-8s", variants[i].name);
+        for (j = 0; j < sizeof(packetSizes) / sizeof(packetSizes[0]); j++)
+        {
+            fillPackets(buf, bufferSize, packetSizes[j]);
+            printf(" %4.1f GB/s", benchNewline(&variants[i], buf, bufferSize, minSeconds));
+            fflush(stdout);
+        }
+        printf(" %11.0f\n", benchCommand(&variants[i], minSeconds));
+    }
+
+    free(buf);
+    return 0;
+}
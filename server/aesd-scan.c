@@ -0,0 +1,277 @@
+/**
+ * @file aesd-scan.c
+ * @brief Vectorized newline search and command prefix matching
+ *
+ * Vector loops only ever load whole blocks that lie inside the buffer, and
+ * leave whatever is left over to the scalar code.
+ */
+
+#include "aesd-scan.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define AESD_SCAN_X86
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define AESD_SCAN_NEON
+#include <arm_neon.h>
+#endif
+
+#define NEWLINE_BYTES   0x0a0a0a0a0a0a0a0aULL
+#define LOW_BITS        0x0101010101010101ULL
+#define HIGH_BITS       0x8080808080808080ULL
+
+// Padded out to a full vector, only the first AESD_COMMAND_PREFIX_LEN bytes
+// are compared
+static const char commandPrefix[16] = AESD_COMMAND_PREFIX;
+
+static bool alwaysSupported(void)
+{
+    return true;
+}
+
+static const char *findNewlineScalar(const char *buf, size_t len)
+{
+    const char *end = buf + len;
+    uint64_t word;
+    uint64_t matches;
+
+    // A word at a time, a byte of word ^ NEWLINE_BYTES is zero exactly where
+    // a newline is, and (x - 1) & ~x & 0x80 flags the first such byte
+    while (end - buf >= (ptrdiff_t)sizeof(word))
+    {
+        memcpy(&word, buf, sizeof(word));
+        word ^= NEWLINE_BYTES;
+        matches = (word - LOW_BITS) & ~word & HIGH_BITS;
+        if (matches != 0)
+        {
+            break;
+        }
+        buf += sizeof(word);
+    }
+
+    while (buf < end)
+    {
+        if (*buf == '\n')
+        {
+            return buf;
+        }
+        buf++;
+    }
+
+    return NULL;
+}
+
+static bool isCommandScalar(const char *buf, size_t len)
+{
+    return len >= AESD_COMMAND_PREFIX_LEN &&
+           memcmp(buf, AESD_COMMAND_PREFIX, AESD_COMMAND_PREFIX_LEN) == 0;
+}
+
+#ifdef AESD_SCAN_X86
+
+static bool sse2Supported(void)
+{
+    return __builtin_cpu_supports("sse2");
+}
+
+static bool avx2Supported(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("sse2")))
+static const char *findNewlineSse2(const char *buf, size_t len)
+{
+    const __m128i newlines = _mm_set1_epi8('\n');
+    const char *end = buf + len;
+    __m128i block;
+    int mask;
+
+    while (end - buf >= 16)
+    {
+        block = _mm_loadu_si128((const __m128i *)buf);
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, newlines));
+        if (mask != 0)
+        {
+            return buf + __builtin_ctz(mask);
+        }
+        buf += 16;
+    }
+
+    return findNewlineScalar(buf, end - buf);
+}
+
+__attribute__((target("sse2")))
+static bool isCommandSse2(const char *buf, size_t len)
+{
+    const int prefixMask = (1 << AESD_COMMAND_PREFIX_LEN) - 1;
+    __m128i block;
+    int mask;
+
+    if (len < 16)
+    {
+        return isCommandScalar(buf, len);
+    }
+
+    block = _mm_loadu_si128((const __m128i *)buf);
+    mask = _mm_movemask_epi8(
+        _mm_cmpeq_epi8(block, _mm_loadu_si128((const __m128i *)commandPrefix)));
+    return (mask & prefixMask) == prefixMask;
+}
+
+__attribute__((target("avx2")))
+static const char *findNewlineAvx2(const char *buf, size_t len)
+{
+    const __m256i newlines = _mm256_set1_epi8('\n');
+    const char *end = buf + len;
+    __m256i first;
+    __m256i second;
+    uint32_t mask;
+
+    // Short packets usually end in the first vector, try it on its own
+    if (end - buf >= 32)
+    {
+        mask = _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)buf), newlines));
+        if (mask != 0)
+        {
+            return buf + __builtin_ctz(mask);
+        }
+        buf += 32;
+    }
+
+    // Then two vectors per trip, only working out which one matched when
+    // either did
+    while (end - buf >= 64)
+    {
+        first = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)buf), newlines);
+        second = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + 32)),
+                                   newlines);
+        if (!_mm256_testz_si256(_mm256_or_si256(first, second),
+                                _mm256_or_si256(first, second)))
+        {
+            mask = _mm256_movemask_epi8(first);
+            if (mask != 0)
+            {
+                return buf + __builtin_ctz(mask);
+            }
+            return buf + 32 + __builtin_ctz(_mm256_movemask_epi8(second));
+        }
+        buf += 64;
+    }
+
+    if (end - buf >= 32)
+    {
+        mask = _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)buf), newlines));
+        if (mask != 0)
+        {
+            return buf + __builtin_ctz(mask);
+        }
+        buf += 32;
+    }
+
+    return findNewlineSse2(buf, end - buf);
+}
+
+#endif
+
+#ifdef AESD_SCAN_NEON
+
+/**
+ * @brief Narrow a byte compare result to 4 bits per byte, NEON has no
+ *  movemask
+ */
+static inline uint64_t neonMatchMask(uint8x16_t matches)
+{
+    return vget_lane_u64(vreinterpret_u64_u8(
+                             vshrn_n_u16(vreinterpretq_u16_u8(matches), 4)), 0);
+}
+
+static const char *findNewlineNeon(const char *buf, size_t len)
+{
+    const uint8x16_t newlines = vdupq_n_u8('\n');
+    const char *end = buf + len;
+    uint64_t mask;
+
+    while (end - buf >= 16)
+    {
+        mask = neonMatchMask(vceqq_u8(vld1q_u8((const uint8_t *)buf), newlines));
+        if (mask != 0)
+        {
+            return buf + __builtin_ctzll(mask) / 4;
+        }
+        buf += 16;
+    }
+
+    return findNewlineScalar(buf, end - buf);
+}
+
+static bool isCommandNeon(const char *buf, size_t len)
+{
+    const uint64_t prefixMask = (1ULL << (AESD_COMMAND_PREFIX_LEN * 4)) - 1;
+    uint64_t mask;
+
+    if (len < 16)
+    {
+        return isCommandScalar(buf, len);
+    }
+
+    mask = neonMatchMask(vceqq_u8(vld1q_u8((const uint8_t *)buf),
+                                  vld1q_u8((const uint8_t *)commandPrefix)));
+    return (mask & prefixMask) == prefixMask;
+}
+
+#endif
+
+static const aesd_scan_variant_t scanVariants[] = {
+    {"scalar", alwaysSupported, findNewlineScalar, isCommandScalar},
+#ifdef AESD_SCAN_X86
+    {"sse2", sse2Supported, findNewlineSse2, isCommandSse2},
+    {"avx2", avx2Supported, findNewlineAvx2, isCommandSse2},
+#endif
+#ifdef AESD_SCAN_NEON
+    // Advanced SIMD is mandatory on aarch64
+    {"neon", alwaysSupported, findNewlineNeon, isCommandNeon},
+#endif
+};
+
+static const aesd_scan_variant_t *activeVariant = &scanVariants[0];
+
+const aesd_scan_variant_t *aesd_scan_init(void)
+{
+    size_t i;
+
+#ifdef AESD_SCAN_X86
+    __builtin_cpu_init();
+#endif
+
+    for (i = 0; i < sizeof(scanVariants) / sizeof(scanVariants[0]); i++)
+    {
+        if (scanVariants[i].supported())
+        {
+            activeVariant = &scanVariants[i];
+        }
+    }
+
+    return activeVariant;
+}
+
+const aesd_scan_variant_t *aesd_scan_variants(size_t *count)
+{
+    *count = sizeof(scanVariants) / sizeof(scanVariants[0]);
+    return scanVariants;
+}
+
+const char *aesd_scan_newline(const char *buf, size_t len)
+{
+    return activeVariant->findNewline(buf, len);
+}
+
+bool aesd_scan_is_command(const char *buf, size_t len)
+{
+    return activeVariant->isCommand(buf, len);
+}
@@ -0,0 +1,65 @@
+/**
+ * @file aesd-scan.h
+ * @brief Vectorized newline search and command prefix matching, the inner
+ *  loops of packet framing
+ *
+ * Every variant the build supports is compiled in and the fastest one the
+ * CPU can run is picked by aesd_scan_init(): AVX2 or SSE2 on x86-64, NEON on
+ * aarch64, and a portable scalar fallback everywhere else.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Every aesdsocket command starts with this
+#define AESD_COMMAND_PREFIX     "AESDCHAR_"
+#define AESD_COMMAND_PREFIX_LEN (sizeof(AESD_COMMAND_PREFIX) - 1)
+
+typedef struct aesd_scan_variant_s aesd_scan_variant_t;
+
+struct aesd_scan_variant_s
+{
+    const char *name;
+    /**
+     * @brief Check whether the running CPU can execute this variant
+     */
+    bool (*supported)(void);
+    /**
+     * @brief Find the first '\n' in buf, like memchr()
+     */
+    const char *(*findNewline)(const char *buf, size_t len);
+    /**
+     * @brief Check whether buf starts with AESD_COMMAND_PREFIX
+     */
+    bool (*isCommand)(const char *buf, size_t len);
+};
+
+/**
+ * @brief Pick the fastest variant the CPU supports. Must be called before
+ *  any other thread uses the scanner.
+ *
+ * @return const aesd_scan_variant_t* The variant picked
+ */
+const aesd_scan_variant_t *aesd_scan_init(void);
+
+/**
+ * @brief Every variant compiled in, slowest first, for benchmarking
+ *
+ * @param count Location to store the number of variants
+ */
+const aesd_scan_variant_t *aesd_scan_variants(size_t *count);
+
+/**
+ * @brief Find the first '\n' in buf with the variant picked at startup
+ *
+ * @return const char* The newline, or NULL if there is none
+ */
+const char *aesd_scan_newline(const char *buf, size_t len);
+
+/**
+ * @brief Check whether a packet starts with AESD_COMMAND_PREFIX, with the
+ *  variant picked at startup
+ */
+bool aesd_scan_is_command(const char *buf, size_t len);
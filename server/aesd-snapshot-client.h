@@ -0,0 +1,42 @@
+/**
+ * @file aesd-snapshot-client.h
+ * @brief Reader side of aesdsocket log snapshots
+ *
+ * A local reader asks the server's unix domain socket for a snapshot of a
+ * channel and gets back a sealed memfd holding the whole log, which it maps
+ * read-only. The log is never copied through a socket, and readers asking
+ * between the same two appends share one snapshot. The mapping stays valid
+ * until aesd_snapshot_close(), whatever the server does meanwhile.
+ *
+ * Link with libaesdring.a.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct aesd_snapshot_s aesd_snapshot_t;
+
+struct aesd_snapshot_s
+{
+    // The log, or NULL when it was empty
+    const char *data;
+    size_t size;
+    // Appends the channel had seen when the snapshot was taken. Equal
+    // generations of a channel hold equal contents.
+    uint64_t generation;
+};
+
+/**
+ * @brief Take a snapshot of a channel from a server started with -u
+ *
+ * @param unixPath Path of the server's unix domain socket
+ * @param channelName Channel to snapshot, or NULL for the default channel
+ * @return int
+ * @retval -1 Error
+ * @retval  0 Success
+ */
+int aesd_snapshot_open(aesd_snapshot_t *snapshot, const char *unixPath, const char *channelName);
+
+void aesd_snapshot_close(aesd_snapshot_t *snapshot);
@@ -0,0 +1,96 @@
+/**
+ * @file aesd-stats.c
+ * @brief Server-wide counters, reported by AESDCHAR_STATS
+ *
+ * Counters are independent relaxed atomics. A report is not a consistent
+ * snapshot across counters, only each value on its own is exact.
+ */
+
+#include "aesd-stats.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <sys/resource.h>
+
+static atomic_int_fast64_t statValues[STAT_COUNT];
+
+static const char *const statNames[STAT_COUNT] = {
+    [STAT_CONNECTIONS_ACCEPTED] = "connections_accepted",
+    [STAT_CONNECTIONS_ACTIVE] = "connections_active",
+    [STAT_IDLE_TIMEOUTS] = "idle_timeouts",
+    [STAT_READ_TIMEOUTS] = "read_timeouts",
+    [STAT_DATAGRAMS_INGESTED] = "datagrams_ingested",
+    [STAT_DATAGRAMS_DROPPED] = "datagrams_dropped",
+    [STAT_RING_PACKETS_INGESTED] = "ring_packets_ingested",
+    [STAT_RING_PACKETS_DROPPED] = "ring_packets_dropped",
+    [STAT_SNAPSHOTS_BUILT] = "snapshots_built",
+    [STAT_SNAPSHOTS_SHARED] = "snapshots_shared",
+    [STAT_BUSY_POLL_HITS] = "busy_poll_hits",
+    [STAT_BUSY_POLL_PARKS] = "busy_poll_parks",
+    [STAT_MEM_BUDGET_BYTES] = "mem_budget_bytes",
+    [STAT_MEM_USED_BYTES] = "mem_used_bytes",
+    [STAT_MEM_RECEIVE_BYTES] = "mem_receive_bytes",
+    [STAT_MEM_RESPONSE_BYTES] = "mem_response_bytes",
+    [STAT_MEM_SNAPSHOT_BYTES] = "mem_snapshot_bytes",
+    [STAT_MEM_READ_STALLS] = "mem_read_stalls",
+    [STAT_MEM_CHARGES_REFUSED] = "mem_charges_refused",
+    [STAT_ZEROCOPY_SENDS] = "zerocopy_sends",
+    [STAT_ZEROCOPY_BYTES] = "zerocopy_bytes",
+    [STAT_ZEROCOPY_COPIED] = "zerocopy_copied",
+    [STAT_CAPTURE_RECORDS] = "capture_records",
+    [STAT_CAPTURE_BYTES] = "capture_bytes",
+    [STAT_CAPTURE_DROPPED] = "capture_dropped",
+    [STAT_REPLICAS_CONNECTED] = "replicas_connected",
+    [STAT_REPLICATION_BYTES] = "replication_bytes",
+    [STAT_REPLICATION_LAG_BYTES] = "replication_lag_bytes",
+    [STAT_REPLICATION_RECONNECTS] = "replication_reconnects",
+    [STAT_REQUESTS_TRACED] = "requests_traced",
+    [STAT_SLOW_REQUESTS] = "slow_requests",
+    [STAT_LOCK_DEADLINE_MET] = "lock_deadline_met",
+    [STAT_LOCK_DEADLINE_BUSY] = "lock_deadline_busy",
+};
+
+void aesd_stats_add(aesd_stat_t stat, int64_t delta)
+{
+    atomic_fetch_add_explicit(&statValues[stat], delta, memory_order_relaxed);
+}
+
+uint64_t aesd_stats_get(aesd_stat_t stat)
+{
+    return atomic_load_explicit(&statValues[stat], memory_order_relaxed);
+}
+
+size_t aesd_stats_format(char *buf, size_t len)
+{
+    struct rusage usage;
+    size_t used = 0;
+    int ret;
+    int i;
+
+    for (i = 0; i < STAT_COUNT && used < len; i++)
+    {
+        ret = snprintf(buf + used, len - used, "%s %llu\n", statNames[i],
+                       (unsigned long long)aesd_stats_get(i));
+        if (ret < 0)
+        {
+            break;
+        }
+        used += (size_t)ret < len - used ? (size_t)ret : len - used - 1;
+    }
+
+    // Lets a benchmark tell what a mode costs in CPU, not just latency
+    if (used < len && getrusage(RUSAGE_SELF, &usage) == 0)
+    {
+        ret = snprintf(buf + used, len - used, "cpu_user_us %llu\ncpu_system_us %llu\n",
+                       (unsigned long long)usage.ru_utime.tv_sec * 1000000 +
+                           usage.ru_utime.tv_usec,
+                       (unsigned long long)usage.ru_stime.tv_sec * 1000000 +
+                           usage.ru_stime.tv_usec);
+        if (ret > 0)
+        {
+            used += (size_t)ret < len - used ? (size_t)ret : len - used - 1;
+        }
+    }
+
+    return used;
+}
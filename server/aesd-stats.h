@@ -0,0 +1,90 @@
+/**
+ * @file aesd-stats.h
+ * @brief Server-wide counters, reported by AESDCHAR_STATS
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum aesd_stat_e
+{
+    STAT_CONNECTIONS_ACCEPTED,
+    STAT_CONNECTIONS_ACTIVE,
+    // Connections closed for receiving nothing within the idle timeout
+    STAT_IDLE_TIMEOUTS,
+    // Connections closed for not completing a packet within the read
+    // timeout
+    STAT_READ_TIMEOUTS,
+    // Datagrams appended by the UDP ingest socket
+    STAT_DATAGRAMS_INGESTED,
+    // Datagrams thrown away for being truncated or looking like a command
+    STAT_DATAGRAMS_DROPPED,
+    // Packets drained from the shared-memory ring, and those thrown away
+    // for looking like a command
+    STAT_RING_PACKETS_INGESTED,
+    STAT_RING_PACKETS_DROPPED,
+    // Log snapshots copied into a new memfd, and requests answered with
+    // one already built for the same generation
+    STAT_SNAPSHOTS_BUILT,
+    STAT_SNAPSHOTS_SHARED,
+    // Busy-polled receives that found data while spinning, and those that
+    // gave up and parked in a blocking receive
+    STAT_BUSY_POLL_HITS,
+    STAT_BUSY_POLL_PARKS,
+    // Memory budget and what is charged against it in total and by kind,
+    // see aesd-memory.h
+    STAT_MEM_BUDGET_BYTES,
+    STAT_MEM_USED_BYTES,
+    STAT_MEM_RECEIVE_BYTES,
+    STAT_MEM_RESPONSE_BYTES,
+    STAT_MEM_SNAPSHOT_BYTES,
+    // Times a connection stopped reading to wait for memory, and charges
+    // given up on for good: connections shed, replies and snapshots refused
+    STAT_MEM_READ_STALLS,
+    STAT_MEM_CHARGES_REFUSED,
+    // Echo-back sends made zero-copy and the bytes in them, and those the
+    // kernel reported having to copy anyway
+    STAT_ZEROCOPY_SENDS,
+    STAT_ZEROCOPY_BYTES,
+    STAT_ZEROCOPY_COPIED,
+    // Traffic records written to the capture trace, the bytes they took,
+    // and records dropped because the writer fell behind
+    STAT_CAPTURE_RECORDS,
+    STAT_CAPTURE_BYTES,
+    STAT_CAPTURE_DROPPED,
+    // On a leader, followers streaming a channel. On a follower, bytes
+    // copied from the leader, how far behind it every channel is between
+    // them, and streams reconnected after breaking.
+    STAT_REPLICAS_CONNECTED,
+    STAT_REPLICATION_BYTES,
+    STAT_REPLICATION_LAG_BYTES,
+    STAT_REPLICATION_RECONNECTS,
+    // Requests kept for AESDCHAR_TRACE, and of those the ones over the slow
+    // request threshold
+    STAT_REQUESTS_TRACED,
+    STAT_SLOW_REQUESTS,
+    // Bursts that got the channel lock within the lock deadline, and
+    // packets answered EBUSY for not getting it in time
+    STAT_LOCK_DEADLINE_MET,
+    STAT_LOCK_DEADLINE_BUSY,
+    STAT_COUNT,
+} aesd_stat_t;
+
+/**
+ * @brief Add delta to a counter, safe from any thread
+ */
+void aesd_stats_add(aesd_stat_t stat, int64_t delta);
+
+uint64_t aesd_stats_get(aesd_stat_t stat);
+
+/**
+ * @brief Write every counter as a "name value" line, followed by the CPU
+ *  time the process has used as cpu_user_us and cpu_system_us
+ *
+ * @param buf Buffer to write to
+ * @param len Size of buf
+ * @return size_t Number of bytes written, truncated to fit
+ */
+size_t aesd_stats_format(char *buf, size_t len);
@@ -0,0 +1,253 @@
+/**
+ * @file aesd-timer-wheel.c
+ * @brief Hierarchical timer wheel shared by every connection
+ *
+ * A timer expiring delta ticks after the next tick to be run sits in the
+ * lowest level n with delta < TIMER_WHEEL_SLOTS^(n+1), in the slot picked by
+ * bits [n * TIMER_WHEEL_BITS, (n + 1) * TIMER_WHEEL_BITS) of its expiry
+ * tick. Whenever the low n * TIMER_WHEEL_BITS bits of the tick being run
+ * are all zero, the current slot of level n is emptied and its timers
+ * re-added, which lands them a level (or more) lower.
+ */
+
+#include "aesd-timer-wheel.h"
+#include "aesd-placement.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <time.h>
+
+#define TIMER_WHEEL_MAX_DELTA   ((1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+LIST_HEAD(timer_list_s, aesd_timer_s);
+
+static struct timer_list_s wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+static pthread_mutex_t wheelMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t wheelThread;
+static bool wheelRunning = false;
+static atomic_bool stopRequested = false;
+static uint32_t wheelTickMs = 1;
+// Next tick to be run, guarded by wheelMutex
+static uint64_t nextTick = 0;
+static atomic_uint_fast64_t wheelNowMs = 0;
+
+static uint64_t monotonicMs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief File a timer under the level and slot for its expiry. Caller must
+ *  hold wheelMutex.
+ */
+static void addTimer(aesd_timer_t *timer)
+{
+    uint64_t delta;
+    int level;
+
+    // Late timers go out with the next tick
+    if (timer->expiresTick < nextTick)
+    {
+        timer->expiresTick = nextTick;
+    }
+
+    // Too far out for the wheel, fire at its horizon and let the callback
+    // ask for more time
+    delta = timer->expiresTick - nextTick;
+    if (delta > TIMER_WHEEL_MAX_DELTA)
+    {
+        delta = TIMER_WHEEL_MAX_DELTA;
+        timer->expiresTick = nextTick + delta;
+    }
+
+    for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++)
+    {
+        if (delta < 1ULL << (TIMER_WHEEL_BITS * (level + 1)))
+        {
+            break;
+        }
+    }
+
+    LIST_INSERT_HEAD(&wheel[level][(timer->expiresTick >> (TIMER_WHEEL_BITS * level)) &
+                                   (TIMER_WHEEL_SLOTS - 1)],
+                     timer, entries);
+}
+
+static void cascadeSlot(int level, int slot)
+{
+    struct timer_list_s pending = LIST_HEAD_INITIALIZER(pending);
+    aesd_timer_t *timer;
+
+    LIST_SWAP(&pending, &wheel[level][slot], aesd_timer_s, entries);
+    while ((timer = LIST_FIRST(&pending)) != NULL)
+    {
+        LIST_REMOVE(timer, entries);
+        addTimer(timer);
+    }
+}
+
+/**
+ * @brief Run tick nextTick, firing whatever expires on it. Caller must hold
+ *  wheelMutex.
+ */
+static void runTick(uint64_t nowMs)
+{
+    struct timer_list_s expired = LIST_HEAD_INITIALIZER(expired);
+    uint64_t tick = nextTick;
+    uint64_t rearmMs;
+    aesd_timer_t *timer;
+    int level;
+
+    for (level = 1; level < TIMER_WHEEL_LEVELS; level++)
+    {
+        if ((tick & ((1ULL << (TIMER_WHEEL_BITS * level)) - 1)) != 0)
+        {
+            break;
+        }
+        cascadeSlot(level, (tick >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1));
+    }
+
+    LIST_SWAP(&expired, &wheel[0][tick & (TIMER_WHEEL_SLOTS - 1)], aesd_timer_s, entries);
+
+    // Anything a callback re-arms lands on a later tick
+    nextTick = tick + 1;
+
+    while ((timer = LIST_FIRST(&expired)) != NULL)
+    {
+        LIST_REMOVE(timer, entries);
+        timer->armed = false;
+
+        rearmMs = timer->callback(timer->arg, nowMs);
+        if (rearmMs != 0)
+        {
+            timer->expiresTick = (rearmMs + wheelTickMs - 1) / wheelTickMs;
+            addTimer(timer);
+            timer->armed = true;
+        }
+    }
+}
+
+static void *wheelThreadMain(void *arg)
+{
+    struct timespec wakeTime;
+    uint64_t wakeMs;
+    uint64_t nowMs;
+
+    // Housekeeping, left to run wherever the scheduler likes
+    aesd_placement_register("timer-wheel", -1);
+
+    while (!atomic_load(&stopRequested))
+    {
+        pthread_mutex_lock(&wheelMutex);
+        wakeMs = nextTick * wheelTickMs;
+        pthread_mutex_unlock(&wheelMutex);
+
+        wakeTime.tv_sec = wakeMs / 1000;
+        wakeTime.tv_nsec = (wakeMs % 1000) * 1000000;
+        if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wakeTime, NULL) == EINTR)
+        {
+            continue;
+        }
+
+        nowMs = monotonicMs();
+        atomic_store_explicit(&wheelNowMs, nowMs, memory_order_relaxed);
+
+        pthread_mutex_lock(&wheelMutex);
+        while (nextTick <= nowMs / wheelTickMs)
+        {
+            runTick(nowMs);
+        }
+        pthread_mutex_unlock(&wheelMutex);
+    }
+
+    aesd_placement_leave();
+    return NULL;
+}
+
+int aesd_timer_wheel_start(uint32_t tickMs)
+{
+    sigset_t allSignals;
+    sigset_t oldSignals;
+    int retVal;
+
+    wheelTickMs = tickMs ? tickMs : 1;
+    atomic_store(&wheelNowMs, monotonicMs());
+    nextTick = atomic_load(&wheelNowMs) / wheelTickMs + 1;
+    atomic_store(&stopRequested, false);
+
+    // Signals are for the main thread, the wheel thread inherits this mask
+    sigfillset(&allSignals);
+    pthread_sigmask(SIG_BLOCK, &allSignals, &oldSignals);
+    retVal = pthread_create(&wheelThread, NULL, wheelThreadMain, NULL);
+    pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+
+    if (retVal != 0)
+    {
+        errno = retVal;
+        perror("pthread_create() error for timer wheel");
+        return -1;
+    }
+
+    wheelRunning = true;
+    return 0;
+}
+
+void aesd_timer_wheel_stop(void)
+{
+    if (!wheelRunning)
+    {
+        return;
+    }
+
+    atomic_store(&stopRequested, true);
+    pthread_join(wheelThread, NULL);
+    wheelRunning = false;
+}
+
+uint64_t aesd_timer_wheel_now(void)
+{
+    return atomic_load_explicit(&wheelNowMs, memory_order_relaxed);
+}
+
+void aesd_timer_init(aesd_timer_t *timer, aesd_timer_fn callback, void *arg)
+{
+    timer->callback = callback;
+    timer->arg = arg;
+    timer->expiresTick = 0;
+    timer->armed = false;
+}
+
+void aesd_timer_arm(aesd_timer_t *timer, uint64_t expiresMs)
+{
+    pthread_mutex_lock(&wheelMutex);
+
+    if (timer->armed)
+    {
+        LIST_REMOVE(timer, entries);
+    }
+
+    timer->expiresTick = (expiresMs + wheelTickMs - 1) / wheelTickMs;
+    addTimer(timer);
+    timer->armed = true;
+
+    pthread_mutex_unlock(&wheelMutex);
+}
+
+void aesd_timer_cancel(aesd_timer_t *timer)
+{
+    pthread_mutex_lock(&wheelMutex);
+
+    if (timer->armed)
+    {
+        LIST_REMOVE(timer, entries);
+        timer->armed = false;
+    }
+
+    pthread_mutex_unlock(&wheelMutex);
+}
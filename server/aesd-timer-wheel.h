@@ -0,0 +1,79 @@
+/**
+ * @file aesd-timer-wheel.h
+ * @brief Hierarchical timer wheel shared by every connection
+ *
+ * Timers live in one of TIMER_WHEEL_LEVELS levels of TIMER_WHEEL_SLOTS
+ * slots each, level n covering TIMER_WHEEL_SLOTS^(n+1) ticks. Arming and
+ * cancelling are O(1) list operations, and a single thread advances the
+ * wheel one tick at a time, moving timers down a level as their expiry
+ * gets close. Expiry is accurate to one tick.
+ */
+
+#pragma once
+
+#include "./queue.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TIMER_WHEEL_BITS    6
+#define TIMER_WHEEL_SLOTS   (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS  4
+
+typedef struct aesd_timer_s aesd_timer_t;
+
+/**
+ * @brief Called from the wheel thread once a timer expires, with the wheel
+ *  lock held. Must not arm or cancel timers itself.
+ *
+ * @param arg Argument given to aesd_timer_init()
+ * @param nowMs Current time on the wheel's clock
+ * @return uint64_t Time to expire again at, or 0 to leave the timer disarmed
+ */
+typedef uint64_t (*aesd_timer_fn)(void *arg, uint64_t nowMs);
+
+struct aesd_timer_s
+{
+    aesd_timer_fn callback;
+    void *arg;
+    // Tick the timer expires at
+    uint64_t expiresTick;
+    bool armed;
+    LIST_ENTRY(aesd_timer_s) entries;
+};
+
+/**
+ * @brief Start the thread that drives the wheel
+ *
+ * @param tickMs Granularity of the wheel in milliseconds
+ * @return int
+ * @retval -1 Error
+ * @retval  0 Success
+ */
+int aesd_timer_wheel_start(uint32_t tickMs);
+
+/**
+ * @brief Stop the wheel thread. Timers still armed never fire.
+ */
+void aesd_timer_wheel_stop(void);
+
+/**
+ * @brief The wheel's clock, CLOCK_MONOTONIC in milliseconds as of the last
+ *  tick. Cheap enough to call on every receive.
+ */
+uint64_t aesd_timer_wheel_now(void);
+
+void aesd_timer_init(aesd_timer_t *timer, aesd_timer_fn callback, void *arg);
+
+/**
+ * @brief Arm a timer, or move it if it is already armed
+ *
+ * @param expiresMs Time on the wheel's clock to expire at
+ */
+void aesd_timer_arm(aesd_timer_t *timer, uint64_t expiresMs);
+
+/**
+ * @brief Disarm a timer. Once this returns the callback is not running and
+ *  will not run, so whatever it uses may be released.
+ */
+void aesd_timer_cancel(aesd_timer_t *timer);
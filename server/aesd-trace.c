@@ -0,0 +1,199 @@
+/**
+ * @file aesd-trace.c
+ * @brief Per-request latency breakdown, sampled into a ring and logged for
+ *  slow requests
+ */
+
+#include "aesd-trace.h"
+#include "aesd-channel.h"
+#include "aesd-stats.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+typedef struct trace_record_s
+{
+    // Wall clock time the request was answered, in microseconds
+    uint64_t endUs;
+    uint64_t totalNs;
+    uint64_t phaseNs[TRACE_PHASE_COUNT];
+    uint32_t packets;
+    bool slow;
+    const char *kind;
+    char channel[CHANNEL_NAME_MAX + 1];
+} trace_record_t;
+
+static atomic_uint sampleEvery = 0;
+static atomic_uint_fast64_t slowNs = 0;
+static atomic_uint_fast64_t requestCount = 0;
+
+// The ring is guarded by ringMutex, next is where the following record goes
+static pthread_mutex_t ringMutex = PTHREAD_MUTEX_INITIALIZER;
+static trace_record_t ring[TRACE_RING_SIZE];
+static uint64_t ringNext = 0;
+
+// The request this thread is timing, if timing is set
+static _Thread_local bool timing = false;
+static _Thread_local uint64_t startNs;
+static _Thread_local uint64_t phaseNs[TRACE_PHASE_COUNT];
+
+static uint64_t monotonicNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void aesd_trace_configure(uint32_t every, uint64_t slowUs)
+{
+    atomic_store(&sampleEvery, every);
+    atomic_store(&slowNs, slowUs * 1000);
+}
+
+void aesd_trace_begin(void)
+{
+    if (timing ||
+        (atomic_load_explicit(&sampleEvery, memory_order_relaxed) == 0 &&
+         atomic_load_explicit(&slowNs, memory_order_relaxed) == 0))
+    {
+        return;
+    }
+
+    timing = true;
+    memset(phaseNs, 0, sizeof(phaseNs));
+    startNs = monotonicNs();
+}
+
+uint64_t aesd_trace_clock(void)
+{
+    return timing ? monotonicNs() : 0;
+}
+
+void aesd_trace_charge(aesd_trace_phase_t phase, uint64_t sinceNs)
+{
+    if (sinceNs != 0 && timing)
+    {
+        phaseNs[phase] += monotonicNs() - sinceNs;
+    }
+}
+
+void aesd_trace_abandon(void)
+{
+    timing = false;
+}
+
+/**
+ * @brief Whole microseconds and tenths, for printing as "%llu.%u"
+ */
+#define US_PARTS(ns) (unsigned long long)((ns) / 1000), (unsigned)((ns) % 1000 / 100)
+
+/**
+ * @brief Format one record as a line
+ *
+ * @return int As snprintf()
+ */
+static int formatRecord(char *buf, size_t len, const trace_record_t *record)
+{
+    const uint64_t *phase = record->phaseNs;
+    uint64_t otherNs = record->totalNs;
+    int i;
+
+    for (i = 0; i < TRACE_PHASE_COUNT; i++)
+    {
+        otherNs -= otherNs > phase[i] ? phase[i] : otherNs;
+    }
+
+    return snprintf(buf, len,
+                    "%llu %s %s packets=%u total_us=%llu.%u lock_us=%llu.%u append_us=%llu.%u "
+                    "seek_us=%llu.%u read_us=%llu.%u send_us=%llu.%u forward_us=%llu.%u "
+                    "other_us=%llu.%u%s\n",
+                    (unsigned long long)record->endUs, record->kind, record->channel,
+                    record->packets, US_PARTS(record->totalNs), US_PARTS(phase[TRACE_LOCK]),
+                    US_PARTS(phase[TRACE_APPEND]), US_PARTS(phase[TRACE_SEEK]),
+                    US_PARTS(phase[TRACE_READ]), US_PARTS(phase[TRACE_SEND]),
+                    US_PARTS(phase[TRACE_FORWARD]), US_PARTS(otherNs),
+                    record->slow ? " slow" : "");
+}
+
+void aesd_trace_end(const char *kind, const char *channel, uint32_t packets)
+{
+    uint32_t every = atomic_load_explicit(&sampleEvery, memory_order_relaxed);
+    uint64_t slowAfterNs = atomic_load_explicit(&slowNs, memory_order_relaxed);
+    trace_record_t record;
+    struct timespec now;
+    char line[TRACE_LINE_MAX];
+    bool sampled;
+
+    if (!timing)
+    {
+        return;
+    }
+    timing = false;
+
+    record.totalNs = monotonicNs() - startNs;
+    record.slow = slowAfterNs != 0 && record.totalNs >= slowAfterNs;
+    sampled = every != 0 && atomic_fetch_add(&requestCount, 1) % every == 0;
+    if (!sampled && !record.slow)
+    {
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    record.endUs = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    memcpy(record.phaseNs, phaseNs, sizeof(record.phaseNs));
+    record.packets = packets;
+    record.kind = kind;
+    snprintf(record.channel, sizeof(record.channel), "%s", channel);
+
+    if (record.slow)
+    {
+        aesd_stats_add(STAT_SLOW_REQUESTS, 1);
+        formatRecord(line, sizeof(line), &record);
+        syslog(LOG_WARNING, "Slow request: %s", line);
+    }
+    aesd_stats_add(STAT_REQUESTS_TRACED, 1);
+
+    pthread_mutex_lock(&ringMutex);
+    ring[ringNext % TRACE_RING_SIZE] = record;
+    ringNext++;
+    pthread_mutex_unlock(&ringMutex);
+}
+
+size_t aesd_trace_format(char *buf, size_t len)
+{
+    uint64_t first;
+    uint64_t i;
+    size_t used = 0;
+    int written;
+
+    pthread_mutex_lock(&ringMutex);
+
+    written = snprintf(buf, len, "sample_every=%u slow_us=%llu kept=%llu\n",
+                       atomic_load(&sampleEvery),
+                       (unsigned long long)(atomic_load(&slowNs) / 1000),
+                       (unsigned long long)ringNext);
+    if (written > 0 && (size_t)written < len)
+    {
+        used = written;
+    }
+
+    first = ringNext > TRACE_RING_SIZE ? ringNext - TRACE_RING_SIZE : 0;
+    for (i = first; used > 0 && i < ringNext; i++)
+    {
+        written = formatRecord(buf + used, len - used, &ring[i % TRACE_RING_SIZE]);
+        if (written < 0 || (size_t)written >= len - used)
+        {
+            break;
+        }
+        used += written;
+    }
+
+    pthread_mutex_unlock(&ringMutex);
+    return used;
+}
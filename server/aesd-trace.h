@@ -0,0 +1,96 @@
+/**
+ * @file aesd-trace.h
+ * @brief Per-request latency breakdown, sampled into a ring and logged for
+ *  slow requests
+ *
+ * A request is a burst of packets up to its echo-back or acknowledgement,
+ * or a command up to its reply. While a connection thread serves one, the
+ * time it spends in each phase is added up: waiting for the channel lock,
+ * appending, seeking, reading the log back, sending, and on a follower
+ * waiting for the leader. Whatever is left of the total went on receiving
+ * and parsing the rest of the burst.
+ *
+ * Phases are charged to the request of the calling thread, so the channel
+ * code times itself without knowing which connection it works for. Threads
+ * serving no request, and every thread while tracing is off, only pay for
+ * a check of a thread-local flag.
+ *
+ * One request in every sampleEvery is kept in a ring of the latest
+ * TRACE_RING_SIZE, dumped by AESDCHAR_TRACE. Requests taking at least
+ * slowUs are always kept, and logged with their breakdown.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Requests kept for AESDCHAR_TRACE
+#define TRACE_RING_SIZE     1024
+// Longest line a request takes in AESDCHAR_TRACE
+#define TRACE_LINE_MAX      256
+
+typedef enum aesd_trace_phase_e
+{
+    TRACE_LOCK,
+    TRACE_APPEND,
+    TRACE_SEEK,
+    TRACE_READ,
+    TRACE_SEND,
+    // A follower waiting for the leader to take a burst and for its copy
+    // to catch up
+    TRACE_FORWARD,
+    TRACE_PHASE_COUNT,
+} aesd_trace_phase_t;
+
+/**
+ * @brief Keep one request in every sampleEvery, and log requests taking at
+ *  least slowUs. Either 0 turns that off, both 0 stop timing requests.
+ *  Takes effect from the next request.
+ */
+void aesd_trace_configure(uint32_t sampleEvery, uint64_t slowUs);
+
+/**
+ * @brief Start timing a request on this thread, unless one is being timed
+ *  already or tracing is off
+ */
+void aesd_trace_begin(void);
+
+/**
+ * @brief Monotonic time in nanoseconds to charge a phase from, or 0 when
+ *  this thread is timing no request
+ */
+uint64_t aesd_trace_clock(void);
+
+/**
+ * @brief Charge the time since sinceNs, from aesd_trace_clock(), to phase.
+ *  Does nothing for sinceNs 0.
+ */
+void aesd_trace_charge(aesd_trace_phase_t phase, uint64_t sinceNs);
+
+/**
+ * @brief Finish the request being timed on this thread, keeping it if
+ *  sampled or slow
+ *
+ * @param kind What the request was, a string that outlives the ring
+ * @param channel Name of the channel it was on
+ * @param packets Packets it appended
+ */
+void aesd_trace_end(const char *kind, const char *channel, uint32_t packets);
+
+/**
+ * @brief Stop timing this thread's request without keeping it, for a
+ *  connection going away or turning into a stream
+ */
+void aesd_trace_abandon(void);
+
+/**
+ * @brief Write a "sample_every=... slow_us=... kept=..." line with the
+ *  settings and how many requests were ever kept, then a line per request
+ *  still in the ring, oldest first: when it was answered
+ *  in microseconds since the epoch, kind, channel, packets, and the total
+ *  and each phase in microseconds
+ *
+ * @return size_t Number of bytes written, truncated to whole lines that fit
+ */
+size_t aesd_trace_format(char *buf, size_t len);
@@ -0,0 +1,421 @@
+/**
+ * @file aesd-zerocopy-bench.c
+ * @brief Find the echo-back size from which MSG_ZEROCOPY beats copying
+ *
+ * Sends the same file range over one TCP connection again and again, once
+ * the way aesdsocket copies echo-backs (read into a buffer, send the
+ * buffer) and once through aesd-zerocopy.c exactly as aesdsocket -z does,
+ * reports included. Each size is timed both ways, and the sender's CPU time
+ * is measured on its own thread so the receiving side does not count.
+ *
+ * Over loopback the kernel has to copy zero-copy sends on delivery anyway,
+ * so the crossover only means something with a real network in between:
+ * run with -l on the receiving host and -H on the sending one.
+ */
+
+#include "aesd-stats.h"
+#include "aesd-zerocopy.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+// Read buffer of the copying path, as in aesd-channel.c
+#define COPY_BUFF_SIZE      65536
+#define SINK_BUFF_SIZE      (1024 * 1024)
+#define MAX_SIZES           32
+
+typedef struct bench_result_s
+{
+    double seconds;
+    double cpuSeconds;
+} bench_result_t;
+
+static double clockSeconds(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Read and throw away everything sent on each accepted connection
+ */
+static void *sinkThread(void *arg)
+{
+    int listenSock = *(int *)arg;
+    char *buff = malloc(SINK_BUFF_SIZE);
+    int sockfd;
+
+    while (buff != NULL && (sockfd = accept(listenSock, NULL, NULL)) != -1)
+    {
+        while (recv(sockfd, buff, SINK_BUFF_SIZE, 0) > 0)
+        {
+        }
+        close(sockfd);
+    }
+
+    free(buff);
+    return NULL;
+}
+
+static int listenOn(const char *address, uint16_t port)
+{
+    struct sockaddr_in addr;
+    int one = 1;
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (sockfd == -1)
+    {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, address, &addr.sin_addr);
+
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(sockfd, 1) != 0)
+    {
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+static int connectTo(const char *host, const char *port)
+{
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *res;
+    int sockfd;
+
+    if (getaddrinfo(host, port, &hints, &res) != 0)
+    {
+        return -1;
+    }
+
+    sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (sockfd != -1 && connect(sockfd, res->ai_addr, res->ai_addrlen) != 0)
+    {
+        close(sockfd);
+        sockfd = -1;
+    }
+
+    freeaddrinfo(res);
+    return sockfd;
+}
+
+/**
+ * @brief Send len bytes of fd from the start the way copied echo-backs are
+ */
+static int sendCopied(int sockfd, int fd, size_t len)
+{
+    static char buff[COPY_BUFF_SIZE];
+    size_t done = 0;
+    size_t readLen;
+    size_t sent;
+    ssize_t ret;
+
+    while (done < len)
+    {
+        ret = pread(fd, buff, len - done < sizeof(buff) ? len - done : sizeof(buff), done);
+        if (ret <= 0)
+        {
+            return -1;
+        }
+        readLen = ret;
+        for (sent = 0; sent < readLen; sent += ret)
+        {
+            ret = send(sockfd, buff + sent, readLen - sent, MSG_NOSIGNAL);
+            if (ret < 0)
+            {
+                return -1;
+            }
+        }
+        done += readLen;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Time count sends of size bytes
+ *
+ * @param zc Zero-copy state to send with, NULL to copy
+ */
+static int runOne(aesd_zerocopy_t *zc, int sockfd, int fd, size_t size, uint64_t count,
+                  bench_result_t *result)
+{
+    double start = clockSeconds(CLOCK_MONOTONIC);
+    double cpuStart = clockSeconds(CLOCK_THREAD_CPUTIME_ID);
+    ssize_t sent;
+    uint64_t i;
+
+    for (i = 0; i < count; i++)
+    {
+        if (zc == NULL)
+        {
+            if (sendCopied(sockfd, fd, size) != 0)
+            {
+                return -1;
+            }
+            continue;
+        }
+
+        aesd_zerocopy_reap(zc, 0);
+        sent = aesd_zerocopy_send_file(zc, fd, 0, size, false);
+        if (sent < 0)
+        {
+            return -1;
+        }
+        // Too many sends waiting to be reported, copied as aesdsocket would
+        if ((size_t)sent < size && sendCopied(sockfd, fd, size) != 0)
+        {
+            return -1;
+        }
+    }
+
+    // Not done until the kernel has let go of every page
+    while (zc != NULL && !STAILQ_EMPTY(&zc->pending))
+    {
+        if (aesd_zerocopy_reap(zc, ZEROCOPY_DRAIN_MS) <= 0)
+        {
+            fprintf(stderr, "Zero-copy sends were never reported\n");
+            return -1;
+        }
+    }
+
+    result->seconds = clockSeconds(CLOCK_MONOTONIC) - start;
+    result->cpuSeconds = clockSeconds(CLOCK_THREAD_CPUTIME_ID) - cpuStart;
+    return 0;
+}
+
+/**
+ * @brief Smallest size from which zero-copy does better at every larger
+ *  size tested
+ *
+ * @param byCpu Compare sender CPU time rather than elapsed time
+ * @return size_t The size, or 0 if zero-copy does not win at the largest
+ */
+static size_t crossover(const size_t *sizes, int sizeCount, const bench_result_t *copied,
+                        const bench_result_t *zerocopy, bool byCpu)
+{
+    size_t from = 0;
+    double copiedCost;
+    double zerocopyCost;
+    int i;
+
+    for (i = sizeCount - 1; i >= 0; i--)
+    {
+        copiedCost = byCpu ? copied[i].cpuSeconds : copied[i].seconds;
+        zerocopyCost = byCpu ? zerocopy[i].cpuSeconds : zerocopy[i].seconds;
+        if (zerocopyCost >= copiedCost)
+        {
+            break;
+        }
+        from = sizes[i];
+    }
+
+    return from;
+}
+
+static void printCrossover(const char *what, size_t from)
+{
+    if (from != 0)
+    {
+        printf("zero-copy wins on %s from %zu bytes\n", what, from);
+    }
+    else
+    {
+        printf("zero-copy never wins on %s at the sizes tested\n", what);
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "USAGE: %s [-H host -p port] [-s min size] [-S max size] [-b bytes per run]\n"
+            "       %s -l port\n\n"
+            "  Times copied and zero-copy sends of each power of two from -s to -S\n"
+            "  bytes, -b bytes each way. Sends to a sink thread over loopback\n"
+            "  unless -H names a host running %s -l.\n",
+            prog, prog, prog);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *host = NULL;
+    const char *port = NULL;
+    const char *listenPort = NULL;
+    size_t minSize = 4096;
+    size_t maxSize = 4 * 1024 * 1024;
+    uint64_t runBytes = 256ULL * 1024 * 1024;
+    size_t sizes[MAX_SIZES];
+    size_t size;
+    bench_result_t copied[MAX_SIZES];
+    bench_result_t zerocopy[MAX_SIZES];
+    char path[] = "/var/tmp/aesd-zerocopy-bench-XXXXXX";
+    char *fill;
+    aesd_zerocopy_t zc;
+    pthread_t sink;
+    struct sockaddr_in sinkAddr;
+    socklen_t sinkAddrLen = sizeof(sinkAddr);
+    char sinkPort[8];
+    uint64_t copiedBefore;
+    uint64_t count;
+    int sizeCount = 0;
+    int listenSock;
+    int sockfd;
+    int fd;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "H:p:s:S:b:l:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'H':
+            host = optarg;
+            break;
+        case 'p':
+            port = optarg;
+            break;
+        case 's':
+            minSize = strtoul(optarg, NULL, 10);
+            break;
+        case 'S':
+            maxSize = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            runBytes = strtoull(optarg, NULL, 10);
+            break;
+        case 'l':
+            listenPort = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (listenPort != NULL)
+    {
+        listenSock = listenOn("0.0.0.0", atoi(listenPort));
+        if (listenSock == -1)
+        {
+            perror("Could not listen");
+            return -1;
+        }
+        sinkThread(&listenSock);
+        return 0;
+    }
+
+    if ((host == NULL) != (port == NULL) || minSize == 0 || maxSize < minSize ||
+        runBytes < maxSize)
+    {
+        usage(argv[0]);
+        return -1;
+    }
+
+    for (size = minSize; size <= maxSize && sizeCount < MAX_SIZES; size *= 2)
+    {
+        sizes[sizeCount++] = size;
+    }
+
+    // The file stands in for a channel's data file, in the page cache
+    fd = mkstemp(path);
+    fill = malloc(maxSize);
+    if (fd == -1 || fill == NULL)
+    {
+        perror("Could not create the file to send");
+        return -1;
+    }
+    unlink(path);
+    memset(fill, 'x', maxSize);
+    if (write(fd, fill, maxSize) != (ssize_t)maxSize)
+    {
+        perror("Could not fill the file to send");
+        return -1;
+    }
+    free(fill);
+
+    if (host == NULL)
+    {
+        listenSock = listenOn("127.0.0.1", 0);
+        if (listenSock == -1 ||
+            getsockname(listenSock, (struct sockaddr *)&sinkAddr, &sinkAddrLen) != 0 ||
+            pthread_create(&sink, NULL, sinkThread, &listenSock) != 0)
+        {
+            perror("Could not start the sink");
+            return -1;
+        }
+        pthread_detach(sink);
+        snprintf(sinkPort, sizeof(sinkPort), "%u", ntohs(sinkAddr.sin_port));
+        host = "127.0.0.1";
+        port = sinkPort;
+    }
+
+    sockfd = connectTo(host, port);
+    if (sockfd == -1)
+    {
+        perror("Could not connect to the sink");
+        return -1;
+    }
+
+    aesd_zerocopy_init(minSize);
+    if (!aesd_zerocopy_open(&zc, sockfd))
+    {
+        perror("SO_ZEROCOPY is not supported");
+        return -1;
+    }
+
+    printf("%10s %12s %12s %14s %14s %10s\n", "size", "copy MB/s", "zc MB/s",
+           "copy cpu us/MB", "zc cpu us/MB", "zc copied");
+
+    for (i = 0; i < sizeCount; i++)
+    {
+        count = runBytes / sizes[i];
+        copiedBefore = aesd_stats_get(STAT_ZEROCOPY_COPIED);
+
+        if (runOne(NULL, sockfd, fd, sizes[i], count, &copied[i]) != 0 ||
+            runOne(&zc, sockfd, fd, sizes[i], count, &zerocopy[i]) != 0)
+        {
+            perror("Send failed");
+            return -1;
+        }
+
+        printf("%10zu %12.0f %12.0f %14.1f %14.1f %10llu\n", sizes[i],
+               count * sizes[i] / 1e6 / copied[i].seconds,
+               count * sizes[i] / 1e6 / zerocopy[i].seconds,
+               copied[i].cpuSeconds * 1e6 / (count * sizes[i] / 1e6),
+               zerocopy[i].cpuSeconds * 1e6 / (count * sizes[i] / 1e6),
+               (unsigned long long)(aesd_stats_get(STAT_ZEROCOPY_COPIED) - copiedBefore));
+    }
+
+    printf("\n");
+    printCrossover("sender CPU", crossover(sizes, sizeCount, copied, zerocopy, true));
+    printCrossover("throughput", crossover(sizes, sizeCount, copied, zerocopy, false));
+    if (aesd_stats_get(STAT_ZEROCOPY_COPIED) != 0)
+    {
+        printf("the kernel copied zero-copy sends anyway, as it does over loopback, so\n"
+               "use -l and -H across a real network to find the crossover\n");
+    }
+
+    aesd_zerocopy_close(&zc);
+    close(sockfd);
+    close(fd);
+    return 0;
+}
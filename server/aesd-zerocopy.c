@@ -0,0 +1,341 @@
+/**
+ * @file aesd-zerocopy.c
+ * @brief Echo-backs sent straight from the page cache with MSG_ZEROCOPY
+ *
+ * The kernel numbers every sendmsg() that goes out zero-copy on a socket,
+ * starting from 0, and reports them as ranges of those numbers. Each
+ * mapping remembers the numbers its sends were given, and is unmapped once
+ * all of them have been reported.
+ */
+
+#include "aesd-zerocopy.h"
+#include "aesd-memory.h"
+#include "aesd-stats.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY     60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY    0x4000000
+#endif
+
+static atomic_size_t zerocopyThreshold = 0;
+
+void aesd_zerocopy_init(size_t threshold)
+{
+    atomic_store_explicit(&zerocopyThreshold, threshold, memory_order_relaxed);
+}
+
+bool aesd_zerocopy_open(aesd_zerocopy_t *zc, int sockfd)
+{
+    int one = 1;
+
+    zc->sockfd = sockfd;
+    zc->enabled = false;
+    zc->nextSeq = 0;
+    zc->pendingCount = 0;
+    STAILQ_INIT(&zc->pending);
+
+    if (atomic_load_explicit(&zerocopyThreshold, memory_order_relaxed) == 0)
+    {
+        return false;
+    }
+
+    // Refused for unix domain sockets, which always copy
+    if (setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) != 0)
+    {
+        return false;
+    }
+
+    zc->enabled = true;
+    return true;
+}
+
+bool aesd_zerocopy_wanted(const aesd_zerocopy_t *zc, uint64_t len)
+{
+    size_t threshold = atomic_load_explicit(&zerocopyThreshold, memory_order_relaxed);
+
+    return zc->enabled && threshold != 0 && len >= threshold;
+}
+
+static void unmapPending(aesd_zerocopy_t *zc, aesd_zerocopy_map_t *map)
+{
+    STAILQ_REMOVE(&zc->pending, map, aesd_zerocopy_map_s, entries);
+    zc->pendingCount--;
+    munmap(map->addr, map->len);
+    aesd_memory_release(MEM_RESPONSE, map->len);
+    free(map);
+}
+
+/**
+ * @brief Send every iovec in full, zero-copy while the kernel allows it
+ *
+ * @param stop Set if the kernel ran out of room to track zero-copy sends,
+ *  in which case the rest was copied
+ * @return int
+ * @retval -1 Error
+ * @retval  0 Success
+ */
+static int sendFromMap(aesd_zerocopy_t *zc, aesd_zerocopy_map_t *map, struct iovec *iov,
+                       uint32_t count, int flags, bool *stop)
+{
+    struct msghdr msg;
+    uint32_t firstIov = 0;
+    ssize_t sendRet;
+
+    while (firstIov < count)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov[firstIov];
+        msg.msg_iovlen = count - firstIov;
+
+        sendRet = sendmsg(zc->sockfd, &msg, flags | (*stop ? 0 : MSG_ZEROCOPY) | MSG_NOSIGNAL);
+        if (sendRet < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == ENOBUFS && !*stop)
+            {
+                *stop = true;
+                continue;
+            }
+            return -1;
+        }
+
+        if (!*stop)
+        {
+            map->lastSeq = zc->nextSeq++;
+            map->outstanding++;
+            aesd_stats_add(STAT_ZEROCOPY_SENDS, 1);
+            aesd_stats_add(STAT_ZEROCOPY_BYTES, sendRet);
+        }
+
+        while (firstIov < count && (size_t)sendRet >= iov[firstIov].iov_len)
+        {
+            sendRet -= iov[firstIov].iov_len;
+            firstIov++;
+        }
+        if (firstIov < count)
+        {
+            iov[firstIov].iov_base = (char *)iov[firstIov].iov_base + sendRet;
+            iov[firstIov].iov_len -= sendRet;
+        }
+    }
+
+    return 0;
+}
+
+ssize_t aesd_zerocopy_send_file(aesd_zerocopy_t *zc, int fd, uint64_t offset, uint64_t len,
+                                bool framed)
+{
+    const uint64_t pageSize = sysconf(_SC_PAGESIZE);
+    const uint64_t mapOffset = offset - offset % pageSize;
+    const size_t frameCount = (len + ZEROCOPY_FRAME_MAX - 1) / ZEROCOPY_FRAME_MAX;
+    aesd_zerocopy_map_t *map;
+    struct iovec iov[2];
+    uint64_t sent = 0;
+    size_t frameLen;
+    size_t frame;
+    bool stop = false;
+
+    if (zc->pendingCount >= ZEROCOPY_MAX_PENDING)
+    {
+        aesd_zerocopy_reap(zc, ZEROCOPY_WAIT_MS);
+        if (zc->pendingCount >= ZEROCOPY_MAX_PENDING)
+        {
+            return 0;
+        }
+    }
+
+    map = malloc(sizeof(*map) + frameCount * sizeof(map->frameHeaders[0]));
+    if (map == NULL)
+    {
+        return 0;
+    }
+
+    map->len = offset - mapOffset + len;
+    map->addr = mmap(NULL, map->len, PROT_READ, MAP_SHARED, fd, mapOffset);
+    if (map->addr == MAP_FAILED)
+    {
+        perror("mmap() error in zero-copy echo-back");
+        free(map);
+        return 0;
+    }
+    map->firstSeq = zc->nextSeq;
+    map->lastSeq = map->firstSeq;
+    map->outstanding = 0;
+
+    // Charged until the kernel lets go of the pages, which it may hold
+    // well after the reply has been sent
+    aesd_memory_charge(MEM_RESPONSE, map->len);
+    STAILQ_INSERT_TAIL(&zc->pending, map, entries);
+    zc->pendingCount++;
+
+    for (frame = 0; frame < frameCount && !stop; frame++)
+    {
+        frameLen = len - sent < ZEROCOPY_FRAME_MAX ? len - sent : ZEROCOPY_FRAME_MAX;
+
+        map->frameHeaders[frame] = htonl(frameLen);
+        iov[0].iov_base = &map->frameHeaders[frame];
+        iov[0].iov_len = framed ? sizeof(map->frameHeaders[frame]) : 0;
+        iov[1].iov_base = (char *)map->addr + (offset - mapOffset) + sent;
+        iov[1].iov_len = frameLen;
+
+        // Corked until the empty frame, as copied replies are
+        if (sendFromMap(zc, map, iov, 2, framed ? MSG_MORE : 0, &stop) != 0)
+        {
+            if (map->outstanding == 0)
+            {
+                unmapPending(zc, map);
+            }
+            return -1;
+        }
+        sent += frameLen;
+    }
+
+    if (map->outstanding == 0)
+    {
+        unmapPending(zc, map);
+    }
+
+    return sent;
+}
+
+/**
+ * @brief Count sends first..last as reported, unmapping what they finish
+ */
+static void completeSends(aesd_zerocopy_t *zc, uint32_t first, uint32_t last, bool copied)
+{
+    // Numbers are 32 bits on the wire, and never more than a few behind
+    const uint64_t lo = zc->nextSeq - (uint32_t)((uint32_t)zc->nextSeq - first);
+    const uint64_t hi = lo + (uint32_t)(last - first);
+    aesd_zerocopy_map_t *map;
+    aesd_zerocopy_map_t *next;
+    uint64_t from;
+    uint64_t to;
+
+    if (copied)
+    {
+        // The kernel copied the pages after all, pinning them only added
+        // to the cost
+        aesd_stats_add(STAT_ZEROCOPY_COPIED, hi - lo + 1);
+        zc->enabled = false;
+    }
+
+    STAILQ_FOREACH_SAFE(map, &zc->pending, entries, next)
+    {
+        // A mapping's sends are numbered back to back, and each is reported
+        // exactly once
+        from = lo > map->firstSeq ? lo : map->firstSeq;
+        to = hi < map->lastSeq ? hi : map->lastSeq;
+        if (from <= to && map->outstanding > 0)
+        {
+            map->outstanding -= to - from + 1;
+            if (map->outstanding == 0)
+            {
+                unmapPending(zc, map);
+            }
+        }
+    }
+}
+
+int aesd_zerocopy_reap(aesd_zerocopy_t *zc, int timeoutMs)
+{
+    // Reports are queued as errors, so poll() flags them with POLLERR
+    struct pollfd pollFd = {.fd = zc->sockfd, .events = 0};
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+    struct sock_extended_err *serr;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    bool waited = timeoutMs <= 0;
+    int handled = 0;
+
+    if (STAILQ_EMPTY(&zc->pending))
+    {
+        return 0;
+    }
+
+    while (!STAILQ_EMPTY(&zc->pending))
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(zc->sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN && handled == 0 && !waited)
+            {
+                waited = true;
+                if (poll(&pollFd, 1, timeoutMs) > 0)
+                {
+                    continue;
+                }
+            }
+            return errno == EAGAIN || errno == EINTR ? handled : -1;
+        }
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                  (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)))
+            {
+                continue;
+            }
+
+            serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+            if (serr->ee_origin == SO_EE_ORIGIN_ZEROCOPY && serr->ee_errno == 0)
+            {
+                completeSends(zc, serr->ee_info, serr->ee_data,
+                              serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED);
+                handled++;
+            }
+        }
+    }
+
+    return handled;
+}
+
+void aesd_zerocopy_close(aesd_zerocopy_t *zc)
+{
+    struct timespec start;
+    struct timespec now;
+    int waitedMs = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (!STAILQ_EMPTY(&zc->pending) && waitedMs < ZEROCOPY_DRAIN_MS)
+    {
+        // Nothing arriving in time, or the peer hanging up, ends the wait
+        if (aesd_zerocopy_reap(zc, ZEROCOPY_DRAIN_MS - waitedMs) <= 0)
+        {
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        waitedMs = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+    }
+
+    while (!STAILQ_EMPTY(&zc->pending))
+    {
+        unmapPending(zc, STAILQ_FIRST(&zc->pending));
+    }
+}
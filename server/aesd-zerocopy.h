@@ -0,0 +1,121 @@
+/**
+ * @file aesd-zerocopy.h
+ * @brief Echo-backs sent straight from the page cache with MSG_ZEROCOPY
+ *
+ * Large echo-backs of a file-backed channel are sent from a read-only
+ * mapping of its data file rather than copied through a read buffer. The
+ * kernel then references the pages instead of copying them into the socket,
+ * and reports on the socket's error queue once it no longer needs them.
+ * Each mapping is kept until every send from it has been reported.
+ *
+ * Zero-copy only pays once a reply is large enough that copying it costs
+ * more than pinning its pages and handling the report, so replies below the
+ * threshold are copied as before. A connection whose sends the kernel ends
+ * up copying anyway, as it does over loopback, goes back to copying.
+ */
+
+#pragma once
+
+#include "./queue.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Largest frame a zero-copy echo-back is cut into
+#define ZEROCOPY_FRAME_MAX      (16 * 1024 * 1024)
+// Mappings a connection may have waiting for the kernel before it waits
+// for reports rather than sending more
+#define ZEROCOPY_MAX_PENDING    64
+// How long to wait for reports when too many are pending, or when the
+// connection closes
+#define ZEROCOPY_WAIT_MS        100
+#define ZEROCOPY_DRAIN_MS       1000
+
+typedef struct aesd_zerocopy_map_s aesd_zerocopy_map_t;
+
+struct aesd_zerocopy_map_s
+{
+    void *addr;
+    size_t len;
+    // Sends made from the mapping, numbered as the kernel numbers them,
+    // and how many of those it has not reported yet
+    uint64_t firstSeq;
+    uint64_t lastSeq;
+    uint32_t outstanding;
+    STAILQ_ENTRY(aesd_zerocopy_map_s) entries;
+    // Frame headers, which the kernel may read until the sends are reported
+    uint32_t frameHeaders[];
+};
+
+typedef struct aesd_zerocopy_s
+{
+    int sockfd;
+    // Set once SO_ZEROCOPY is on, cleared again if sends end up copied
+    bool enabled;
+    // Number the kernel gives the next zero-copy send on the socket
+    uint64_t nextSeq;
+    size_t pendingCount;
+    STAILQ_HEAD(zerocopy_map_list_s, aesd_zerocopy_map_s) pending;
+} aesd_zerocopy_t;
+
+/**
+ * @brief Set how large an echo-back must be to be sent zero-copy, at any
+ *  time. Connections only turn zero-copy on when they start, so lifting a
+ *  threshold of 0 only affects connections started afterwards.
+ *
+ * @param threshold Bytes, or 0 to always copy
+ */
+void aesd_zerocopy_init(size_t threshold);
+
+/**
+ * @brief Turn on zero-copy sends for a connected socket, if the threshold
+ *  is set and the socket supports them
+ *
+ * zc is ready for aesd_zerocopy_close() whether or not this succeeds.
+ *
+ * @return bool True if zero-copy sends are on
+ */
+bool aesd_zerocopy_open(aesd_zerocopy_t *zc, int sockfd);
+
+/**
+ * @brief Whether an echo-back of len bytes should be sent zero-copy
+ */
+bool aesd_zerocopy_wanted(const aesd_zerocopy_t *zc, uint64_t len);
+
+/**
+ * @brief Send len bytes of a file from offset, zero-copy
+ *
+ * Stops early, without an error, if the kernel runs out of room to track
+ * zero-copy sends or too many are waiting to be reported. The caller
+ * copies whatever is left, and should have reaped reports beforehand.
+ *
+ * @param fd File to send from, which must only ever be appended to
+ * @param framed Send as frames, each preceded by its length as a
+ *  big-endian uint32_t. The empty frame ending the reply is left to the
+ *  caller.
+ * @return ssize_t Bytes sent, or -1 on error sending to the peer
+ */
+ssize_t aesd_zerocopy_send_file(aesd_zerocopy_t *zc, int fd, uint64_t offset, uint64_t len,
+                                bool framed);
+
+/**
+ * @brief Handle the reports the kernel has queued, unmapping whatever it
+ *  no longer needs
+ *
+ * @param timeoutMs How long to wait for a report if none is queued, 0 to
+ *  not wait
+ * @return int Number of reports handled, or -1 on error
+ */
+int aesd_zerocopy_reap(aesd_zerocopy_t *zc, int timeoutMs);
+
+/**
+ * @brief Wait a little for outstanding sends, then unmap everything. Call
+ *  before the socket is closed.
+ *
+ * Pages the kernel still references stay valid after unmapping, and never
+ * change since the file is only appended to, so a peer that stopped reading
+ * cannot hold the connection open.
+ */
+void aesd_zerocopy_close(aesd_zerocopy_t *zc);
@@ -0,0 +1,1444 @@
+/**
+ * @file aesdsocket-bench.c
+ * @brief Load generator for aesdsocket
+ *
+ * Each connection sends a burst of packets (one by default) and waits for
+ * the echo-back of the log, which always ends with the last packet just
+ * appended, before sending the next burst. Connections can be spread across
+ * channels to measure how throughput scales when producers do not share a
+ * log. With -B the same packets are sent as length-prefixed records, so
+ * the cost of newline framing can be compared on large packets.
+ *
+ * The round trip of every burst is timed. -U connects over a unix domain
+ * socket instead of TCP, and -X runs the same load over both and compares
+ * them side by side.
+ *
+ * -A sends through the client library instead, pipelining up to the
+ * pipeline depth of packets and timing each from being queued until the
+ * server acknowledges it, without any echo-back of the log.
+ *
+ * -W adds connections that stream packets back to back on the same channels
+ * for as long as the measured connections run, never waiting for an
+ * echo-back, to show how long everybody else waits on the channel lock
+ * with and without aesdsocket -f.
+ *
+ * -D fires the packets as datagrams at the server's UDP ingest port
+ * instead, in batches of the pipeline depth, and measures how many lines
+ * per second the server appends from the datagrams_ingested counter.
+ *
+ * Connection runs also report the CPU time the server spent on them, and
+ * how often busy-polling threads found data while spinning, so aesdsocket
+ * -b can be weighed on latency and CPU together.
+ */
+
+#define _GNU_SOURCE
+
+#include "aesd-client.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+
+#define BENCH_RECV_BUFF_SIZE    65536
+#define RECORD_HEADER_LEN       4
+// Ingest is done once the server's count has not moved for this long
+#define INGEST_SETTLE_SEC       0.5
+#define INGEST_STAT_NAME        "datagrams_ingested"
+// Packets a streamer has in flight per send
+#define STREAM_BATCH_PACKETS    64
+
+typedef struct bench_config_s
+{
+    const char *host;
+    const char *port;
+    int connections;
+    int packets;
+    int packetSize;
+    int channels;
+    int subscribers;
+    int streamers;
+    int pipelineDepth;
+    bool perLineEcho;
+    bool binaryFraming;
+    // Pipeline through the client library, timing acknowledgements
+    bool asyncAcks;
+    // Connect here over AF_UNIX rather than to host:port
+    const char *unixPath;
+    // Keeps the channels of one transport apart from another's in -X runs
+    const char *channelTag;
+    // Send datagrams to this UDP port rather than connecting
+    const char *ingestPort;
+    // Kept open across runs for reading the server's counters
+    aesd_client_config_t control;
+    aesd_client_pool_t *controlPool;
+} bench_config_t;
+
+typedef struct bench_thread_s
+{
+    pthread_t threadHandle;
+    int id;
+    const bench_config_t *config;
+    uint64_t packetsSent;
+    uint64_t bytesSent;
+    uint64_t bytesReceived;
+    // Round trip of each burst, in seconds
+    double *latencies;
+    size_t latencyCount;
+    // -A runs only, when each packet still in flight was queued, by its
+    // number modulo the pipeline depth
+    double *queuedAt;
+    // -A runs only, packets the server answered EBUSY and did not append
+    uint64_t busyPackets;
+    bool failed;
+} bench_thread_t;
+
+typedef struct bench_result_s
+{
+    uint64_t packets;
+    uint64_t bytesSent;
+    uint64_t bytesReceived;
+    uint64_t pushedPackets;
+    uint64_t streamedPackets;
+    uint64_t busyPackets;
+    double elapsed;
+    // Every burst round trip, sorted
+    double *latencies;
+    size_t latencyCount;
+    int failures;
+    // Datagram runs only, packets the server appended and how long it took
+    uint64_t ingestedPackets;
+    double ingestElapsed;
+    // Server counters over the run, left zero if it could not be asked
+    bool haveServerStats;
+    uint64_t serverUserUs;
+    uint64_t serverSystemUs;
+    uint64_t busyPollHits;
+    uint64_t busyPollParks;
+} bench_result_t;
+
+// Counters runBench() reads before and after a run
+static const char *const serverStatNames[] = {
+    "cpu_user_us",
+    "cpu_system_us",
+    "busy_poll_hits",
+    "busy_poll_parks",
+};
+#define SERVER_STAT_COUNT   (sizeof(serverStatNames) / sizeof(serverStatNames[0]))
+
+static uint32_t runNonce;
+static volatile bool producersDone = false;
+
+static double nowSeconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void setClientConfig(const bench_config_t *config, aesd_client_config_t *clientConfig)
+{
+    memset(clientConfig, 0, sizeof(*clientConfig));
+    clientConfig->host = config->host;
+    clientConfig->port = config->port;
+    clientConfig->unixPath = config->unixPath;
+}
+
+static int connectToServer(const bench_config_t *config)
+{
+    aesd_client_config_t clientConfig;
+
+    setClientConfig(config, &clientConfig);
+    return aesd_client_dial(&clientConfig);
+}
+
+/**
+ * @brief Keep only the last tailSize bytes of the stream in tail
+ */
+static void updateTail(char *tail, size_t *tailLen, size_t tailSize, const char *buf,
+                       size_t len)
+{
+    size_t keep;
+
+    if (len >= tailSize)
+    {
+        memcpy(tail, buf + len - tailSize, tailSize);
+        *tailLen = tailSize;
+    }
+    else
+    {
+        keep = *tailLen < tailSize - len ? *tailLen : tailSize - len;
+        memmove(tail, tail + *tailLen - keep, keep);
+        memcpy(tail + keep, buf, len);
+        *tailLen = keep + len;
+    }
+}
+
+/**
+ * @brief Receive until the stream ends with the given packet, which marks
+ *  the end of the echo-back that answers it
+ *
+ * @return Bytes received, or -1 on error
+ */
+static ssize_t recvEchoEndingWith(int sockfd, const char *packet, size_t packetLen,
+                                  char *recvBuff, char *tail)
+{
+    ssize_t recvRet;
+    ssize_t total = 0;
+    size_t tailLen = 0;
+
+    while (tailLen < packetLen || memcmp(tail, packet, packetLen) != 0)
+    {
+        recvRet = recv(sockfd, recvBuff, BENCH_RECV_BUFF_SIZE, 0);
+        if (recvRet <= 0)
+        {
+            if (recvRet < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        total += recvRet;
+        updateTail(tail, &tailLen, packetLen, recvBuff, recvRet);
+    }
+
+    return total;
+}
+
+/**
+ * @brief Binary framing counterpart of recvEchoEndingWith(), receives whole
+ *  framed replies until one ends with the given packet
+ *
+ * @return Bytes received, or -1 on error
+ */
+static ssize_t recvFramedEchoEndingWith(int sockfd, const char *packet, size_t packetLen,
+                                        char *recvBuff, char *tail)
+{
+    uint8_t frameHeader[RECORD_HEADER_LEN];
+    size_t headerLen = 0;
+    uint32_t frameLeft = 0;
+    size_t buffPos;
+    size_t payloadLen;
+    size_t chunkLen;
+    ssize_t recvRet;
+    ssize_t total = 0;
+    size_t tailLen = 0;
+
+    while (true)
+    {
+        recvRet = recv(sockfd, recvBuff, BENCH_RECV_BUFF_SIZE, 0);
+        if (recvRet <= 0)
+        {
+            if (recvRet < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        total += recvRet;
+
+        // Squeeze the frame headers out so the tail is updated once per
+        // recv rather than once per frame
+        buffPos = 0;
+        payloadLen = 0;
+        while (buffPos < (size_t)recvRet)
+        {
+            if (frameLeft > 0)
+            {
+                chunkLen = frameLeft < recvRet - buffPos ? frameLeft : recvRet - buffPos;
+                memmove(recvBuff + payloadLen, recvBuff + buffPos, chunkLen);
+                payloadLen += chunkLen;
+                frameLeft -= chunkLen;
+                buffPos += chunkLen;
+                continue;
+            }
+
+            frameHeader[headerLen++] = recvBuff[buffPos++];
+            if (headerLen < RECORD_HEADER_LEN)
+            {
+                continue;
+            }
+
+            headerLen = 0;
+            frameLeft = (uint32_t)frameHeader[0] << 24 | frameHeader[1] << 16 |
+                        frameHeader[2] << 8 | frameHeader[3];
+            if (frameLeft > 0)
+            {
+                continue;
+            }
+
+            // An empty frame ends a reply, which is the last one owed if it
+            // ends with the packet
+            updateTail(tail, &tailLen, packetLen, recvBuff, payloadLen);
+            payloadLen = 0;
+            if (tailLen == packetLen && memcmp(tail, packet, packetLen) == 0)
+            {
+                return total;
+            }
+        }
+
+        updateTail(tail, &tailLen, packetLen, recvBuff, payloadLen);
+    }
+}
+
+/**
+ * @brief Switch the connection to length-prefixed records
+ */
+static int startBinaryFraming(int sockfd)
+{
+    const char binaryCmd[] = "AESDCHAR_BINARY\n";
+    const char binaryAck[] = "AESDCHAR_BINARY:OK\n";
+    char reply[sizeof(binaryAck) - 1];
+
+    if (aesd_client_send_all(sockfd, binaryCmd, strlen(binaryCmd)) != 0 ||
+        aesd_client_recv_all(sockfd, reply, sizeof(reply)) != 0 ||
+        memcmp(reply, binaryAck, sizeof(reply)) != 0)
+    {
+        fprintf(stderr, "Server did not accept binary framing\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int selectChannel(int sockfd, const bench_config_t *config, int id)
+{
+    char channelCmd[64];
+
+    if (config->channels == 0)
+    {
+        return 0;
+    }
+
+    snprintf(channelCmd, sizeof(channelCmd), "AESDCHAR_CHANNEL:bench%s%d\n",
+             config->channelTag, id % config->channels);
+    return aesd_client_send_all(sockfd, channelCmd, strlen(channelCmd));
+}
+
+static void fillPacket(char *packet, int packetSize, int id, int seq)
+{
+    int headerLen = snprintf(packet, packetSize, "%08x c%d s%d ", runNonce, id, seq);
+
+    if (headerLen >= packetSize)
+    {
+        headerLen = packetSize - 1;
+    }
+    memset(packet + headerLen, 'x', packetSize - headerLen - 1);
+    packet[packetSize - 1] = '\n';
+}
+
+/**
+ * @brief Round trips a connection times: one per burst, or one per packet
+ *  when pipelining through the client library
+ */
+static size_t latenciesPerConnection(const bench_config_t *config)
+{
+    if (config->asyncAcks)
+    {
+        return config->packets;
+    }
+
+    return (config->packets + config->pipelineDepth - 1) / config->pipelineDepth;
+}
+
+static void *benchThread(void *arg)
+{
+    bench_thread_t *thread = arg;
+    const bench_config_t *config = thread->config;
+    const char lineEchoCmd[] = "AESDCHAR_ECHOMODE:line\n";
+    size_t headerLen = config->binaryFraming ? RECORD_HEADER_LEN : 0;
+    size_t recordSize = headerLen + config->packetSize;
+    char *burst = malloc(recordSize * config->pipelineDepth);
+    uint32_t recordHeader = htonl(config->packetSize);
+    char *lastPacket;
+    char *tail = malloc(config->packetSize);
+    char *recvBuff = malloc(BENCH_RECV_BUFF_SIZE);
+    ssize_t recvd;
+    double burstStart;
+    int sockfd;
+    int burstPackets;
+    int seq;
+    int i;
+
+    thread->failed = true;
+    thread->latencies = malloc(sizeof(double) * latenciesPerConnection(config));
+
+    if (burst == NULL || tail == NULL || recvBuff == NULL || thread->latencies == NULL)
+    {
+        goto out;
+    }
+
+    sockfd = connectToServer(config);
+    if (sockfd == -1)
+    {
+        goto out;
+    }
+
+    if (selectChannel(sockfd, config, thread->id) != 0)
+    {
+        goto closeSock;
+    }
+
+    if (config->perLineEcho &&
+        aesd_client_send_all(sockfd, lineEchoCmd, strlen(lineEchoCmd)) != 0)
+    {
+        goto closeSock;
+    }
+
+    if (config->binaryFraming && startBinaryFraming(sockfd) != 0)
+    {
+        goto closeSock;
+    }
+
+    for (seq = 0; seq < config->packets; seq += burstPackets)
+    {
+        burstPackets = config->packets - seq < config->pipelineDepth ?
+                           config->packets - seq : config->pipelineDepth;
+
+        for (i = 0; i < burstPackets; i++)
+        {
+            // The packet keeps its newline either way so the log ends up the
+            // same in both framings
+            memcpy(burst + (size_t)i * recordSize, &recordHeader, headerLen);
+            fillPacket(burst + (size_t)i * recordSize + headerLen, config->packetSize,
+                       thread->id, seq + i);
+        }
+        lastPacket = burst + (size_t)(burstPackets - 1) * recordSize + headerLen;
+
+        burstStart = nowSeconds();
+        if (aesd_client_send_all(sockfd, burst, (size_t)burstPackets * recordSize) != 0)
+        {
+            perror("send() error");
+            goto closeSock;
+        }
+
+        // Whether the server answers every packet or the burst as a whole,
+        // the final echo-back ends with the last packet
+        if (config->binaryFraming)
+        {
+            recvd = recvFramedEchoEndingWith(sockfd, lastPacket, config->packetSize,
+                                             recvBuff, tail);
+        }
+        else
+        {
+            recvd = recvEchoEndingWith(sockfd, lastPacket, config->packetSize, recvBuff, tail);
+        }
+        if (recvd < 0)
+        {
+            fprintf(stderr, "Connection %d lost waiting for echo\n", thread->id);
+            goto closeSock;
+        }
+
+        thread->latencies[thread->latencyCount++] = nowSeconds() - burstStart;
+        thread->packetsSent += burstPackets;
+        thread->bytesSent += (size_t)burstPackets * config->packetSize;
+        thread->bytesReceived += recvd;
+    }
+
+    thread->failed = false;
+
+closeSock:
+    close(sockfd);
+out:
+    free(burst);
+    free(tail);
+    free(recvBuff);
+    return NULL;
+}
+
+static void recordAcks(void *arg, uint64_t firstSeq, uint32_t count)
+{
+    bench_thread_t *thread = arg;
+    const bench_config_t *config = thread->config;
+    double now = nowSeconds();
+    uint64_t seq;
+
+    for (seq = firstSeq; seq < firstSeq + count; seq++)
+    {
+        thread->latencies[thread->latencyCount++] = now - thread->queuedAt[seq %
+                                                                           config->pipelineDepth];
+    }
+    thread->packetsSent += count;
+    thread->bytesSent += (uint64_t)count * config->packetSize;
+}
+
+static void countBusy(void *arg, uint64_t seq)
+{
+    bench_thread_t *thread = arg;
+
+    thread->busyPackets++;
+}
+
+static void countEcho(void *arg, uint64_t seq, const char *log, size_t len)
+{
+    bench_thread_t *thread = arg;
+
+    thread->bytesReceived += len;
+}
+
+/**
+ * @brief Keep up to the pipeline depth of packets in flight through the
+ *  client library, which batches them into as few writes as it can
+ */
+static void *asyncThread(void *arg)
+{
+    bench_thread_t *thread = arg;
+    const bench_config_t *config = thread->config;
+    char *packet = malloc(config->packetSize);
+    aesd_client_config_t clientConfig;
+    aesd_client_conn_t conn;
+    char channel[64];
+    int seq;
+
+    thread->failed = true;
+    thread->latencies = malloc(sizeof(double) * latenciesPerConnection(config));
+    thread->queuedAt = malloc(sizeof(double) * config->pipelineDepth);
+
+    if (packet == NULL || thread->latencies == NULL || thread->queuedAt == NULL)
+    {
+        goto out;
+    }
+
+    setClientConfig(config, &clientConfig);
+    if (config->channels > 0)
+    {
+        snprintf(channel, sizeof(channel), "bench%s%d", config->channelTag,
+                 thread->id % config->channels);
+        clientConfig.channel = channel;
+    }
+    clientConfig.echo = config->perLineEcho;
+    clientConfig.window = config->pipelineDepth;
+    clientConfig.onAck = recordAcks;
+    clientConfig.onEcho = countEcho;
+    clientConfig.onBusy = countBusy;
+    clientConfig.arg = thread;
+
+    if (aesd_client_open(&conn, &clientConfig) != 0)
+    {
+        goto out;
+    }
+
+    // Queued packets go out once the batch fills or the window does, so
+    // the time they wait in the batch counts towards their round trip
+    for (seq = 0; seq < config->packets; seq++)
+    {
+        fillPacket(packet, config->packetSize, thread->id, seq);
+        thread->queuedAt[seq % config->pipelineDepth] = nowSeconds();
+        if (aesd_client_append(&conn, packet, config->packetSize) != 0)
+        {
+            perror("Connection lost sending");
+            goto closeConn;
+        }
+    }
+
+    if (aesd_client_sync(&conn) != 0)
+    {
+        fprintf(stderr, "Connection %d lost waiting for acknowledgements\n", thread->id);
+        goto closeConn;
+    }
+
+    thread->failed = false;
+
+closeConn:
+    aesd_client_close(&conn);
+out:
+    free(packet);
+    free(thread->queuedAt);
+    return NULL;
+}
+
+/**
+ * @brief Follow a channel and count the packets pushed to it until the
+ *  producers are done and the stream goes quiet
+ */
+static void *subscriberThread(void *arg)
+{
+    bench_thread_t *thread = arg;
+    const char subscribeCmd[] = "AESDCHAR_SUBSCRIBE\n";
+    struct timeval recvTimeout = {.tv_sec = 0, .tv_usec = 500000};
+    char *recvBuff = malloc(BENCH_RECV_BUFF_SIZE);
+    char *nlPtr;
+    ssize_t recvRet;
+    int sockfd;
+
+    thread->failed = true;
+
+    if (recvBuff == NULL)
+    {
+        return NULL;
+    }
+
+    sockfd = connectToServer(thread->config);
+    if (sockfd == -1)
+    {
+        free(recvBuff);
+        return NULL;
+    }
+
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &recvTimeout, sizeof(recvTimeout));
+
+    if (selectChannel(sockfd, thread->config, thread->id) != 0 ||
+        aesd_client_send_all(sockfd, subscribeCmd, strlen(subscribeCmd)) != 0)
+    {
+        goto out;
+    }
+
+    while (true)
+    {
+        recvRet = recv(sockfd, recvBuff, BENCH_RECV_BUFF_SIZE, 0);
+        if (recvRet < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            if (producersDone)
+            {
+                break;
+            }
+            continue;
+        }
+        if (recvRet <= 0)
+        {
+            fprintf(stderr, "Subscriber %d disconnected\n", thread->id);
+            goto out;
+        }
+
+        thread->bytesReceived += recvRet;
+        nlPtr = recvBuff;
+        while ((nlPtr = memchr(nlPtr, '\n', recvRet - (nlPtr - recvBuff))) != NULL)
+        {
+            thread->packetsSent++;
+            nlPtr++;
+        }
+    }
+
+    thread->failed = false;
+
+out:
+    close(sockfd);
+    free(recvBuff);
+    return NULL;
+}
+
+/**
+ * @brief Send packets back to back until the measured connections are done,
+ *  reading and throwing away echo-backs only so the server never blocks
+ *  sending them
+ */
+static void *streamerThread(void *arg)
+{
+    bench_thread_t *thread = arg;
+    const bench_config_t *config = thread->config;
+    size_t batchSize = (size_t)config->packetSize * STREAM_BATCH_PACKETS;
+    char *batch = malloc(batchSize);
+    char *recvBuff = malloc(BENCH_RECV_BUFF_SIZE);
+    struct pollfd pfd;
+    size_t batchSent = batchSize;
+    ssize_t ioRet;
+    int seq = 0;
+    int i;
+
+    thread->failed = true;
+
+    if (batch == NULL || recvBuff == NULL)
+    {
+        goto out;
+    }
+
+    pfd.fd = connectToServer(config);
+    if (pfd.fd == -1)
+    {
+        goto out;
+    }
+
+    if (selectChannel(pfd.fd, config, thread->id) != 0 ||
+        fcntl(pfd.fd, F_SETFL, O_NONBLOCK) != 0)
+    {
+        goto closeSock;
+    }
+
+    while (!producersDone)
+    {
+        if (batchSent == batchSize)
+        {
+            for (i = 0; i < STREAM_BATCH_PACKETS; i++)
+            {
+                fillPacket(batch + (size_t)i * config->packetSize, config->packetSize,
+                           config->connections + thread->id, seq++);
+            }
+            batchSent = 0;
+        }
+
+        pfd.events = POLLIN | POLLOUT;
+        if (poll(&pfd, 1, 100) <= 0)
+        {
+            continue;
+        }
+
+        if (pfd.revents & (POLLERR | POLLHUP))
+        {
+            fprintf(stderr, "Streamer %d lost its connection\n", thread->id);
+            goto closeSock;
+        }
+
+        while ((ioRet = recv(pfd.fd, recvBuff, BENCH_RECV_BUFF_SIZE, 0)) > 0)
+        {
+            thread->bytesReceived += ioRet;
+        }
+
+        ioRet = send(pfd.fd, batch + batchSent, batchSize - batchSent, MSG_NOSIGNAL);
+        if (ioRet > 0)
+        {
+            // Whole packets only, a partial one is finished by the next send
+            thread->packetsSent += (batchSent + ioRet) / config->packetSize -
+                                   batchSent / config->packetSize;
+            batchSent += ioRet;
+        }
+        else if (ioRet < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            perror("send() error on streamer");
+            goto closeSock;
+        }
+    }
+
+    thread->failed = false;
+
+closeSock:
+    close(pfd.fd);
+out:
+    free(batch);
+    free(recvBuff);
+    return NULL;
+}
+
+/**
+ * @brief Fire packets at the ingest port in batches of the pipeline depth,
+ *  one sendmmsg() per batch, without waiting for anything back
+ */
+static void *datagramThread(void *arg)
+{
+    bench_thread_t *thread = arg;
+    const bench_config_t *config = thread->config;
+    struct mmsghdr *msgs = calloc(config->pipelineDepth, sizeof(struct mmsghdr));
+    struct iovec *iovs = calloc(config->pipelineDepth, sizeof(struct iovec));
+    char *burst = malloc((size_t)config->packetSize * config->pipelineDepth);
+    struct addrinfo hints;
+    struct addrinfo *res = NULL;
+    int sockfd = -1;
+    int burstPackets;
+    int sent;
+    int seq;
+    int i;
+
+    thread->failed = true;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    if (msgs == NULL || iovs == NULL || burst == NULL ||
+        getaddrinfo(config->host, config->ingestPort, &hints, &res) != 0)
+    {
+        goto out;
+    }
+
+    sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (sockfd == -1 || connect(sockfd, res->ai_addr, res->ai_addrlen) != 0)
+    {
+        perror("connect() error for ingest port");
+        goto out;
+    }
+
+    for (i = 0; i < config->pipelineDepth; i++)
+    {
+        iovs[i].iov_base = burst + (size_t)i * config->packetSize;
+        iovs[i].iov_len = config->packetSize;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    for (seq = 0; seq < config->packets; seq += burstPackets)
+    {
+        burstPackets = config->packets - seq < config->pipelineDepth ?
+                           config->packets - seq : config->pipelineDepth;
+
+        for (i = 0; i < burstPackets; i++)
+        {
+            fillPacket(iovs[i].iov_base, config->packetSize, thread->id, seq + i);
+        }
+
+        for (i = 0; i < burstPackets; i += sent)
+        {
+            sent = sendmmsg(sockfd, msgs + i, burstPackets - i, 0);
+            if (sent < 0)
+            {
+                if (errno == EINTR || errno == ENOBUFS)
+                {
+                    sent = 0;
+                    continue;
+                }
+                perror("sendmmsg() error");
+                goto out;
+            }
+        }
+
+        thread->packetsSent += burstPackets;
+        thread->bytesSent += (size_t)burstPackets * config->packetSize;
+    }
+
+    thread->failed = false;
+
+out:
+    if (sockfd != -1)
+    {
+        close(sockfd);
+    }
+    if (res != NULL)
+    {
+        freeaddrinfo(res);
+    }
+    free(msgs);
+    free(iovs);
+    free(burst);
+    return NULL;
+}
+
+/**
+ * @brief Find the complete "name value" line for a counter in a stats reply
+ *
+ * @return bool True if the line was found and value set
+ */
+static bool findStat(const char *reply, const char *name, uint64_t *value)
+{
+    size_t nameLen = strlen(name);
+    const char *line = reply;
+
+    while (line != NULL)
+    {
+        if (strncmp(line, name, nameLen) == 0 && line[nameLen] == ' ' &&
+            strchr(line, '\n') != NULL)
+        {
+            *value = strtoull(line + nameLen + 1, NULL, 10);
+            return true;
+        }
+        line = strchr(line, '\n');
+        line = line != NULL ? line + 1 : NULL;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Read counters from the server's AESDCHAR_STATS reply
+ *
+ * @param names Names of the counters wanted
+ * @param values Filled with the value of each counter in names
+ * @param count Number of counters wanted
+ * @return int
+ * @retval -1 Error or a counter missing from the reply
+ * @retval  0 Success
+ */
+static int queryStats(const bench_config_t *config, const char *const *names, uint64_t *values,
+                      int count)
+{
+    char reply[4096];
+    aesd_client_conn_t *conn;
+    ssize_t replyLen;
+    int i;
+
+    // Datagram runs poll the counters every millisecond, over one
+    // connection rather than a new one each time
+    conn = aesd_client_pool_acquire(config->controlPool);
+    if (conn == NULL)
+    {
+        return -1;
+    }
+    replyLen = aesd_client_query(conn, "AESDCHAR_STATS", reply, sizeof(reply) - 1);
+    aesd_client_pool_release(config->controlPool, conn);
+
+    if (replyLen < 0)
+    {
+        return -1;
+    }
+    reply[replyLen < (ssize_t)sizeof(reply) ? replyLen : (ssize_t)sizeof(reply) - 1] = '\0';
+
+    for (i = 0; i < count; i++)
+    {
+        if (!findStat(reply, names[i], &values[i]))
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int queryIngested(const bench_config_t *config, uint64_t *ingested)
+{
+    static const char *const names[] = {INGEST_STAT_NAME};
+
+    return queryStats(config, names, ingested, 1);
+}
+
+/**
+ * @brief Fire the configured load at the ingest port, then wait for the
+ *  server's ingest count to settle
+ *
+ * @return int
+ * @retval -1 Could not start the load or reach the server
+ * @retval  0 Ran, result->failures counts senders that did not finish
+ */
+static int runDatagramBench(const bench_config_t *config, bench_result_t *result)
+{
+    bench_thread_t *threads;
+    uint64_t startCount;
+    uint64_t count;
+    uint64_t lastCount;
+    double startTime;
+    double lastChange;
+    int i;
+
+    memset(result, 0, sizeof(*result));
+
+    if (queryIngested(config, &startCount) != 0)
+    {
+        fprintf(stderr, "Could not read datagrams_ingested from the server\n");
+        return -1;
+    }
+
+    threads = calloc(config->connections, sizeof(bench_thread_t));
+    if (threads == NULL)
+    {
+        return -1;
+    }
+
+    startTime = nowSeconds();
+
+    for (i = 0; i < config->connections; i++)
+    {
+        threads[i].id = i;
+        threads[i].config = config;
+        if (pthread_create(&threads[i].threadHandle, NULL, datagramThread, &threads[i]) != 0)
+        {
+            perror("pthread_create() error");
+            return -1;
+        }
+    }
+
+    for (i = 0; i < config->connections; i++)
+    {
+        pthread_join(threads[i].threadHandle, NULL);
+        result->packets += threads[i].packetsSent;
+        result->bytesSent += threads[i].bytesSent;
+        result->failures += threads[i].failed;
+    }
+
+    result->elapsed = nowSeconds() - startTime;
+
+    // Whatever has not arrived by the time the count stops moving was lost
+    lastCount = startCount;
+    lastChange = nowSeconds();
+    while (lastCount - startCount < result->packets &&
+           nowSeconds() - lastChange < INGEST_SETTLE_SEC)
+    {
+        if (queryIngested(config, &count) != 0)
+        {
+            free(threads);
+            return -1;
+        }
+        if (count != lastCount)
+        {
+            lastCount = count;
+            lastChange = nowSeconds();
+        }
+        usleep(1000);
+    }
+
+    result->ingestedPackets = lastCount - startCount;
+    result->ingestElapsed = lastChange - startTime;
+
+    free(threads);
+    return 0;
+}
+
+static void printDatagramResult(const bench_config_t *config, const bench_result_t *result)
+{
+    printf("transport:          udp ingest\n");
+    printf("senders:            %d\n", config->connections);
+    printf("packet size:        %d\n", config->packetSize);
+    printf("datagrams/sendmmsg: %d\n", config->pipelineDepth);
+    printf("packets sent:       %llu\n", (unsigned long long)result->packets);
+    printf("send elapsed (s):   %.3f\n", result->elapsed);
+    printf("packets/s sent:     %.0f\n", result->packets / result->elapsed);
+    printf("packets ingested:   %llu (%.2f%% lost)\n",
+           (unsigned long long)result->ingestedPackets,
+           result->packets ?
+               100.0 * (result->packets - result->ingestedPackets) / result->packets : 0.0);
+    printf("ingest elapsed (s): %.3f\n", result->ingestElapsed);
+    printf("lines/s ingested:   %.0f\n",
+           result->ingestElapsed > 0 ? result->ingestedPackets / result->ingestElapsed : 0.0);
+    printf("failed senders:     %d\n", result->failures);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "USAGE: %s [-H host] [-p port] [-U unix socket path] [-c connections]\n"
+            "          [-n packets] [-s packet size] [-C channels] [-S subscribers]\n"
+            "          [-W streamers] [-P pipeline depth] [-L] [-B] [-A] [-X] [-D udp port]\n\n"
+            "  -C 0 keeps every connection on the default channel, otherwise\n"
+            "  connections are spread round-robin over that many channels\n"
+            "  -S adds connections that subscribe to the same channels and\n"
+            "  count the packets pushed to them\n"
+            "  -W adds connections that stream packets to the same channels\n"
+            "  without waiting for echo-backs while the others are measured\n"
+            "  -P sends that many packets back to back before waiting for the\n"
+            "  echo-back, -L asks the server for an echo-back after every one\n"
+            "  -B sends packets as length-prefixed records instead of relying\n"
+            "  on their newlines\n"
+            "  -A pipelines through the client library, up to -P packets in\n"
+            "  flight, and times each packet until the server acknowledges it\n"
+            "  (with -L, until its echo-back). Packets a server past its lock\n"
+            "  deadline turns away are counted rather than sent again.\n"
+            "  -U connects over a unix domain socket instead of TCP, -X runs\n"
+            "  over TCP and then over -U and compares the two, each on its own\n"
+            "  channels so the echo-backs are the same size\n"
+            "  -D sends each packet as a datagram to that UDP ingest port, -P\n"
+            "  at a time, and reports how fast the server appends them\n",
+            prog);
+}
+
+static int compareDoubles(const void *a, const void *b)
+{
+    double lhs = *(const double *)a;
+    double rhs = *(const double *)b;
+
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+static double percentile(const bench_result_t *result, double fraction)
+{
+    if (result->latencyCount == 0)
+    {
+        return 0.0;
+    }
+
+    return result->latencies[(size_t)(fraction * (result->latencyCount - 1))];
+}
+
+/**
+ * @brief Run the configured load once and collect its results
+ *
+ * @return int
+ * @retval -1 Could not start the load
+ * @retval  0 Ran, result->failures counts connections that did not finish
+ */
+static int runBench(const bench_config_t *config, bench_result_t *result)
+{
+    bench_thread_t *threads;
+    bench_thread_t *subscribers = NULL;
+    bench_thread_t *streamers = NULL;
+    uint64_t statsBefore[SERVER_STAT_COUNT];
+    uint64_t statsAfter[SERVER_STAT_COUNT];
+    bool haveStatsBefore;
+    double startTime;
+    int i;
+
+    memset(result, 0, sizeof(*result));
+    producersDone = false;
+
+    threads = calloc(config->connections, sizeof(bench_thread_t));
+    if (threads == NULL)
+    {
+        return -1;
+    }
+
+    if (config->subscribers > 0)
+    {
+        subscribers = calloc(config->subscribers, sizeof(bench_thread_t));
+        if (subscribers == NULL)
+        {
+            free(threads);
+            return -1;
+        }
+
+        for (i = 0; i < config->subscribers; i++)
+        {
+            subscribers[i].id = i;
+            subscribers[i].config = config;
+            if (pthread_create(&subscribers[i].threadHandle, NULL, subscriberThread,
+                               &subscribers[i]) != 0)
+            {
+                perror("pthread_create() error");
+                return -1;
+            }
+        }
+
+        // Subscriptions are not acknowledged, give them time to land
+        usleep(200000);
+    }
+
+    if (config->streamers > 0)
+    {
+        streamers = calloc(config->streamers, sizeof(bench_thread_t));
+        if (streamers == NULL)
+        {
+            free(threads);
+            free(subscribers);
+            return -1;
+        }
+
+        for (i = 0; i < config->streamers; i++)
+        {
+            streamers[i].id = i;
+            streamers[i].config = config;
+            if (pthread_create(&streamers[i].threadHandle, NULL, streamerThread,
+                               &streamers[i]) != 0)
+            {
+                perror("pthread_create() error");
+                return -1;
+            }
+        }
+
+        // Measure against a stream that is already flowing
+        usleep(100000);
+    }
+
+    // Servers without the counters, or the CPU report, still get benched
+    haveStatsBefore = queryStats(config, serverStatNames, statsBefore, SERVER_STAT_COUNT) == 0;
+
+    startTime = nowSeconds();
+
+    for (i = 0; i < config->connections; i++)
+    {
+        threads[i].id = i;
+        threads[i].config = config;
+        if (pthread_create(&threads[i].threadHandle, NULL,
+                           config->asyncAcks ? asyncThread : benchThread, &threads[i]) != 0)
+        {
+            perror("pthread_create() error");
+            return -1;
+        }
+    }
+
+    result->latencies = malloc(sizeof(double) * config->connections *
+                               latenciesPerConnection(config));
+
+    for (i = 0; i < config->connections; i++)
+    {
+        pthread_join(threads[i].threadHandle, NULL);
+        result->packets += threads[i].packetsSent;
+        result->busyPackets += threads[i].busyPackets;
+        result->bytesSent += threads[i].bytesSent;
+        result->bytesReceived += threads[i].bytesReceived;
+        result->failures += threads[i].failed;
+        if (result->latencies != NULL && threads[i].latencies != NULL)
+        {
+            memcpy(result->latencies + result->latencyCount, threads[i].latencies,
+                   sizeof(double) * threads[i].latencyCount);
+            result->latencyCount += threads[i].latencyCount;
+        }
+        free(threads[i].latencies);
+    }
+
+    result->elapsed = nowSeconds() - startTime;
+
+    if (haveStatsBefore &&
+        queryStats(config, serverStatNames, statsAfter, SERVER_STAT_COUNT) == 0)
+    {
+        result->haveServerStats = true;
+        result->serverUserUs = statsAfter[0] - statsBefore[0];
+        result->serverSystemUs = statsAfter[1] - statsBefore[1];
+        result->busyPollHits = statsAfter[2] - statsBefore[2];
+        result->busyPollParks = statsAfter[3] - statsBefore[3];
+    }
+    producersDone = true;
+
+    for (i = 0; i < config->subscribers; i++)
+    {
+        pthread_join(subscribers[i].threadHandle, NULL);
+        result->pushedPackets += subscribers[i].packetsSent;
+        result->failures += subscribers[i].failed;
+    }
+
+    for (i = 0; i < config->streamers; i++)
+    {
+        pthread_join(streamers[i].threadHandle, NULL);
+        result->streamedPackets += streamers[i].packetsSent;
+        result->failures += streamers[i].failed;
+    }
+
+    if (result->latencies != NULL)
+    {
+        qsort(result->latencies, result->latencyCount, sizeof(double), compareDoubles);
+    }
+
+    free(threads);
+    free(subscribers);
+    free(streamers);
+    return 0;
+}
+
+/**
+ * @brief Print what the run cost the server in CPU, which a busy-polling
+ *  server trades for latency
+ */
+static void printServerStats(const bench_result_t *result)
+{
+    double cpuUs = result->serverUserUs + result->serverSystemUs;
+
+    printf("server cpu user/system (ms): %.1f / %.1f\n", result->serverUserUs / 1e3,
+           result->serverSystemUs / 1e3);
+    printf("server cpu/packet (us): %.2f\n", result->packets ? cpuUs / result->packets : 0.0);
+    printf("server cpu (%% of a core): %.1f\n",
+           result->elapsed > 0 ? cpuUs / (result->elapsed * 1e4) : 0.0);
+    if (result->busyPollHits + result->busyPollParks > 0)
+    {
+        printf("busy-poll hits/parks: %llu / %llu\n", (unsigned long long)result->busyPollHits,
+               (unsigned long long)result->busyPollParks);
+    }
+}
+
+static void printResult(const bench_config_t *config, const bench_result_t *result)
+{
+    printf("transport:          %s\n", config->unixPath ? "unix socket" : "tcp");
+    printf("connections:        %d\n", config->connections);
+    printf("channels:           %d\n", config->channels);
+    printf("packet size:        %d\n", config->packetSize);
+    printf("pipeline depth:     %d%s\n", config->pipelineDepth,
+           config->perLineEcho ? " (echo per line)" : "");
+    printf("framing:            %s%s\n",
+           config->binaryFraming || config->asyncAcks ? "binary" : "text",
+           config->asyncAcks ? " (client library)" : "");
+    printf("packets:            %llu\n", (unsigned long long)result->packets);
+    if (result->busyPackets > 0)
+    {
+        printf("packets busy:       %llu (%.2f%% turned away)\n",
+               (unsigned long long)result->busyPackets,
+               100.0 * result->busyPackets / (result->packets + result->busyPackets));
+    }
+    printf("elapsed (s):        %.3f\n", result->elapsed);
+    printf("packets/s:          %.0f\n", result->packets / result->elapsed);
+    printf("MB/s sent:          %.2f\n", result->bytesSent / result->elapsed / 1e6);
+    printf("server bytes sent/packet: %.0f\n",
+           result->packets ? (double)result->bytesReceived / result->packets : 0.0);
+    printf("round trip p50/p99/p99.9/max (us): %.1f / %.1f / %.1f / %.1f\n",
+           percentile(result, 0.5) * 1e6, percentile(result, 0.99) * 1e6,
+           percentile(result, 0.999) * 1e6, percentile(result, 1.0) * 1e6);
+    if (result->haveServerStats)
+    {
+        printServerStats(result);
+    }
+    if (config->subscribers > 0)
+    {
+        printf("subscribers:        %d\n", config->subscribers);
+        printf("packets pushed:     %llu\n", (unsigned long long)result->pushedPackets);
+    }
+    if (config->streamers > 0)
+    {
+        printf("streamers:          %d\n", config->streamers);
+        printf("packets streamed:   %llu\n", (unsigned long long)result->streamedPackets);
+    }
+    printf("failed connections: %d\n", result->failures);
+}
+
+static void printComparison(const bench_result_t *tcp, const bench_result_t *uds)
+{
+    printf("%-21s %12s %12s\n", "", "tcp", "unix socket");
+    printf("%-21s %12.0f %12.0f\n", "packets/s", tcp->packets / tcp->elapsed,
+           uds->packets / uds->elapsed);
+    printf("%-21s %12.1f %12.1f\n", "round trip p50 (us)", percentile(tcp, 0.5) * 1e6,
+           percentile(uds, 0.5) * 1e6);
+    printf("%-21s %12.1f %12.1f\n", "round trip p99 (us)", percentile(tcp, 0.99) * 1e6,
+           percentile(uds, 0.99) * 1e6);
+    printf("%-21s %12.1f %12.1f\n", "round trip p99.9 (us)", percentile(tcp, 0.999) * 1e6,
+           percentile(uds, 0.999) * 1e6);
+    printf("%-21s %12.1f %12.1f\n", "round trip max (us)", percentile(tcp, 1.0) * 1e6,
+           percentile(uds, 1.0) * 1e6);
+    if (tcp->haveServerStats && uds->haveServerStats)
+    {
+        printf("%-21s %12.2f %12.2f\n", "server cpu/pkt (us)",
+               tcp->packets ? (double)(tcp->serverUserUs + tcp->serverSystemUs) / tcp->packets : 0.0,
+               uds->packets ? (double)(uds->serverUserUs + uds->serverSystemUs) / uds->packets : 0.0);
+    }
+    printf("%-21s %12d %12d\n", "failed connections", tcp->failures, uds->failures);
+}
+
+/**
+ * @brief Set up the connection runs read the server's counters over
+ */
+static int startControl(bench_config_t *config, aesd_client_pool_t *pool)
+{
+    setClientConfig(config, &config->control);
+    if (aesd_client_pool_init(pool, &config->control, 1) != 0)
+    {
+        return -1;
+    }
+
+    config->controlPool = pool;
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    bench_config_t config = {
+        .host = "127.0.0.1",
+        .port = "9000",
+        .connections = 4,
+        .packets = 1000,
+        .packetSize = 64,
+        .channels = 0,
+        .subscribers = 0,
+        .streamers = 0,
+        .pipelineDepth = 1,
+        .perLineEcho = false,
+        .binaryFraming = false,
+        .asyncAcks = false,
+        .unixPath = NULL,
+        .channelTag = "",
+        .ingestPort = NULL,
+    };
+    bench_config_t tcpConfig;
+    aesd_client_pool_t controlPool;
+    aesd_client_pool_t tcpControlPool;
+    bench_result_t result;
+    bench_result_t tcpResult;
+    bool compare = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "H:p:U:c:n:s:C:S:W:P:LBAXD:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'H':
+            config.host = optarg;
+            break;
+        case 'p':
+            config.port = optarg;
+            break;
+        case 'U':
+            config.unixPath = optarg;
+            break;
+        case 'c':
+            config.connections = atoi(optarg);
+            break;
+        case 'n':
+            config.packets = atoi(optarg);
+            break;
+        case 's':
+            config.packetSize = atoi(optarg);
+            break;
+        case 'C':
+            config.channels = atoi(optarg);
+            break;
+        case 'S':
+            config.subscribers = atoi(optarg);
+            break;
+        case 'W':
+            config.streamers = atoi(optarg);
+            break;
+        case 'P':
+            config.pipelineDepth = atoi(optarg);
+            break;
+        case 'L':
+            config.perLineEcho = true;
+            break;
+        case 'B':
+            config.binaryFraming = true;
+            break;
+        case 'A':
+            config.asyncAcks = true;
+            break;
+        case 'X':
+            compare = true;
+            break;
+        case 'D':
+            config.ingestPort = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    // Room for the identifying header and the newline
+    if (config.connections < 1 || config.packets < 1 || config.packetSize < 32 ||
+        config.channels < 0 || config.subscribers < 0 || config.streamers < 0 ||
+        config.pipelineDepth < 1 ||
+        (compare && config.unixPath == NULL) || (compare && config.ingestPort != NULL))
+    {
+        usage(argv[0]);
+        return -1;
+    }
+
+    runNonce = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
+
+    if (startControl(&config, &controlPool) != 0)
+    {
+        return -1;
+    }
+
+    if (config.ingestPort != NULL)
+    {
+        if (runDatagramBench(&config, &result) != 0)
+        {
+            return -1;
+        }
+        printDatagramResult(&config, &result);
+        aesd_client_pool_destroy(&controlPool);
+        return result.failures ? -1 : 0;
+    }
+
+    if (!compare)
+    {
+        if (runBench(&config, &result) != 0)
+        {
+            return -1;
+        }
+        printResult(&config, &result);
+        free(result.latencies);
+        aesd_client_pool_destroy(&controlPool);
+        return result.failures ? -1 : 0;
+    }
+
+    // Each transport starts from empty channels of its own
+    if (config.channels == 0)
+    {
+        config.channels = 1;
+    }
+    tcpConfig = config;
+    tcpConfig.unixPath = NULL;
+    tcpConfig.channelTag = "tcp";
+    config.channelTag = "uds";
+
+    if (startControl(&tcpConfig, &tcpControlPool) != 0)
+    {
+        return -1;
+    }
+
+    if (runBench(&tcpConfig, &tcpResult) != 0 || runBench(&config, &result) != 0)
+    {
+        return -1;
+    }
+    printComparison(&tcpResult, &result);
+
+    free(tcpResult.latencies);
+    free(result.latencies);
+    aesd_client_pool_destroy(&tcpControlPool);
+    aesd_client_pool_destroy(&controlPool);
+    return tcpResult.failures || result.failures ? -1 : 0;
+}
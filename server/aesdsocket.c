@@ -1,66 +1,50 @@
+// For ppoll()
+#define _GNU_SOURCE
 
 #include "aesdsocket.h"
 
-#include <sys/ioctl.h>
-
 struct addrinfo *sockaddr = NULL;
-SLIST_HEAD(slisthead, socket_data_s)
-head;
-pthread_mutex_t mutex;
+// Set when also listening on an AF_UNIX socket, removed again on exit
+const char *unixSocketPath = NULL;
+
+// Settings in force, and the ones SIGHUP reads to compare against them
+static aesdsocket_options_t options;
+static aesdsocket_options_t reloadedOptions;
+static volatile sig_atomic_t reloadRequested = 0;
 
-void SIGTERM_handler(int SIG_val)
+// SIGINT and SIGTERM both end the server
+void exit_handler(int SIG_val)
 {
-    if (unlink(OUTPUT_FILEPATH) == -1)
+    if (unlink(options.dataPath) == -1)
     {
         if (errno == ENOENT)
         {
             syslog(LOG_INFO, "Output file had not been created yet");
         }
     }
+    if (options.indexPath[0] != '\0')
+    {
+        unlink(options.indexPath);
+    }
+    aesdsocket_remove_channel_files();
+    if (unixSocketPath != NULL)
+    {
+        unlink(unixSocketPath);
+    }
 
     syslog(LOG_INFO, "Caught signal, exiting");
     graceful_exit(0);
     exit(0);
 }
 
-void SIGINT_handler(int SIG_val)
+void SIGHUP_handler(int SIG_val)
 {
-    if (unlink(OUTPUT_FILEPATH) == -1)
-    {
-        if (errno == ENOENT)
-        {
-            syslog(LOG_INFO, "Output file had not been created yet");
-        }
-    }
-
-    syslog(LOG_INFO, "Caught signal, exiting");
-    graceful_exit(0);
-    exit(0);
+    // Picked up by the accept loop, which is not inside the library
+    reloadRequested = 1;
 }
 
-#ifndef USE_AESD_CHAR_DEVICE
 void alarm_handler(int signo)
 {
-    int lockRet = pthread_mutex_lock(&mutex);
-
-    if (lockRet != 0)
-    {
-        perror("pthread_mutex_lock() error");
-        graceful_exit(-1);
-        exit(-1);
-    }
-
-    // Open output file to append to or create if it does not already exist
-    int outputFd = open(OUTPUT_FILEPATH, O_RDWR | O_CREAT | O_APPEND,
-                        S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
-
-    if (outputFd == -1)
-    {
-        perror("open() error in timestamping");
-        graceful_exit(-1);
-        exit(-1);
-    }
-
     time_t t;
     struct tm *tmp;
     char timeStr[200];
@@ -84,57 +68,85 @@ void alarm_handler(int signo)
         exit(-1);
     }
 
-    int bytesOutFile = 0;
-
-    do
+    // Timestamps only go to the default channel
+    if (aesdsocket_append(NULL, timeStr, bytesWritten) != 0)
     {
-        bytesOutFile = write(outputFd, &timeStr[bytesOutFile],
-                             bytesWritten);
-        bytesWritten -= bytesOutFile;
-    } while (bytesWritten > 0);
-
-    close(outputFd);
-
-    pthread_mutex_unlock(&mutex);
+        fprintf(stderr, "Timestamp append failed\n");
+    }
 
     return;
 }
-#endif
 
 int main(int argc, char *argv[])
 {
     openlog("aesdsocket", 0, LOG_USER);
 
-    bool daemonFlag = false;
-    // Check for correct number of arguments and provide usage information
-    if (argc > 1)
+    aesdsocket_config_t config;
+
+    if (checkInput(argc, argv, &options) != 0)
     {
-        if (checkInput(argc, argv) != 0)
-        {
-            return -1;
-        }
-        daemonFlag = true;
+        closelog();
+        return -1;
     }
+    setlogmask(LOG_UPTO(options.logLevel));
 
     // Set up signal-handling
-    struct sigaction SIGINT_action;
-    struct sigaction SIGTERM_action;
-    SIGINT_action.sa_handler = &SIGINT_handler;
-    SIGTERM_action.sa_handler = &SIGTERM_handler;
-    sigemptyset(&SIGINT_action.sa_mask);
-    sigemptyset(&SIGTERM_action.sa_mask);
-    SIGINT_action.sa_flags = 0;
-    SIGTERM_action.sa_flags = 0;
-    sigaction(SIGTERM, &SIGTERM_action, NULL);
-    sigaction(SIGINT, &SIGINT_action, NULL);
-
-    int sockfd = createStreamSocket(SERVER_PORT);
-    if (sockfd == -1)
+    struct sigaction exit_action;
+    struct sigaction SIGHUP_action;
+    exit_action.sa_handler = &exit_handler;
+    SIGHUP_action.sa_handler = &SIGHUP_handler;
+    sigemptyset(&exit_action.sa_mask);
+    sigemptyset(&SIGHUP_action.sa_mask);
+    exit_action.sa_flags = 0;
+    SIGHUP_action.sa_flags = 0;
+    sigaction(SIGTERM, &exit_action, NULL);
+    sigaction(SIGINT, &exit_action, NULL);
+    sigaction(SIGHUP, &SIGHUP_action, NULL);
+
+    // Handlers only run while the loop below waits in ppoll(), never while
+    // this thread is inside the library holding one of its locks
+    sigset_t handledSignals;
+    sigset_t waitSignals;
+    sigemptyset(&handledSignals);
+    sigaddset(&handledSignals, SIGINT);
+    sigaddset(&handledSignals, SIGTERM);
+    sigaddset(&handledSignals, SIGHUP);
+    sigaddset(&handledSignals, SIGALRM);
+    sigprocmask(SIG_BLOCK, &handledSignals, &waitSignals);
+
+    // Index 1 is only used with -u
+    struct pollfd listenFds[2];
+    nfds_t listenCount = 1;
+
+    listenFds[0].fd = createStreamSocket(options.port, options.backlog);
+    if (listenFds[0].fd == -1)
     {
         return graceful_exit(-1);
     }
 
-    if (daemonFlag)
+    if (options.unixPath[0] != '\0')
+    {
+        unixSocketPath = options.unixPath;
+        listenFds[1].fd = createUnixSocket(unixSocketPath, options.backlog);
+        if (listenFds[1].fd == -1)
+        {
+            return graceful_exit(-1);
+        }
+        listenCount = 2;
+    }
+
+    fillConfig(&options, &config);
+
+    if (options.ingestPort[0] != '\0')
+    {
+        config.ingestSock = createDatagramSocket(options.ingestPort);
+        if (config.ingestSock == -1)
+        {
+            return graceful_exit(-1);
+        }
+    }
+
+    if (options.daemon)
     {
         int pid = fork();
         if (pid == -1)
@@ -149,51 +161,92 @@ int main(int argc, char *argv[])
         }
     }
 
-#ifndef USE_AESD_CHAR_DEVICE
+    // Threads do not survive the fork
+    if (aesdsocket_init(&config) != 0)
+    {
+        return graceful_exit(-1);
+    }
+
+    // After the library's threads are started, which would otherwise
+    // inherit the acceptor's cores
+    if (aesdsocket_place_thread("acceptor",
+                                options.acceptorCpuCount != 0 ? options.acceptorCpus : NULL,
+                                options.acceptorCpuCount) != 0)
+    {
+        return graceful_exit(-1);
+    }
+
     // Timer must be set up after daemon has been created,
-    // as child processes do not inherit timers
-    if (setupTimer() != 0)
+    // as child processes do not inherit timers. The driver keeps
+    // no timestamps, and a follower gets the leader's.
+    if (options.indexPath[0] != '\0' && options.leaderHost[0] == '\0' &&
+        setupTimer(options.timestampSec) != 0)
     {
         fprintf(stderr, "Timer setup failed\n");
         return -1;
     }
-#endif
-
-    SLIST_INIT(&head);
-
-    socket_data_t *newListElement = NULL;
-    socket_data_t *listSearchp = NULL;
-
-    socket_data_t *tmpItem = NULL;
 
-    int retVal;
+    const struct timespec limitRecheck = {
+        .tv_sec = 0,
+        .tv_nsec = CONNECTION_LIMIT_POLL_MS * 1000000L,
+    };
+    int retVal = 0;
+    bool atLimit;
+    nfds_t i;
 
     do
     {
-        retVal = listenForConnections(sockfd, &newListElement);
+        if (reloadRequested)
+        {
+            reloadRequested = 0;
+            reloadOptions(argc, argv);
+        }
+
+        // At the connection limit, new connections wait in the backlog and
+        // the loop only wakes to see whether one has closed
+        atLimit = options.maxConnections != 0 &&
+                  aesdsocket_active_connections() >= options.maxConnections;
+        for (i = 0; i < listenCount; i++)
+        {
+            listenFds[i].events = atLimit ? 0 : POLLIN;
+            listenFds[i].revents = 0;
+        }
 
-        if (retVal == 0)
+        if (ppoll(listenFds, listenCount, atLimit ? &limitRecheck : NULL, &waitSignals) == -1)
         {
-            SLIST_INSERT_HEAD(&head, newListElement, entries);
+            // Allow this to keep executing even on interruptions from
+            // interval alarm
+            retVal = errno == EINTR ? -2 : -1;
+            if (retVal == -1)
+            {
+                perror("ppoll() error");
+            }
+            continue;
+        }
+
+        for (i = 0; i < listenCount; i++)
+        {
+            if (!(listenFds[i].revents & POLLIN))
+            {
+                continue;
+            }
 
-            // Check list for completed threads
-            SLIST_FOREACH_SAFE(listSearchp, &head, entries, tmpItem)
+            retVal = listenForConnections(listenFds[i].fd);
+            if (retVal == -1)
             {
-                if (listSearchp->threadCompleteFlag)
-                {
-                    pthread_join(listSearchp->threadHandle, NULL);
-                    SLIST_REMOVE(&head, listSearchp, socket_data_s, entries);
-                    free(listSearchp);
-                }
+                break;
             }
         }
 
+        // Join threads whose connections have closed
+        aesdsocket_reap();
+
     } while (retVal != -1);
 
     return graceful_exit(-1);
 }
 
-int createStreamSocket(const char *portNumberStr)
+int createStreamSocket(const char *portNumberStr, int backlog)
 {
     // Create addrinfo struct for creating TCP stream
     // socket
@@ -228,7 +281,7 @@ int createStreamSocket(const char *portNumberStr)
         return -1;
     }
 
-    if (listen(sockfd, 1) != 0)
+    if (listen(sockfd, backlog) != 0)
     {
         perror("listen() error");
         return -1;
@@ -237,12 +290,105 @@ int createStreamSocket(const char *portNumberStr)
     return sockfd;
 }
 
-int listenForConnections(int sockfd, socket_data_t **newListElement)
+int createDatagramSocket(const char *portNumberStr)
+{
+    struct addrinfo hints;
+    struct addrinfo *datagramAddr;
+    int sockfd;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    if (getaddrinfo(NULL, portNumberStr, &hints, &datagramAddr) != 0)
+    {
+        perror("getaddrinfo() error for ingest socket");
+        return -1;
+    }
+
+    sockfd = socket(datagramAddr->ai_family, datagramAddr->ai_socktype,
+                    datagramAddr->ai_protocol);
+    if (sockfd == -1)
+    {
+        perror("socket() error for ingest socket");
+        freeaddrinfo(datagramAddr);
+        return -1;
+    }
+
+    // Best effort, a smaller buffer only means more drops under bursts
+    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &(int){INGEST_RCVBUF_SIZE},
+                   sizeof(int)) == -1)
+    {
+        perror("setsockopt() error for ingest socket receive buffer");
+    }
+
+    if (bind(sockfd, datagramAddr->ai_addr, datagramAddr->ai_addrlen) != 0)
+    {
+        perror("bind() error for ingest socket");
+        freeaddrinfo(datagramAddr);
+        close(sockfd);
+        return -1;
+    }
+
+    freeaddrinfo(datagramAddr);
+    syslog(LOG_INFO, "Ingesting datagrams on UDP port %s", portNumberStr);
+    return sockfd;
+}
+
+int createUnixSocket(const char *path, int backlog)
 {
-    struct sockaddr peeraddr;
+    struct sockaddr_un addr;
+    int sockfd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Unix socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd == -1)
+    {
+        perror("socket() error for unix socket");
+        return -1;
+    }
+
+    // Left behind by a previous run that did not exit cleanly
+    if (unlink(path) == -1 && errno != ENOENT)
+    {
+        perror("unlink() error on unix socket path");
+        close(sockfd);
+        return -1;
+    }
+
+    if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        perror("bind() error for unix socket");
+        close(sockfd);
+        return -1;
+    }
+
+    if (listen(sockfd, backlog) != 0)
+    {
+        perror("listen() error for unix socket");
+        close(sockfd);
+        return -1;
+    }
+
+    syslog(LOG_INFO, "Listening on unix socket %s", path);
+    return sockfd;
+}
+
+int listenForConnections(int sockfd)
+{
+    struct sockaddr_storage peeraddr;
     socklen_t peer_addr_size = sizeof(peeraddr);
 
-    int connectedSock = accept(sockfd, &peeraddr, &peer_addr_size);
+    int connectedSock = accept(sockfd, (struct sockaddr *)&peeraddr, &peer_addr_size);
     if (connectedSock == -1)
     {
         if (errno == EINTR)
@@ -256,360 +402,504 @@ int listenForConnections(int sockfd, socket_data_t **newListElement)
         return -1;
     }
 
-    *newListElement = (socket_data_t *)malloc(sizeof(socket_data_t));
-
-    if (*newListElement == NULL)
+    // Echo-backs go out in several sends, don't let Nagle hold the last
+    // one back waiting on the peer's delayed ACK
+    if (peeraddr.ss_family != AF_UNIX &&
+        setsockopt(connectedSock, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int)) == -1)
     {
-        // If cannot malloc anymore space
-        return -1;
+        perror("setsockopt() TCP_NODELAY error");
     }
 
-    // Initialize arguments to be used by thread
-    (*newListElement)->connectedSock = connectedSock;
-    (*newListElement)->peeraddr = peeraddr;
-    (*newListElement)->threadCompleteFlag = false;
+    return aesdsocket_serve(connectedSock, &peeraddr);
+}
+
+int parseCpuList(const char *list, int *cpus, size_t maxCpus, size_t *cpuCount)
+{
+    const char *pos = list;
+    char *endPtr;
+    long first;
+    long last;
 
-    if (pthread_create((&(*newListElement)->threadHandle), NULL,
-                       recvAndSendAndLog, *newListElement) != 0)
+    *cpuCount = 0;
+    while (*pos != '\0')
     {
-        perror("pthread_create() error");
-        free(*newListElement);
-        return -1;
+        errno = 0;
+        first = strtol(pos, &endPtr, 10);
+        last = first;
+        if (errno != 0 || endPtr == pos || first < 0 || first >= CPU_SETSIZE)
+        {
+            return -1;
+        }
+        pos = endPtr;
+
+        if (*pos == '-')
+        {
+            last = strtol(++pos, &endPtr, 10);
+            if (errno != 0 || endPtr == pos || last < first || last >= CPU_SETSIZE)
+            {
+                return -1;
+            }
+            pos = endPtr;
+        }
+
+        for (; first <= last; first++)
+        {
+            if (*cpuCount == maxCpus)
+            {
+                return -1;
+            }
+            cpus[(*cpuCount)++] = first;
+        }
+
+        if (*pos == ',')
+        {
+            pos++;
+        }
+        else if (*pos != '\0')
+        {
+            return -1;
+        }
     }
 
-    return 0;
+    return *cpuCount != 0 ? 0 : -1;
 }
 
-void *recvAndSendAndLog(void *socket_data_arg)
+typedef struct config_key_s
+{
+    const char *name;
+    // Command line option setting the same thing
+    int opt;
+} config_key_t;
+
+static const config_key_t configKeys[] = {
+    {"daemon", 'd'},
+    {"fair_locking", 'f'},
+    {"port", 'p'},
+    {"backlog", 'q'},
+    {"data_path", 'o'},
+    {"unix_socket", 'u'},
+    {"udp_port", 'i'},
+    {"ring_mib", 'm'},
+    {"busy_poll_us", 'b'},
+    {"busy_poll_cpus", 'B'},
+    {"acceptor_cpus", 'A'},
+    {"worker_cpus", 'w'},
+    {"leader", 'F'},
+    {"max_connections", 'W'},
+    {"recv_buffer", 'r'},
+    {"idle_timeout", 't'},
+    {"read_timeout", 'T'},
+    {"timestamp_interval", 's'},
+    {"memory_mib", 'M'},
+    {"zerocopy_threshold", 'z'},
+    {"capture_path", 'R'},
+    {"capture_max_mib", 'L'},
+    {"slow_request_us", 'S'},
+    {"trace_sample", 'e'},
+    {"lock_deadline_ms", 'l'},
+    {"log_level", 'v'},
+};
+
+static const char *const logLevelNames[] = {
+    [LOG_EMERG] = "emerg",
+    [LOG_ALERT] = "alert",
+    [LOG_CRIT] = "crit",
+    [LOG_ERR] = "err",
+    [LOG_WARNING] = "warning",
+    [LOG_NOTICE] = "notice",
+    [LOG_INFO] = "info",
+    [LOG_DEBUG] = "debug",
+};
+
+static const char OPTION_STRING[] = "c:dfp:q:o:u:i:m:b:B:A:w:F:W:r:t:T:s:M:z:R:L:S:e:l:v:";
+
+/**
+ * @brief Parse a whole unsigned number no smaller than min and no larger
+ *  than max
+ */
+static bool parseUnsigned(const char *value, unsigned long min, unsigned long max,
+                          unsigned long *result)
 {
-    socket_data_t *socket_data = (socket_data_t *)socket_data_arg;
+    char *endPtr;
 
-    // Determine IP address of client for logging
-    struct sockaddr_in *peeraddr_in;
-    peeraddr_in = (struct sockaddr_in *)(&(socket_data->peeraddr));
-    const char *ipv4Addr = (char *)(&peeraddr_in->sin_addr.s_addr);
+    errno = 0;
+    *result = strtoul(value, &endPtr, 10);
+    return errno == 0 && endPtr != value && *endPtr == '\0' && value[0] != '-' &&
+           *result >= min && *result <= max;
+}
 
-    syslog(LOG_INFO, "Accepted connection from %d.%d.%d.%d",
-           ipv4Addr[0], ipv4Addr[1], ipv4Addr[2], ipv4Addr[3]);
+/**
+ * @brief Copy a value into a fixed-size setting, refusing one that does not
+ *  fit or is empty
+ */
+static bool copySetting(char *setting, size_t size, const char *value)
+{
+    if (value[0] == '\0' || strlen(value) >= size)
+    {
+        return false;
+    }
+    strcpy(setting, value);
+    return true;
+}
 
-    // Open output file to append to or create if it does not already exist
-    int outputFd = open(OUTPUT_FILEPATH, O_RDWR | O_CREAT | O_TRUNC,
-                        S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+/**
+ * @brief Split host:port at its last ':', so a bare IPv6 address still
+ *  works
+ */
+static bool parseLeader(const char *value, aesdsocket_options_t *options)
+{
+    const char *colon = strrchr(value, ':');
 
-    if (outputFd == -1)
+    if (colon == NULL || colon == value || (size_t)(colon - value) >= sizeof(options->leaderHost) ||
+        !copySetting(options->leaderPort, sizeof(options->leaderPort), colon + 1))
     {
-        perror("open() error");
-        socket_data->threadCompleteFlag = true;
-        pthread_exit(socket_data);
+        return false;
     }
+    memcpy(options->leaderHost, value, colon - value);
+    options->leaderHost[colon - value] = '\0';
+    return true;
+}
 
-    // Receive a single byte at a time
-    char recvdByte;
-
-    char retByte;
-    ssize_t sendRet;
-    ssize_t readRet;
-    int lockRet;
+/**
+ * @brief Parse a flag's value, NULL being a flag given on the command line
+ */
+static bool parseFlag(const char *value, bool *flag)
+{
+    if (value == NULL || strcmp(value, "yes") == 0 || strcmp(value, "true") == 0 ||
+        strcmp(value, "1") == 0)
+    {
+        *flag = true;
+        return true;
+    }
+    if (strcmp(value, "no") == 0 || strcmp(value, "false") == 0 || strcmp(value, "0") == 0)
+    {
+        *flag = false;
+        return true;
+    }
+    return false;
+}
 
-    bool mutexLocked = false;
-    command_parser_state_t command_parser_state = HEADER;
-    int commandStrInd = 0;
-    char argX[20];
-    char argY[20];
-    struct aesd_seekto aesd_seekto_params;
-    char tempStr[sizeof(IOCSEEK_CMD_STR) / sizeof(IOCSEEK_CMD_STR[0])];
-    long ioctlRes;
+static bool parseLogLevel(const char *value, int *level)
+{
+    unsigned long number;
     int i;
-    bool tempBuffFlushed = true;
-    off_t retval;
 
-    // Append each byte received to the output file
-    while (recv(socket_data->connectedSock, &recvdByte, 1, 0) != 0)
+    for (i = LOG_EMERG; i <= LOG_DEBUG; i++)
     {
-        if (!mutexLocked)
+        if (strcmp(value, logLevelNames[i]) == 0)
         {
+            *level = i;
+            return true;
+        }
+    }
 
-            lockRet = pthread_mutex_lock(&mutex);
+    if (parseUnsigned(value, LOG_EMERG, LOG_DEBUG, &number))
+    {
+        *level = number;
+        return true;
+    }
+    return false;
+}
 
-            if (lockRet != 0)
-            {
-                perror("pthread_mutex_lock() error");
-                command_parser_state = NOT_CMD;
-                pthread_exit(socket_data);
-            }
+bool applyOption(aesdsocket_options_t *options, int opt, const char *value)
+{
+    unsigned long number;
 
-            mutexLocked = true;
-        }
+    // Only flags may be given without a value
+    if (value == NULL && opt != 'd' && opt != 'f')
+    {
+        return false;
+    }
 
-        switch (command_parser_state)
+    switch (opt)
+    {
+    case 'd':
+        return parseFlag(value, &options->daemon);
+    case 'f':
+        return parseFlag(value, &options->fairLocking);
+    case 'p':
+        return copySetting(options->port, sizeof(options->port), value);
+    case 'q':
+        if (!parseUnsigned(value, 1, BACKLOG_MAX, &number))
         {
-        case HEADER:
-            if (recvdByte != IOCSEEK_CMD_STR[commandStrInd])
-            {
-                syslog(LOG_INFO, "Last character read: %c", recvdByte);
-                syslog(LOG_INFO, "Last character index: %d", commandStrInd);
-                command_parser_state = NOT_CMD;
-                tempStr[commandStrInd] = recvdByte;
-                tempStr[commandStrInd + 1] = '\0';
-                tempBuffFlushed = false;
-            }
-            else
-            {
-                tempStr[commandStrInd] = recvdByte;
-                commandStrInd++;
-                if (commandStrInd == (sizeof(IOCSEEK_CMD_STR) / sizeof(IOCSEEK_CMD_STR[0]) - 1))
-                {
-                    command_parser_state = ARG_X;
-                    commandStrInd = 0;
-                }
-            }
-            break;
+            return false;
+        }
+        options->backlog = number;
+        return true;
+    case 'o':
+        return copySetting(options->dataPath, sizeof(options->dataPath), value);
+    case 'u':
+        return copySetting(options->unixPath, sizeof(options->unixPath), value);
+    case 'i':
+        return copySetting(options->ingestPort, sizeof(options->ingestPort), value);
+    case 'm':
+        return parseUnsigned(value, 1, SHMRING_MAX_MIB, &options->ringMiB);
+    case 'b':
+        return parseUnsigned(value, 1, BUSY_POLL_MAX_US, &options->busyPollUs);
+    case 'B':
+        return parseCpuList(value, options->busyPollCpus, AESDSOCKET_BUSY_POLL_MAX_CPUS,
+                            &options->busyPollCpuCount) == 0;
+    case 'A':
+        return parseCpuList(value, options->acceptorCpus, CPU_LIST_MAX,
+                            &options->acceptorCpuCount) == 0;
+    case 'w':
+        return parseCpuList(value, options->workerCpus, CPU_LIST_MAX,
+                            &options->workerCpuCount) == 0;
+    case 'F':
+        return parseLeader(value, options);
+    case 'W':
+        return parseUnsigned(value, 0, ULONG_MAX, &options->maxConnections);
+    case 'r':
+        return parseUnsigned(value, 1, RECV_BUFF_MAX, &options->recvBuffSize);
+    case 't':
+        return parseUnsigned(value, 1, TIMEOUT_MAX_SEC, &options->idleTimeoutSec);
+    case 'T':
+        return parseUnsigned(value, 1, TIMEOUT_MAX_SEC, &options->readTimeoutSec);
+    case 's':
+        return parseUnsigned(value, 0, TIMESTAMP_MAX_SEC, &options->timestampSec);
+    case 'M':
+        return parseUnsigned(value, 0, MEMORY_BUDGET_MAX_MIB, &options->memoryMiB);
+    case 'z':
+        return parseUnsigned(value, ZEROCOPY_MIN_BYTES, ULONG_MAX, &options->zerocopyThreshold);
+    case 'R':
+        return copySetting(options->capturePath, sizeof(options->capturePath), value);
+    case 'L':
+        return parseUnsigned(value, 0, CAPTURE_MAX_MIB, &options->captureMiB);
+    case 'S':
+        return parseUnsigned(value, 0, UINT32_MAX, &options->slowRequestUs);
+    case 'e':
+        return parseUnsigned(value, 0, UINT32_MAX, &options->traceSampleEvery);
+    case 'l':
+        return parseUnsigned(value, 0, LOCK_DEADLINE_MAX_MS, &options->lockDeadlineMs);
+    case 'v':
+        return parseLogLevel(value, &options->logLevel);
+    default:
+        return false;
+    }
+}
 
-        case ARG_X:
-            if (recvdByte != ',')
-            {
-                argX[commandStrInd] = recvdByte;
-                commandStrInd++;
-            }
-            else
-            {
-                argX[commandStrInd] = '\0';
-                syslog(LOG_INFO, "Arg X: %s", argX);
-                command_parser_state = ARG_Y;
-                commandStrInd = 0;
-            }
-            break;
+/**
+ * @brief Strip leading and trailing whitespace in place
+ */
+static char *trim(char *str)
+{
+    char *end;
 
-        case ARG_Y:
-            if (recvdByte != '\n')
-            {
-                argY[commandStrInd] = recvdByte;
-                commandStrInd++;
-            }
-            else
-            {
-                // Add null-terminator to end of arg Y
-                argY[commandStrInd] = '\0';
-                syslog(LOG_INFO, "Arg Y: %s", argY);
-
-                // Form specific ioctl argument struct
-                aesd_seekto_params.write_cmd = atol(argX);
-                aesd_seekto_params.write_cmd_offset = atol(argY);
-
-                if (mutexLocked)
-                {
-                    lockRet = pthread_mutex_unlock(&mutex);
-
-                    if (lockRet != 0)
-                    {
-                        perror("pthread_mutex_lock() error");
-                        socket_data->threadCompleteFlag = true;
-                        pthread_exit(socket_data);
-                    }
-                }
-
-                ioctlRes = ioctl(outputFd, AESDCHAR_IOCSEEKTO, &aesd_seekto_params);
-                syslog(LOG_INFO, "ioctl result (f_pos): %lu", ioctlRes);
-                command_parser_state = HEADER;
-                commandStrInd = 0;
-
-                if (mutexLocked)
-                {
-                    lockRet = pthread_mutex_unlock(&mutex);
-
-                    if (lockRet != 0)
-                    {
-                        perror("pthread_mutex_lock() error");
-                        socket_data->threadCompleteFlag = true;
-                        pthread_exit(socket_data);
-                    }
-                }
-
-                goto outputContents;
-            }
-            break;
+    while (*str == ' ' || *str == '\t')
+    {
+        str++;
+    }
+    end = str + strlen(str);
+    while (end > str && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\n' ||
+                         end[-1] == '\r'))
+    {
+        end--;
+    }
+    *end = '\0';
+    return str;
+}
+
+static void reportConfigError(const char *path, int lineNumber, const char *problem,
+                              const char *key)
+{
+    fprintf(stderr, "%s:%d: %s %s\n", path, lineNumber, problem, key);
+    syslog(LOG_ERR, "%s:%d: %s %s", path, lineNumber, problem, key);
+}
 
-        case NOT_CMD:
+int readConfigFile(const char *path, aesdsocket_options_t *options)
+{
+    char line[CONFIG_LINE_MAX];
+    char *comment;
+    char *equals;
+    char *key;
+    char *value;
+    int lineNumber = 0;
+    int retVal = 0;
+    size_t i;
+    FILE *file;
+
+    file = fopen(path, "r");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Could not open config file %s: %s\n", path, strerror(errno));
+        syslog(LOG_ERR, "Could not open config file %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    while (retVal == 0 && fgets(line, sizeof(line), file) != NULL)
+    {
+        lineNumber++;
+        if (strchr(line, '\n') == NULL && !feof(file))
+        {
+            reportConfigError(path, lineNumber, "line too long", "");
+            retVal = -1;
             break;
         }
 
-        if (command_parser_state == NOT_CMD)
+        comment = strchr(line, '#');
+        if (comment != NULL)
         {
-            if (!tempBuffFlushed)
-            {
-                for (i = 0; i <= commandStrInd; i++)
-                {
-                    while (write(outputFd, &tempStr[i], 1) != 1)
-                        ;
-
-                    if (tempStr[i] == '\n')
-                    {
-                        // Set file pointer to 0
-                        retval = lseek(outputFd, 0, SEEK_SET);
-                        if (retval < 0)
-                        {
-                            perror("lseek() error in returning socket input"
-                                   "to peer");
-                            close(outputFd);
-                            // Include error element in socket_data_t?
-                            socket_data->threadCompleteFlag = true;
-                            pthread_exit(socket_data);
-                        }
-                        else
-                        {
-                            syslog(LOG_INFO, "f_pos set to %lu", retval);
-                        }
-                        
-                        readRet = 1;
-                        // Read until EOF
-                        while (readRet != 0)
-                        {
-                            do
-                            {
-                                readRet = read(outputFd, &retByte, 1);
-                                if (readRet < 0)
-                                {
-                                    if (errno != EAGAIN)
-                                    {
-                                        perror("read() error in returning socket"
-                                               "input to peer");
-                                        close(outputFd);
-                                        socket_data->threadCompleteFlag = true;
-                                        pthread_exit(socket_data);
-                                    }
-                                }
-
-                            } while (readRet < 0);
-
-                            do
-                            {
-                                sendRet = send(socket_data->connectedSock, &retByte, readRet, 0);
-                                if (sendRet == -1)
-                                {
-                                    perror("send() error in returning socket"
-                                           "input to peer");
-                                    close(outputFd);
-                                    socket_data->threadCompleteFlag = true;
-                                    pthread_exit(socket_data);
-                                }
-                            } while (sendRet < 0);
-                        }
-
-                        if (mutexLocked)
-                        {
-                            lockRet = pthread_mutex_unlock(&mutex);
-
-                            if (lockRet != 0)
-                            {
-                                perror("pthread_mutex_lock() error");
-                                socket_data->threadCompleteFlag = true;
-                                pthread_exit(socket_data);
-                            }
-                        }
-                    }
-                }
-                command_parser_state = HEADER;
-                commandStrInd = 0;
-                tempBuffFlushed = true;
-                continue;
-            }
+            *comment = '\0';
+        }
+        key = trim(line);
+        if (*key == '\0')
+        {
+            continue;
+        }
 
-            while (write(outputFd, &recvdByte, 1) != 1)
-                ;
+        equals = strchr(key, '=');
+        if (equals == NULL)
+        {
+            reportConfigError(path, lineNumber, "expected key = value, got", key);
+            retVal = -1;
+            break;
+        }
+        *equals = '\0';
+        key = trim(key);
+        value = trim(equals + 1);
 
-            // Output contents of output file to
-            // the peer for every packet received
-            if (recvdByte == '\n')
+        for (i = 0; i < sizeof(configKeys) / sizeof(configKeys[0]); i++)
+        {
+            if (strcmp(key, configKeys[i].name) == 0)
             {
-
-                // Set file pointer to 0
-                retval = lseek(outputFd, 0, SEEK_SET);
-                if (retval < 0)
-                {
-                    perror("lseek() error in returning socket input"
-                           "to peer");
-                    close(outputFd);
-                    // Include error element in socket_data_t?
-                    socket_data->threadCompleteFlag = true;
-                    pthread_exit(socket_data);
-                }
-                else
-                {
-                    syslog(LOG_INFO, "f_pos set to %lu", retval);
-                }
-
-            outputContents:
-                readRet = 1;
-                // Read until EOF
-                while (readRet != 0)
-                {
-                    do
-                    {
-                        readRet = read(outputFd, &retByte, 1);
-                        if (readRet == -1)
-                        {
-                            if (errno != EAGAIN)
-                            {
-                                perror("read() error in returning socket"
-                                       "input to peer");
-                                close(outputFd);
-                                socket_data->threadCompleteFlag = true;
-                                pthread_exit(socket_data);
-                            }
-                        }
-
-                    } while (readRet < 0);
-
-                    do
-                    {
-                        sendRet = send(socket_data->connectedSock, &retByte, readRet, 0);
-                        if (sendRet == -1)
-                        {
-                            perror("send() error in returning socket"
-                                   "input to peer");
-                            close(outputFd);
-                            socket_data->threadCompleteFlag = true;
-                            pthread_exit(socket_data);
-                        }
-                    } while (sendRet < 0);
-                }
-
-                if (mutexLocked)
-                {
-                    lockRet = pthread_mutex_unlock(&mutex);
-
-                    if (lockRet != 0)
-                    {
-                        perror("pthread_mutex_lock() error");
-                        socket_data->threadCompleteFlag = true;
-                        pthread_exit(socket_data);
-                    }
-                }
-
-                command_parser_state = HEADER;
-                commandStrInd = 0;
+                break;
             }
         }
-    }
-
-    syslog(LOG_INFO, "Closed connection from %d.%d.%d.%d",
-           ipv4Addr[0], ipv4Addr[1], ipv4Addr[2], ipv4Addr[3]);
-    close(outputFd);
 
-    socket_data->threadCompleteFlag = true;
+        if (i == sizeof(configKeys) / sizeof(configKeys[0]))
+        {
+            reportConfigError(path, lineNumber, "unknown setting", key);
+            retVal = -1;
+        }
+        else if (!applyOption(options, configKeys[i].opt, value))
+        {
+            reportConfigError(path, lineNumber, "invalid value for", key);
+            retVal = -1;
+        }
+    }
 
-    pthread_exit(socket_data);
+    fclose(file);
+    return retVal;
 }
 
-int checkInput(int argc, char *argv[])
+int checkInput(int argc, char *argv[], aesdsocket_options_t *options)
 {
+    const char *correctUsageStr =
+        "USAGE: aesdsocket [-c config file] [-d] [-f] [-p port] [-q backlog] [-o data path]\n"
+        "                  [-u unix socket path] [-i udp port] [-m ring MiB]\n"
+        "                  [-b spin usec [-B cpu list]] [-A cpu list] [-w cpu list]\n"
+        "                  [-F leader host:port]\n"
+        "                  [-W connections] [-r bytes] [-t sec] [-T sec] [-s sec]\n"
+        "                  [-M memory MiB] [-z bytes] [-R trace path [-L MiB]]\n"
+        "                  [-S usec] [-e requests] [-l msec] [-v log level]\n"
+        "  -c reads settings from a file of key = value lines, see\n"
+        "     aesdsocket.conf. Options given here win over the file.\n"
+        "  -d runs aesdsocket as a daemon\n"
+        "  -f hands channel locks to connections strictly in the order they\n"
+        "     ask, instead of to whichever gets to run first\n"
+        "  -p listens on that TCP port (default 9000)\n"
+        "  -q lets the kernel queue that many connections not yet accepted\n"
+        "     (default 128)\n"
+        "  -o logs to that path, the aesdchar driver if it is a character\n"
+        "     device and otherwise a regular file with an index at path.idx\n"
+        "  -u also listens on a unix domain socket at that path\n"
+        "  -i also appends each datagram received on that UDP port as a packet\n"
+        "  -m offers local producers a shared-memory ingest ring of that size\n"
+        "     over the -u socket\n"
+        "  -b has connection threads spin on non-blocking receives for up to\n"
+        "     that long before blocking, one thread per online core\n"
+        "  -B gives busy-polling threads these cores instead, such as 2,4-7,\n"
+        "     one thread pinned to each\n"
+        "  -A pins the thread accepting connections to these cores\n"
+        "  -w keeps connection and ingest threads on these cores, each on the\n"
+        "     cores of one NUMA node with memory from that node\n"
+        "  -F follows the aesdsocket at host:port, serving reads from a copy\n"
+        "     of its logs and forwarding packets to it. Needs a file-backed\n"
+        "     log, next to which other channels are kept, and cannot be used\n"
+        "     with -i or -m.\n"
+        "Live settings, applied again when SIGHUP re-reads the config file:\n"
+        "  -W serves at most that many connections at once, each on a thread\n"
+        "     of its own, the rest wait in the backlog (default 0, no limit)\n"
+        "  -r receives into a buffer of that many bytes per connection\n"
+        "     (default 4096)\n"
+        "  -t closes connections that send nothing for that long (default 300)\n"
+        "  -T closes connections taking longer than that over one packet\n"
+        "     (default 30)\n"
+        "  -s appends a timestamp to a file-backed log that often (default 10,\n"
+        "     0 for none)\n"
+        "  -M caps what buffered packets, replies and snapshots may take\n"
+        "     (default 256 MiB, 0 for no cap)\n"
+        "  -z sends echo-backs of at least that many bytes zero-copy, straight\n"
+        "     from the page cache (file backend, TCP connections only)\n"
+        "  -R records what connections receive to a trace at that path, for\n"
+        "     aesd-replay to play back. A new path starts a new trace.\n"
+        "  -L stops recording once the trace reaches that size (default\n"
+        "     1024 MiB, 0 for no limit)\n"
+        "  -S logs every request taking at least that long, with where the\n"
+        "     time went (default 0, none)\n"
+        "  -e keeps that breakdown for one request in that many, for\n"
+        "     AESDCHAR_TRACE (default 0, none)\n"
+        "  -l answers a packet that waits longer than that for its channel\n"
+        "     with AESDCHAR_ERROR:EBUSY and drops it, for the peer to retry\n"
+        "     (default 0, packets wait as long as it takes)\n"
+        "  -v logs messages down to that syslog level, err, warning, notice,\n"
+        "     info or debug (default info)\n\n";
+    const char *configPath = NULL;
+    bool validInput = true;
+    struct stat dataStat;
+#ifdef USE_AESD_CHAR_DEVICE
+    const bool defaultIsDevice = true;
+#else
+    const bool defaultIsDevice = false;
+#endif
+    int opt;
+
+    // Receive buffer size and timeouts left at 0 get the library defaults
+    memset(options, 0, sizeof(*options));
+    strcpy(options->port, SERVER_PORT);
+    options->backlog = BACKLOG;
+    strcpy(options->dataPath, OUTPUT_FILEPATH);
+    options->timestampSec = TIMESTAMP_INTERVAL_SEC;
+    options->memoryMiB = MEMORY_BUDGET_DEFAULT_MIB;
+    options->captureMiB = CAPTURE_DEFAULT_MIB;
+    options->logLevel = LOG_INFO;
+
+    // The config file goes first wherever -c is, so the command line wins
+    opterr = 0;
+    optind = 0;
+    while ((opt = getopt(argc, argv, OPTION_STRING)) != -1)
+    {
+        if (opt == 'c')
+        {
+            configPath = optarg;
+        }
+    }
+    opterr = 1;
 
-    if (argc > 2)
+    if (configPath != NULL)
     {
-        const char *usageErrStr = "Invalid number of options provided.\n\n";
+        if (!copySetting(options->configPath, sizeof(options->configPath), configPath) ||
+            readConfigFile(configPath, options) != 0)
+        {
+            return -1;
+        }
+    }
 
-        const char *correctUsageStr = "USAGE: The only available option is -d, "
-                                      "which runs aesdsocket as a daemon\n\n";
+    optind = 0;
+    while (validInput && (opt = getopt(argc, argv, OPTION_STRING)) != -1)
+    {
+        validInput = opt == 'c' || applyOption(options, opt, optarg);
+    }
+
+    // The ring is handed out over the unix socket, and cores are only
+    // handed out to threads that spin. A follower takes packets in through
+    // connections only.
+    if (!validInput || optind != argc || (options->ringMiB != 0 && options->unixPath[0] == '\0') ||
+        (options->busyPollCpuCount != 0 && options->busyPollUs == 0) ||
+        (options->leaderHost[0] != '\0' &&
+         (options->ingestPort[0] != '\0' || options->ringMiB != 0)))
+    {
+        const char *usageErrStr = "Invalid option provided.\n\n";
 
         fprintf(stderr, "%s", usageErrStr);
         printf("%s", correctUsageStr);
@@ -617,33 +907,181 @@ int checkInput(int argc, char *argv[])
         syslog(LOG_ERR, "%s", usageErrStr);
         syslog(LOG_INFO, "%s", correctUsageStr);
 
-        closelog();
-
         return -1;
     }
-    else if (argc == 2 && (strcmp(argv[1], "-d") != 0))
+
+    // Anything but a character device is a file-backed log, which without
+    // the driver's circular buffer to walk resolves seeks through an index
+    // of where each packet starts. The driver's default node counts as the
+    // driver even before its module is loaded.
+    if (stat(options->dataPath, &dataStat) == 0 ? !S_ISCHR(dataStat.st_mode)
+                                                : !defaultIsDevice ||
+                                                      strcmp(options->dataPath, OUTPUT_FILEPATH) != 0)
     {
-        const char *usageErrStr = "Invalid option provided.\n\n";
+        if (strlen(options->dataPath) + strlen(INDEX_FILE_SUFFIX) >= sizeof(options->indexPath))
+        {
+            fprintf(stderr, "Data path too long: %s\n", options->dataPath);
+            return -1;
+        }
+        strcpy(options->indexPath, options->dataPath);
+        strcat(options->indexPath, INDEX_FILE_SUFFIX);
+    }
 
-        const char *correctUsageStr = "USAGE: The only available option is -d, "
-                                      "which runs aesdsocket as a daemon\n\n";
+    if (options->leaderHost[0] == '\0')
+    {
+        strcpy(options->channelPrefix, CHANNEL_FILEPATH_PREFIX);
+    }
+    else if (snprintf(options->channelPrefix, sizeof(options->channelPrefix), "%s-",
+                      options->dataPath) >= (int)sizeof(options->channelPrefix))
+    {
+        fprintf(stderr, "Data path too long: %s\n", options->dataPath);
+        return -1;
+    }
 
-        fprintf(stderr, "%s", usageErrStr);
-        printf("%s", correctUsageStr);
+    return 0;
+}
 
-        syslog(LOG_ERR, "%s", usageErrStr);
-        syslog(LOG_INFO, "%s", correctUsageStr);
+void fillConfig(const aesdsocket_options_t *options, aesdsocket_config_t *config)
+{
+    memset(config, 0, sizeof(*config));
+    config->dataPath = options->dataPath;
+    config->indexPath = options->indexPath[0] != '\0' ? options->indexPath : NULL;
+    config->channelPathPrefix = options->channelPrefix;
+    config->ingestSock = -1;
+    config->ringSize = options->ringMiB * 1024 * 1024;
+    config->fairLocking = options->fairLocking;
+    config->busyPollUs = options->busyPollUs;
+    config->busyPollCpus = options->busyPollCpuCount != 0 ? options->busyPollCpus : NULL;
+    config->busyPollCpuCount = options->busyPollCpuCount;
+    config->workerCpus = options->workerCpuCount != 0 ? options->workerCpus : NULL;
+    config->workerCpuCount = options->workerCpuCount;
+    config->memoryBudget = (size_t)options->memoryMiB * 1024 * 1024;
+    config->zerocopyThreshold = options->zerocopyThreshold;
+    config->idleTimeoutSec = options->idleTimeoutSec;
+    config->readTimeoutSec = options->readTimeoutSec;
+    config->recvBuffSize = options->recvBuffSize;
+    config->capturePath = options->capturePath[0] != '\0' ? options->capturePath : NULL;
+    config->captureMaxBytes = (uint64_t)options->captureMiB * 1024 * 1024;
+    config->traceSampleEvery = options->traceSampleEvery;
+    config->slowRequestUs = options->slowRequestUs;
+    config->lockDeadlineMs = options->lockDeadlineMs;
+    config->leaderHost = options->leaderHost[0] != '\0' ? options->leaderHost : NULL;
+    config->leaderPort = options->leaderPort;
+}
 
-        closelog();
+static bool sameCpus(const int *cpus, size_t count, const int *otherCpus, size_t otherCount)
+{
+    return count == otherCount && memcmp(cpus, otherCpus, count * sizeof(cpus[0])) == 0;
+}
 
-        return -1;
+/**
+ * @brief Name a setting that differs between two sets of options but can
+ *  only change with a restart
+ *
+ * @return const char* Config file key of the setting, NULL if none differs
+ */
+static const char *restartOnlyChange(const aesdsocket_options_t *current,
+                                     const aesdsocket_options_t *reloaded)
+{
+    if (strcmp(current->port, reloaded->port) != 0)
+    {
+        return "port";
     }
+    if (current->backlog != reloaded->backlog)
+    {
+        return "backlog";
+    }
+    if (strcmp(current->dataPath, reloaded->dataPath) != 0)
+    {
+        return "data_path";
+    }
+    if (strcmp(current->unixPath, reloaded->unixPath) != 0)
+    {
+        return "unix_socket";
+    }
+    if (strcmp(current->ingestPort, reloaded->ingestPort) != 0)
+    {
+        return "udp_port";
+    }
+    if (current->ringMiB != reloaded->ringMiB)
+    {
+        return "ring_mib";
+    }
+    if (current->fairLocking != reloaded->fairLocking)
+    {
+        return "fair_locking";
+    }
+    if (current->busyPollUs != reloaded->busyPollUs)
+    {
+        return "busy_poll_us";
+    }
+    if (!sameCpus(current->busyPollCpus, current->busyPollCpuCount, reloaded->busyPollCpus,
+                  reloaded->busyPollCpuCount))
+    {
+        return "busy_poll_cpus";
+    }
+    if (!sameCpus(current->acceptorCpus, current->acceptorCpuCount, reloaded->acceptorCpus,
+                  reloaded->acceptorCpuCount))
+    {
+        return "acceptor_cpus";
+    }
+    if (!sameCpus(current->workerCpus, current->workerCpuCount, reloaded->workerCpus,
+                  reloaded->workerCpuCount))
+    {
+        return "worker_cpus";
+    }
+    if (strcmp(current->leaderHost, reloaded->leaderHost) != 0 ||
+        strcmp(current->leaderPort, reloaded->leaderPort) != 0)
+    {
+        return "leader";
+    }
+    return NULL;
+}
 
-    return 0;
+void reloadOptions(int argc, char *argv[])
+{
+    aesdsocket_config_t config;
+    const char *changed;
+
+    if (checkInput(argc, argv, &reloadedOptions) != 0)
+    {
+        syslog(LOG_ERR, "Reload failed, keeping the current settings");
+        return;
+    }
+
+    changed = restartOnlyChange(&options, &reloadedOptions);
+    if (changed != NULL)
+    {
+        syslog(LOG_WARNING, "Setting %s changed, it takes effect on restart", changed);
+    }
+
+    options.maxConnections = reloadedOptions.maxConnections;
+    options.recvBuffSize = reloadedOptions.recvBuffSize;
+    options.idleTimeoutSec = reloadedOptions.idleTimeoutSec;
+    options.readTimeoutSec = reloadedOptions.readTimeoutSec;
+    options.timestampSec = reloadedOptions.timestampSec;
+    options.memoryMiB = reloadedOptions.memoryMiB;
+    options.zerocopyThreshold = reloadedOptions.zerocopyThreshold;
+    strcpy(options.capturePath, reloadedOptions.capturePath);
+    options.captureMiB = reloadedOptions.captureMiB;
+    options.slowRequestUs = reloadedOptions.slowRequestUs;
+    options.traceSampleEvery = reloadedOptions.traceSampleEvery;
+    options.lockDeadlineMs = reloadedOptions.lockDeadlineMs;
+    options.logLevel = reloadedOptions.logLevel;
+
+    setlogmask(LOG_UPTO(options.logLevel));
+    if (options.indexPath[0] != '\0' && options.leaderHost[0] == '\0')
+    {
+        setupTimer(options.timestampSec);
+    }
+    fillConfig(&options, &config);
+    aesdsocket_reconfigure(&config);
+
+    syslog(LOG_INFO, "Reloaded settings%s%s", options.configPath[0] != '\0' ? " from " : "",
+           options.configPath);
 }
 
-#ifndef USE_AESD_CHAR_DEVICE
-int setupTimer()
+int setupTimer(unsigned long intervalSec)
 {
     // Alarm signal-handling
     struct sigaction alrm_action;
@@ -652,9 +1090,9 @@ int setupTimer()
     sigemptyset(&alrm_action.sa_mask);
     sigaction(SIGALRM, &alrm_action, NULL);
     struct itimerval delay;
-    delay.it_value.tv_sec = 10;
+    delay.it_value.tv_sec = intervalSec;
     delay.it_value.tv_usec = 0;
-    delay.it_interval.tv_sec = 10;
+    delay.it_interval.tv_sec = intervalSec;
     delay.it_interval.tv_usec = 0;
 
     if (setitimer(ITIMER_REAL, &delay, NULL) != 0)
@@ -665,28 +1103,11 @@ int setupTimer()
 
     return 0;
 }
-#endif
 
 int graceful_exit(int returnVal)
 {
-    socket_data_t *listSearchp = NULL;
-    socket_data_t *tmpItem = NULL;
-
-    while (!SLIST_EMPTY(&head))
-    {
-        // Check list for completed threads
-        SLIST_FOREACH_SAFE(listSearchp, &head, entries, tmpItem)
-        {
-            if (listSearchp->threadCompleteFlag)
-            {
-                pthread_join(listSearchp->threadHandle, NULL);
-                SLIST_REMOVE(&head, listSearchp, socket_data_s, entries);
-                free(listSearchp);
-            }
-        }
-    }
-
+    aesdsocket_shutdown();
     freeaddrinfo(sockaddr);
     closelog();
     return returnVal;
-}
\ No newline at end of file
+}
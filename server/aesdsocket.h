@@ -1,10 +1,13 @@
 #pragma once
 
+// Build with -DUSE_AESD_FILE_BACKEND to log to a regular file instead of
+// the aesdchar driver
+#ifndef USE_AESD_FILE_BACKEND
 #define USE_AESD_CHAR_DEVICE
+#endif
 
-#include "./queue.h"
+#include "./libaesdsocket.h"
 #include <stdbool.h>
-#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
@@ -13,15 +16,24 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <sched.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include <syslog.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <signal.h>
 #include <sys/time.h>
+#include <time.h>
+
+#include <limits.h>
 
-#define BACKLOG     1
-#define BUFF_SIZE   256
+// Defaults for whatever neither the config file nor the command line sets
+#define BACKLOG     128
 
 #ifdef USE_AESD_CHAR_DEVICE
 const char OUTPUT_FILEPATH[] = "/dev/aesdchar";
@@ -30,74 +42,224 @@ const char OUTPUT_FILEPATH[] = "/var/tmp/aesdsocketdata";
 #endif
 const char SERVER_PORT[] = "9000";
 
-const char IOCSEEK_CMD_STR[] = "AESDCHAR_IOCSEEKTO:";
+// A file-backed log keeps its packet index next to it, at its path + this
+const char INDEX_FILE_SUFFIX[] = ".idx";
 
-typedef enum command_parser_state_s
-{
-    NOT_CMD,
-    HEADER,
-    ARG_X,
-    ARG_Y,
-} command_parser_state_t;
+// Seconds between timestamps appended to a file-backed log
+#define TIMESTAMP_INTERVAL_SEC  10
+
+// Channels other than the default one are stored at this prefix + name
+const char CHANNEL_FILEPATH_PREFIX[] = "/var/tmp/aesdsocketdata-";
+
+// Receive buffer asked for on the ingest socket, so bursts queue up rather
+// than being dropped while a batch is written. Capped by net.core.rmem_max.
+#define INGEST_RCVBUF_SIZE  (8 * 1024 * 1024)
+
+// Largest shared-memory ring -m may ask for, in MiB
+#define SHMRING_MAX_MIB     1024
+
+// Longest spin -b may ask for, in microseconds
+#define BUSY_POLL_MAX_US    1000000
+
+// Most cores -A or -w may list
+#define CPU_LIST_MAX        1024
+
+// Memory budget without -M, and the most -M may ask for, in MiB
+#define MEMORY_BUDGET_DEFAULT_MIB   256
+#define MEMORY_BUDGET_MAX_MIB       (1024 * 1024)
+
+// Smallest echo-back -z may send zero-copy. Below a page, pinning it and
+// handling the kernel's report always costs more than copying.
+#define ZEROCOPY_MIN_BYTES  4096
+
+// Largest -q, -r, -t and -T, -s, and -l
+#define BACKLOG_MAX         65535
+#define RECV_BUFF_MAX       (16 * 1024 * 1024)
+#define TIMEOUT_MAX_SEC     (7 * 24 * 3600)
+#define TIMESTAMP_MAX_SEC   (24 * 3600)
+#define LOCK_DEADLINE_MAX_MS    60000
+
+// Longest line of a config file, and longest port number or service name
+#define CONFIG_LINE_MAX     (PATH_MAX + 64)
+#define PORT_STR_MAX        32
 
-#define AESD_IOC_MAGIC 0x16
+// Size at which a capture trace stops growing without -L, and the most -L
+// may ask for, in MiB
+#define CAPTURE_DEFAULT_MIB 1024
+#define CAPTURE_MAX_MIB     (1024 * 1024)
 
-// Define a write command from the user point of view, use command number 1
-#define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+// How often the acceptor looks again while -W connections are being served
+#define CONNECTION_LIMIT_POLL_MS    50
 
 /**
- * A structure to be passed by IOCTL from user space to kernel space, describing the type
- * of seek performed on the aesdchar driver
+ * Settings from the config file given with -c and from the command line,
+ * which wins where both set something. SIGHUP reads both again but only
+ * applies the live settings, see reloadOptions().
  */
-struct aesd_seekto {
-    /**
-     * The zero referenced write command to seek into
-     */
-    uint32_t write_cmd;
-    /**
-     * The zero referenced offset within the write
-     */
-    uint32_t write_cmd_offset;
-};
-
-typedef struct socket_data_s socket_data_t;
-
-struct socket_data_s{
-    pthread_t threadHandle;
-    int connectedSock;
-    struct sockaddr peeraddr;
-    bool threadCompleteFlag;
-    SLIST_ENTRY(socket_data_s) entries;
-};
+typedef struct aesdsocket_options_s
+{
+    char configPath[PATH_MAX];
+    bool daemon;
+    char port[PORT_STR_MAX];
+    int backlog;
+    // The aesdchar driver when this is a character device, else a regular
+    // file with an index at indexPath, empty for the driver
+    char dataPath[PATH_MAX];
+    char indexPath[PATH_MAX];
+    // Empty when not listening on a unix domain socket or ingesting UDP
+    char unixPath[PATH_MAX];
+    char ingestPort[PORT_STR_MAX];
+    unsigned long ringMiB;
+    bool fairLocking;
+    unsigned long busyPollUs;
+    int busyPollCpus[AESDSOCKET_BUSY_POLL_MAX_CPUS];
+    size_t busyPollCpuCount;
+    int acceptorCpus[CPU_LIST_MAX];
+    size_t acceptorCpuCount;
+    int workerCpus[CPU_LIST_MAX];
+    size_t workerCpuCount;
+    // Leader to follow, empty when leading
+    char leaderHost[NI_MAXHOST];
+    char leaderPort[PORT_STR_MAX];
+    // CHANNEL_FILEPATH_PREFIX, or for a follower the data path and '-', so
+    // it can share a host with its leader
+    char channelPrefix[PATH_MAX];
+
+    // Live settings, re-applied on SIGHUP
+
+    // Most connections served at once, 0 for no limit. Others wait in the
+    // listen backlog.
+    unsigned long maxConnections;
+    unsigned long recvBuffSize;
+    unsigned long idleTimeoutSec;
+    unsigned long readTimeoutSec;
+    // 0 for no timestamps
+    unsigned long timestampSec;
+    unsigned long memoryMiB;
+    unsigned long zerocopyThreshold;
+    // Trace recording what connections receive, empty for none
+    char capturePath[PATH_MAX];
+    unsigned long captureMiB;
+    // Request tracing, see aesd-trace.h, 0 turning either off
+    unsigned long slowRequestUs;
+    unsigned long traceSampleEvery;
+    // Longest a packet waits for the channel lock, 0 for no limit
+    unsigned long lockDeadlineMs;
+    // Least important syslog priority still logged
+    int logLevel;
+} aesdsocket_options_t;
 
 /**
  * @brief Create a Stream Socket object
  * 
  * @param portNumberStr The desired port number to have stream socket server listen to. Input as string
+ * @param backlog Connections the kernel queues until they are accepted
  * @return int 
  * @retval -1 Error
  * @retval  0 Success
  */
-int createStreamSocket(const char *portNumberStr);
+int createStreamSocket(const char *portNumberStr, int backlog);
+
+/**
+ * @brief Create a listening AF_UNIX stream socket, for producers on the
+ *  same host to skip the TCP loopback stack
+ *
+ * A stale socket file left at path is replaced.
+ *
+ * @param path Filesystem path to bind to
+ * @param backlog Connections the kernel queues until they are accepted
+ * @return int Listening socket, or -1 on error
+ */
+int createUnixSocket(const char *path, int backlog);
+
+/**
+ * @brief Create a bound UDP socket for fire-and-forget producers, each
+ *  datagram being one packet
+ *
+ * @param portNumberStr String representation of port number to bind to
+ * @return int Bound socket, or -1 on error
+ */
+int createDatagramSocket(const char *portNumberStr);
+
+/**
+ * @brief Accept a connection on a listening socket and hand it to
+ *  libaesdsocket to serve
+ *
+ * @param sockfd Listening socket poll() found readable
+ * @return int
+ * @retval -2 Interrupted, try again
+ * @retval -1 Error
+ * @retval  0 Success
+ */
+int listenForConnections(int sockfd);
+
+/**
+ * @brief Parse a list of cores such as "2,4-7"
+ *
+ * @param list List given on the command line
+ * @param cpus Filled with the cores in the order listed
+ * @param maxCpus Room in cpus
+ * @param cpuCount Set to the number of cores
+ * @return int
+ * @retval -1 Error, malformed list or more than maxCpus cores
+ * @retval  0 Success
+ */
+int parseCpuList(const char *list, int *cpus, size_t maxCpus, size_t *cpuCount);
 
-int listenForConnections(int sockfd, socket_data_t **newListElement);
+/**
+ * @brief Apply one setting, given on the command line or in a config file
+ *
+ * @param opt Command line option letter of the setting
+ * @param value Value given, NULL for a flag given on the command line
+ * @return bool False if the value is not valid for the setting
+ */
+bool applyOption(aesdsocket_options_t *options, int opt, const char *value);
 
-void* recvAndSendAndLog(void* socket_data_arg);
+/**
+ * @brief Apply every "key = value" line of a config file. Blank lines and
+ *  anything after a '#' are ignored.
+ *
+ * @return int
+ * @retval -1 Error, reported with the offending line
+ * @retval  0 Success
+ */
+int readConfigFile(const char *path, aesdsocket_options_t *options);
 
 /**
- * @brief Check input to the application for validity
+ * @brief Work out the settings from the defaults, the config file given
+ *  with -c and the command line, in that order, and check them for
+ *  validity
  * 
  * @param argc Number of arguments
  * @param argv Vector of arguments
+ * @param options Filled in with the settings
  * @return int 
- * @retval -1 Error
+ * @retval -1 Error, usage has been printed
  * @retval  0 Success
  */
-int checkInput(int argc, char *argv[]);
+int checkInput(int argc, char *argv[], aesdsocket_options_t *options);
 
-#ifdef USE_AESD_CHAR_DEVICE
-int setupTimer();
-#endif
+/**
+ * @brief Fill in the library configuration from the settings
+ */
+void fillConfig(const aesdsocket_options_t *options, aesdsocket_config_t *config);
+
+/**
+ * @brief Read the config file and command line again on SIGHUP and apply
+ *  the live settings. Anything else that changed is logged as needing a
+ *  restart, and a config file that no longer checks out changes nothing.
+ */
+void reloadOptions(int argc, char *argv[]);
+
+/**
+ * @brief Append a timestamp to the default channel every intervalSec
+ *  seconds, or stop if intervalSec is 0
+ *
+ * @return int
+ * @retval -1 Error
+ * @retval  0 Success
+ */
+int setupTimer(unsigned long intervalSec);
 
 /**
  * @brief Exit gracefully, freeing the sockaddr structs generated by getaddrinfo()
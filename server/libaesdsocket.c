@@ -0,0 +1,307 @@
+/**
+ * @file libaesdsocket.c
+ * @brief Embeddable aesdsocket: the storage backend, framing, command
+ *  parser and echo-back behind a thread-safe C API
+ */
+
+#include "libaesdsocket.h"
+#include "aesd-capture.h"
+#include "aesd-channel.h"
+#include "aesd-connection.h"
+#include "aesd-ingest.h"
+#include "aesd-memory.h"
+#include "aesd-placement.h"
+#include "aesd-replica.h"
+#include "aesd-ring.h"
+#include "aesd-scan.h"
+#include "aesd-stats.h"
+#include "aesd-timer-wheel.h"
+#include "aesd-trace.h"
+#include "aesd-zerocopy.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#define TIMER_WHEEL_TICK_MS 100
+
+static pthread_mutex_t initMutex = PTHREAD_MUTEX_INITIALIZER;
+static bool initialized = false;
+static aesd_ring_t shmRing = {.fd = -1};
+
+int aesdsocket_init(const aesdsocket_config_t *config)
+{
+    int ingestSock = config->ingestSock;
+
+    pthread_mutex_lock(&initMutex);
+
+    if (initialized)
+    {
+        pthread_mutex_unlock(&initMutex);
+        errno = EALREADY;
+        return -1;
+    }
+
+    // Before any connection thread can be framing packets
+    syslog(LOG_INFO, "Packet scanning uses %s", aesd_scan_init()->name);
+    aesd_memory_init(config->memoryBudget);
+    aesd_zerocopy_init(config->zerocopyThreshold);
+    aesd_connection_limits(config->idleTimeoutSec, config->readTimeoutSec,
+                           config->recvBuffSize, config->lockDeadlineMs);
+    aesd_trace_configure(config->traceSampleEvery, config->slowRequestUs);
+
+    if (aesd_channel_registry_init(config->dataPath, config->indexPath,
+                                   config->channelPathPrefix, config->fairLocking) != 0)
+    {
+        fprintf(stderr, "Channel setup failed\n");
+        goto closeIngest;
+    }
+
+    if (aesd_placement_init(config->workerCpus, config->workerCpuCount) != 0)
+    {
+        perror("Worker placement setup failed");
+        goto cleanupChannels;
+    }
+
+    if (aesd_connection_busy_poll(config->busyPollUs, config->busyPollCpus,
+                                  config->busyPollCpuCount) != 0)
+    {
+        perror("Busy-poll setup failed");
+        goto cleanupChannels;
+    }
+
+    // Only the leader takes packets in other than through connections
+    if (config->leaderHost != NULL && (ingestSock != -1 || config->ringSize != 0))
+    {
+        fprintf(stderr, "A follower cannot ingest datagrams or a shared-memory ring\n");
+        errno = EINVAL;
+        goto cleanupChannels;
+    }
+
+    if (aesd_timer_wheel_start(TIMER_WHEEL_TICK_MS) != 0)
+    {
+        goto cleanupChannels;
+    }
+
+    if (aesd_replica_init(config->leaderHost, config->leaderPort) != 0)
+    {
+        perror("Cannot follow the leader");
+        goto stopWheel;
+    }
+
+    if (ingestSock != -1)
+    {
+        if (aesd_ingest_start(ingestSock, aesd_channel_default()) != 0)
+        {
+            goto stopReplica;
+        }
+        // aesd_ingest_stop() closes it from here on
+        ingestSock = -1;
+    }
+
+    // Failing to record is not worth failing to serve over
+    aesd_capture_configure(config->capturePath, config->captureMaxBytes);
+
+    if (config->ringSize != 0)
+    {
+        if (aesd_ring_create(&shmRing, config->ringSize) != 0 ||
+            aesd_ingest_ring_start(&shmRing, aesd_channel_default()) != 0)
+        {
+            goto stopIngest;
+        }
+        syslog(LOG_INFO, "Shared-memory ingest ring of %llu bytes",
+               (unsigned long long)shmRing.header->dataSize);
+    }
+
+    initialized = true;
+    pthread_mutex_unlock(&initMutex);
+    return 0;
+
+stopIngest:
+    aesd_capture_configure(NULL, 0);
+    aesd_ingest_stop();
+    aesd_ring_close(&shmRing);
+stopReplica:
+    aesd_replica_stop();
+stopWheel:
+    aesd_timer_wheel_stop();
+cleanupChannels:
+    aesd_channel_registry_cleanup();
+closeIngest:
+    if (ingestSock != -1)
+    {
+        close(ingestSock);
+    }
+    pthread_mutex_unlock(&initMutex);
+    return -1;
+}
+
+int aesdsocket_reconfigure(const aesdsocket_config_t *config)
+{
+    pthread_mutex_lock(&initMutex);
+
+    if (!initialized)
+    {
+        pthread_mutex_unlock(&initMutex);
+        errno = EINVAL;
+        return -1;
+    }
+
+    aesd_memory_init(config->memoryBudget);
+    aesd_zerocopy_init(config->zerocopyThreshold);
+    aesd_connection_limits(config->idleTimeoutSec, config->readTimeoutSec,
+                           config->recvBuffSize, config->lockDeadlineMs);
+    aesd_capture_configure(config->capturePath, config->captureMaxBytes);
+    aesd_trace_configure(config->traceSampleEvery, config->slowRequestUs);
+
+    pthread_mutex_unlock(&initMutex);
+    return 0;
+}
+
+void aesdsocket_shutdown(void)
+{
+    pthread_mutex_lock(&initMutex);
+
+    if (initialized)
+    {
+        // Followers and subscribers would otherwise be streamed to for as
+        // long as they stay
+        aesd_replica_stop();
+        aesd_channel_stop_followers();
+        aesd_connection_wait_all();
+        aesd_capture_configure(NULL, 0);
+        aesd_ingest_stop();
+        aesd_ring_close(&shmRing);
+        aesd_timer_wheel_stop();
+        aesd_channel_registry_cleanup();
+        initialized = false;
+    }
+
+    pthread_mutex_unlock(&initMutex);
+}
+
+static aesd_channel_t *lookupChannel(const char *channelName)
+{
+    aesd_channel_t *channel;
+
+    channel = channelName == NULL ? aesd_channel_default() : aesd_channel_get(channelName);
+    if (channel == NULL)
+    {
+        errno = EINVAL;
+    }
+    // Appends only ever happen on the leader
+    else if (aesd_replica_following())
+    {
+        errno = EROFS;
+        channel = NULL;
+    }
+    return channel;
+}
+
+int aesdsocket_append(const char *channelName, const char *packet, size_t len)
+{
+    aesd_channel_t *channel = lookupChannel(channelName);
+    int retVal;
+
+    if (channel == NULL)
+    {
+        return -1;
+    }
+
+    // A partial packet would be completed by whoever appends next
+    if (len == 0 || packet[len - 1] != '\n')
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (aesd_channel_lock(channel) != 0)
+    {
+        return -1;
+    }
+    retVal = aesd_channel_append(channel, packet, len);
+    aesd_channel_unlock(channel);
+
+    return retVal;
+}
+
+int aesdsocket_append_packets(const char *channelName, const struct iovec *packets,
+                              uint32_t count)
+{
+    aesd_channel_t *channel = lookupChannel(channelName);
+    uint32_t batch;
+    uint32_t i;
+    int retVal = 0;
+
+    if (channel == NULL)
+    {
+        return -1;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        if (packets[i].iov_len == 0 ||
+            ((const char *)packets[i].iov_base)[packets[i].iov_len - 1] != '\n')
+        {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    if (aesd_channel_lock(channel) != 0)
+    {
+        return -1;
+    }
+
+    for (i = 0; i < count && retVal == 0; i += batch)
+    {
+        batch = count - i < CHANNEL_APPEND_BATCH_MAX ? count - i : CHANNEL_APPEND_BATCH_MAX;
+        retVal = aesd_channel_append_packets(channel, packets + i, batch);
+    }
+
+    aesd_channel_unlock(channel);
+    return retVal;
+}
+
+int aesdsocket_serve(int connectedSock, const struct sockaddr_storage *peeraddr)
+{
+    // Counts the acceptor's migrations when the kernel does not
+    aesd_placement_sample();
+    return aesd_connection_start(connectedSock, peeraddr);
+}
+
+uint64_t aesdsocket_active_connections(void)
+{
+    return aesd_stats_get(STAT_CONNECTIONS_ACTIVE);
+}
+
+void aesdsocket_reap(void)
+{
+    aesd_connection_reap();
+}
+
+void aesdsocket_remove_channel_files(void)
+{
+    aesd_channel_registry_remove_files();
+}
+
+int aesdsocket_place_thread(const char *role, const int *cpus, size_t cpuCount)
+{
+    int node = -1;
+
+    if (cpus != NULL && aesd_placement_pin_self(cpus, cpuCount, &node) != 0)
+    {
+        return -1;
+    }
+
+    aesd_placement_register(role, node);
+    return 0;
+}
+
+size_t aesdsocket_stats(char *buf, size_t len)
+{
+    return aesd_stats_format(buf, len);
+}
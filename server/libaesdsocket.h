@@ -0,0 +1,247 @@
+/**
+ * @file libaesdsocket.h
+ * @brief Embeddable aesdsocket: the storage backend, framing, command
+ *  parser and echo-back behind a thread-safe C API
+ *
+ * An application links libaesdsocket.a to write into the same logs as
+ * aesdsocket without going over the network. In-process appends take the
+ * channel lock and write to storage, nothing more. The application can
+ * also hand the library connected sockets to serve with the full
+ * aesdsocket protocol, which is all the aesdsocket binary does on top of
+ * accepting connections.
+ *
+ * Every function may be called from any thread once aesdsocket_init() has
+ * returned. Threads the library starts block all signals.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// Most cores busy-poll mode can be given
+#define AESDSOCKET_BUSY_POLL_MAX_CPUS   64
+
+typedef struct aesdsocket_config_s aesdsocket_config_t;
+
+struct aesdsocket_config_s
+{
+    /**
+     * Log of the default channel, the aesdchar driver or a regular file
+     */
+    const char *dataPath;
+    /**
+     * Packet index of a file-backed default channel, NULL when dataPath is
+     * the aesdchar driver
+     */
+    const char *indexPath;
+    /**
+     * Prefix prepended to a channel name to form the path of its data file
+     */
+    const char *channelPathPrefix;
+    /**
+     * Bound datagram socket to ingest packets from, owned by the library
+     * from now on, or -1 for none
+     */
+    int ingestSock;
+    /**
+     * Bytes of shared-memory ring to hand to producers on unix domain
+     * socket connections, or 0 for none
+     */
+    size_t ringSize;
+    /**
+     * Hand channel locks over strictly in the order connections ask for
+     * them, instead of to whichever gets to run first
+     */
+    bool fairLocking;
+    /**
+     * Microseconds a connection thread spins on non-blocking receives
+     * before blocking, or 0 to always block
+     */
+    uint32_t busyPollUs;
+    /**
+     * Cores to pin busy-polling connection threads to, one thread each.
+     * NULL gives one unpinned thread per online core instead, later
+     * connections block as usual.
+     */
+    const int *busyPollCpus;
+    // At most AESDSOCKET_BUSY_POLL_MAX_CPUS
+    size_t busyPollCpuCount;
+    /**
+     * Cores connection and ingest threads may run on, grouped by NUMA node
+     * with each thread kept to one node's cores and memory. NULL leaves
+     * them to the scheduler.
+     */
+    const int *workerCpus;
+    size_t workerCpuCount;
+    /**
+     * Bytes receive buffers, pending responses and cached snapshots may
+     * take between them, or 0 for no limit. Connections using the most stop
+     * reading as the budget runs out.
+     */
+    size_t memoryBudget;
+    /**
+     * Echo-backs of file-backed channels at least this many bytes long are
+     * sent zero-copy from the page cache, or 0 to always copy
+     */
+    size_t zerocopyThreshold;
+    /**
+     * Seconds a connection may receive nothing, and may take over one
+     * packet, before it is closed. 0 for the defaults.
+     */
+    uint32_t idleTimeoutSec;
+    uint32_t readTimeoutSec;
+    /**
+     * Bytes each connection receives into at once, or 0 for the default
+     */
+    size_t recvBuffSize;
+    /**
+     * Trace to record what connections receive to, for aesd-replay, or
+     * NULL to record nothing. Recording stops once the trace reaches
+     * captureMaxBytes, 0 for no limit.
+     */
+    const char *capturePath;
+    uint64_t captureMaxBytes;
+    /**
+     * Keep the latency breakdown of one request in every traceSampleEvery
+     * for AESDCHAR_TRACE, and log every request taking at least
+     * slowRequestUs microseconds. 0 turns either off.
+     */
+    uint32_t traceSampleEvery;
+    uint64_t slowRequestUs;
+    /**
+     * Milliseconds a connection's packet may wait for the channel lock
+     * before it is answered AESDCHAR_ERROR:EBUSY and dropped, for the peer
+     * to retry, or 0 to wait as long as it takes. Packets forwarded by
+     * followers, over connections presenting the token of a replication
+     * stream, always wait.
+     */
+    uint32_t lockDeadlineMs;
+    /**
+     * Leader to follow, see aesd-replica.h, or NULL to lead. A follower
+     * needs a file-backed default channel, forwards every append to the
+     * leader and takes no ingestSock or ringSize.
+     */
+    const char *leaderHost;
+    const char *leaderPort;
+};
+
+/**
+ * @brief Open the logs and start the library's threads. Call once, and
+ *  after any fork() since threads do not survive one.
+ *
+ * @return int
+ * @retval -1 Error
+ * @retval  0 Success
+ */
+int aesdsocket_init(const aesdsocket_config_t *config);
+
+/**
+ * @brief Apply the settings of config that can change while running:
+ *  memoryBudget, zerocopyThreshold, idleTimeoutSec, readTimeoutSec,
+ *  recvBuffSize, capturePath, captureMaxBytes, traceSampleEvery,
+ *  slowRequestUs and lockDeadlineMs. The rest of config is ignored.
+ *
+ * Connections already being served keep going. Timeouts, the lock
+ * deadline and the memory budget apply to them straight away, a new
+ * receive buffer size and a zero-copy threshold lifted from 0 only to
+ * connections served afterwards.
+ * A new capture path starts a new trace, which only records connections
+ * served afterwards.
+ *
+ * @return int
+ * @retval -1 Error, errno EINVAL before aesdsocket_init()
+ * @retval  0 Success
+ */
+int aesdsocket_reconfigure(const aesdsocket_config_t *config);
+
+/**
+ * @brief Shut down every served connection and wait for it to finish, then
+ *  stop the library's threads and close the logs. Does nothing before
+ *  aesdsocket_init().
+ *
+ * Peers see their connection closed as if it had timed out. Stop handing
+ * connections to aesdsocket_serve() first.
+ */
+void aesdsocket_shutdown(void);
+
+/**
+ * @brief Append one packet to a channel
+ *
+ * @param channelName Channel to append to, created on first use, or NULL
+ *  for the default channel
+ * @param packet Packet contents, which must end with its newline
+ * @param len Bytes in packet
+ * @return int
+ * @retval -1 Error, errno EINVAL for a bad channel name or a packet
+ *  without its newline, EROFS when following a leader
+ * @retval  0 Success
+ */
+int aesdsocket_append(const char *channelName, const char *packet, size_t len);
+
+/**
+ * @brief Append several packets to a channel in as few writes as possible,
+ *  with no other packet landing between them
+ *
+ * @param channelName Channel to append to, or NULL for the default channel
+ * @param packets One iovec per packet, each ending with its newline
+ * @param count Number of packets
+ * @return int
+ * @retval -1 Error, errno EROFS when following a leader
+ * @retval  0 Success
+ */
+int aesdsocket_append_packets(const char *channelName, const struct iovec *packets,
+                              uint32_t count);
+
+/**
+ * @brief Serve a connected stream socket with the aesdsocket protocol on a
+ *  thread of its own
+ *
+ * @param connectedSock Connected socket, owned by the library from now on
+ * @param peeraddr Address of the peer as returned by accept()
+ * @return int
+ * @retval -1 Error
+ * @retval  0 Success
+ */
+int aesdsocket_serve(int connectedSock, const struct sockaddr_storage *peeraddr);
+
+/**
+ * @brief Number of connections being served right now
+ */
+uint64_t aesdsocket_active_connections(void);
+
+/**
+ * @brief Release what is left of connections whose peers have gone. Call
+ *  now and then when serving connections.
+ */
+void aesdsocket_reap(void);
+
+/**
+ * @brief Remove the data and index files of every named channel
+ */
+void aesdsocket_remove_channel_files(void);
+
+/**
+ * @brief Pin the calling thread, typically the one accepting connections,
+ *  and list it in AESDCHAR_THREADS replies under role. Call after
+ *  aesdsocket_init() from a thread that lives until aesdsocket_shutdown().
+ *
+ * @param role What the thread does, kept by the library
+ * @param cpus Cores to pin to, or NULL to only list the thread
+ * @param cpuCount Number of cores in cpus
+ * @return int
+ * @retval -1 Error
+ * @retval  0 Success
+ */
+int aesdsocket_place_thread(const char *role, const int *cpus, size_t cpuCount);
+
+/**
+ * @brief Write the server counters as "name value" lines, as
+ *  AESDCHAR_STATS replies
+ *
+ * @return size_t Number of bytes written, truncated to fit len
+ */
+size_t aesdsocket_stats(char *buf, size_t len);
@@ -0,0 +1,136 @@
+#include "unity.h"
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "test-server.h"
+#include "../../server/aesd-connection.h"
+
+// Long enough for the server to have received what came before on its own
+#define SPLIT_PAUSE_US  50000
+
+static void sendRecordHeader(int sock, uint32_t len)
+{
+    uint32_t header = htonl(len);
+
+    sendTestRequest(sock, &header, sizeof(header));
+}
+
+/**
+ * Connects, switches to binary framing and checks the switch was
+ * acknowledged
+ */
+static int connectBinary(void)
+{
+    char reply[64];
+    int sock = connectTestServer();
+
+    sendTestRequest(sock, "AESDCHAR_BINARY\n", 16);
+    recvTestReply(sock, reply, sizeof(reply));
+    TEST_ASSERT_EQUAL_STRING("AESDCHAR_BINARY:OK\n", reply);
+    return sock;
+}
+
+/**
+ * Checks a reply is one frame holding expected followed by the empty frame
+ * that ends every reply
+ */
+static void assertFramedReply(int sock, const char *expected)
+{
+    char reply[256];
+    uint32_t header;
+    size_t len = strlen(expected);
+
+    TEST_ASSERT_EQUAL_INT(len + 2 * sizeof(header), recvTestReply(sock, reply, sizeof(reply)));
+    memcpy(&header, reply, sizeof(header));
+    TEST_ASSERT_EQUAL_UINT32(len, ntohl(header));
+    TEST_ASSERT_EQUAL_MEMORY(expected, reply + sizeof(header), len);
+    memcpy(&header, reply + sizeof(header) + len, sizeof(header));
+    TEST_ASSERT_EQUAL_UINT32(0, header);
+}
+
+static void sendCommandRecord(int sock, const char *command)
+{
+    sendRecordHeader(sock, RECORD_COMMAND_FLAG | (uint32_t)strlen(command));
+    sendTestRequest(sock, command, strlen(command));
+}
+
+void test_binary_records_are_stored_as_packets()
+{
+    int sock;
+
+    startTestServer();
+    sock = connectBinary();
+
+    // Newlines inside a record are payload, the server adds the final one.
+    // The log comes back framed once the record is stored.
+    sendRecordHeader(sock, 7);
+    sendTestRequest(sock, "one\ntwo", 7);
+    assertFramedReply(sock, "one\ntwo\n");
+
+    // An empty record stores nothing and gets no reply
+    sendRecordHeader(sock, 0);
+    sendRecordHeader(sock, 6);
+    sendTestRequest(sock, "three\n", 6);
+    assertFramedReply(sock, "one\ntwo\nthree\n");
+
+    sendCommandRecord(sock, "AESDCHAR_SIZE");
+    assertFramedReply(sock, "14\n");
+    sendCommandRecord(sock, "AESDCHAR_READ:0,0,14");
+    assertFramedReply(sock, "one\ntwo\nthree\n");
+
+    close(sock);
+    stopTestServer();
+}
+
+void test_binary_records_split_across_receives()
+{
+    const char payload[] = "split record";
+    uint32_t header = htonl(sizeof(payload) - 1);
+    int sock;
+
+    startTestServer();
+    sock = connectBinary();
+
+    // The header arrives a byte and then three at a time, the payload in
+    // two pieces
+    sendTestRequest(sock, &header, 1);
+    usleep(SPLIT_PAUSE_US);
+    sendTestRequest(sock, (const char *)&header + 1, 3);
+    usleep(SPLIT_PAUSE_US);
+    sendTestRequest(sock, payload, 5);
+    usleep(SPLIT_PAUSE_US);
+    sendTestRequest(sock, payload + 5, sizeof(payload) - 1 - 5);
+    assertFramedReply(sock, "split record\n");
+
+    sendCommandRecord(sock, "AESDCHAR_COUNT");
+    assertFramedReply(sock, "1\n");
+    sendCommandRecord(sock, "AESDCHAR_READ:0,0,13");
+    assertFramedReply(sock, "split record\n");
+
+    close(sock);
+    stopTestServer();
+}
+
+void test_binary_framing_rejects_bad_records()
+{
+    char reply[64];
+    int sock;
+
+    startTestServer();
+    sock = connectBinary();
+
+    // A command record that is no command, and asking to switch twice
+    sendCommandRecord(sock, "not a command");
+    assertFramedReply(sock, "AESDCHAR_ERROR:ENOSYS\n");
+    sendCommandRecord(sock, "AESDCHAR_BINARY");
+    assertFramedReply(sock, "AESDCHAR_ERROR:EINVAL\n");
+
+    // A length over the limit closes the connection
+    sendRecordHeader(sock, RECORD_MAX_LEN + 1);
+    TEST_ASSERT_EQUAL_INT(0, recvTestReply(sock, reply, sizeof(reply)));
+    TEST_ASSERT_EQUAL_INT(0, recv(sock, reply, sizeof(reply), 0));
+
+    close(sock);
+    stopTestServer();
+}
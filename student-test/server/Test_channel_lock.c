@@ -0,0 +1,223 @@
+#include "unity.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include "../../server/libaesdsocket.h"
+
+// Longest a packet may wait for its ack behind a connection streaming to
+// the same channel. Each burst holds the lock for one receive, so waits
+// are a few milliseconds, this only leaves room for a loaded machine.
+#define LOCK_WAIT_MAX_MS        500
+// Fails a test starved outright rather than leaving it hanging
+#define REPLY_TIMEOUT_SEC       5
+#define LOCK_WAIT_SAMPLES       200
+#define STREAM_CHUNK_PACKETS    2000
+
+static atomic_bool streaming;
+
+static uint64_t nowNs(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+// Over TCP loopback, whose buffers let the streamer stay well ahead of the
+// server, which is when a burst could go on forever
+static int serveLoopbackConnection(int *clientSock)
+{
+    struct sockaddr_in addr = {.sin_family = AF_INET,
+                               .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    struct sockaddr_storage peeraddr;
+    socklen_t addrLen = sizeof(addr);
+    socklen_t peeraddrLen = sizeof(peeraddr);
+    int listenSock;
+    int serverSock = -1;
+
+    *clientSock = -1;
+    listenSock = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenSock == -1)
+    {
+        return -1;
+    }
+    if (bind(listenSock, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+        listen(listenSock, 1) == 0 &&
+        getsockname(listenSock, (struct sockaddr *)&addr, &addrLen) == 0)
+    {
+        *clientSock = socket(AF_INET, SOCK_STREAM, 0);
+    }
+    if (*clientSock != -1 &&
+        connect(*clientSock, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+    {
+        serverSock = accept(listenSock, (struct sockaddr *)&peeraddr, &peeraddrLen);
+    }
+    close(listenSock);
+
+    if (serverSock == -1 || aesdsocket_serve(serverSock, &peeraddr) != 0)
+    {
+        if (*clientSock != -1)
+        {
+            close(*clientSock);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+static bool sendAll(int sock, const char *buf, size_t len)
+{
+    ssize_t sent;
+
+    while (len > 0)
+    {
+        sent = send(sock, buf, len, MSG_NOSIGNAL);
+        if (sent <= 0)
+        {
+            return false;
+        }
+        buf += sent;
+        len -= (size_t)sent;
+    }
+    return true;
+}
+
+// Reads one reply line, false once the connection is gone
+static bool recvLine(int sock, char *buf, size_t len)
+{
+    size_t used = 0;
+
+    while (used + 1 < len && recv(sock, buf + used, 1, 0) == 1)
+    {
+        if (buf[used++] == '\n')
+        {
+            buf[used] = '\0';
+            return true;
+        }
+    }
+    return false;
+}
+
+static void *drainAcks(void *arg)
+{
+    char buf[65536];
+    int sock = *(int *)arg;
+
+    while (recv(sock, buf, sizeof(buf), 0) > 0)
+    {
+    }
+    return NULL;
+}
+
+static void *streamPackets(void *arg)
+{
+    static char chunk[STREAM_CHUNK_PACKETS * 24];
+    size_t len = 0;
+    int sock = *(int *)arg;
+    int i;
+
+    for (i = 0; i < STREAM_CHUNK_PACKETS; i++)
+    {
+        len += (size_t)sprintf(chunk + len, "stream packet %06d\n", i);
+    }
+
+    while (atomic_load(&streaming) && sendAll(sock, chunk, len))
+    {
+    }
+    return NULL;
+}
+
+/**
+ * Serves one connection streaming acknowledged packets as fast as it can
+ * and a second one appending a packet at a time, returning the longest the
+ * second waited for an ack.
+ */
+static uint64_t secondAppenderMaxWaitMs(bool fairLocking)
+{
+    char dir[] = "/tmp/aesd-lock-test-XXXXXX";
+    char dataPath[64];
+    char indexPath[64];
+    char channelPrefix[64];
+    char reply[128];
+    struct timeval replyTimeout = {.tv_sec = REPLY_TIMEOUT_SEC};
+    aesdsocket_config_t config = {0};
+    pthread_t streamer;
+    pthread_t drainer;
+    uint64_t maxWaitNs = 0;
+    uint64_t start;
+    uint64_t elapsedNs;
+    int streamSock;
+    int appendSock;
+    int i;
+
+    TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+    snprintf(dataPath, sizeof(dataPath), "%s/data", dir);
+    snprintf(indexPath, sizeof(indexPath), "%s/data.idx", dir);
+    snprintf(channelPrefix, sizeof(channelPrefix), "%s/data-", dir);
+
+    config.dataPath = dataPath;
+    config.indexPath = indexPath;
+    config.channelPathPrefix = channelPrefix;
+    config.ingestSock = -1;
+    config.fairLocking = fairLocking;
+    TEST_ASSERT_EQUAL_INT(0, aesdsocket_init(&config));
+
+    TEST_ASSERT_EQUAL_INT(0, serveLoopbackConnection(&streamSock));
+    TEST_ASSERT_EQUAL_INT(0, serveLoopbackConnection(&appendSock));
+    TEST_ASSERT_EQUAL_INT(0, setsockopt(appendSock, SOL_SOCKET, SO_RCVTIMEO, &replyTimeout,
+                                        sizeof(replyTimeout)));
+    TEST_ASSERT_TRUE(sendAll(streamSock, "AESDCHAR_ECHOMODE:ack\n", 22));
+    TEST_ASSERT_TRUE(sendAll(appendSock, "AESDCHAR_ECHOMODE:ack\n", 22));
+
+    atomic_store(&streaming, true);
+    TEST_ASSERT_EQUAL_INT(0, pthread_create(&drainer, NULL, drainAcks, &streamSock));
+    TEST_ASSERT_EQUAL_INT(0, pthread_create(&streamer, NULL, streamPackets, &streamSock));
+    // Let the streamer get going before anybody competes with it
+    usleep(100000);
+
+    for (i = 0; i < LOCK_WAIT_SAMPLES; i++)
+    {
+        start = nowNs();
+        TEST_ASSERT_TRUE(sendAll(appendSock, "second appender\n", 16));
+        TEST_ASSERT_TRUE(recvLine(appendSock, reply, sizeof(reply)));
+        TEST_ASSERT_EQUAL_INT(0, strncmp(reply, "AESDCHAR_ACK", 12));
+        elapsedNs = nowNs() - start;
+        if (elapsedNs > maxWaitNs)
+        {
+            maxWaitNs = elapsedNs;
+        }
+    }
+
+    atomic_store(&streaming, false);
+    pthread_join(streamer, NULL);
+    close(appendSock);
+    // Shuts the streamer's connection down, which ends the drainer too
+    aesdsocket_shutdown();
+    pthread_join(drainer, NULL);
+    close(streamSock);
+
+    unlink(dataPath);
+    unlink(indexPath);
+    rmdir(dir);
+
+    return maxWaitNs / 1000000;
+}
+
+void test_plain_lock_bounds_wait_behind_streamer()
+{
+    TEST_ASSERT_LESS_THAN_UINT64(LOCK_WAIT_MAX_MS, secondAppenderMaxWaitMs(false));
+}
+
+void test_fair_lock_bounds_wait_behind_streamer()
+{
+    TEST_ASSERT_LESS_THAN_UINT64(LOCK_WAIT_MAX_MS, secondAppenderMaxWaitMs(true));
+}
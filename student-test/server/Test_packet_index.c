@@ -0,0 +1,170 @@
+#include "unity.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../../server/aesd-packet-index.h"
+
+// Three packets, ending at 2, 5 and 9
+static const char threePackets[] = "a\nbb\nccc\n";
+
+static char indexDir[64];
+static char dataPath[96];
+static char indexPath[96];
+
+static void makeIndexPaths(void)
+{
+    strcpy(indexDir, "/tmp/aesd-index-test-XXXXXX");
+    TEST_ASSERT_NOT_NULL(mkdtemp(indexDir));
+    snprintf(dataPath, sizeof(dataPath), "%s/data", indexDir);
+    snprintf(indexPath, sizeof(indexPath), "%s/data.idx", indexDir);
+}
+
+static void removeIndexPaths(void)
+{
+    unlink(dataPath);
+    unlink(indexPath);
+    rmdir(indexDir);
+}
+
+static void writeFile(const char *path, const void *buf, size_t len)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+
+    TEST_ASSERT_TRUE(fd != -1);
+    TEST_ASSERT_EQUAL_INT((int)len, (int)write(fd, buf, len));
+    close(fd);
+}
+
+static off_t fileSize(const char *path)
+{
+    struct stat pathStat;
+
+    TEST_ASSERT_EQUAL_INT(0, stat(path, &pathStat));
+    return pathStat.st_size;
+}
+
+void test_packet_index_builds_and_reloads()
+{
+    aesd_packet_index_t index;
+
+    makeIndexPaths();
+    writeFile(dataPath, threePackets, strlen(threePackets));
+
+    // Built from the data file the first time
+    TEST_ASSERT_EQUAL_INT(0, aesd_packet_index_open(&index, dataPath, indexPath));
+    TEST_ASSERT_EQUAL_UINT32(3, index.count);
+    TEST_ASSERT_EQUAL_UINT64(2, index.packetEnds[0]);
+    TEST_ASSERT_EQUAL_UINT64(5, index.packetEnds[1]);
+    TEST_ASSERT_EQUAL_UINT64(9, index.packetEnds[2]);
+    aesd_packet_index_close(&index);
+    TEST_ASSERT_EQUAL_INT(3 * sizeof(uint64_t), fileSize(indexPath));
+
+    // And loaded as persisted the next
+    TEST_ASSERT_EQUAL_INT(0, aesd_packet_index_open(&index, dataPath, indexPath));
+    TEST_ASSERT_EQUAL_UINT32(3, index.count);
+    TEST_ASSERT_EQUAL_UINT64(9, index.packetEnds[2]);
+    aesd_packet_index_close(&index);
+    TEST_ASSERT_EQUAL_INT(3 * sizeof(uint64_t), fileSize(indexPath));
+
+    removeIndexPaths();
+}
+
+void test_packet_index_drops_entries_that_disagree_with_the_data()
+{
+    // Past the end of the data, and not increasing
+    const uint64_t pastEnd[] = {2, 5, 100};
+    const uint64_t notIncreasing[] = {2, 2, 9};
+    aesd_packet_index_t index;
+
+    makeIndexPaths();
+    writeFile(dataPath, threePackets, strlen(threePackets));
+
+    writeFile(indexPath, pastEnd, sizeof(pastEnd));
+    TEST_ASSERT_EQUAL_INT(0, aesd_packet_index_open(&index, dataPath, indexPath));
+    TEST_ASSERT_EQUAL_UINT32(3, index.count);
+    TEST_ASSERT_EQUAL_UINT64(9, index.packetEnds[2]);
+    aesd_packet_index_close(&index);
+
+    writeFile(indexPath, notIncreasing, sizeof(notIncreasing));
+    TEST_ASSERT_EQUAL_INT(0, aesd_packet_index_open(&index, dataPath, indexPath));
+    TEST_ASSERT_EQUAL_UINT32(3, index.count);
+    TEST_ASSERT_EQUAL_UINT64(5, index.packetEnds[1]);
+    TEST_ASSERT_EQUAL_UINT64(9, index.packetEnds[2]);
+    aesd_packet_index_close(&index);
+    TEST_ASSERT_EQUAL_INT(3 * sizeof(uint64_t), fileSize(indexPath));
+
+    removeIndexPaths();
+}
+
+void test_packet_index_rescans_tail_after_crash()
+{
+    // Persisted up to the second packet, then a torn third entry, as a
+    // crash mid-write leaves it
+    const uint64_t persisted[] = {2, 5};
+    const char tornEntry[3] = {0};
+    const uint64_t more[] = {20, 24};
+    aesd_packet_index_t index;
+    int fd;
+
+    makeIndexPaths();
+    // Two more packets and a partial one made it to the data file
+    writeFile(dataPath, "a\nbb\nccc\nddd\nee", 15);
+    writeFile(indexPath, persisted, sizeof(persisted));
+    fd = open(indexPath, O_WRONLY | O_APPEND);
+    TEST_ASSERT_EQUAL_INT(sizeof(tornEntry), write(fd, tornEntry, sizeof(tornEntry)));
+    close(fd);
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_packet_index_open(&index, dataPath, indexPath));
+    // The partial packet is not indexed until its newline arrives
+    TEST_ASSERT_EQUAL_UINT32(4, index.count);
+    TEST_ASSERT_EQUAL_UINT64(9, index.packetEnds[2]);
+    TEST_ASSERT_EQUAL_UINT64(13, index.packetEnds[3]);
+    TEST_ASSERT_EQUAL_INT(4 * sizeof(uint64_t), fileSize(indexPath));
+
+    // Appends carry on from the rescanned entries
+    TEST_ASSERT_EQUAL_INT(0, aesd_packet_index_append(&index, 16));
+    TEST_ASSERT_EQUAL_INT(0, aesd_packet_index_append_batch(&index, more, 2));
+    TEST_ASSERT_EQUAL_UINT32(7, index.count);
+    TEST_ASSERT_EQUAL_UINT64(24, index.packetEnds[6]);
+    aesd_packet_index_close(&index);
+    TEST_ASSERT_EQUAL_INT(7 * sizeof(uint64_t), fileSize(indexPath));
+
+    removeIndexPaths();
+}
+
+void test_packet_index_lookup_bounds()
+{
+    aesd_packet_index_t index;
+    off_t fileOffset = -1;
+
+    makeIndexPaths();
+
+    // No data file yet, nothing to seek to
+    TEST_ASSERT_EQUAL_INT(0, aesd_packet_index_open(&index, dataPath, indexPath));
+    TEST_ASSERT_EQUAL_UINT32(0, index.count);
+    TEST_ASSERT_EQUAL_INT(-1, aesd_packet_index_lookup(&index, 0, 0, &fileOffset));
+    aesd_packet_index_close(&index);
+
+    writeFile(dataPath, threePackets, strlen(threePackets));
+    TEST_ASSERT_EQUAL_INT(0, aesd_packet_index_open(&index, dataPath, indexPath));
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_packet_index_lookup(&index, 0, 0, &fileOffset));
+    TEST_ASSERT_EQUAL_INT(0, fileOffset);
+    TEST_ASSERT_EQUAL_INT(0, aesd_packet_index_lookup(&index, 1, 2, &fileOffset));
+    TEST_ASSERT_EQUAL_INT(4, fileOffset);
+    // The newline is the last byte of a packet that can be sought to
+    TEST_ASSERT_EQUAL_INT(0, aesd_packet_index_lookup(&index, 2, 3, &fileOffset));
+    TEST_ASSERT_EQUAL_INT(8, fileOffset);
+
+    TEST_ASSERT_EQUAL_INT(-1, aesd_packet_index_lookup(&index, 1, 3, &fileOffset));
+    TEST_ASSERT_EQUAL_INT(-1, aesd_packet_index_lookup(&index, 3, 0, &fileOffset));
+    TEST_ASSERT_EQUAL_INT(-1, aesd_packet_index_lookup(&index, UINT32_MAX, 0, &fileOffset));
+    TEST_ASSERT_EQUAL_INT(8, fileOffset);
+
+    aesd_packet_index_close(&index);
+    removeIndexPaths();
+}
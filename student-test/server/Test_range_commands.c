@@ -0,0 +1,119 @@
+#include "unity.h"
+#include <string.h>
+#include <unistd.h>
+#include "test-server.h"
+#include "../../server/aesd-connection.h"
+
+// Three packets starting at 0, 4 and 8, 14 bytes in all
+static const char rangeTestLog[] = "one\ntwo\nthree\n";
+
+/**
+ * Starts the test server with rangeTestLog in its default channel and
+ * returns a connection to it
+ */
+static int connectWithRangeTestLog(void)
+{
+    char reply[64];
+    int sock;
+
+    startTestServer();
+    sock = connectTestServer();
+
+    // The log is echoed back once stored
+    sendTestRequest(sock, rangeTestLog, strlen(rangeTestLog));
+    recvTestReply(sock, reply, sizeof(reply));
+    TEST_ASSERT_EQUAL_STRING(rangeTestLog, reply);
+    return sock;
+}
+
+static void assertReply(int sock, const char *request, const char *expected)
+{
+    char reply[512];
+
+    sendTestRequest(sock, request, strlen(request));
+    recvTestReply(sock, reply, sizeof(reply));
+    TEST_ASSERT_EQUAL_STRING(expected, reply);
+}
+
+void test_read_returns_the_requested_range()
+{
+    int sock = connectWithRangeTestLog();
+
+    assertReply(sock, "AESDCHAR_READ:1,1,2\n", "wo");
+    assertReply(sock, "AESDCHAR_READ:0,0,4\n", "one\n");
+    // Ranges run on into later packets, and stop at the end of the log
+    assertReply(sock, "AESDCHAR_READ:1,3,3\n", "\nth");
+    assertReply(sock, "AESDCHAR_READ:2,2,100\n", "ree\n");
+
+    close(sock);
+    stopTestServer();
+}
+
+void test_read_rejects_malformed_ranges()
+{
+    int sock = connectWithRangeTestLog();
+
+    assertReply(sock, "AESDCHAR_READ:1,1\n", "AESDCHAR_ERROR:EINVAL\n");
+    assertReply(sock, "AESDCHAR_READ:1,1,2,3\n", "AESDCHAR_ERROR:EINVAL\n");
+    assertReply(sock, "AESDCHAR_READ: 1,1,2\n", "AESDCHAR_ERROR:EINVAL\n");
+    assertReply(sock, "AESDCHAR_READ:-1,1,2\n", "AESDCHAR_ERROR:EINVAL\n");
+    assertReply(sock, "AESDCHAR_READ:1,1,2x\n", "AESDCHAR_ERROR:EINVAL\n");
+    assertReply(sock, "AESDCHAR_READ:4294967296,0,1\n", "AESDCHAR_ERROR:EINVAL\n");
+    // Well formed, but past the last packet or the end of one
+    assertReply(sock, "AESDCHAR_READ:3,0,1\n", "AESDCHAR_ERROR:EINVAL\n");
+    assertReply(sock, "AESDCHAR_READ:0,4,1\n", "AESDCHAR_ERROR:EINVAL\n");
+
+    // None of which cost the connection
+    assertReply(sock, "AESDCHAR_READ:0,0,3\n", "one");
+
+    close(sock);
+    stopTestServer();
+}
+
+void test_readv_answers_every_range_in_one_reply()
+{
+    int sock = connectWithRangeTestLog();
+
+    assertReply(sock, "AESDCHAR_READV:2,0,5\n", "5\nthree");
+    assertReply(sock, "AESDCHAR_READV:0,0,3;2,1,4;1,0,0\n", "3\none4\nhree0\n");
+
+    close(sock);
+    stopTestServer();
+}
+
+void test_readv_rejects_malformed_batches()
+{
+    char request[CMD_MAX_LEN];
+    size_t used;
+    int sock = connectWithRangeTestLog();
+    int i;
+
+    assertReply(sock, "AESDCHAR_READV:0,0,3;\n", "AESDCHAR_ERROR:EINVAL\n");
+    assertReply(sock, "AESDCHAR_READV:0,0,3;;1,0,1\n", "AESDCHAR_ERROR:EINVAL\n");
+    assertReply(sock, "AESDCHAR_READV:0,0,3,1,0,1\n", "AESDCHAR_ERROR:EINVAL\n");
+    // One bad range fails the whole batch
+    assertReply(sock, "AESDCHAR_READV:0,0,3;9,0,1\n", "AESDCHAR_ERROR:EINVAL\n");
+
+    // One range more than a batch may hold
+    used = (size_t)sprintf(request, "AESDCHAR_READV:0,0,1");
+    for (i = 1; i <= READV_MAX_RANGES; i++)
+    {
+        used += (size_t)sprintf(request + used, ";0,0,1");
+    }
+    strcpy(request + used, "\n");
+    assertReply(sock, request, "AESDCHAR_ERROR:E2BIG\n");
+
+    close(sock);
+    stopTestServer();
+}
+
+void test_count_and_size_describe_the_log()
+{
+    int sock = connectWithRangeTestLog();
+
+    assertReply(sock, "AESDCHAR_COUNT\n", "3\n");
+    assertReply(sock, "AESDCHAR_SIZE\n", "14\n");
+
+    close(sock);
+    stopTestServer();
+}
@@ -0,0 +1,204 @@
+#include "unity.h"
+#include <errno.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "../../server/aesd-ring.h"
+
+#define RING_TEST_SIZE          AESD_RING_MIN_SIZE
+#define RING_TEST_PACKET_LEN    1000
+// Header plus packet, already a multiple of AESD_RING_ALIGN
+#define RING_TEST_RECORD_LEN    (sizeof(aesd_ring_record_t) + RING_TEST_PACKET_LEN)
+
+static char testPacket[RING_TEST_PACKET_LEN];
+
+static aesd_ring_record_t *ringRecordAt(const aesd_ring_t *ring, uint64_t offset)
+{
+    return (aesd_ring_record_t *)(ring->data + offset);
+}
+
+static void writeTestPackets(aesd_ring_t *ring, int count)
+{
+    int i;
+
+    memset(testPacket, 'r', sizeof(testPacket) - 1);
+    testPacket[sizeof(testPacket) - 1] = '\n';
+    for (i = 0; i < count; i++)
+    {
+        TEST_ASSERT_EQUAL_INT(0, aesd_ring_write(ring, testPacket, sizeof(testPacket)));
+    }
+}
+
+void test_ring_round_trip()
+{
+    struct iovec packets[4];
+    aesd_ring_t ring;
+    aesd_ring_t producer;
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_ring_create(&ring, RING_TEST_SIZE));
+    // A producer attaching sees the same ring
+    TEST_ASSERT_EQUAL_INT(0, aesd_ring_attach(&producer, dup(ring.fd)));
+
+    // The newline is added when missing
+    TEST_ASSERT_EQUAL_INT(0, aesd_ring_write(&producer, "abc", 3));
+    TEST_ASSERT_EQUAL_INT(0, aesd_ring_write(&producer, "defg\n", 5));
+
+    TEST_ASSERT_EQUAL_INT(2, aesd_ring_read(&ring, packets, 4));
+    TEST_ASSERT_EQUAL_INT(4, packets[0].iov_len);
+    TEST_ASSERT_EQUAL_MEMORY("abc\n", packets[0].iov_base, 4);
+    TEST_ASSERT_EQUAL_INT(5, packets[1].iov_len);
+    TEST_ASSERT_EQUAL_MEMORY("defg\n", packets[1].iov_base, 5);
+    aesd_ring_release(&ring);
+
+    // Released space reads as empty again
+    TEST_ASSERT_EQUAL_INT(0, aesd_ring_read(&ring, packets, 4));
+    TEST_ASSERT_EQUAL_UINT64(atomic_load(&ring.header->head), atomic_load(&ring.header->tail));
+
+    aesd_ring_close(&producer);
+    aesd_ring_close(&ring);
+}
+
+void test_ring_refuses_what_does_not_fit()
+{
+    char big[RING_TEST_SIZE];
+    aesd_ring_t ring;
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_ring_create(&ring, RING_TEST_SIZE));
+
+    memset(big, 'b', sizeof(big));
+    errno = 0;
+    TEST_ASSERT_EQUAL_INT(-1, aesd_ring_write(&ring, big, aesd_ring_max_packet(&ring) + 1));
+    TEST_ASSERT_EQUAL_INT(EMSGSIZE, errno);
+    // Room for the newline it adds is part of the limit
+    TEST_ASSERT_EQUAL_INT(-1, aesd_ring_write(&ring, big, aesd_ring_max_packet(&ring)));
+
+    // Four records fill it, the consumer has not handed any back
+    writeTestPackets(&ring, 4);
+    errno = 0;
+    TEST_ASSERT_EQUAL_INT(-1, aesd_ring_write(&ring, testPacket, sizeof(testPacket)));
+    TEST_ASSERT_EQUAL_INT(EAGAIN, errno);
+
+    aesd_ring_close(&ring);
+}
+
+void test_ring_wraps_with_padding()
+{
+    struct iovec packets[4];
+    aesd_ring_t ring;
+    uint64_t padOffset = 4 * RING_TEST_RECORD_LEN;
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_ring_create(&ring, RING_TEST_SIZE));
+
+    writeTestPackets(&ring, 3);
+    TEST_ASSERT_EQUAL_INT(3, aesd_ring_read(&ring, packets, 4));
+    aesd_ring_release(&ring);
+
+    // The fourth record still fits before the end, the fifth does not and
+    // starts over at the beginning behind a padding record
+    writeTestPackets(&ring, 2);
+    TEST_ASSERT_EQUAL_UINT32(RING_RECORD_PADDING,
+                             atomic_load(&ringRecordAt(&ring, padOffset)->state));
+    TEST_ASSERT_EQUAL_UINT64(5 * RING_TEST_RECORD_LEN + (RING_TEST_SIZE - padOffset),
+                             atomic_load(&ring.header->head));
+
+    // Padding is skipped, never handed out
+    TEST_ASSERT_EQUAL_INT(2, aesd_ring_read(&ring, packets, 4));
+    TEST_ASSERT_EQUAL_PTR(ringRecordAt(&ring, 3 * RING_TEST_RECORD_LEN)->data,
+                          packets[0].iov_base);
+    TEST_ASSERT_EQUAL_PTR(ringRecordAt(&ring, 0)->data, packets[1].iov_base);
+    TEST_ASSERT_EQUAL_INT(RING_TEST_PACKET_LEN, packets[1].iov_len);
+    aesd_ring_release(&ring);
+
+    // Handing the padding back zeroed it along with the records
+    TEST_ASSERT_EQUAL_UINT32(RING_RECORD_EMPTY,
+                             atomic_load(&ringRecordAt(&ring, padOffset)->state));
+    TEST_ASSERT_EQUAL_INT(0, aesd_ring_read(&ring, packets, 4));
+
+    aesd_ring_close(&ring);
+}
+
+void test_ring_read_rejects_corrupt_records()
+{
+    struct iovec packets[4];
+    aesd_ring_t ring;
+    aesd_ring_record_t *record;
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_ring_create(&ring, RING_TEST_SIZE));
+    writeTestPackets(&ring, 1);
+    record = ringRecordAt(&ring, 0);
+
+    // Running past the end of the ring
+    record->len = RING_TEST_SIZE;
+    TEST_ASSERT_EQUAL_INT(-1, aesd_ring_read(&ring, packets, 4));
+    record->len = RING_TEST_PACKET_LEN;
+
+    // A state no producer writes
+    atomic_store(&record->state, RING_RECORD_PADDING + 1);
+    TEST_ASSERT_EQUAL_INT(-1, aesd_ring_read(&ring, packets, 4));
+
+    // Padding that stops short of the end of the ring
+    atomic_store(&record->state, RING_RECORD_PADDING);
+    TEST_ASSERT_EQUAL_INT(-1, aesd_ring_read(&ring, packets, 4));
+
+    atomic_store(&record->state, RING_RECORD_PACKET);
+    TEST_ASSERT_EQUAL_INT(1, aesd_ring_read(&ring, packets, 4));
+
+    aesd_ring_close(&ring);
+}
+
+void test_ring_trusts_nothing_rewritten_after_commit()
+{
+    struct iovec packets[8];
+    aesd_ring_t ring;
+    aesd_ring_record_t *forged;
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_ring_create(&ring, RING_TEST_SIZE));
+    writeTestPackets(&ring, 2);
+
+    // Lengths and the shared tail rewritten once the first packet is
+    // handed out change neither it nor what is handed back
+    TEST_ASSERT_EQUAL_INT(1, aesd_ring_read(&ring, packets, 1));
+    ringRecordAt(&ring, 0)->len = RING_TEST_SIZE;
+    atomic_store(&ring.header->tail, 3 * RING_TEST_RECORD_LEN);
+    TEST_ASSERT_EQUAL_INT(RING_TEST_PACKET_LEN, packets[0].iov_len);
+    aesd_ring_release(&ring);
+    TEST_ASSERT_EQUAL_UINT64(RING_TEST_RECORD_LEN, atomic_load(&ring.header->tail));
+
+    atomic_store(&ring.header->tail, 0);
+    TEST_ASSERT_EQUAL_INT(1, aesd_ring_read(&ring, packets, 8));
+    TEST_ASSERT_EQUAL_PTR(ringRecordAt(&ring, RING_TEST_RECORD_LEN)->data, packets[0].iov_base);
+    TEST_ASSERT_EQUAL_INT(RING_TEST_PACKET_LEN, packets[0].iov_len);
+    TEST_ASSERT_EQUAL_MEMORY(testPacket, packets[0].iov_base, RING_TEST_PACKET_LEN);
+    aesd_ring_release(&ring);
+    aesd_ring_close(&ring);
+
+    // Records that each fit but together run round the ring past the tail
+    TEST_ASSERT_EQUAL_INT(0, aesd_ring_create(&ring, RING_TEST_SIZE));
+    writeTestPackets(&ring, 3);
+    forged = ringRecordAt(&ring, 3 * RING_TEST_RECORD_LEN);
+    forged->len = RING_TEST_SIZE - 3 * RING_TEST_RECORD_LEN - sizeof(aesd_ring_record_t);
+    atomic_store(&forged->state, RING_RECORD_PACKET);
+    TEST_ASSERT_EQUAL_INT(-1, aesd_ring_read(&ring, packets, 8));
+
+    aesd_ring_close(&ring);
+}
+
+void test_ring_attach_rejects_other_files()
+{
+    aesd_ring_t ring;
+    aesd_ring_t attached;
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_ring_create(&ring, RING_TEST_SIZE));
+    ring.header->magic = ~AESD_RING_MAGIC;
+    TEST_ASSERT_EQUAL_INT(-1, aesd_ring_attach(&attached, dup(ring.fd)));
+    ring.header->magic = AESD_RING_MAGIC;
+
+    ring.header->dataSize = RING_TEST_SIZE + 8;
+    TEST_ASSERT_EQUAL_INT(-1, aesd_ring_attach(&attached, dup(ring.fd)));
+    ring.header->dataSize = RING_TEST_SIZE;
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_ring_attach(&attached, dup(ring.fd)));
+    aesd_ring_close(&attached);
+    aesd_ring_close(&ring);
+}
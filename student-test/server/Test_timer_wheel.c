@@ -0,0 +1,115 @@
+#include "unity.h"
+#include <stdatomic.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "../../server/aesd-timer-wheel.h"
+
+#define WHEEL_TICK_MS   1
+// How late a timer may fire on a loaded machine, the wheel itself is
+// accurate to one tick
+#define FIRE_SLACK_MS   100
+
+typedef struct
+{
+    uint64_t expiresMs;
+    atomic_uint_fast64_t firedMs;
+    atomic_uint fireCount;
+    // Times to fire before staying disarmed, and how far apart
+    unsigned int rearms;
+    uint64_t rearmMs;
+} wheel_test_timer_t;
+
+static uint64_t recordExpiry(void *arg, uint64_t nowMs)
+{
+    wheel_test_timer_t *testTimer = arg;
+    unsigned int fired = atomic_fetch_add(&testTimer->fireCount, 1) + 1;
+
+    atomic_store(&testTimer->firedMs, nowMs);
+    return fired < testTimer->rearms ? nowMs + testTimer->rearmMs : 0;
+}
+
+static void armTestTimer(aesd_timer_t *timer, wheel_test_timer_t *testTimer, uint64_t inMs)
+{
+    testTimer->expiresMs = aesd_timer_wheel_now() + inMs;
+    atomic_init(&testTimer->firedMs, 0);
+    atomic_init(&testTimer->fireCount, 0);
+    aesd_timer_init(timer, recordExpiry, testTimer);
+    aesd_timer_arm(timer, testTimer->expiresMs);
+}
+
+static void assertFiredOnTime(wheel_test_timer_t *testTimer)
+{
+    uint64_t firedMs = atomic_load(&testTimer->firedMs);
+
+    TEST_ASSERT_EQUAL_UINT(1, atomic_load(&testTimer->fireCount));
+    TEST_ASSERT_TRUE(firedMs >= testTimer->expiresMs);
+    TEST_ASSERT_TRUE(firedMs <= testTimer->expiresMs + FIRE_SLACK_MS);
+}
+
+void test_timer_wheel_cascades_to_lower_levels()
+{
+    // Level 0 holds the next TIMER_WHEEL_SLOTS ticks, level 1 the next
+    // TIMER_WHEEL_SLOTS^2 and level 2 the next TIMER_WHEEL_SLOTS^3
+    const uint64_t level1Ms = 3 * TIMER_WHEEL_SLOTS * WHEEL_TICK_MS;
+    const uint64_t level2Ms = (TIMER_WHEEL_SLOTS * TIMER_WHEEL_SLOTS + 100) * WHEEL_TICK_MS;
+    wheel_test_timer_t level0 = {.rearms = 1};
+    wheel_test_timer_t level1 = {.rearms = 1};
+    wheel_test_timer_t level2 = {.rearms = 1};
+    aesd_timer_t timers[3];
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_timer_wheel_start(WHEEL_TICK_MS));
+
+    armTestTimer(&timers[2], &level2, level2Ms);
+    armTestTimer(&timers[1], &level1, level1Ms);
+    armTestTimer(&timers[0], &level0, 10 * WHEEL_TICK_MS);
+
+    usleep((level1Ms + FIRE_SLACK_MS) * 1000);
+    assertFiredOnTime(&level0);
+    assertFiredOnTime(&level1);
+    TEST_ASSERT_EQUAL_UINT(0, atomic_load(&level2.fireCount));
+
+    usleep((level2Ms - level1Ms) * 1000);
+    assertFiredOnTime(&level2);
+
+    aesd_timer_wheel_stop();
+}
+
+void test_timer_wheel_rearms_from_the_callback()
+{
+    wheel_test_timer_t rearmed = {.rearms = 3, .rearmMs = 20 * WHEEL_TICK_MS};
+    aesd_timer_t timer;
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_timer_wheel_start(WHEEL_TICK_MS));
+
+    armTestTimer(&timer, &rearmed, 10 * WHEEL_TICK_MS);
+    usleep((10 + 3 * 20 + FIRE_SLACK_MS) * WHEEL_TICK_MS * 1000);
+
+    // Fired once and re-armed twice, then left disarmed
+    TEST_ASSERT_EQUAL_UINT(3, atomic_load(&rearmed.fireCount));
+    TEST_ASSERT_FALSE(timer.armed);
+
+    aesd_timer_wheel_stop();
+}
+
+void test_timer_wheel_moves_and_cancels()
+{
+    wheel_test_timer_t moved = {.rearms = 1};
+    wheel_test_timer_t cancelled = {.rearms = 1};
+    aesd_timer_t timers[2];
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_timer_wheel_start(WHEEL_TICK_MS));
+
+    // Arming an armed timer moves it rather than adding it twice
+    armTestTimer(&timers[0], &moved, 10 * WHEEL_TICK_MS);
+    moved.expiresMs = aesd_timer_wheel_now() + 2 * TIMER_WHEEL_SLOTS * WHEEL_TICK_MS;
+    aesd_timer_arm(&timers[0], moved.expiresMs);
+
+    armTestTimer(&timers[1], &cancelled, 10 * WHEEL_TICK_MS);
+    aesd_timer_cancel(&timers[1]);
+
+    usleep((2 * TIMER_WHEEL_SLOTS * WHEEL_TICK_MS + FIRE_SLACK_MS) * 1000);
+    assertFiredOnTime(&moved);
+    TEST_ASSERT_EQUAL_UINT(0, atomic_load(&cancelled.fireCount));
+
+    aesd_timer_wheel_stop();
+}
@@ -0,0 +1,108 @@
+/**
+ * @file test-server.h
+ * @brief An in-process aesdsocket for tests that speak its protocol, over
+ *  socket pairs handed to aesdsocket_serve()
+ */
+
+#pragma once
+
+#include "unity.h"
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "../../server/libaesdsocket.h"
+
+// How long a reply may take to start, and how long a quiet socket is taken
+// to mean it is complete
+#define TEST_REPLY_WAIT_MS  2000
+#define TEST_REPLY_QUIET_MS 100
+
+static char testServerDir[64];
+static char testServerDataPath[96];
+static char testServerIndexPath[96];
+static char testServerChannelPrefix[96];
+
+static inline void startTestServer(void)
+{
+    aesdsocket_config_t config = {0};
+
+    strcpy(testServerDir, "/tmp/aesd-server-test-XXXXXX");
+    TEST_ASSERT_NOT_NULL(mkdtemp(testServerDir));
+    snprintf(testServerDataPath, sizeof(testServerDataPath), "%s/data", testServerDir);
+    snprintf(testServerIndexPath, sizeof(testServerIndexPath), "%s/data.idx", testServerDir);
+    snprintf(testServerChannelPrefix, sizeof(testServerChannelPrefix), "%s/data-",
+             testServerDir);
+
+    config.dataPath = testServerDataPath;
+    config.indexPath = testServerIndexPath;
+    config.channelPathPrefix = testServerChannelPrefix;
+    config.ingestSock = -1;
+    TEST_ASSERT_EQUAL_INT(0, aesdsocket_init(&config));
+}
+
+static inline void stopTestServer(void)
+{
+    aesdsocket_shutdown();
+    unlink(testServerDataPath);
+    unlink(testServerIndexPath);
+    rmdir(testServerDir);
+}
+
+/**
+ * Returns the peer's end of a new connection to the test server
+ */
+static inline int connectTestServer(void)
+{
+    struct sockaddr_storage peeraddr = {.ss_family = AF_UNIX};
+    int socks[2];
+
+    TEST_ASSERT_EQUAL_INT(0, socketpair(AF_UNIX, SOCK_STREAM, 0, socks));
+    TEST_ASSERT_EQUAL_INT(0, aesdsocket_serve(socks[1], &peeraddr));
+    return socks[0];
+}
+
+static inline void sendTestRequest(int sock, const void *buf, size_t len)
+{
+    const char *bufp = buf;
+    ssize_t sent;
+
+    while (len > 0)
+    {
+        sent = send(sock, bufp, len, MSG_NOSIGNAL);
+        TEST_ASSERT_TRUE(sent > 0);
+        bufp += sent;
+        len -= (size_t)sent;
+    }
+}
+
+/**
+ * Receives whatever arrives until the socket goes quiet, NUL terminated
+ *
+ * @return size_t Bytes received, 0 if the server closed the connection or
+ *  sent nothing
+ */
+static inline size_t recvTestReply(int sock, char *buf, size_t size)
+{
+    struct pollfd pfd = {.fd = sock, .events = POLLIN};
+    int timeoutMs = TEST_REPLY_WAIT_MS;
+    size_t used = 0;
+    ssize_t recvRet;
+
+    while (used + 1 < size && poll(&pfd, 1, timeoutMs) == 1)
+    {
+        recvRet = recv(sock, buf + used, size - used - 1, 0);
+        if (recvRet <= 0)
+        {
+            break;
+        }
+        used += (size_t)recvRet;
+        timeoutMs = TEST_REPLY_QUIET_MS;
+    }
+
+    buf[used] = '\0';
+    return used;
+}